@@ -3,17 +3,26 @@
 // See LICENSE file in the project root for full license information.
 //
 #pragma once
+#include "AsyncLog.hpp"
 #include "Database.hpp"
 #include "Gui.hpp"
 #include "MeasuringTask.hpp"
 #include "RgbLed.hpp"
+#include "Scheduler.hpp"
 #include "Sensor.hpp"
+#include "SensorTraits.hpp"
 #include "Telemetry.hpp"
+#include "WarmStartSnapshot.hpp"
 #include <ArduinoJson.h>
 #include <WiFi.h>
+#include <atomic>
 #include <chrono>
 #include <esp_task.h>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <vector>
 
 //
 //
@@ -25,7 +34,36 @@ public:
   //
   constexpr static auto APPLICATION_TASK_STACK_SIZE = size_t{8192};
   //
+  constexpr static auto MEASURING_TASK_STACK_SIZE = size_t{4096};
+  // 起動の段階を並行して進めるタスクの数(startupを呼んだタスクを含む)
+  constexpr static auto STARTUP_WORKER_COUNT = size_t{3};
+  constexpr static auto STARTUP_TASK_STACK_SIZE = size_t{8192};
+  // GUIはARDUINO_RUNNING_CORE, 測定と保存と送信はもう片方のコアで動かす
+  constexpr static auto DATA_PROCESSING_CORE =
+      BaseType_t{ARDUINO_RUNNING_CORE == 0 ? 1 : 0};
+  //
   constexpr static auto TIMEOUT = std::chrono::seconds{3};
+  // データベースを整理する周期(消し残しがあれば早める)
+  constexpr static auto DATABASE_TASK_INTERVAL = std::chrono::seconds{333};
+  constexpr static auto DATABASE_RETENTION_CONTINUE_INTERVAL =
+      std::chrono::seconds{1};
+  // Wi-Fiと時刻が揃うまでテレメトリを始めるのを待つ周期
+  constexpr static auto TELEMETRY_START_POLLING_INTERVAL =
+      std::chrono::seconds{1};
+  // テレメトリの再接続を試す間隔(失敗が続くほど倍にして上限で止める)
+  constexpr static auto TELEMETRY_RECONNECT_MIN_INTERVAL =
+      std::chrono::seconds{30};
+  constexpr static auto TELEMETRY_RECONNECT_MAX_INTERVAL =
+      std::chrono::minutes{15};
+  // この回数失敗したらMQTTクライアントを作り直す
+  constexpr static auto TELEMETRY_RECREATE_AFTER_ATTEMPTS = uint32_t{3};
+  // 起動している間にLEDを虹色に1周させる時間
+  constexpr static auto STARTUP_RAINBOW_PERIOD =
+      std::chrono::milliseconds{3600};
+  // この年より前のRTCの時刻は設定されていないとみなす
+  constexpr static auto RTC_VALID_SINCE_YEAR = int{2024};
+  // 計った所要時間の分布をデバイスツインに載せる周期
+  constexpr static auto DIAGNOSTICS_REPORT_INTERVAL = std::chrono::minutes{10};
   // time zone = Asia_Tokyo(UTC+9)
   constexpr static auto TZ_TIME_ZONE = std::string_view{"JST-9"};
   //
@@ -40,17 +78,44 @@ public:
   const static inline std::string EXPORT_IMPORT_DATABASE_FILE_URI{
       std::string{"file:"} + std::string{EXPORT_IMPORT_DATABASE_FILE_PATH}};
   //
+  constexpr static std::string_view EXPORT_CSV_FILE_PATH{
+      "/sd/data_aquisition_log.csv"};
+  // 書き出しと書き戻しを進める周期
+  // (動いていない時は頼まれた時のnotifyで起きるので, 確認は念のため)
+  constexpr static auto TRANSFER_STEP_INTERVAL =
+      std::chrono::milliseconds{10};
+  constexpr static auto TRANSFER_IDLE_INTERVAL = std::chrono::seconds{10};
+  // 送信するまで測定値を溜めておくファイル
+  constexpr static std::string_view TELEMETRY_SPOOL_FILE_PATH{
+      "/sd/telemetry_spool.bin"};
+  // スプールをSDカードに反映させる周期(この間の追記は電源が落ちると消える)
+  constexpr static auto TELEMETRY_SPOOL_CHECKPOINT_INTERVAL =
+      std::chrono::seconds{10};
+  // ログを追記するファイル
+  constexpr static std::string_view LOG_FILE_PATH{"/sd/device_log.txt"};
+  // 再起動した時に書き戻す測定値のファイル(SDカードが無ければLittleFSに置く)
+  constexpr static std::string_view WARM_START_SNAPSHOT_FILE_PATH_SD{
+      "/sd/warm_start_snapshot.bin"};
+  constexpr static std::string_view WARM_START_SNAPSHOT_FILE_PATH_LITTLEFS{
+      "/littlefs/warm_start_snapshot.bin"};
+  // 書き戻す測定値をファイルに追記する周期(増えていなければ書かない)
+  constexpr static auto WARM_START_CHECKPOINT_INTERVAL =
+      std::chrono::minutes{15};
+  // 時刻が合うまで書き戻すのを待つ周期
+  constexpr static auto WARM_START_RESTORE_POLLING_INTERVAL =
+      std::chrono::seconds{1};
+  //
   constexpr static auto BME280_I2C_ADDRESS = uint8_t{0x76};
   constexpr static auto SENSOR_DESCRIPTOR_BME280 =
-      SensorDescriptor({'B', 'M', 'E', '2', '8', '0', '\0', '\0'});
+      Sensor::Traits<Sensor::Bme280>::descriptor;
   constexpr static auto SENSOR_DESCRIPTOR_SGP30 =
-      SensorDescriptor({'S', 'G', 'P', '3', '0', '\0', '\0', '\0'});
+      Sensor::Traits<Sensor::Sgp30>::descriptor;
   constexpr static auto SENSOR_DESCRIPTOR_SCD30 =
-      SensorDescriptor({'S', 'C', 'D', '3', '0', '\0', '\0', '\0'});
+      Sensor::Traits<Sensor::Scd30>::descriptor;
   constexpr static auto SENSOR_DESCRIPTOR_SCD41 =
-      SensorDescriptor({'S', 'C', 'D', '4', '1', '\0', '\0', '\0'});
+      Sensor::Traits<Sensor::Scd41>::descriptor;
   constexpr static auto SENSOR_DESCRIPTOR_M5ENV3 =
-      SensorDescriptor({'M', '5', 'E', 'N', 'V', '3', '\0', '\0'});
+      Sensor::Traits<Sensor::M5Env3>::descriptor;
 
 public:
   Application(const Application &) = delete;
@@ -63,12 +128,13 @@ public:
     }
     _instance = this;
   }
-  //
-  bool task_handler();
   // 起動
   bool startup();
   //
-  std::string getStartupLog() const { return _startup_log; }
+  std::string getStartupLog() const {
+    std::lock_guard<std::mutex> lock{_startup_log_mutex};
+    return _startup_log;
+  }
   //
   static RgbLed &getRgbLed() { return getInstance()->_rgb_led; }
   //
@@ -78,6 +144,10 @@ public:
   //
   static Telemetry &getTelemetry() { return getInstance()->_telemetry; }
   //
+  static WarmStartSnapshot &getWarmStartSnapshot() {
+    return getInstance()->_warm_start_snapshot;
+  }
+  //
   static Gui &getGui() { return getInstance()->_gui; }
   //
   static std::vector<std::unique_ptr<Sensor::Device>> &getSensors() {
@@ -92,6 +162,10 @@ public:
     return getInstance()->_rtos_application_task_handle;
   }
   //
+  static TaskHandle_t getMeasuringTaskHandle() {
+    return getInstance()->_rtos_measuring_task_handle;
+  }
+  //
   static Application *getInstance() {
     if (_instance == nullptr) {
       esp_system_abort("Application is not started.");
@@ -100,6 +174,10 @@ public:
   }
   //
   static bool isTimeSynced() { return getInstance()->_time_is_synced; }
+  // 測定時刻に使える時刻か(時間サーバーと同期したか, RTCの時刻が使える)
+  static bool isTimeValid() {
+    return getInstance()->_time_is_synced || getInstance()->_rtc_time_is_valid;
+  }
   //
   static std::chrono::seconds uptime() {
     auto elapsed = std::chrono::steady_clock::now() -
@@ -111,6 +189,29 @@ public:
   static std::string isoformatUTC(std::chrono::system_clock::time_point utctp) {
     return isoformatUTC(std::chrono::system_clock::to_time_t(utctp));
   }
+  // SDカードへの書き出しと書き戻しはTask:Applicationで少しずつ進める
+  static void requestTransfer(Database::TransferKind kind) {
+    getInstance()->_transfer_cancel = false;
+    getInstance()->_transfer_request = static_cast<int>(kind);
+    getInstance()->_scheduler.notify(getInstance()->_transfer_job);
+  }
+  //
+  static void cancelTransfer() {
+    getInstance()->_transfer_cancel = true;
+    getInstance()->_scheduler.notify(getInstance()->_transfer_job);
+  }
+  // 頼んでから終わるまでtrue
+  static bool isTransferBusy() {
+    return getInstance()->_transfer_request.load() >= 0 ||
+           getInstance()->_transfer_progress.load() >= 0;
+  }
+  // 進み具合[%](動いていなければstd::nullopt)
+  static std::optional<int> getTransferProgress() {
+    auto progress = getInstance()->_transfer_progress.load();
+    return progress >= 0 ? std::make_optional(progress) : std::nullopt;
+  }
+  // 最後に終わった転送のエラー(取り出すと消える)
+  static Database::ErrorString takeTransferError();
 
 private:
   static Application *_instance;
@@ -128,14 +229,48 @@ private:
   std::optional<std::string> getSettings_AzureIoTHub_DeviceID();
   //
   std::optional<std::string> getSettings_AzureIoTHub_DeviceKey();
-  // 起動時のログ
+  // 1つのメッセージにまとめて送る測定値の数
+  std::optional<int> getSettings_AzureIoTHub_BatchSize();
+  // 1つのメッセージにまとめて送るバイト数
+  std::optional<int> getSettings_AzureIoTHub_BatchBytes();
+  // 送信するメッセージの形式("json" / "cbor")
+  std::optional<std::string> getSettings_AzureIoTHub_Encoding();
+  //
+  std::optional<int> getSettings_Sensor_AveragingSeconds();
+  //
+  std::optional<Sensor::Device::SamplingPolicy>
+  getSettings_Sensor_SamplingPolicy(const SensorDescriptor &descriptor);
+  //
+  std::optional<DeadbandFilter::Bands> getSettings_Sensor_Deadband();
+  //
+  std::optional<int> getSettings_Sensor_HeartbeatSeconds();
+  //
+  std::optional<esp_log_level_t> getSettings_Log_Level(AsyncLog::Module module);
+  //
+  std::optional<bool> getSettings_Log_File();
+  // 起動時のログ(起動の段階を進めるタスクから書く)
+  mutable std::mutex _startup_log_mutex;
   std::string _startup_log;
   // インターネット時間サーバーに同期しているか
-  bool _time_is_synced{false};
+  std::atomic<bool> _time_is_synced{false};
+  // RTCから戻した時刻で測定を始めてよいか
+  bool _rtc_time_is_valid{false};
+  // 再起動する前の測定値を書き戻したか
+  // (起動時に時刻が合っていなければ, 合ってからTask:Applicationで書き戻す)
+  bool _warm_start_restored{false};
+  // テレメトリを始めたか(Task:Applicationだけが使う)
+  bool _telemetry_started{false};
+  // テレメトリの接続を待っている間だけある(Task:Applicationだけが使う)
+  std::optional<std::chrono::steady_clock::time_point>
+      _telemetry_connect_deadline{};
+  // 続けて失敗したテレメトリの再接続の回数(Task:Applicationだけが使う)
+  uint32_t _telemetry_reconnect_attempts{0};
   // LED
   RgbLed _rgb_led;
   // データーベース
   Database _data_acquisition_db;
+  // 再起動した時にデーターベースに書き戻す測定値
+  WarmStartSnapshot _warm_start_snapshot;
   // テレメトリ
   Telemetry _telemetry;
   // GUI
@@ -149,18 +284,72 @@ private:
   //
   TaskHandle_t _rtos_application_task_handle{};
   //
-  void idle_task_handler();
+  TaskHandle_t _rtos_measuring_task_handle{};
+  // GUIから頼まれた転送(Database::TransferKind, 負なら無し)
+  std::atomic<int> _transfer_request{-1};
+  std::atomic<bool> _transfer_cancel{false};
+  // 転送の進み具合[%](負なら動いていない)
+  std::atomic<int> _transfer_progress{-1};
+  // 終わった転送のエラー
+  std::mutex _transfer_error_mutex;
+  Database::ErrorString _transfer_error{};
+  // Task:Applicationで実行する仕事
+  Scheduler _scheduler{};
+  // 転送を頼まれたら起こす仕事
+  Scheduler::JobId _transfer_job{};
+  // Task:Measuringで実行する仕事
+  Scheduler _measuring_scheduler{};
+  //
+  void schedule_tasks();
+  //
+  void input_task_handler();
+  //
+  Scheduler::Duration database_task_handler();
+  //
+  Scheduler::Duration transfer_task_handler();
+  //
+  void finish_transfer(Database::ErrorString error);
+  //
+  void warm_start_checkpoint_task_handler();
+  //
+  Scheduler::Duration warm_start_restore_task_handler();
+  //
+  void telemetry_spool_checkpoint_task_handler();
+  //
+  void restore_warm_start_snapshot(std::ostream &os);
+  //
+  void wifi_task_handler();
+  //
+  void telemetry_task_handler();
+  //
+  Scheduler::Duration telemetry_start_task_handler();
+  //
+  Scheduler::Duration telemetry_reconnect_task_handler();
+  //
+  void diagnostics_report_task_handler();
+  // 起動の段階
+  // (afterに書いた段階が全て終わってから, 空いているタスクで始める)
+  struct StartupStage {
+    std::function<bool(std::ostream &)> start;
+    std::vector<size_t> after;
+  };
+  //
+  struct StartupGraph;
+  //
+  struct StartupLogBuffer;
+  // 全ての段階が終わるまで戻らない
+  void run_startup_stages(std::vector<StartupStage> stages);
   //
   bool read_settings_json(std::ostream &os);
   //
   bool start_SD(std::ostream &os);
   //
   bool start_wifi(std::ostream &os);
-  // インターネット時間サーバと同期する
+  // インターネット時間サーバと同期する(同期するのは待たない)
   bool synchronize_ntp(std::ostream &os);
   //
   bool start_database(std::ostream &os);
-  //
+  // 接続を始めるだけで, 接続するのは待たない
   bool start_telemetry(std::ostream &os);
   //
   bool start_sensor_BME280(std::ostream &os);
@@ -0,0 +1,63 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <esp_log.h>
+#include <optional>
+#include <string_view>
+
+//
+// M5_LOGx のログを呼んだタスクで書き出さずに, 溜めておいて
+// 優先度の低いTask:LogでUART(とSDカードのファイル)に書き出す
+//
+namespace AsyncLog {
+//
+// ログを出す場所(ソースファイル名で分ける)
+//
+enum class Module : uint8_t {
+  Application, // Application.cpp, main.cpp
+  Database,    // Database.cpp, RingBufferStore.cpp, WarmStartSnapshot.cpp
+  Telemetry,   // Telemetery.cpp, TelemetrySpool.cpp, SerialLogger.cpp
+  Measuring,   // MeasuringTask.cpp, Sensor.cpp
+  Gui,         // Gui.cpp
+  Other,
+};
+constexpr static std::array<std::string_view, 6> MODULE_NAMES{
+    "Application", //
+    "Database",    //
+    "Telemetry",   //
+    "Measuring",   //
+    "Gui",         //
+    "Other"        //
+};
+// 場所毎のログの水準(これより詳しいログは捨てる)
+inline std::array<std::atomic<uint8_t>, MODULE_NAMES.size()> levels{
+    CORE_DEBUG_LEVEL, CORE_DEBUG_LEVEL, CORE_DEBUG_LEVEL,
+    CORE_DEBUG_LEVEL, CORE_DEBUG_LEVEL, CORE_DEBUG_LEVEL,
+};
+//
+inline void setLevel(Module module, esp_log_level_t level) {
+  levels[static_cast<size_t>(module)].store(level, std::memory_order_relaxed);
+}
+// ログを組み立てる前に調べる
+// (CORE_DEBUG_LEVELより詳しい水準はコンパイル時に消える)
+inline bool enabled(Module module, esp_log_level_t level) {
+  return level <= CORE_DEBUG_LEVEL &&
+         level <= levels[static_cast<size_t>(module)].load(
+                      std::memory_order_relaxed);
+}
+//
+std::optional<Module> moduleOf(std::string_view name);
+// "none", "error", "warn", "info", "debug", "verbose"
+std::optional<esp_log_level_t> levelOf(std::string_view name);
+// Task:Logを作ってM5.Logの書き出し先を入れ替える
+bool begin();
+// SDカードのファイルにも追記する
+bool openFile(std::string_view path);
+// 溜めきれずに捨てたログの数
+uint32_t dropped();
+} // namespace AsyncLog
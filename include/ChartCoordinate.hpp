@@ -0,0 +1,149 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "SensorTraits.hpp"
+#include "value_types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <utility>
+
+//
+// 測定値からグラフの座標を得る
+// (LVGLを使わないので単体で試験できる)
+//
+namespace Chart {
+using system_clock = std::chrono::system_clock;
+// lv_coord_tと同じ型(LV_USE_LARGE_COORD 0)
+using Coord = int16_t;
+// LV_CHART_POINT_NONEと同じ値(点を描かない)
+constexpr Coord POINT_NONE = std::numeric_limits<Coord>::max();
+// 表示範囲[分]
+constexpr uint16_t X_POINT_COUNT{1440};
+// 気圧はこの値との差を描く
+constexpr DeciPa PRESSURE_BIAS = std::chrono::round<DeciPa>(HectoPa{1000});
+// Total VOCはこの値で割って描く
+constexpr int16_t TOTAL_VOC_DIVIDER{2};
+//
+struct Point {
+  Coord x;
+  Coord y;
+};
+
+// 表示範囲の左端からの分
+inline Coord coordinateX(system_clock::time_point tp_zero,
+                         system_clock::time_point at) {
+  using namespace std::chrono;
+  auto timediff = duration_cast<minutes>(floor<minutes>(at) - tp_zero).count();
+  return static_cast<Coord>(
+      std::clamp<int64_t>(timediff, 0, X_POINT_COUNT - 1));
+}
+
+// Metricの単位の値をy座標にする
+inline Coord coordinateY(Sensor::Metric metric, double value) {
+  using namespace std::chrono;
+  switch (metric) {
+  case Sensor::Metric::Temperature:
+    return duration_cast<CentiDegC>(DegC(value)).count();
+  case Sensor::Metric::RelativeHumidity:
+    return duration_cast<CentiRH>(PctRH(value)).count();
+  case Sensor::Metric::Pressure:
+    return static_cast<Coord>(
+        duration_cast<Pascal>(HectoPa(value) - PRESSURE_BIAS).count());
+  case Sensor::Metric::CarbonDioxide:
+    return static_cast<Coord>(static_cast<uint16_t>(value));
+  case Sensor::Metric::TotalVoc:
+    return static_cast<Coord>(static_cast<uint16_t>(value) /
+                              TOTAL_VOC_DIVIDER);
+  }
+  return POINT_NONE;
+}
+
+//
+inline Point coordinateXY(Sensor::Metric metric,
+                          system_clock::time_point tp_zero,
+                          system_clock::time_point at, double value) {
+  return Point{.x = coordinateX(tp_zero, at),
+               .y = coordinateY(metric, value)};
+}
+
+//
+// 1区間(チャートの1ピクセル幅)に入った値の最小値と最大値
+//
+struct MinMaxBucket {
+  bool empty{true};
+  std::pair<int64_t, Coord> min{}; // (分の通し番号, y座標)
+  std::pair<int64_t, Coord> max{};
+  //
+  void clear() { empty = true; }
+  //
+  void push(int64_t minute, Coord y) {
+    if (empty) {
+      min = max = {minute, y};
+      empty = false;
+    } else if (y < min.second) {
+      min = {minute, y};
+    } else if (y > max.second) {
+      max = {minute, y};
+    }
+  }
+  // 形を崩さない様に最小値と最大値を時刻順に並べる
+  std::pair<Coord, Coord> points() const {
+    if (empty) {
+      return {POINT_NONE, POINT_NONE};
+    }
+    return min.first <= max.first ? std::make_pair(min.second, max.second)
+                                  : std::make_pair(max.second, min.second);
+  }
+};
+
+//
+// 表示範囲の下限と上限を単調キューで追いかける
+// (分の通し番号, y座標)
+//
+struct MinMaxQueue {
+  std::deque<std::pair<int64_t, Coord>> min_queue{};
+  std::deque<std::pair<int64_t, Coord>> max_queue{};
+  //
+  void clear() {
+    min_queue.clear();
+    max_queue.clear();
+  }
+  // 時刻順に入れること
+  void push(int64_t minute, Coord y) {
+    while (!min_queue.empty() && min_queue.back().second >= y) {
+      min_queue.pop_back();
+    }
+    min_queue.emplace_back(minute, y);
+    while (!max_queue.empty() && max_queue.back().second <= y) {
+      max_queue.pop_back();
+    }
+    max_queue.emplace_back(minute, y);
+  }
+  // 表示範囲から外れた値を捨てる
+  void expire(int64_t begin_minute) {
+    while (!min_queue.empty() && min_queue.front().first < begin_minute) {
+      min_queue.pop_front();
+    }
+    while (!max_queue.empty() && max_queue.front().first < begin_minute) {
+      max_queue.pop_front();
+    }
+  }
+  // 値が無ければ(最大値, 最小値)
+  std::pair<Coord, Coord> getMinMaxOfYPoints() const {
+    auto y_min = std::numeric_limits<Coord>::max();
+    auto y_max = std::numeric_limits<Coord>::min();
+    if (!min_queue.empty()) {
+      y_min = min_queue.front().second;
+    }
+    if (!max_queue.empty()) {
+      y_max = max_queue.front().second;
+    }
+    return {y_min, y_max};
+  }
+};
+} // namespace Chart
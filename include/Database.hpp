@@ -3,15 +3,29 @@
 // See LICENSE file in the project root for full license information.
 //
 #pragma once
-#include "Sensor.hpp"
+#include "Diagnostics.hpp"
+#include "Measurement.hpp"
+#include "SensorTraits.hpp"
+#include "VersionedSnapshot.hpp"
 #include "value_types.hpp"
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
 #include <ctime>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <sqlite3.h>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 //
 //
@@ -28,23 +42,59 @@ class Database final {
   };
   using Sqlite3StmtPointerUnique =
       std::unique_ptr<sqlite3_stmt, Sqlite3StmtDeleter>;
+  // キャッシュから借りたステートメントは使用後にリセットして返す
+  struct Sqlite3StmtResetter {
+    void operator()(sqlite3_stmt *ptr) const;
+  };
+  using Sqlite3StmtPointerCached =
+      std::unique_ptr<sqlite3_stmt, Sqlite3StmtResetter>;
+  //
+  struct Sqlite3BackupDeleter {
+    void operator()(sqlite3_backup *ptr) const;
+  };
+  //
+  struct FileCloser {
+    void operator()(std::FILE *ptr) const;
+  };
   //
   struct Transaction;
+  //
+  struct InsertVisitor;
+  struct PublishVisitor;
+  //
+  struct Accumulator;
 
 private:
   const static sqlite3_mem_methods _custom_mem_methods;
+  // 接続とステートメントのキャッシュはTask:LVGLとTask:Applicationが使う
+  // (公開している関数の入口で取る, 関数同士で呼び合うので再帰的に取れる)
+  mutable std::recursive_mutex _mutex{};
+  using Lock = std::lock_guard<std::recursive_mutex>;
   Sqlite3PointerUnique _sqlite3_db{};
+  // クエリ文字列をキーにしたプリペアドステートメントのキャッシュ
+  // (キーはstatic storageにあるクエリ文字列を指す)
+  std::unordered_map<std::string_view, Sqlite3StmtPointerUnique>
+      _statement_cache{};
+  size_t _statement_cache_hits{0};
+  size_t _statement_cache_misses{0};
 #ifdef SQLITE_ENABLE_MEMSYS5
+  // SQLiteだけが使うSPIRAMの領域(MEMSYS5のbuddy allocatorで割り当てる)
   constexpr static size_t DATABASE_USE_PREALLOCATED_MEMORY_SIZE =
       3 * 1024 * 1024;
+  // 最小の割り当て(2の累乗)
+  constexpr static int DATABASE_PREALLOCATED_MEMORY_MIN_ALLOCATION{64};
   void *_database_use_preallocated_memory{};
 #endif
-  //
-  std::optional<Sensor::MeasurementBme280> _latestMeasurementBme280{};
-  std::optional<Sensor::MeasurementSgp30> _latestMeasurementSgp30{};
-  std::optional<Sensor::MeasurementScd30> _latestMeasurementScd30{};
-  std::optional<Sensor::MeasurementScd41> _latestMeasurementScd41{};
-  std::optional<Sensor::MeasurementM5Env3> _latestMeasurementM5Env3{};
+  // センサー毎に最後に入れた測定値(GUIは別のタスクから読む)
+  template <typename V> struct LatestMeasurement {
+    std::chrono::system_clock::time_point at;
+    V value;
+  };
+  template <typename V>
+  using LatestSnapshot = VersionedSnapshot<LatestMeasurement<V>>;
+  Sensor::Registered::Each<LatestSnapshot> _latest_measurements;
+  // どれかのセンサーの最後の測定値が変わる度に増える
+  std::atomic<uint32_t> _latest_measurements_generation{0};
 
 public:
   //
@@ -67,46 +117,230 @@ public:
   using ReadCallback = std::function<bool(size_t counter, T)>;
   //
   using OrderBy = enum { OrderByAtAsc = 0, OrderByAtDesc = 1 };
+  // 測定値のテーブル
+  using Table = Sensor::Metric;
+  //
+  using Days = std::chrono::duration<int64_t, std::ratio<86400>>;
+  // 集計の区間
+  enum class Resolution : uint8_t { Hourly, Daily };
+  // 1時間または1日の測定値の集計
+  struct Aggregate {
+    uint32_t samples;
+    double min;
+    double mean;
+    double max;
+  };
+  //
+  using TimePointAndAggregate =
+      std::tuple<SensorId, system_clock::time_point, Aggregate>;
+  // 集計の1行(再起動しても残すためにファイルに写す)
+  struct RollupRow {
+    Resolution resolution;
+    Table table;
+    SensorId sensor_id;
+    system_clock::time_point at;
+    uint32_t samples;
+    double minimum;
+    double total;
+    double maximum;
+  };
+  //
+  // 測定値の保存先
+  // (設定しなければSQLiteのテーブルに保存する)
+  //
+  class MeasurementStore {
+  public:
+    virtual ~MeasurementStore() {}
+    //
+    virtual bool insert(Table table, TimePointAndDouble values) = 0;
+    virtual bool insert(Table table, TimePointAndIntAndOptInt values) = 0;
+    //
+    virtual std::optional<size_t>
+    read(Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+         ReadCallback<TimePointAndDouble> callback) = 0;
+    virtual std::optional<size_t>
+    read(Table table, std::tuple<SensorId, OrderBy, size_t> placeholder,
+         ReadCallback<TimePointAndDouble> callback) = 0;
+    virtual std::optional<size_t>
+    read(Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+         ReadCallback<TimePointAndUInt16> callback) = 0;
+    virtual std::optional<size_t>
+    read(Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+         ReadCallback<TimePointAndIntAndOptInt> callback) = 0;
+    virtual std::optional<size_t>
+    read(Table table, std::tuple<SensorId, OrderBy, size_t> placeholder,
+         ReadCallback<TimePointAndIntAndOptInt> callback) = 0;
+    //
+    virtual bool delete_older_than(system_clock::time_point tp) = 0;
+    //
+    virtual void clear() = 0;
+  };
+  //
+  // 最後に入れた時刻の測定値
+  // (GUIのタスクがSQLiteを使わずに新しい測定値を読めるようにする)
+  //
+  struct LatestTick {
+    // 1つのテーブルに同時に入るセンサーの数
+    constexpr static size_t MAX_ROWS{4};
+    constexpr static size_t TABLES{5};
+    //
+    struct Row {
+      SensorId sensor_id;
+      double value;
+      std::optional<uint16_t> baseline;
+    };
+    // falseなら使えない
+    bool valid;
+    system_clock::time_point at;
+    // この時刻より後でatより前の測定値は無い
+    system_clock::time_point previous_at;
+    std::array<uint8_t, TABLES> counts;
+    std::array<std::array<Row, MAX_ROWS>, TABLES> rows;
+  };
+  //
+  struct StatementCacheStatistics {
+    size_t hits;
+    size_t misses;
+    size_t entries;
+  };
+  // SQLiteが使っているメモリ
+  struct MemoryStatistics {
+    // 専用の領域の大きさ(ヒープから割り当てていれば0)
+    size_t arena_size;
+    int64_t used;
+    int64_t highwater;
+    // 1回で要求された最大のバイト数
+    int64_t largest_request;
+  };
   //
   constexpr static std::chrono::minutes LOOP_TIMEOUT{1};
+  // PRAGMA user_version
+  constexpr static int SCHEMA_VERSION{2};
+  // 1回の削除で消す最大の行数
+  constexpr static size_t RETENTION_CHUNK_ROWS{256};
+  // 集計を測定値より長く残す期間
+  constexpr static auto ROLLUP_HOURLY_RETENTION = Days{7};
+  constexpr static auto ROLLUP_DAILY_RETENTION = Days{365};
+  //
+  struct RetentionResult {
+    size_t deleted_rows;
+    size_t reclaimed_bytes;
+    // falseなら消し残しがある
+    bool completed;
+  };
   //
   virtual ~Database() { terminate(); }
   //
   bool available() const { return static_cast<bool>(_sqlite3_db); }
   //
   bool begin(const std::string &database_file_path);
+  // 測定値の保存先を指定して開く(nullptrならSQLiteのテーブル)
+  bool begin(const std::string &database_file_path,
+             std::unique_ptr<MeasurementStore> measurement_store);
   //
   void terminate();
   //
-  bool delete_old_measurements_from_database(
+  std::optional<RetentionResult> delete_old_measurements_from_database(
       system_clock::time_point delete_of_older_than_tp);
+  // 終わった時間の測定値を1時間毎と1日毎の集計に畳み込む
+  // (古い測定値を消す前に呼ぶこと)
+  bool rollup_measurements(system_clock::time_point now);
+  //
+  size_t read_aggregates(Resolution resolution, Table table, OrderBy order,
+                         system_clock::time_point at_begin,
+                         ReadCallback<TimePointAndAggregate> callback);
+  // 集計を畳み込む度に増える
+  uint32_t getRollupGeneration() const { return _rollup_generation.load(); }
+  // ここより前の測定値は集計に畳み込み済み
+  std::optional<system_clock::time_point> rollup_watermark();
+  // 1時間毎と1日毎の集計を全部読む(最後まで読めたらtrue)
+  bool read_rollups(ReadCallback<RollupRow> callback);
+  // 写しておいた集計を書き戻す(同じ区間の集計は置き換える)
+  bool restore_rollups(system_clock::time_point watermark,
+                       const std::vector<RollupRow> &rows);
   //
   using ErrorString = std::optional<std::string>;
   //
   ErrorString save_to_file(std::string_view to_file_path);
   //
   ErrorString restore_from_file(std::string_view from_file_path);
+  // ファイルへの書き出しと書き戻しを少しずつ進める
+  // (begin_transferの後, transferring()がfalseになるまでstep_transferを呼ぶ)
+  enum class TransferKind : uint8_t {
+    ExportDatabase, // SQLiteのファイルに書き出す
+    ImportDatabase, // SQLiteのファイルから書き戻す
+    ExportCsv,      // 1分毎の測定値をCSVで書き出す
+  };
+  // 1回のstep_transferで写すページ数(CSVは行数)
+  constexpr static int TRANSFER_PAGES_PER_STEP{64};
+  //
+  struct TransferStatus {
+    TransferKind kind;
+    int remaining;
+    int total;
+  };
+  //
+  ErrorString begin_transfer(TransferKind kind, std::string_view file_path);
+  // エラーか終わったらtransferring()はfalseになる
+  ErrorString step_transfer(int pages = TRANSFER_PAGES_PER_STEP);
+  // 途中で止めると書き出し先(書き戻しならこのデーターベース)は元のまま
+  void cancel_transfer();
   //
-  bool insert(const Sensor::MeasurementBme280 &m);
-  bool insert(const Sensor::MeasurementSgp30 &m);
-  bool insert(const Sensor::MeasurementScd30 &m);
-  bool insert(const Sensor::MeasurementScd41 &m);
-  bool insert(const Sensor::MeasurementM5Env3 &m);
+  bool transferring() const {
+    Lock lock{_mutex};
+    return static_cast<bool>(_transfer);
+  }
+  // 書き戻し中は測定値を入れられない
+  bool importing() const {
+    Lock lock{_mutex};
+    return _transfer && _transfer->kind == TransferKind::ImportDatabase;
+  }
+  //
+  std::optional<TransferStatus> transfer_status() const;
+  //
+  StatementCacheStatistics getStatementCacheStatistics() const;
+  //
+  MemoryStatistics getMemoryStatistics() const;
+  // 同じ時間に測定した値を1つのトランザクションで入れる
+  // (1つでも失敗したら全部取り消す)
+  bool insert(system_clock::time_point at,
+              const std::vector<Sensor::MeasuredValue> &values);
+  //
+  template <typename V> bool insert(const Sensor::Measurement<V> &m) {
+    return insert(m.first, {Sensor::MeasuredValue{m.second}});
+  }
   //
+  template <typename V>
+  std::optional<Sensor::Measurement<V>> getLatestMeasurement() const {
+    auto [version, latest] =
+        std::get<LatestSnapshot<V>>(_latest_measurements).read();
+    if (version == 0) {
+      return std::nullopt;
+    }
+    return Sensor::Measurement<V>{latest.at, latest.value};
+  }
+  // 最後の測定値の世代(0は測定値がまだ無い)
+  // 世代が同じなら測定値も同じなので, 値を読まずに比べられる
+  template <typename V> uint32_t getLatestMeasurementGeneration() const {
+    return std::get<LatestSnapshot<V>>(_latest_measurements).version();
+  }
+  uint32_t getLatestMeasurementsGeneration() const {
+    return _latest_measurements_generation.load(std::memory_order_acquire);
+  }
   std::optional<Sensor::MeasurementBme280> getLatestMeasurementBme280() {
-    return _latestMeasurementBme280;
+    return getLatestMeasurement<Sensor::Bme280>();
   }
   std::optional<Sensor::MeasurementSgp30> getLatestMeasurementSgp30() {
-    return _latestMeasurementSgp30;
+    return getLatestMeasurement<Sensor::Sgp30>();
   }
   std::optional<Sensor::MeasurementScd30> getLatestMeasurementScd30() {
-    return _latestMeasurementScd30;
+    return getLatestMeasurement<Sensor::Scd30>();
   }
   std::optional<Sensor::MeasurementScd41> getLatestMeasurementScd41() {
-    return _latestMeasurementScd41;
+    return getLatestMeasurement<Sensor::Scd41>();
   }
   std::optional<Sensor::MeasurementM5Env3> getLatestMeasurementM5Env3() {
-    return _latestMeasurementM5Env3;
+    return getLatestMeasurement<Sensor::M5Env3>();
   }
 
 public:
@@ -168,6 +402,169 @@ public:
   read_total_vocs(OrderBy order, SensorId sensor_id, size_t limit);
 
 private:
+  //
+  std::unique_ptr<MeasurementStore> _measurement_store{};
+  // 書くのは測定値を入れるタスクだけ
+  VersionedSnapshot<LatestTick> _latest_tick{};
+  // insertの間だけ入れた測定値を集める
+  std::optional<LatestTick> _pending_tick{};
+  // insertの間だけ保存先に入れる測定値を溜めておく
+  // (SQLiteにCOMMITできてから保存先に入れる)
+  std::vector<
+      std::pair<Table, std::variant<TimePointAndDouble, TimePointAndIntAndOptInt>>>
+      _pending_store_rows{};
+  //
+  std::optional<system_clock::time_point> _last_inserted_at{};
+  // 書き戻した後は次に入れるまで使えない
+  std::atomic<bool> _latest_tick_stale{false};
+  //
+  std::atomic<uint32_t> _rollup_generation{0};
+  // 書き出し中か書き戻し中の時だけある
+  struct Transfer {
+    TransferKind kind;
+    Sqlite3PointerUnique file_db;
+    // file_dbより先に後始末する
+    std::unique_ptr<sqlite3_backup, Sqlite3BackupDeleter> backup;
+    // CSVの書き出し先
+    std::unique_ptr<std::FILE, FileCloser> csv_file;
+    // CSVで次に書くテーブルと, そのテーブルで最後に書いた行
+    size_t csv_table;
+    std::optional<std::pair<int64_t, int64_t>> csv_last_key;
+    int csv_rows_total;
+    int csv_rows_written;
+  };
+  std::unique_ptr<Transfer> _transfer{};
+  //
+  ErrorString finish_transfer();
+  //
+  ErrorString step_csv_transfer(int rows);
+  //
+  sqlite3_stmt *prepare_cached_statement(std::string_view query);
+  // 保存先が設定されていればそちらを使う
+  template <typename T>
+  bool store_values(Table table, std::string_view query, T values_to_insert) {
+    Lock lock{_mutex};
+    bool success{true};
+    if (!_measurement_store) {
+      success = insert_values(query, values_to_insert);
+    } else if (_pending_tick) {
+      _pending_store_rows.emplace_back(table, values_to_insert);
+    } else {
+      success = _measurement_store->insert(table, values_to_insert);
+    }
+    if (success) {
+      collect_latest_tick(table, values_to_insert);
+    }
+    return success;
+  }
+  //
+  template <typename P, typename T>
+  std::optional<size_t> load_values(Table table, std::string_view query,
+                                    P placeholder, ReadCallback<T> callback) {
+    Diagnostics::ScopedTimer timer{Diagnostics::Probe::DatabaseRead};
+    // 最後に入れた時刻の測定値はロックを取らずに読めるので
+    // 毎分のグラフの更新は測定値を入れているタスクを待たない
+    if constexpr (std::is_same_v<
+                      P, std::tuple<system_clock::time_point, OrderBy>>) {
+      if (auto count =
+              read_latest_tick(table, std::get<0>(placeholder), callback);
+          count) {
+        return count;
+      }
+    }
+    Lock lock{_mutex};
+    // 書き戻し中のデーターベースは途中まで書き換わっているので読まない
+    if (importing()) {
+      return std::nullopt;
+    }
+    if (_measurement_store) {
+      return _measurement_store->read(table, placeholder, callback);
+    }
+    return read_values(query, placeholder, callback);
+  }
+  //
+  template <typename T>
+  void collect_latest_tick(Table table, const T &values_to_insert) {
+    if (!_pending_tick) {
+      return;
+    }
+    auto index = static_cast<size_t>(table);
+    auto &count = _pending_tick->counts[index];
+    if (count >= LatestTick::MAX_ROWS) {
+      _pending_tick->valid = false;
+      return;
+    }
+    auto &row = _pending_tick->rows[index][count++];
+    row.sensor_id = std::get<0>(values_to_insert);
+    row.value = static_cast<double>(std::get<2>(values_to_insert));
+    if constexpr (std::tuple_size_v<T> == 4) {
+      row.baseline = std::get<3>(values_to_insert);
+    } else {
+      row.baseline = std::nullopt;
+    }
+  }
+  // 最後に入れた時刻の測定値だけで足りればSQLiteを使わずに読む
+  template <typename T>
+  std::optional<size_t> read_latest_tick(Table table,
+                                         system_clock::time_point at_begin,
+                                         ReadCallback<T> callback) const {
+    auto [version, tick] = _latest_tick.read();
+    if (version == 0 || !tick.valid || _latest_tick_stale.load() ||
+        at_begin <= tick.previous_at) {
+      return std::nullopt;
+    }
+    size_t counter{1}; // 1 start
+    if (at_begin > tick.at) {
+      return counter;
+    }
+    auto index = static_cast<size_t>(table);
+    for (size_t i = 0; i < tick.counts[index]; ++i) {
+      const auto &row = tick.rows[index][i];
+      T item{};
+      if constexpr (std::is_same_v<T, TimePointAndDouble>) {
+        item = T{row.sensor_id, tick.at, row.value};
+      } else if constexpr (std::is_same_v<T, TimePointAndUInt16>) {
+        item = T{row.sensor_id, tick.at, static_cast<uint16_t>(row.value)};
+      } else {
+        item = T{row.sensor_id, tick.at, static_cast<uint16_t>(row.value),
+                 row.baseline};
+      }
+      if (callback(counter, item) == false) {
+        break;
+      }
+      counter++;
+    }
+    return counter;
+  }
+  //
+  bool upgrade_schema();
+  bool table_exists(std::string_view name);
+  //
+  // (項目, センサーID, 時間)毎の集計のキー
+  using RollupKey = std::tuple<Table, SensorId, system_clock::time_point>;
+  // 保存先にある[from, until)の測定値を時間毎に集める
+  bool accumulate_store_rows(system_clock::time_point from,
+                             system_clock::time_point until,
+                             std::map<RollupKey, Accumulator> &hourly);
+  //
+  std::optional<system_clock::time_point> read_rollup_watermark();
+  bool write_rollup_watermark(system_clock::time_point at);
+  bool upsert_rollup(std::string_view query, Table table, SensorId sensor_id,
+                     system_clock::time_point at,
+                     const Accumulator &accumulator);
+  // 保存先の測定値とSQLiteのテーブルを相互に写す
+  bool copy_store_to_tables();
+  bool copy_tables_to_store();
+  bool clear_tables();
+  // トランザクションの内側で呼ぶこと
+  // (測定値の項目はSensor::Traitsの表で決まる)
+  template <typename V>
+  bool insert_rows(system_clock::time_point at, const V &in);
+  bool insert_field(Table table, SensorId sensor_id,
+                    system_clock::time_point at, double value,
+                    std::optional<uint16_t> baseline);
+  // INSERTを最後まで進める
+  bool step_insert(sqlite3_stmt *stmt, std::string_view query);
   //
   bool insert_values(std::string_view query,
                      TimePointAndDouble values_to_insert);
@@ -0,0 +1,54 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "Measurement.hpp"
+#include <array>
+#include <chrono>
+#include <optional>
+#include <utility>
+#include <variant>
+
+//
+// 前回通した値から変わっていない測定値を捨てる
+// 変わっていなくてもheartbeat以上経ったら通す
+//
+class DeadbandFilter final {
+public:
+  // これ未満の変化は変わっていないとみなす
+  struct Bands {
+    CentiDegC temperature{10};      // 0.1℃
+    CentiRH relative_humidity{100}; // 1%RH
+    DeciPa pressure{100};           // 10Pa
+    Ppm co2{10};
+    Ppb tvoc{10};
+  };
+  //
+  constexpr static auto DEFAULT_HEARTBEAT = std::chrono::seconds{600};
+
+private:
+  struct ChangedVisitor;
+  //
+  bool _enabled{false};
+  Bands _bands{};
+  std::chrono::seconds _heartbeat{DEFAULT_HEARTBEAT};
+  // 測定値の種類(MeasuredValueのindex)毎に前回通した時間と値
+  std::array<std::optional<std::pair<std::chrono::system_clock::time_point,
+                                     Sensor::MeasuredValue>>,
+             std::variant_size_v<Sensor::MeasuredValue>>
+      _last{};
+
+public:
+  //
+  void enable(const Bands &bands, std::chrono::seconds heartbeat) {
+    _enabled = true;
+    _bands = bands;
+    _heartbeat = heartbeat;
+  }
+  //
+  bool isEnabled() const { return _enabled; }
+  // 通すならtrue
+  bool pass(std::chrono::system_clock::time_point at,
+            const Sensor::MeasuredValue &in);
+};
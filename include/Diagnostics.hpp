@@ -0,0 +1,124 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <esp_timer.h>
+#include <limits>
+#include <string_view>
+
+namespace Diagnostics {
+//
+// 所要時間[us]を2の累乗の区間で数える(どのタスクから記録してもよい)
+//
+class LatencyHistogram final {
+public:
+  // 区間iは[2^i, 2^(i+1))us, 最後の区間はそれより長い全て
+  constexpr static size_t BUCKET_COUNT{20};
+  //
+  struct Summary {
+    uint32_t count;
+    // 区間の上端で見積もる
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+  };
+
+private:
+  std::array<std::atomic<uint32_t>, BUCKET_COUNT> _buckets{};
+  std::atomic<uint32_t> _max_us{0};
+  //
+  static size_t bucket_of(uint32_t us) {
+    return us == 0 ? 0
+                   : std::min<size_t>(31 - __builtin_clz(us),
+                                      BUCKET_COUNT - 1);
+  }
+
+public:
+  //
+  void record(uint32_t us) {
+    _buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+    uint32_t max_us = _max_us.load(std::memory_order_relaxed);
+    while (max_us < us && !_max_us.compare_exchange_weak(
+                              max_us, us, std::memory_order_relaxed)) {
+    }
+  }
+  //
+  Summary summary() const {
+    std::array<uint32_t, BUCKET_COUNT> counts{};
+    uint32_t total{0};
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+      counts[i] = _buckets[i].load(std::memory_order_relaxed);
+      total += counts[i];
+    }
+    uint32_t max_us = _max_us.load(std::memory_order_relaxed);
+    auto percentile = [&](uint32_t percent) -> uint32_t {
+      // 小さい方から数えてtotal * percent / 100番目が入っている区間
+      uint64_t rank = (static_cast<uint64_t>(total) * percent + 99) / 100;
+      uint64_t seen{0};
+      for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += counts[i];
+        if (seen >= rank && seen > 0) {
+          return i + 1 < BUCKET_COUNT ? std::min(uint32_t{2} << i, max_us)
+                                      : max_us;
+        }
+      }
+      return max_us;
+    };
+    return Summary{total, percentile(50), percentile(99), max_us};
+  }
+};
+
+//
+// 計る場所
+//
+enum class Probe : uint8_t {
+  Measure,           // MeasuringTask::measure
+  SensorRead,        // Sensor::Device::collect
+  DatabaseInsert,    // Database::insert
+  DatabaseRead,      // Database::read_*
+  DatabaseRetention, // Database::delete_old_measurements_from_database
+  Telemetry,         // Telemetry::task_handler
+  LvglTask,          // lv_task_handler
+  DisplayFlush,      // DMAで1回転送する
+};
+constexpr static std::array<std::string_view, 8> PROBE_NAMES{
+    "measure",      //
+    "sensor_read",  //
+    "db_insert",    //
+    "db_read",      //
+    "db_retention", //
+    "telemetry",    //
+    "lvgl_task",    //
+    "display_flush" //
+};
+//
+inline std::array<LatencyHistogram, PROBE_NAMES.size()> histograms{};
+//
+inline LatencyHistogram &histogram(Probe probe) {
+  return histograms[static_cast<size_t>(probe)];
+}
+
+//
+// 作ってから壊すまでの時間を記録する
+//
+class ScopedTimer final {
+  LatencyHistogram &_histogram;
+  int64_t _started_us;
+
+public:
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+  explicit ScopedTimer(Probe probe)
+      : _histogram{histogram(probe)}, _started_us{esp_timer_get_time()} {}
+  ~ScopedTimer() {
+    int64_t elapsed = esp_timer_get_time() - _started_us;
+    _histogram.record(static_cast<uint32_t>(std::clamp<int64_t>(
+        elapsed, 0, std::numeric_limits<uint32_t>::max())));
+  }
+};
+} // namespace Diagnostics
@@ -3,14 +3,24 @@
 // See LICENSE file in the project root for full license information.
 //
 #pragma once
+#include "ChartCoordinate.hpp"
 #include "Database.hpp"
 #include "Sensor.hpp"
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <esp_heap_caps.h>
 #include <lvgl.h>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <M5Unified.h>
@@ -98,7 +108,10 @@ class Summary final : public TileBase {
                                   std::optional<Sensor::MeasurementScd30>,
                                   std::optional<Sensor::MeasurementScd41>,
                                   std::optional<Sensor::MeasurementM5Env3>>;
-  Measurements _latest{};
+  // 最後に表示した測定値の世代
+  uint32_t _generation{0};
+  // 行毎に最後に表示したセルの文字列
+  std::vector<std::array<std::optional<std::string>, 3>> _cells{};
 
 public:
   Summary(Summary &&) = delete;
@@ -114,6 +127,15 @@ public:
   void render();
 
 private:
+  //
+  void set_cell(uint16_t row, uint16_t col, const char *text);
+  // 対応している測定値の種類からdescriptorのセンサーの行を作る
+  template <typename... Vs>
+  void put_rows(SensorDescriptor descriptor, uint16_t &row,
+                Sensor::MeasurementTypes<Vs...>);
+  // 測定値の項目の表(Sensor::Traits)から1つのセンサーの行を作る
+  template <typename V>
+  void put_rows(SensorDescriptor descriptor, uint16_t &row);
   //
   static void event_draw_part_begin_callback(lv_event_t *event);
 };
@@ -168,6 +190,32 @@ private:
   static void event_draw_part_begin_callback(lv_event_t *event);
 };
 
+//
+// 計った所要時間の分布(Diagnostics::Probe毎)
+//
+class LatencyHistograms final : public TileBase {
+  std::shared_ptr<lv_obj_t> _table_obj;
+  steady_clock::time_point _rendered_at{};
+
+public:
+  constexpr static auto RENDER_INTERVAL = std::chrono::seconds{1};
+  LatencyHistograms(LatencyHistograms &&) = delete;
+  LatencyHistograms &operator=(const LatencyHistograms &) = delete;
+  LatencyHistograms(InitArg init);
+  //
+  virtual void onActivate() override { render(); }
+  //
+  virtual void onDeactivate() override {}
+  //
+  virtual void update() override {
+    if (steady_clock::now() - _rendered_at >= RENDER_INTERVAL) {
+      render();
+    }
+  }
+  //
+  void render();
+};
+
 //
 //
 //
@@ -195,7 +243,13 @@ class ExportImportData final : public TileBase {
   std::shared_ptr<lv_obj_t> _export_button_obj;
   std::shared_ptr<lv_obj_t> _import_button_obj;
   std::shared_ptr<MessageBox> _messagebox;
-  std::optional<std::string> _error_msg_at_exec;
+  // 書き出しと書き戻しの進み具合(動いている間だけ見せる)
+  std::shared_ptr<lv_obj_t> _progress_label_obj;
+  std::shared_ptr<lv_obj_t> _progress_bar_obj;
+  std::shared_ptr<lv_obj_t> _cancel_button_obj;
+  const char *_transfer_caption{""};
+  bool _transfer_busy{false};
+  int _progress{-1};
 
 public:
   constexpr static auto GUTTER{36};
@@ -212,6 +266,10 @@ public:
 private:
   //
   void doExport();
+  // Task:Applicationに頼む
+  void requestTransfer(Database::TransferKind kind, const char *caption);
+  //
+  void showProgress(bool busy);
   //
   void showExportMessageBox();
   //
@@ -234,15 +292,23 @@ public:
   static std::optional<lv_color32_t> getAssignedColor32(SensorId sensor_id);
 };
 
+// 点を描かない値と座標の型はLVGLと同じにしておく
+static_assert(LV_CHART_POINT_NONE == Chart::POINT_NONE);
+static_assert(std::is_same_v<lv_coord_t, Chart::Coord>);
+
 //
-//
+// 1区間に2点(最小値と最大値)を置くので, 点の数は区間の数の2倍
 //
 struct ChartSeriesWrapper {
+  constexpr static size_t POINTS_PER_BUCKET = 2;
   lv_chart_series_t *chart_series{nullptr};
   std::vector<lv_coord_t> y_points;
+  // y_pointsと同じ並びのリング
+  std::vector<Chart::MinMaxBucket> buckets;
   //
-  ChartSeriesWrapper(lv_chart_series_t *series, size_t num_points)
-      : chart_series{series}, y_points(num_points) {
+  ChartSeriesWrapper(lv_chart_series_t *series, size_t num_buckets)
+      : chart_series{series}, y_points(num_buckets * POINTS_PER_BUCKET),
+        buckets(num_buckets) {
     if (chart_series == nullptr) {
       M5_LOGD("chart series has null");
       return;
@@ -252,21 +318,30 @@ struct ChartSeriesWrapper {
   //
   void fill(lv_coord_t v) { std::fill(y_points.begin(), y_points.end(), v); }
   //
-  std::pair<lv_coord_t, lv_coord_t> getMinMaxOfYPoints() {
-    auto y_min = std::numeric_limits<lv_coord_t>::max();
-    auto y_max = std::numeric_limits<lv_coord_t>::min();
-    if (chart_series) {
-      for (auto &y : y_points) {
-        if (y != LV_CHART_POINT_NONE) {
-          y_min = std::min(y_min, y);
-          y_max = std::max(y_max, y);
-        }
-      }
-    } else {
-      M5_LOGD("chart_series had null");
+  void clearBuckets() {
+    for (auto &bucket : buckets) {
+      bucket.clear();
     }
-    return {y_min, y_max};
   }
+  // 左からn番目の区間(start_pointは区間の境目にあること)
+  Chart::MinMaxBucket &bucketAt(uint16_t start_point, size_t n) {
+    return buckets.at((start_point / POINTS_PER_BUCKET + n) % buckets.size());
+  }
+  // 左からn番目の区間に値を入れて, その区間の2点を書き直す
+  void putIntoBucket(uint16_t start_point, size_t n, int64_t minute,
+                     lv_coord_t y) {
+    auto &bucket = bucketAt(start_point, n);
+    bucket.push(minute, y);
+    auto [first, second] = bucket.points();
+    at(start_point, n * POINTS_PER_BUCKET) = first;
+    at(start_point, n * POINTS_PER_BUCKET + 1) = second;
+  }
+  // SHIFTモードではy_pointsはstart_pointから始まるリングになる
+  lv_coord_t &at(uint16_t start_point, lv_coord_t x) {
+    return y_points.at((start_point + x) % y_points.size());
+  }
+  // 表示範囲の下限と上限
+  Chart::MinMaxQueue min_max{};
 };
 
 //
@@ -312,7 +387,8 @@ public:
   std::shared_ptr<lv_obj_t> getChartObj() { return _chart_obj; }
   //
   system_clock::time_point getBeginX() const { return _begin_x_tp; }
-  //
+  // 新しい測定値だけを右から流し込む
+  // (初めての呼び出しでは全期間を読む)
   void render();
 
 private:
@@ -323,6 +399,20 @@ private:
   std::unordered_map<SensorId, ChartSeriesWrapper> _chart_series_map{};
   //
   system_clock::time_point _begin_x_tp{};
+  // 1区間の分数と区間の数(掛けるとGui::CHART_X_POINT_COUNT)
+  uint16_t _minutes_per_bucket{1};
+  uint16_t _bucket_count{0};
+  // 表示済みの最新の測定時刻
+  std::optional<system_clock::time_point> _latest_rendered_tp{};
+  //
+  system_clock::time_point
+  beginOfBuckets(system_clock::time_point now_min) const;
+  // 全期間を読み直す
+  void rebuild(system_clock::time_point now_min);
+  //
+  void shift_in(system_clock::time_point now_min);
+  //
+  void update_y_range();
   //
   static void event_draw_part_begin_callback(lv_event_t *event);
 };
@@ -358,6 +448,8 @@ private:
                                   std::optional<Sensor::MeasurementScd41>,
                                   std::optional<Sensor::MeasurementM5Env3>>;
   Measurements latest{};
+  // 最後に表示した測定値の世代
+  std::array<uint32_t, std::tuple_size_v<Measurements>> generations{};
   std::unique_ptr<BC> basic_chart;
 
 public:
@@ -419,6 +511,8 @@ private:
                                   std::optional<Sensor::MeasurementScd41>,
                                   std::optional<Sensor::MeasurementM5Env3>>;
   Measurements latest{};
+  // 最後に表示した測定値の世代
+  std::array<uint32_t, std::tuple_size_v<Measurements>> generations{};
   std::unique_ptr<BC> basic_chart;
 
 public:
@@ -469,7 +563,7 @@ class PressureChart final : public TileBase {
     coordinateXY(system_clock::time_point tp_zero,
                  const Database::TimePointAndDouble &in) override;
     //
-    constexpr static DeciPa BIAS = round<DeciPa>(HectoPa{1000});
+    constexpr static DeciPa BIAS = Chart::PRESSURE_BIAS;
     //
     virtual void
     chart_draw_part_tick_label(lv_obj_draw_part_dsc_t *dsc) override;
@@ -480,6 +574,8 @@ private:
   using Measurements = std::tuple<std::optional<Sensor::MeasurementBme280>,
                                   std::optional<Sensor::MeasurementM5Env3>>;
   Measurements latest{};
+  // 最後に表示した測定値の世代
+  std::array<uint32_t, std::tuple_size_v<Measurements>> generations{};
   std::unique_ptr<BC> basic_chart;
 
 public:
@@ -540,6 +636,8 @@ private:
                                   std::optional<Sensor::MeasurementScd30>,
                                   std::optional<Sensor::MeasurementScd41>>;
   Measurements latest{};
+  // 最後に表示した測定値の世代
+  std::array<uint32_t, std::tuple_size_v<Measurements>> generations{};
   std::unique_ptr<BC> basic_chart;
 
 public:
@@ -590,7 +688,7 @@ class TotalVocChart final : public TileBase {
     coordinateXY(system_clock::time_point tp_zero,
                  const Database::TimePointAndUInt16 &in) override;
     //
-    constexpr static int16_t DIVIDER = 2;
+    constexpr static int16_t DIVIDER = Chart::TOTAL_VOC_DIVIDER;
     //
     virtual void
     chart_draw_part_tick_label(lv_obj_draw_part_dsc_t *dsc) override;
@@ -599,6 +697,8 @@ class TotalVocChart final : public TileBase {
 private:
   //
   std::optional<Sensor::MeasurementSgp30> latest{};
+  // 最後に表示した測定値の世代
+  uint32_t generation{0};
   std::unique_ptr<BC> basic_chart;
 
 public:
@@ -629,6 +729,57 @@ public:
   void render();
 };
 
+//
+// 1時間毎(7日間)または1日毎(31日間)の集計の平均値
+//
+class HistoryChart final : public TileBase {
+  constexpr static auto X_AXIS_TICK_COUNT{3};
+  constexpr static auto Y_AXIS_TICK_COUNT{5};
+  //
+  const Database::Table _table;
+  const Database::Resolution _resolution;
+  // 区間の数
+  const uint16_t _point_count;
+  // センサー毎の線(lv_chart_set_ext_y_arrayで渡す)
+  std::unordered_map<SensorId, std::vector<lv_coord_t>> _y_points_map{};
+  std::shared_ptr<lv_obj_t> _chart_obj{};
+  //
+  system_clock::time_point _begin_x_tp{};
+  // 最後に表示した集計の世代
+  std::optional<uint32_t> _generation{};
+
+public:
+  constexpr static uint16_t WEEKLY_POINT_COUNT{7 * 24};
+  constexpr static uint16_t MONTHLY_POINT_COUNT{31};
+  //
+  HistoryChart(HistoryChart &&) = delete;
+  HistoryChart &operator=(const HistoryChart &) = delete;
+  HistoryChart(InitArg init, Database::Table table,
+               Database::Resolution resolution);
+  //
+  virtual void onActivate() override;
+  //
+  virtual void onDeactivate() override {
+    _chart_obj.reset();
+    _y_points_map.clear();
+    _generation.reset();
+  }
+  //
+  virtual void update() override;
+  //
+  void render();
+
+private:
+  // 1区間の長さ
+  system_clock::duration interval() const {
+    return _resolution == Database::Resolution::Hourly
+               ? system_clock::duration{hours{1}}
+               : system_clock::duration{Database::Days{1}};
+  }
+  //
+  static void event_draw_part_begin_callback(lv_event_t *event);
+};
+
 //
 //
 //
@@ -657,13 +808,14 @@ public:
 //
 class Gui {
 public:
-  constexpr static uint16_t CHART_X_POINT_COUNT = 1440;
+  // チャートの表示範囲[分](描く点の数は区間の数で決まる)
+  constexpr static uint16_t CHART_X_POINT_COUNT = Chart::X_POINT_COUNT;
   Gui(M5GFX &gfx) : gfx{gfx} {}
   //
   bool begin();
-  //
+  // LVGLのタスクから呼ぶこと
   bool startUi();
-  //
+  // 以下はLVGLのタスクから呼ぶこと
   void home();
   //
   void movePrev();
@@ -671,31 +823,58 @@ public:
   void moveNext();
   //
   void vibrate();
-  //
-  bool update_startup_progress(int16_t percent) {
-    if (_startup_widget) {
-      _startup_widget->updateProgress(percent);
-      return true;
-    }
-    return false;
+  // ボタンの操作
+  enum class Navigation : uint8_t { None, Prev, Home, Next };
+  // 他のタスクから呼べる(LVGLのタイマーが後で行う)
+  void requestNavigation(Navigation navigation) {
+    _navigation_request.store(navigation);
+  }
+  // 以下は他のタスクから呼べる(LVGLのタイマーが後で起動画面に出す)
+  void update_startup_progress(int16_t percent) {
+    std::lock_guard<std::mutex> lock{_startup_mutex};
+    _startup_progress = percent;
   }
   //
-  bool update_startup_message(const std::string &s) {
-    if (_startup_widget) {
-      _startup_widget->updateMessage(s);
-      return true;
-    }
-    return false;
+  void update_startup_message(const std::string &s) {
+    std::lock_guard<std::mutex> lock{_startup_mutex};
+    _startup_message = s;
+  }
+  // 起動画面を消してタイルを表示する
+  void requestStartUi() { _start_ui_requested.store(true); }
+  // 画面を描き直す速さ(LVGLのタスクから読む)
+  struct DisplayStatistics {
+    // 直近1秒間に描き直した画面の数
+    uint16_t fps;
+    // 最後に描き直した画面にかかった時間[ms]
+    uint32_t render_ms;
+    // 1回の転送にかかった時間の平均[us]
+    uint32_t flush_us;
+  };
+  DisplayStatistics getDisplayStatistics() const {
+    return _display_monitor.latest;
   }
 
 private:
   M5GFX &gfx;
   //
   std::unique_ptr<Widget::Startup> _startup_widget{};
+  // 起動画面にまだ出していない進み具合とログ
+  std::mutex _startup_mutex{};
+  std::optional<int16_t> _startup_progress{};
+  std::optional<std::string> _startup_message{};
+  std::atomic<bool> _start_ui_requested{false};
+  // 起動画面を更新する(起動画面を消したらfalse)
+  bool apply_startup();
   //
   std::shared_ptr<lv_obj_t> _tileview_obj;
   // tile widget
   std::vector<std::unique_ptr<Widget::TileBase>> tile_vector{};
+  // home()で表示するタイル(Summary)の列
+  uint8_t _home_col{0};
+  // 他のタスクから頼まれたボタンの操作
+  std::atomic<Navigation> _navigation_request{Navigation::None};
+  //
+  void navigate();
   //
   static bool
   check_if_active_tile(const std::unique_ptr<Widget::TileBase> &tile_to_test) {
@@ -706,28 +885,69 @@ private:
     }
   }
   //
-  template <typename T> inline void add_tile(const Widget::InitArg &arg) {
-    tile_vector.emplace_back(std::make_unique<T>(arg));
+  template <typename T, typename... Args>
+  inline void add_tile(const Widget::InitArg &arg, Args &&...args) {
+    tile_vector.emplace_back(
+        std::make_unique<T>(arg, std::forward<Args>(args)...));
   }
 
 private:
-  constexpr static size_t LVGL_BUFFER_ONE_SIZE_OF_BYTES = 8192;
+  // 描画用のバッファ1つの行数(2つのバッファを交互に描いて転送する)
+#ifdef LVGL_DRAW_BUFFER_LINES
+  constexpr static size_t LVGL_BUFFER_ONE_LINES = LVGL_DRAW_BUFFER_LINES;
+#else
+  constexpr static size_t LVGL_BUFFER_ONE_LINES = 24;
+#endif
+  // 描画用のバッファを置く場所
+#ifdef LVGL_DRAW_BUFFER_IN_PSRAM
+  constexpr static uint32_t LVGL_BUFFER_CAPS = MALLOC_CAP_SPIRAM;
+#else
+  constexpr static uint32_t LVGL_BUFFER_CAPS =
+      MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL;
+#endif
+  // 転送の終わりを確かめる周期[ms]
+  constexpr static uint32_t LVGL_FLUSH_POLLING_PERIOD = 5;
+  // ボタンの操作を確かめる周期[ms]
+  constexpr static uint32_t NAVIGATION_POLLING_PERIOD = 20;
+  // 起動画面を更新する周期[ms]
+  constexpr static uint32_t STARTUP_POLLING_PERIOD = 20;
+  //
+  struct HeapCapsDeleter {
+    void operator()(lv_color_t *ptr) const { heap_caps_free(ptr); }
+  };
   // LVGL use area
   struct LvglUseArea {
     // LVGL draw buffer
-    static lv_color_t
-        draw_buf_1[LVGL_BUFFER_ONE_SIZE_OF_BYTES / sizeof(lv_color_t)];
-    static lv_color_t
-        draw_buf_2[LVGL_BUFFER_ONE_SIZE_OF_BYTES / sizeof(lv_color_t)];
+    std::unique_ptr<lv_color_t, HeapCapsDeleter> draw_buf_1;
+    std::unique_ptr<lv_color_t, HeapCapsDeleter> draw_buf_2;
     lv_disp_draw_buf_t draw_buf_dsc;
     lv_disp_drv_t disp_drv;
     lv_indev_drv_t indev_drv;
   } lvgl_use;
   //
+  struct DisplayMonitor {
+    // DMAで転送している間はtrue
+    bool flushing{false};
+    std::chrono::steady_clock::time_point flush_started_at{};
+    // 1秒毎に数え直す
+    std::chrono::steady_clock::time_point window_started_at{};
+    uint16_t frames{0};
+    uint32_t flushes{0};
+    std::chrono::steady_clock::duration flush_total{};
+    DisplayStatistics latest{};
+  } _display_monitor;
+  // 転送が終わっていれば次のバッファを渡せるようにする
+  void complete_flush();
+  //
   static void lvgl_use_display_flush_callback(lv_disp_drv_t *disp_drv,
                                               const lv_area_t *area,
                                               lv_color_t *color_p);
   //
+  static void lvgl_use_display_wait_callback(lv_disp_drv_t *disp_drv);
+  //
+  static void lvgl_use_display_monitor_callback(lv_disp_drv_t *disp_drv,
+                                                uint32_t time, uint32_t px);
+  //
   static void lvgl_use_touchpad_read_callback(lv_indev_drv_t *indev_drv,
                                               lv_indev_data_t *data);
 };
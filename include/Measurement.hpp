@@ -0,0 +1,115 @@
+// Copyright (c) 2021 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "value_types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <variant>
+
+namespace Sensor {
+//
+// 各センサーの測定値
+//
+struct Bme280;
+struct Sgp30;
+struct Scd30;
+struct Scd41;
+struct M5Env3;
+
+// 測定時間と測定値のペア
+template <typename V>
+using Measurement = std::pair<std::chrono::system_clock::time_point, V>;
+using MeasurementBme280 = Measurement<Bme280>;
+using MeasurementSgp30 = Measurement<Sgp30>;
+using MeasurementScd30 = Measurement<Scd30>;
+using MeasurementScd41 = Measurement<Scd41>;
+using MeasurementM5Env3 = Measurement<M5Env3>;
+
+//
+// 対応している測定値の一覧
+// (この順番がMeasuredValueとAnyMeasurementのindexになる)
+//
+template <typename... Vs> struct MeasurementTypes {
+  using MeasuredValue = std::variant<std::monostate, Vs...>;
+  using AnyMeasurement = std::variant<Measurement<Vs>...>;
+  // 測定値の種類毎にBox<V>を並べたtuple
+  template <template <typename> class Box> using Each = std::tuple<Box<Vs>...>;
+  // 一番大きい測定値の大きさ
+  constexpr static size_t max_size() { return std::max({sizeof(Vs)...}); }
+};
+using Registered = MeasurementTypes<Bme280, Sgp30, Scd30, Scd41, M5Env3>;
+using MeasuredValue = Registered::MeasuredValue;
+using AnyMeasurement = Registered::AnyMeasurement;
+
+// Value Objects
+struct Bme280 {
+  SensorDescriptor sensor_descriptor;
+  CentiDegC temperature;
+  CentiRH relative_humidity;
+  DeciPa pressure;
+  bool operator==(const Bme280 &other) const {
+    return (sensor_descriptor == other.sensor_descriptor &&
+            temperature == other.temperature &&
+            relative_humidity == other.relative_humidity &&
+            pressure == other.pressure);
+  }
+  bool operator!=(const Bme280 &other) const { return !(*this == other); }
+};
+struct Sgp30 {
+  SensorDescriptor sensor_descriptor;
+  Ppm eCo2;
+  Ppb tvoc;
+  std::optional<BaselineECo2> eCo2_baseline;
+  std::optional<BaselineTotalVoc> tvoc_baseline;
+  bool operator==(const Sgp30 &other) const {
+    return (sensor_descriptor == other.sensor_descriptor &&
+            eCo2 == other.eCo2 && tvoc == other.tvoc &&
+            eCo2_baseline == other.eCo2_baseline &&
+            tvoc_baseline == other.tvoc_baseline);
+  }
+  bool operator!=(const Sgp30 &other) const { return !(*this == other); }
+};
+struct Scd30 {
+  SensorDescriptor sensor_descriptor;
+  Ppm co2;
+  CentiDegC temperature;
+  CentiRH relative_humidity;
+  bool operator==(const Scd30 &other) const {
+    return (sensor_descriptor == other.sensor_descriptor && co2 == other.co2 &&
+            temperature == other.temperature &&
+            relative_humidity == other.relative_humidity);
+  }
+  bool operator!=(const Scd30 &other) const { return !(*this == other); }
+};
+struct Scd41 {
+  SensorDescriptor sensor_descriptor;
+  Ppm co2;
+  CentiDegC temperature;
+  CentiRH relative_humidity;
+  bool operator==(const Scd41 &other) const {
+    return (sensor_descriptor == other.sensor_descriptor && co2 == other.co2 &&
+            temperature == other.temperature &&
+            relative_humidity == other.relative_humidity);
+  }
+  bool operator!=(const Scd41 &other) const { return !(*this == other); }
+};
+struct M5Env3 {
+  SensorDescriptor sensor_descriptor;
+  CentiDegC temperature;
+  CentiRH relative_humidity;
+  DeciPa pressure;
+  bool operator==(const M5Env3 &other) const {
+    return (sensor_descriptor == other.sensor_descriptor &&
+            temperature == other.temperature &&
+            relative_humidity == other.relative_humidity &&
+            pressure == other.pressure);
+  }
+  bool operator!=(const M5Env3 &other) const { return !(*this == other); }
+};
+} // namespace Sensor
@@ -1,36 +1,70 @@
-// Copyright (c) 2021 Akihiro Yamamoto.
-// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
-// See LICENSE file in the project root for full license information.
-//
-#pragma once
-#include "Sensor.hpp"
-#include <chrono>
-#include <queue>
-#include <tuple>
-
-//
-// 測定用
-//
-class MeasuringTask final {
-  struct Visitor;
-  using TimeAndMeasurement =
-      std::pair<std::chrono::system_clock::time_point, Sensor::MeasuredValue>;
-  // 測定値キュー
-  std::queue<TimeAndMeasurement> _queue{};
-  //
-  std::chrono::system_clock::time_point next_queue_in_tp{};
-  // 次回の実行予定時間
-  std::chrono::system_clock::time_point next_run_tp{};
-  // 測定
-  void measure();
-  // 現在値をキューに入れる
-  void queueIn(std::chrono::system_clock::time_point nowtp);
-  // キューに値があれば, IoTHubに送信＆データーベースに入れる
-  void queueOut();
-
-public:
-  //
-  bool begin(std::chrono::system_clock::time_point nowtp);
-  // 測定関数
-  void task_handler(std::chrono::system_clock::time_point nowtp);
-};
+// Copyright (c) 2021 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "DeadbandFilter.hpp"
+#include "Scheduler.hpp"
+#include "Sensor.hpp"
+#include "SpscQueue.hpp"
+#include <chrono>
+#include <optional>
+#include <tuple>
+#include <vector>
+
+//
+// 測定用
+//
+class MeasuringTask final {
+  struct Visitor;
+  // 同じ時間に測定した全センサーの値
+  using TimeAndMeasurements =
+      std::pair<std::chrono::system_clock::time_point,
+                std::vector<Sensor::MeasuredValue>>;
+  // 測定値キュー(測定するタスクが入れて, 保存と送信をするタスクが出す)
+  SpscQueue<TimeAndMeasurements, 16> _queue{};
+  // 時刻が合うまでは無い
+  std::optional<std::chrono::system_clock::time_point> next_queue_in_tp{};
+  // 変わっていない値は送信も保存もしない
+  DeadbandFilter _deadband{};
+  // 変換中のセンサーと読み出せる時刻
+  struct Conversion {
+    Sensor::Device *device;
+    std::chrono::steady_clock::time_point due;
+  };
+  std::vector<Conversion> _conversions{};
+  // キューから出す仕事(入れたら起こす)
+  Scheduler *_storing{nullptr};
+  Scheduler::JobId _queue_out_job{};
+  // 変換中のセンサーが無い時に読み出せるか確認する間隔
+  constexpr static auto POLLING_INTERVAL = std::chrono::milliseconds{1000};
+  // 変換の完了を諦めるまでの時間
+  constexpr static auto CONVERSION_TIMEOUT = std::chrono::milliseconds{1000};
+  // 時刻が合うのを待つ間に確認する間隔
+  constexpr static auto TIME_POLLING_INTERVAL = std::chrono::milliseconds{1000};
+  // 書き戻しが終わるのを待つ間に確認する間隔
+  constexpr static auto IMPORT_POLLING_INTERVAL =
+      std::chrono::milliseconds{1000};
+  // キューが空の時に確認する間隔(普段はキューに入れた時のnotifyで起きる)
+  constexpr static auto QUEUE_OUT_IDLE_INTERVAL = std::chrono::minutes{1};
+  // 測定(全センサーの変換を一斉に始めて, 終わった物から読み出す)
+  // 戻り値は次に呼び出すまでの時間
+  Scheduler::Duration measure();
+  // 現在値をキューに入れる
+  void queueIn(std::chrono::system_clock::time_point nowtp);
+  // キューに値があれば, IoTHubに送信＆データーベースに入れる
+  // 戻り値は次に呼び出すまでの時間
+  Scheduler::Duration queueOut();
+  // 次にキューに入れる時刻を決める
+  void begin(std::chrono::system_clock::time_point nowtp);
+
+public:
+  //
+  void enableDeadband(const DeadbandFilter::Bands &bands,
+                      std::chrono::seconds heartbeat) {
+    _deadband.enable(bands, heartbeat);
+  }
+  // 測定とキューに入れるのをsampling,
+  // キューから出すのをstoringのschedulerに登録する
+  void schedule(Scheduler &sampling, Scheduler &storing);
+};
@@ -0,0 +1,158 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <cmath>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+//
+// 固定長のバッファにJSONを直接書く
+//
+class JsonWriter final {
+  char *_buffer;
+  size_t _size;
+  size_t _length{0};
+  bool _overflow{false};
+  bool _first_field{true};
+
+public:
+  JsonWriter(char *buffer, size_t size) : _buffer{buffer}, _size{size} {}
+  //
+  // 書式はコンパイラに調べさせる
+  __attribute__((format(printf, 2, 3))) void print(const char *format, ...) {
+    if (_overflow) {
+      return;
+    }
+    va_list args;
+    va_start(args, format);
+    auto n = std::vsnprintf(_buffer + _length, _size - _length, format, args);
+    va_end(args);
+    if (n < 0 || static_cast<size_t>(n) >= _size - _length) {
+      _overflow = true;
+    } else {
+      _length += n;
+    }
+  }
+  //
+  void beginObject() {
+    print("{");
+    _first_field = true;
+  }
+  void endObject() { print("}"); }
+  //
+  void key(const char *name) {
+    if (!_first_field) {
+      print(",");
+    }
+    print("\"%s\":", name);
+    _first_field = false;
+  }
+  //
+  void field(const char *name, uint16_t value) {
+    key(name);
+    print("%u", value);
+  }
+  //
+  void field(const char *name, float value) {
+    key(name);
+    if (std::isfinite(value)) {
+      print("%.2f", value);
+    } else {
+      print("null");
+    }
+  }
+  // エスケープの要らない文字列
+  void field(const char *name, const char *value) {
+    key(name);
+    print("\"%s\"", value);
+  }
+  // 入りきらなければ0
+  size_t length() const { return _overflow ? 0 : _length; }
+};
+
+//
+// 固定長のバッファにCBOR(RFC 8949)を直接書く
+//
+constexpr uint8_t CBOR_UNSIGNED{0};
+constexpr uint8_t CBOR_NEGATIVE{1};
+constexpr uint8_t CBOR_TEXT{3};
+constexpr uint8_t CBOR_MAP{5};
+constexpr uint8_t CBOR_INDEFINITE_ARRAY{0x9f};
+constexpr uint8_t CBOR_NULL{0xf6};
+constexpr uint8_t CBOR_BREAK{0xff};
+class CborWriter final {
+  uint8_t *_buffer;
+  size_t _size;
+  size_t _length{0};
+  bool _overflow{false};
+
+public:
+  CborWriter(char *buffer, size_t size)
+      : _buffer{reinterpret_cast<uint8_t *>(buffer)}, _size{size} {}
+  //
+  void byte(uint8_t value) {
+    if (_length < _size) {
+      _buffer[_length++] = value;
+    } else {
+      _overflow = true;
+    }
+  }
+  // 主型と引数(引数は最も短い形で書く)
+  void head(uint8_t major, uint64_t argument) {
+    uint8_t initial = major << 5;
+    if (argument < 24) {
+      byte(initial | argument);
+      return;
+    }
+    // 続く引数のバイト数は1, 2, 4, 8の順に24, 25, 26, 27で表す
+    size_t bytes{1};
+    uint8_t additional{24};
+    while (bytes < 8 && argument >> (bytes * 8) != 0) {
+      bytes *= 2;
+      additional++;
+    }
+    byte(initial | additional);
+    for (size_t i = bytes; i > 0; --i) {
+      byte(static_cast<uint8_t>(argument >> ((i - 1) * 8)));
+    }
+  }
+  //
+  void integer(int64_t value) {
+    if (value >= 0) {
+      head(CBOR_UNSIGNED, value);
+    } else {
+      head(CBOR_NEGATIVE, -1 - value);
+    }
+  }
+  //
+  void text(const char *str) {
+    size_t n = std::strlen(str);
+    head(CBOR_TEXT, n);
+    for (size_t i = 0; i < n; ++i) {
+      byte(str[i]);
+    }
+  }
+  //
+  void beginMap(size_t pairs) { head(CBOR_MAP, pairs); }
+  //
+  void field(const char *name, int64_t value) {
+    text(name);
+    integer(value);
+  }
+  // 固定小数点の整数にする
+  void field(const char *name, double value, int32_t scale) {
+    text(name);
+    if (std::isfinite(value)) {
+      integer(std::llround(value * scale));
+    } else {
+      byte(CBOR_NULL);
+    }
+  }
+  // 入りきらなければ0
+  size_t length() const { return _overflow ? 0 : _length; }
+};
@@ -0,0 +1,30 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+//
+// ファイルに書くレコードのチェックサム
+// (checksumの欄を0として計算する)
+//
+template <typename T> uint32_t checksum_of(const T &in) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  std::array<uint8_t, sizeof(T)> bytes;
+  std::memcpy(bytes.data(), &in, sizeof(T));
+  std::fill_n(bytes.begin() + offsetof(T, checksum), sizeof(in.checksum), 0);
+  // Fletcher-32
+  uint32_t sum1{0xffff};
+  uint32_t sum2{0xffff};
+  for (auto byte : bytes) {
+    sum1 = (sum1 + byte) % 0xffff;
+    sum2 = (sum2 + sum1) % 0xffff;
+  }
+  return sum2 << 16 | sum1;
+}
@@ -6,27 +6,65 @@
 #define FASTLED_INTERNAL
 #include <FastLED.h>
 #include <array>
+#include <chrono>
+#include <mutex>
+#include <optional>
 
 //
-//
+// LEDの色はTask:RgbLedが変える
+// (呼んだタスクは待たない, 前に出した色と同じならLEDに送らない)
 //
 class RgbLed {
   constexpr static auto NUM_OF_LEDS = uint8_t{10};
   constexpr static auto GPIO_PIN_SK6815 = uint16_t{25};
+  constexpr static auto TASK_STACK_SIZE = size_t{3072};
+  // 色を変えている間の周期と, 変えていない間に見に行く周期
+  constexpr static auto FRAME_INTERVAL = std::chrono::milliseconds{20};
+  constexpr static auto IDLE_INTERVAL = std::chrono::milliseconds{100};
   std::array<CRGB, NUM_OF_LEDS> leds{};
+  //
+  std::mutex _mutex;
+  // fromからtoに変えている(durationが0なら変え終わっている)
+  CRGB _from{CRGB::Black};
+  CRGB _to{CRGB::Black};
+  std::chrono::steady_clock::time_point _transition_start{};
+  std::chrono::milliseconds _transition_duration{0};
+  // 虹色に回している時の1周の時間
+  std::optional<std::chrono::milliseconds> _rainbow_period{};
+  std::chrono::steady_clock::time_point _rainbow_start{};
+  //
+  uint8_t _brightness{255};
+  // LEDに送った色と明るさ(まだ送っていなければ無い)
+  std::optional<std::pair<CRGB, uint8_t>> _shown{};
 
 public:
+  // CO2の値が変わった時に色を変えるのにかける時間
+  constexpr static auto CO2_TRANSITION = std::chrono::milliseconds{1000};
+  // Task:RgbLedをcoreで動かす
+  // (LEDに送る割り込みもこのコアで動く)
+  void begin(BaseType_t core);
   //
-  void begin();
-  //
-  void setBrightness(uint8_t scale) { FastLED.setBrightness(scale); }
+  void setBrightness(uint8_t scale);
   //
   void clear() { fill(CRGB::Black); }
   //
-  void fill(CRGB color);
+  void fill(CRGB color) { fadeTo(color, std::chrono::milliseconds{0}); }
+  // 今の色からdurationかけて変える
+  void fadeTo(CRGB color, std::chrono::milliseconds duration);
+  // 止めるまで虹色に回す
+  void rainbow(std::chrono::milliseconds period);
   //
   static CRGB colorFromCarbonDioxide(uint16_t ppm);
   //
   static CRGB hslToRgb(float_t hue /* 0 < 360*/, float_t saturation /* 0 < 1 */,
                        float_t lightness /* 0 < 1 */);
+  // hslToRgb(hue, 1.0, 0.5)を表から引く
+  static CRGB hueToRgb(uint16_t hue /* 0 < 360*/);
+
+private:
+  // _mutexを取ってから呼ぶ
+  CRGB color_at(std::chrono::steady_clock::time_point now) const;
+  bool animating(std::chrono::steady_clock::time_point now) const;
+  //
+  static void task(void *arg);
 };
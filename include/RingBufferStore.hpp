@@ -0,0 +1,131 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "Database.hpp"
+#include "value_types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+//
+// (テーブル, センサーID)ごとに固定長のリングバッファで測定値を保持する
+// 1分に1スロットで, スロットの位置は分の通し番号から計算する
+//
+class RingBufferStore final : public Database::MeasurementStore {
+public:
+  using system_clock = std::chrono::system_clock;
+  using Table = Database::Table;
+  using OrderBy = Database::OrderBy;
+  using TimePointAndDouble = Database::TimePointAndDouble;
+  using TimePointAndUInt16 = Database::TimePointAndUInt16;
+  using TimePointAndIntAndOptInt = Database::TimePointAndIntAndOptInt;
+  template <typename T> using ReadCallback = Database::ReadCallback<T>;
+  //
+  // 列ごとに詰めて持つリングバッファ
+  //
+  template <typename T> class Ring final {
+    // 0は空きスロット
+    std::vector<uint32_t> _minutes;
+    std::vector<T> _values;
+    uint32_t _latest_minute{0};
+
+  public:
+    explicit Ring(size_t capacity) : _minutes(capacity, 0), _values(capacity) {}
+    //
+    size_t capacity() const { return _minutes.size(); }
+    //
+    uint32_t latest_minute() const { return _latest_minute; }
+    // 保持している最も古い分
+    uint32_t oldest_minute() const {
+      return _latest_minute >= capacity() ? _latest_minute - capacity() + 1
+                                          : 1;
+    }
+    // 同じスロットにある古い値は上書きして捨てる
+    bool put(uint32_t minute, T value) {
+      if (minute == 0 || (_latest_minute >= capacity() &&
+                          minute <= _latest_minute - capacity())) {
+        return false; // 保持期間より古い
+      }
+      auto index = minute % capacity();
+      _minutes[index] = minute;
+      _values[index] = value;
+      _latest_minute = std::max(_latest_minute, minute);
+      return true;
+    }
+    //
+    std::optional<T> get(uint32_t minute) const {
+      auto index = minute % capacity();
+      if (minute >= oldest_minute() && _minutes[index] == minute) {
+        return _values[index];
+      }
+      return std::nullopt;
+    }
+  };
+  //
+  struct RingWithBaseline final {
+    Ring<uint16_t> value;
+    Ring<uint16_t> baseline;
+    explicit RingWithBaseline(size_t capacity)
+        : value{capacity}, baseline{capacity} {}
+    //
+    size_t capacity() const { return value.capacity(); }
+    uint32_t latest_minute() const { return value.latest_minute(); }
+    uint32_t oldest_minute() const { return value.oldest_minute(); }
+  };
+
+private:
+  const size_t _capacity;
+  // この分より古い値は削除済み
+  uint32_t _floor_minute{0};
+  //
+  std::unordered_map<SensorId, Ring<CentiDegC::rep>> _temperature{};
+  std::unordered_map<SensorId, Ring<CentiRH::rep>> _relative_humidity{};
+  std::unordered_map<SensorId, Ring<DeciPa::rep>> _pressure{};
+  std::unordered_map<SensorId, RingWithBaseline> _carbon_dioxide{};
+  std::unordered_map<SensorId, RingWithBaseline> _total_voc{};
+  // GUIと測定のタスクから呼ばれる
+  mutable std::mutex _mutex{};
+
+public:
+  // capacity: 1つのリングバッファが保持する分数
+  explicit RingBufferStore(size_t capacity) : _capacity{capacity} {}
+  //
+  bool insert(Table table, TimePointAndDouble values) override;
+  bool insert(Table table, TimePointAndIntAndOptInt values) override;
+  //
+  std::optional<size_t>
+  read(Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+       ReadCallback<TimePointAndDouble> callback) override;
+  std::optional<size_t>
+  read(Table table, std::tuple<SensorId, OrderBy, size_t> placeholder,
+       ReadCallback<TimePointAndDouble> callback) override;
+  std::optional<size_t>
+  read(Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+       ReadCallback<TimePointAndUInt16> callback) override;
+  std::optional<size_t>
+  read(Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+       ReadCallback<TimePointAndIntAndOptInt> callback) override;
+  std::optional<size_t>
+  read(Table table, std::tuple<SensorId, OrderBy, size_t> placeholder,
+       ReadCallback<TimePointAndIntAndOptInt> callback) override;
+  //
+  bool delete_older_than(system_clock::time_point tp) override;
+  //
+  void clear() override;
+  //
+  static uint32_t to_minute(system_clock::time_point tp) {
+    return static_cast<uint32_t>(
+        std::chrono::floor<std::chrono::minutes>(tp.time_since_epoch())
+            .count());
+  }
+  //
+  static system_clock::time_point from_minute(uint32_t minute) {
+    return system_clock::time_point{std::chrono::minutes{minute}};
+  }
+};
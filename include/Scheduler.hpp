@@ -0,0 +1,68 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+//
+// 登録した仕事を期限の早い順に実行する
+// 次の期限まではタスクを眠らせてCPUを空ける
+// (notifyされたら期限を待たずに起きる)
+//
+class Scheduler final {
+public:
+  using steady_clock = std::chrono::steady_clock;
+  using Duration = std::chrono::milliseconds;
+  // 戻り値は実行を終えてから次回実行までの間隔
+  using Job = std::function<Duration()>;
+  // addの戻り値(notifyに使う)
+  using JobId = size_t;
+  // 期限が無い時に眠る最大時間
+  constexpr static Duration MAX_SLEEP{1000};
+
+private:
+  //
+  struct Deadline {
+    steady_clock::time_point due;
+    size_t job_index;
+    bool operator>(const Deadline &other) const { return due > other.due; }
+  };
+  //
+  std::vector<Job> _jobs{};
+  // 仕事毎の今の期限(これと違う_deadlinesの要素は古いので捨てる)
+  std::vector<steady_clock::time_point> _due{};
+  // 他のタスクから起こされた仕事
+  std::deque<std::atomic<bool>> _notified{};
+  // run()しているタスク
+  std::atomic<TaskHandle_t> _task{nullptr};
+  // 期限の早い順
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>>
+      _deadlines{};
+
+public:
+  // first_delay後に最初の実行をする
+  // (run()の前に登録する)
+  JobId add(Duration first_delay, Job job);
+  // period毎に実行する
+  void every(Duration period, std::function<void()> fn) {
+    add(period, [period, fn = std::move(fn)]() -> Duration {
+      fn();
+      return period;
+    });
+  }
+  // 期限を待たずに次の機会に実行させる(他のタスクから呼べる)
+  void notify(JobId id);
+  // 期限の来た仕事を実行して, 次の期限までの時間を返す
+  Duration run_pending(steady_clock::time_point now);
+  // 呼び出したタスクで実行し続ける
+  [[noreturn]] void run();
+};
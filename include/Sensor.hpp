@@ -3,6 +3,7 @@
 // See LICENSE file in the project root for full license information.
 //
 #pragma once
+#include "Measurement.hpp"
 #include "SimpleMovingAverage.hpp"
 #include "value_types.hpp"
 #include <Adafruit_BME280.h>
@@ -13,104 +14,19 @@
 #include <SensirionI2CScd4x.h>
 #include <Wire.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <ctime>
 #include <memory>
 #include <optional>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <variant>
 
 namespace Sensor {
-//
-// 各センサーの測定値
-//
-struct Bme280;
-struct Sgp30;
-struct Scd30;
-struct Scd41;
-struct M5Env3;
-using MeasuredValue =
-    std::variant<std::monostate, Bme280, Sgp30, Scd30, Scd41, M5Env3>;
-
-// 測定時間と測定値のペア
-using MeasurementBme280 =
-    std::pair<std::chrono::system_clock::time_point, Bme280>;
-using MeasurementSgp30 =
-    std::pair<std::chrono::system_clock::time_point, Sgp30>;
-using MeasurementScd30 =
-    std::pair<std::chrono::system_clock::time_point, Scd30>;
-using MeasurementScd41 =
-    std::pair<std::chrono::system_clock::time_point, Scd41>;
-using MeasurementM5Env3 =
-    std::pair<std::chrono::system_clock::time_point, M5Env3>;
-
-// Value Objects
-struct Bme280 {
-  SensorDescriptor sensor_descriptor;
-  CentiDegC temperature;
-  CentiRH relative_humidity;
-  DeciPa pressure;
-  bool operator==(const Bme280 &other) const {
-    return (sensor_descriptor == other.sensor_descriptor &&
-            temperature == other.temperature &&
-            relative_humidity == other.relative_humidity &&
-            pressure == other.pressure);
-  }
-  bool operator!=(const Bme280 &other) const { return !(*this == other); }
-};
-struct Sgp30 {
-  SensorDescriptor sensor_descriptor;
-  Ppm eCo2;
-  Ppb tvoc;
-  std::optional<BaselineECo2> eCo2_baseline;
-  std::optional<BaselineTotalVoc> tvoc_baseline;
-  bool operator==(const Sgp30 &other) const {
-    return (sensor_descriptor == other.sensor_descriptor &&
-            eCo2 == other.eCo2 && tvoc == other.tvoc &&
-            eCo2_baseline == other.eCo2_baseline &&
-            tvoc_baseline == other.tvoc_baseline);
-  }
-  bool operator!=(const Sgp30 &other) const { return !(*this == other); }
-};
-struct Scd30 {
-  SensorDescriptor sensor_descriptor;
-  Ppm co2;
-  CentiDegC temperature;
-  CentiRH relative_humidity;
-  bool operator==(const Scd30 &other) const {
-    return (sensor_descriptor == other.sensor_descriptor && co2 == other.co2 &&
-            temperature == other.temperature &&
-            relative_humidity == other.relative_humidity);
-  }
-  bool operator!=(const Scd30 &other) const { return !(*this == other); }
-};
-struct Scd41 {
-  SensorDescriptor sensor_descriptor;
-  Ppm co2;
-  CentiDegC temperature;
-  CentiRH relative_humidity;
-  bool operator==(const Scd41 &other) const {
-    return (sensor_descriptor == other.sensor_descriptor && co2 == other.co2 &&
-            temperature == other.temperature &&
-            relative_humidity == other.relative_humidity);
-  }
-  bool operator!=(const Scd41 &other) const { return !(*this == other); }
-};
-struct M5Env3 {
-  SensorDescriptor sensor_descriptor;
-  CentiDegC temperature;
-  CentiRH relative_humidity;
-  DeciPa pressure;
-  bool operator==(const M5Env3 &other) const {
-    return (sensor_descriptor == other.sensor_descriptor &&
-            temperature == other.temperature &&
-            relative_humidity == other.relative_humidity &&
-            pressure == other.pressure);
-  }
-  bool operator!=(const M5Env3 &other) const { return !(*this == other); }
-};
-
 //
 // device driver
 //
@@ -120,14 +36,81 @@ struct Device {
   virtual bool available() const = 0;
   virtual bool readyToRead() = 0;
   virtual MeasuredValue read() = 0;
+  // 分割実行する測定(変換開始 -> 完了確認 -> 読み出し)
+  // 変換を始めて読み出せるまでの時間を返す, 始められなければnullopt
+  // 分割できないセンサーはcollect()で全部やる
+  virtual std::optional<std::chrono::milliseconds> startConversion() {
+    return std::chrono::milliseconds{0};
+  }
+  virtual bool conversionComplete() { return true; }
+  virtual MeasuredValue collect() { return read(); }
+  //
   virtual MeasuredValue calculateSMA() = 0;
+  // 移動平均を取る時間
+  // (窓の測定回数は測定間隔が変わる度にこの時間に合わせる)
+  void setAveragingWindow(std::chrono::seconds window) {
+    averaging_window = window;
+    resizeAveragingWindow();
+  }
+  // 測定間隔の方針
+  // 主な測定値が前回からchange_threshold以上変わったらfast_intervalで,
+  // 変わらなければslow_intervalで測定する
+  struct SamplingPolicy {
+    std::chrono::seconds fast_interval;
+    std::chrono::seconds slow_interval;
+    float change_threshold; // 主な測定値(℃, ppm)の単位
+  };
+  void setSamplingPolicy(const SamplingPolicy &policy) {
+    sampling_policy = policy;
+    sampling_policy.fast_interval =
+        std::min(policy.fast_interval, policy.slow_interval);
+    interval = sampling_policy.slow_interval;
+    resizeAveragingWindow();
+  }
+  //
+  constexpr static auto DEFAULT_INTERVAL = std::chrono::seconds{12};
+  constexpr static auto DEFAULT_AVERAGING_WINDOW = std::chrono::seconds{61};
+  // 移動平均を取る時間内の測定回数
+  constexpr static uint8_t samplesInWindow(std::chrono::seconds window,
+                                           std::chrono::seconds interval,
+                                           uint8_t capacity) {
+    auto samples = window / interval;
+    return samples < 1          ? uint8_t{1}
+           : samples > capacity ? capacity
+                                : static_cast<uint8_t>(samples);
+  }
+
+protected:
+  SamplingPolicy sampling_policy{DEFAULT_INTERVAL, DEFAULT_INTERVAL, 0.0f};
+  // 次の測定までの間隔
+  std::chrono::seconds interval{DEFAULT_INTERVAL};
+  std::optional<float> last_primary_value{};
+  //
+  std::chrono::seconds averaging_window{DEFAULT_AVERAGING_WINDOW};
+  // averaging_windowとintervalから移動平均の窓の測定回数を決め直す
+  virtual void resizeAveragingWindow() = 0;
+  // 主な測定値の変化で次の測定間隔を決める
+  void adaptInterval(float primary_value) {
+    bool changing =
+        last_primary_value && sampling_policy.change_threshold > 0.0f &&
+        std::abs(primary_value - *last_primary_value) >=
+            sampling_policy.change_threshold;
+    auto next_interval = changing ? sampling_policy.fast_interval
+                                  : sampling_policy.slow_interval;
+    last_primary_value = primary_value;
+    if (next_interval != interval) {
+      interval = next_interval;
+      resizeAveragingWindow();
+    }
+  }
 };
 
 // Bosch BME280: Temperature and Humidity and Pressure Sensor
 class Bme280Device : public Device {
-  constexpr static auto INTERVAL = std::chrono::seconds{12};
-  constexpr static auto SMA_PERIOD =
-      std::chrono::seconds{61} / INTERVAL; // reads per min
+  // 最長5分の移動平均を取れる
+  constexpr static auto SMA_CAPACITY = uint8_t{25};
+  constexpr static auto SMA_WINDOW =
+      samplesInWindow(DEFAULT_AVERAGING_WINDOW, DEFAULT_INTERVAL, SMA_CAPACITY);
   //
   const SensorDescriptor sensor_descriptor;
   const uint8_t i2c_address;
@@ -135,10 +118,12 @@ class Bme280Device : public Device {
   bool initialized{false};
   std::chrono::steady_clock::time_point last_measured_at{};
   Adafruit_BME280 bme280;
-  SimpleMovingAverage<SMA_PERIOD, CentiDegC::rep, int32_t> sma_temperature{};
-  SimpleMovingAverage<SMA_PERIOD, CentiRH::rep, int32_t>
-      sma_relative_humidity{};
-  SimpleMovingAverage<SMA_PERIOD, DeciPa::rep, int32_t> sma_pressure{};
+  SimpleMovingAverage<SMA_CAPACITY, CentiDegC::rep, int32_t>
+      sma_temperature{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, CentiRH::rep, int32_t>
+      sma_relative_humidity{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, DeciPa::rep, int32_t>
+      sma_pressure{SMA_WINDOW};
 
 public:
   Bme280Device(const SensorDescriptor &custom_sensor_descriptor,
@@ -160,6 +145,7 @@ public:
   bool readyToRead() override;
   MeasuredValue read() override;
   MeasuredValue calculateSMA() override;
+  void resizeAveragingWindow() override;
   //
   void setSampling() {
     bme280.setSampling(Adafruit_BME280::MODE_NORMAL,
@@ -173,9 +159,10 @@ public:
 
 // Sensirion SGP30: Air Quality Sensor
 class Sgp30Device : public Device {
-  constexpr static auto INTERVAL = std::chrono::seconds{12};
-  constexpr static auto SMA_PERIOD =
-      std::chrono::seconds{61} / INTERVAL; // reads per min
+  // 最長5分の移動平均を取れる
+  constexpr static auto SMA_CAPACITY = uint8_t{25};
+  constexpr static auto SMA_WINDOW =
+      samplesInWindow(DEFAULT_AVERAGING_WINDOW, DEFAULT_INTERVAL, SMA_CAPACITY);
   //
   const SensorDescriptor sensor_descriptor;
   TwoWire &two_wire;
@@ -184,8 +171,12 @@ class Sgp30Device : public Device {
   std::optional<BaselineECo2> last_eco2_baseline{std::nullopt};
   std::optional<BaselineTotalVoc> last_tvoc_baseline{std::nullopt};
   Adafruit_SGP30 sgp30;
-  SimpleMovingAverage<SMA_PERIOD, uint16_t, uint32_t> sma_eCo2{};
-  SimpleMovingAverage<SMA_PERIOD, uint16_t, uint32_t> sma_tvoc{};
+  //
+  constexpr static auto SGP30_I2C_ADDRESS = uint8_t{0x58};
+  // Measure_iaqの変換時間
+  constexpr static auto MEASURE_IAQ_DURATION = std::chrono::milliseconds{12};
+  SimpleMovingAverage<SMA_CAPACITY, uint16_t, uint32_t> sma_eCo2{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, uint16_t, uint32_t> sma_tvoc{SMA_WINDOW};
 
 public:
   Sgp30Device(const SensorDescriptor &custom_sensor_descriptor, TwoWire &wire)
@@ -205,7 +196,10 @@ public:
   bool available() const override { return initialized; }
   bool readyToRead() override;
   MeasuredValue read() override;
+  std::optional<std::chrono::milliseconds> startConversion() override;
+  MeasuredValue collect() override;
   MeasuredValue calculateSMA() override;
+  void resizeAveragingWindow() override;
   //
   bool setIAQBaseline(BaselineECo2 eco2_base, BaselineTotalVoc tvoc_base);
   bool setHumidity(MilligramPerCubicMetre absolute_humidity);
@@ -213,18 +207,21 @@ public:
 
 // Sensirion SCD30: NDIR CO2 and Temperature and Humidity Sensor
 class Scd30Device : public Device {
-  constexpr static auto INTERVAL = std::chrono::seconds{12};
-  constexpr static auto SMA_PERIOD =
-      std::chrono::seconds{61} / INTERVAL; // reads per min
+  // 最長5分の移動平均を取れる
+  constexpr static auto SMA_CAPACITY = uint8_t{25};
+  constexpr static auto SMA_WINDOW =
+      samplesInWindow(DEFAULT_AVERAGING_WINDOW, DEFAULT_INTERVAL, SMA_CAPACITY);
   //
   const SensorDescriptor &sensor_descriptor;
   TwoWire &two_wire;
   bool initialized{false};
   std::chrono::steady_clock::time_point last_measured_at{};
   Adafruit_SCD30 scd30;
-  SimpleMovingAverage<SMA_PERIOD, uint16_t, uint32_t> sma_co2{};
-  SimpleMovingAverage<SMA_PERIOD, int16_t, int32_t> sma_temperature{};
-  SimpleMovingAverage<SMA_PERIOD, uint16_t, uint32_t> sma_relative_humidity{};
+  SimpleMovingAverage<SMA_CAPACITY, uint16_t, uint32_t> sma_co2{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, int16_t, int32_t>
+      sma_temperature{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, uint16_t, uint32_t>
+      sma_relative_humidity{SMA_WINDOW};
 
 public:
   Scd30Device(const SensorDescriptor &custom_sensor_descriptor, TwoWire &wire)
@@ -244,22 +241,26 @@ public:
   bool readyToRead() override;
   MeasuredValue read() override;
   MeasuredValue calculateSMA() override;
+  void resizeAveragingWindow() override;
 };
 
 // Sensirion SCD41: PASens CO2 and Temperature and Humidity Sensor
 class Scd41Device : public Device {
-  constexpr static auto INTERVAL = std::chrono::seconds{12};
-  constexpr static auto SMA_PERIOD =
-      std::chrono::seconds{61} / INTERVAL; // reads per min
+  // 最長5分の移動平均を取れる
+  constexpr static auto SMA_CAPACITY = uint8_t{25};
+  constexpr static auto SMA_WINDOW =
+      samplesInWindow(DEFAULT_AVERAGING_WINDOW, DEFAULT_INTERVAL, SMA_CAPACITY);
   //
   const SensorDescriptor &sensor_descriptor;
   TwoWire &two_wire;
   bool initialized{false};
   std::chrono::steady_clock::time_point last_measured_at{};
   SensirionI2CScd4x scd4x;
-  SimpleMovingAverage<SMA_PERIOD, uint16_t, uint32_t> sma_co2{};
-  SimpleMovingAverage<SMA_PERIOD, int16_t, int32_t> sma_temperature{};
-  SimpleMovingAverage<SMA_PERIOD, uint16_t, uint32_t> sma_relative_humidity{};
+  SimpleMovingAverage<SMA_CAPACITY, uint16_t, uint32_t> sma_co2{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, int16_t, int32_t>
+      sma_temperature{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, uint16_t, uint32_t>
+      sma_relative_humidity{SMA_WINDOW};
 
 public:
   Scd41Device(const SensorDescriptor &custom_sensor_descriptor, TwoWire &wire)
@@ -281,15 +282,19 @@ public:
   SensorStatus getSensorStatus();
   MeasuredValue read() override;
   MeasuredValue calculateSMA() override;
+  void resizeAveragingWindow() override;
 };
 
 // M5Stack ENV.iii unit: Temperature and Humidity and Pressure Sensor
 class M5Env3Device : public Device {
-  constexpr static auto INTERVAL = std::chrono::seconds{12};
-  constexpr static auto SMA_PERIOD =
-      std::chrono::seconds{61} / INTERVAL; // reads per min
+  // 最長5分の移動平均を取れる
+  constexpr static auto SMA_CAPACITY = uint8_t{25};
+  constexpr static auto SMA_WINDOW =
+      samplesInWindow(DEFAULT_AVERAGING_WINDOW, DEFAULT_INTERVAL, SMA_CAPACITY);
   constexpr static auto ENV3_I2C_ADDRESS_SHT31 = uint8_t{0x44};
   constexpr static auto ENV3_I2C_ADDRESS_QMP6988 = uint8_t{0x70};
+  // 1回測定(高精度, クロックストレッチ無し)の変換時間
+  constexpr static auto SHT31_MEASURE_DURATION = std::chrono::milliseconds{16};
   //
   const SensorDescriptor sensor_descriptor;
   TwoWire &two_wire;
@@ -300,10 +305,12 @@ class M5Env3Device : public Device {
   std::chrono::steady_clock::time_point last_measured_at{};
   SHT3X sht31;
   QMP6988 qmp6988;
-  SimpleMovingAverage<SMA_PERIOD, CentiDegC::rep, int32_t> sma_temperature{};
-  SimpleMovingAverage<SMA_PERIOD, CentiRH::rep, int32_t>
-      sma_relative_humidity{};
-  SimpleMovingAverage<SMA_PERIOD, DeciPa::rep, int32_t> sma_pressure{};
+  SimpleMovingAverage<SMA_CAPACITY, CentiDegC::rep, int32_t>
+      sma_temperature{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, CentiRH::rep, int32_t>
+      sma_relative_humidity{SMA_WINDOW};
+  SimpleMovingAverage<SMA_CAPACITY, DeciPa::rep, int32_t>
+      sma_pressure{SMA_WINDOW};
 
 public:
   M5Env3Device(const SensorDescriptor &custom_sensor_descriptor, TwoWire &wire,
@@ -325,7 +332,10 @@ public:
   bool available() const override { return initialized; }
   bool readyToRead() override;
   MeasuredValue read() override;
+  std::optional<std::chrono::milliseconds> startConversion() override;
+  MeasuredValue collect() override;
   MeasuredValue calculateSMA() override;
+  void resizeAveragingWindow() override;
 };
 
 } // namespace Sensor
\ No newline at end of file
@@ -0,0 +1,166 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "Measurement.hpp"
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace Sensor {
+//
+// 測定値の項目(データーベースのテーブル)
+//
+enum class Metric : uint8_t {
+  Temperature,      // [℃]
+  RelativeHumidity, // [%RH]
+  Pressure,         // [hPa]
+  CarbonDioxide,    // [ppm]
+  TotalVoc,         // [ppb]
+};
+// 整数で持つ項目
+constexpr bool isIntegral(Metric metric) {
+  return metric == Metric::CarbonDioxide || metric == Metric::TotalVoc;
+}
+// Metricの単位の値からセンサーの持つ固定小数点の値への倍率
+constexpr int32_t fixedPointScale(Metric metric) {
+  switch (metric) {
+  case Metric::Temperature:
+    return 100; // CentiDegC
+  case Metric::RelativeHumidity:
+    return 100; // CentiRH
+  case Metric::Pressure:
+    return 1000; // DeciPa
+  default:
+    return 1; // Ppm, Ppb
+  }
+}
+
+//
+// 測定値の項目1つ分の情報
+//
+template <typename V> struct Field {
+  // 送信するJSONの名前
+  const char *name;
+  Metric metric;
+  // Metricの単位での値
+  double (*value)(const V &);
+  // ベースラインが無ければnullptr
+  const char *baseline_name;
+  std::optional<uint16_t> (*baseline)(const V &);
+};
+
+//
+// センサー毎の測定値の項目の表
+// (MeasuringTask, Database, Telemetry, DeadbandFilter, Gui::Summaryは
+//  この表から処理を作る)
+//
+template <typename V> struct Traits;
+
+// Bosch BME280: Temperature and Humidity and Pressure Sensor
+template <> struct Traits<Bme280> {
+  constexpr static std::string_view name{"Bme280"};
+  constexpr static SensorDescriptor descriptor{
+      {'B', 'M', 'E', '2', '8', '0', '\0', '\0'}};
+  constexpr static bool indicates_co2{false};
+  constexpr static std::array<Field<Bme280>, 3> fields{{
+      {"temperature", Metric::Temperature,
+       [](const Bme280 &v) -> double { return DegC(v.temperature).count(); },
+       nullptr, nullptr},
+      {"humidity", Metric::RelativeHumidity,
+       [](const Bme280 &v) -> double {
+         return PctRH(v.relative_humidity).count();
+       },
+       nullptr, nullptr},
+      {"pressure", Metric::Pressure,
+       [](const Bme280 &v) -> double { return HectoPa(v.pressure).count(); },
+       nullptr, nullptr},
+  }};
+};
+
+// Sensirion SGP30: Air Quality Sensor
+template <> struct Traits<Sgp30> {
+  constexpr static std::string_view name{"Sgp30"};
+  constexpr static SensorDescriptor descriptor{
+      {'S', 'G', 'P', '3', '0', '\0', '\0', '\0'}};
+  constexpr static bool indicates_co2{false};
+  constexpr static std::array<Field<Sgp30>, 2> fields{{
+      {"tvoc", Metric::TotalVoc,
+       [](const Sgp30 &v) -> double { return v.tvoc.value; }, "tvoc_baseline",
+       [](const Sgp30 &v) -> std::optional<uint16_t> {
+         return v.tvoc_baseline ? std::make_optional(v.tvoc_baseline->value)
+                                : std::nullopt;
+       }},
+      {"eCo2", Metric::CarbonDioxide,
+       [](const Sgp30 &v) -> double { return v.eCo2.value; }, "eCo2_baseline",
+       [](const Sgp30 &v) -> std::optional<uint16_t> {
+         return v.eCo2_baseline ? std::make_optional(v.eCo2_baseline->value)
+                                : std::nullopt;
+       }},
+  }};
+};
+
+// Sensirion SCD30: NDIR CO2 and Temperature and Humidity Sensor
+template <> struct Traits<Scd30> {
+  constexpr static std::string_view name{"Scd30"};
+  constexpr static SensorDescriptor descriptor{
+      {'S', 'C', 'D', '3', '0', '\0', '\0', '\0'}};
+  // CO2の値でLEDの色を変える
+  constexpr static bool indicates_co2{true};
+  constexpr static std::array<Field<Scd30>, 3> fields{{
+      {"co2", Metric::CarbonDioxide,
+       [](const Scd30 &v) -> double { return v.co2.value; }, nullptr, nullptr},
+      {"temperature", Metric::Temperature,
+       [](const Scd30 &v) -> double { return DegC(v.temperature).count(); },
+       nullptr, nullptr},
+      {"humidity", Metric::RelativeHumidity,
+       [](const Scd30 &v) -> double {
+         return PctRH(v.relative_humidity).count();
+       },
+       nullptr, nullptr},
+  }};
+};
+
+// Sensirion SCD41: PASens CO2 and Temperature and Humidity Sensor
+template <> struct Traits<Scd41> {
+  constexpr static std::string_view name{"Scd41"};
+  constexpr static SensorDescriptor descriptor{
+      {'S', 'C', 'D', '4', '1', '\0', '\0', '\0'}};
+  constexpr static bool indicates_co2{false};
+  constexpr static std::array<Field<Scd41>, 3> fields{{
+      {"co2", Metric::CarbonDioxide,
+       [](const Scd41 &v) -> double { return v.co2.value; }, nullptr, nullptr},
+      {"temperature", Metric::Temperature,
+       [](const Scd41 &v) -> double { return DegC(v.temperature).count(); },
+       nullptr, nullptr},
+      {"humidity", Metric::RelativeHumidity,
+       [](const Scd41 &v) -> double {
+         return PctRH(v.relative_humidity).count();
+       },
+       nullptr, nullptr},
+  }};
+};
+
+// M5Stack ENV.iii unit: Temperature and Humidity and Pressure Sensor
+template <> struct Traits<M5Env3> {
+  constexpr static std::string_view name{"M5Env3"};
+  constexpr static SensorDescriptor descriptor{
+      {'M', '5', 'E', 'N', 'V', '3', '\0', '\0'}};
+  constexpr static bool indicates_co2{false};
+  constexpr static std::array<Field<M5Env3>, 3> fields{{
+      {"temperature", Metric::Temperature,
+       [](const M5Env3 &v) -> double { return DegC(v.temperature).count(); },
+       nullptr, nullptr},
+      {"humidity", Metric::RelativeHumidity,
+       [](const M5Env3 &v) -> double {
+         return PctRH(v.relative_humidity).count();
+       },
+       nullptr, nullptr},
+      {"pressure", Metric::Pressure,
+       [](const M5Env3 &v) -> double { return HectoPa(v.pressure).count(); },
+       nullptr, nullptr},
+  }};
+};
+} // namespace Sensor
@@ -14,8 +14,8 @@ class SerialLogger
 {
 public:
   SerialLogger();
-  void Info(String message);
-  void Error(String message);
+  void Info(const String &message);
+  void Error(const String &message);
 };
 
 extern SerialLogger Logger;
@@ -3,29 +3,158 @@
 // See LICENSE file in the project root for full license information.
 //
 #pragma once
+#include <algorithm>
 #include <array>
 #include <cstdint>
-#include <numeric>
+#include <functional>
+#include <type_traits>
+#include <utility>
 
+//
+// 窓の中の最小値(Compare = less)または最大値(Compare = greater)を
+// 先頭に持つ単調な列
+//
+template <uint8_t N, typename value_t, typename Compare>
+class MonotonicWedge final {
+  std::array<std::pair<uint32_t, value_t>, N> ring{};
+  uint8_t first{0};
+  uint8_t size{0};
+  //
+  static uint8_t wrap(unsigned index) { return index % N; }
+
+public:
+  void clear() {
+    first = 0;
+    size = 0;
+  }
+  // 窓から外れた(seqがoldestより前の)値を捨てる
+  void expire(uint32_t oldest) {
+    while (size > 0 && ring[first].first < oldest) {
+      first = wrap(first + 1);
+      --size;
+    }
+  }
+  // 先頭になれない値を末尾から捨ててから入れる
+  void push_back(uint32_t seq, value_t input) {
+    while (size > 0 && !Compare{}(ring[wrap(first + size - 1)].second, input)) {
+      --size;
+    }
+    ring[wrap(first + size)] = {seq, input};
+    ++size;
+  }
+  //
+  value_t front() const { return ring[first].second; }
+};
+
+//
+// 直近window個の単純移動平均(Nは最大の窓の大きさ)
+// 合計と2乗の合計を入れ替えながら持つので, 追加も計算もO(1)
+//
 template <uint8_t N, typename value_t, typename sum_t>
 class SimpleMovingAverage final {
-  bool ready_to_go;
-  std::array<value_t, N> ring;
-  typename decltype(ring)::iterator itr;
+  static_assert(N > 0, "N must be a natural number.");
+  static_assert(std::is_integral_v<value_t>, "value_t must be an integer.");
+  std::array<value_t, N> ring{};
+  uint8_t window{N};
+  // 次に書く位置
+  uint8_t next{0};
+  // 窓の中の値の数
+  uint8_t count{0};
+  // 次に入れる値の通し番号
+  uint32_t seq{0};
+  sum_t sum{0};
+  int64_t sum_of_squares{0};
+  MonotonicWedge<N, value_t, std::less<value_t>> minimum{};
+  MonotonicWedge<N, value_t, std::greater<value_t>> maximum{};
 
 public:
-  SimpleMovingAverage() : ready_to_go{false}, ring{}, itr{ring.begin()} {};
-  bool ready() const { return ready_to_go; }
+  explicit SimpleMovingAverage(uint8_t window = N)
+      : window{std::clamp<uint8_t>(window, 1, N)} {}
+  //
+  struct Statistics {
+    uint8_t count;
+    value_t mean;
+    value_t min;
+    value_t max;
+    float variance; // 母分散
+  };
+  //
+  constexpr static uint8_t capacity() { return N; }
+  // 窓の大きさを変えると, 溜めた値は捨てる
+  void setWindow(uint8_t new_window) {
+    window = std::clamp<uint8_t>(new_window, 1, N);
+    clear();
+  }
+  // 新しい方から新しい窓に入る分だけ溜めた値を残して大きさを変える
+  void resize(uint8_t new_window) {
+    new_window = std::clamp<uint8_t>(new_window, 1, N);
+    if (new_window == window) {
+      return;
+    }
+    uint8_t kept = std::min(count, new_window);
+    // 一番新しい値はnextの1つ前にある
+    std::array<value_t, N> newest{};
+    for (uint8_t i = 0; i < kept; ++i) {
+      newest[kept - 1 - i] = ring[(next + window - 1 - i) % window];
+    }
+    window = new_window;
+    clear();
+    for (uint8_t i = 0; i < kept; ++i) {
+      push_back(newest[i]);
+    }
+  }
+  uint8_t getWindow() const { return window; }
+  //
+  void clear() {
+    next = 0;
+    count = 0;
+    sum = sum_t(0);
+    sum_of_squares = 0;
+    minimum.clear();
+    maximum.clear();
+  }
+  // 値が1つでもあれば, その数で平均を取る
+  bool ready() const { return count > 0; }
+  bool full() const { return count == window; }
+  //
   void push_back(value_t input) {
-    if (itr == ring.end()) {
-      itr = ring.begin();
-      ready_to_go = true;
+    if (count == window) {
+      value_t oldest = ring[next];
+      sum -= oldest;
+      sum_of_squares -= static_cast<int64_t>(oldest) * oldest;
+    } else {
+      ++count;
     }
-    *itr++ = input;
+    ring[next] = input;
+    next = next + 1 < window ? next + 1 : 0;
+    sum += input;
+    sum_of_squares += static_cast<int64_t>(input) * input;
+    //
+    minimum.expire(seq + 1 - count);
+    maximum.expire(seq + 1 - count);
+    minimum.push_back(seq, input);
+    maximum.push_back(seq, input);
+    ++seq;
   }
+  //
   value_t calculate() const {
-    static_assert(N > 0, "N must be a natural number.");
-    sum_t summary = std::accumulate(ring.begin(), ring.end(), sum_t(0));
-    return summary / N;
+    return count > 0 ? static_cast<value_t>(sum / count) : value_t(0);
+  }
+  //
+  Statistics statistics() const {
+    if (count == 0) {
+      return Statistics{0, value_t(0), value_t(0), value_t(0), 0.0f};
+    }
+    // 桁落ちしないように整数で(n * Σx^2 - (Σx)^2) / n^2を計算する
+    int64_t n = count;
+    int64_t s = static_cast<int64_t>(sum);
+    int64_t numerator = n * sum_of_squares - s * s;
+    return Statistics{
+        count,
+        calculate(),
+        minimum.front(),
+        maximum.front(),
+        static_cast<float>(static_cast<double>(numerator) / (n * n)),
+    };
   }
 };
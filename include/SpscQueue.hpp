@@ -0,0 +1,57 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <utility>
+
+//
+// 入れるタスクと出すタスクが1つずつの固定長の待ち行列(ロック無し)
+//
+template <typename T, size_t N> class SpscQueue final {
+  // 1つは満杯と空を区別するために空けておく
+  std::array<T, N + 1> _ring{};
+  // 出すタスクだけが書く
+  std::atomic<size_t> _head{0};
+  // 入れるタスクだけが書く
+  std::atomic<size_t> _tail{0};
+  //
+  constexpr static size_t next(size_t index) {
+    return index + 1 < N + 1 ? index + 1 : 0;
+  }
+
+public:
+  //
+  constexpr static size_t capacity() { return N; }
+  // 満杯ならfalse
+  bool push(T in) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t next_tail = next(tail);
+    if (next_tail == _head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    _ring[tail] = std::move(in);
+    _tail.store(next_tail, std::memory_order_release);
+    return true;
+  }
+  // 空ならnullopt
+  std::optional<T> pop() {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+      return std::nullopt;
+    }
+    std::optional<T> out{std::move(_ring[head])};
+    _ring[head] = T{};
+    _head.store(next(head), std::memory_order_release);
+    return out;
+  }
+  //
+  bool empty() const {
+    return _head.load(std::memory_order_acquire) ==
+           _tail.load(std::memory_order_acquire);
+  }
+};
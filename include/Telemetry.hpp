@@ -5,9 +5,19 @@
 #pragma once
 #include "AzIoTSasToken.h"
 #include "Sensor.hpp"
+#include "TelemetryEncoder.hpp"
+#include "TelemetrySpool.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <deque>
 #include <mqtt_client.h>
-#include <queue>
+#include <optional>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 extern "C" {
@@ -19,15 +29,35 @@ extern "C" {
 
 // MQTT通信
 class Telemetry {
+public:
+  // メッセージの形式
+  using Encoding = TelemetryEncoder::Encoding;
+
+private:
   constexpr static int32_t MQTT_PORT{AZ_IOT_DEFAULT_MQTT_CONNECT_PORT};
   constexpr static size_t MAX_SEND_FIFO_BUFFER_SIZE{500};
   constexpr static int32_t SAS_TOKEN_DURATION_IN_MINUTES{60};
+  // 有効期限のこれだけ前に, 接続したまま次のSASトークンに入れ替える
+  constexpr static std::chrono::minutes SAS_TOKEN_RENEW_BEFORE_EXPIRY{10};
+  // 入れ替えてから送信が途切れるのを待つ最長の時間
+  // (過ぎたら送信中でも新しいSASトークンで接続し直す)
+  constexpr static std::chrono::minutes SAS_TOKEN_RECONNECT_GRACE{5};
+  // MQTTクライアントが自分で再接続するまでの時間
+  // (一斉に再接続しないようにデバイス毎にずらす)
+  constexpr static std::chrono::seconds MQTT_RECONNECT_TIMEOUT_MIN{10};
+  constexpr static std::chrono::seconds MQTT_RECONNECT_TIMEOUT_JITTER{10};
   using MessageId = int32_t;
+  // 送信メッセージ用の固定長バッファ(まとめて送る場合はこの大きさまで)
+  constexpr static size_t MESSAGE_BUFFER_SIZE{1024};
+  constexpr static size_t MESSAGE_POOL_SIZE{8};
+  using MessageBuffer = std::array<char, MESSAGE_BUFFER_SIZE>;
+  // PUBLISHEDが来ないまま経過したら送信済みとみなしてバッファを戻す
+  constexpr static std::chrono::seconds IN_FLIGHT_TIMEOUT{60};
+  // バッファの状態(1以上はQoS1で送信中のメッセージID)
+  constexpr static MessageId MESSAGE_BUFFER_FREE{0};
+  constexpr static MessageId MESSAGE_BUFFER_RESERVED{-1};
   // 送信用
-  using Payload =
-      std::variant<Sensor::MeasurementBme280, Sensor::MeasurementSgp30,
-                   Sensor::MeasurementScd30, Sensor::MeasurementScd41,
-                   Sensor::MeasurementM5Env3>;
+  using Payload = TelemetrySpool::Payload;
   //
   struct Configuration {
     std::string iothub_fqdn{};
@@ -61,33 +91,80 @@ private:
   std::array<uint8_t, 256> sas_signature_buffer{};
   std::array<uint8_t, 256> sas_token_buffer{};
   std::optional<AzIoTSasToken> optAzIoTSasToken{};
-  // 送信用FIFO待ち行列
-  std::queue<Payload> _sending_fifo_buffer{};
-  // 送信メッセージの実体を送信が終わるまで保持するコンテナ
-  std::unordered_map<MessageId, std::string> _sent_messages{};
+  // 次のSASトークンに入れ替える時間
+  std::chrono::steady_clock::time_point _sas_token_renew_at{};
+  // 入れ替えた後, 新しいSASトークンで接続し直す期限
+  std::optional<std::chrono::steady_clock::time_point> _reconnect_deadline{};
+  //
+  std::chrono::milliseconds _mqtt_reconnect_timeout{
+      MQTT_RECONNECT_TIMEOUT_MIN};
+  // 送信用FIFO待ち行列(まとめて送るときは先頭から複数を見る)
+  std::deque<Payload> _sending_fifo_buffer{};
+  // 送信メッセージの実体を送信が終わるまで保持するプール
+  std::array<MessageBuffer, MESSAGE_POOL_SIZE> _message_pool{};
+  std::array<std::atomic<MessageId>, MESSAGE_POOL_SIZE>
+      _in_flight_message_ids{};
+  std::array<std::chrono::steady_clock::time_point, MESSAGE_POOL_SIZE>
+      _in_flight_since{};
+  // 送信中のメッセージに入っているスプールのレコード
+  std::array<TelemetrySpool::Range, MESSAGE_POOL_SIZE>
+      _in_flight_spool_ranges{};
+  // 送った側がメッセージIDを書く前に来たPUBLISHEDのメッセージID
+  // (書くのはMQTTのタスクだけで, 古いものから上書きする)
+  std::array<std::atomic<MessageId>, MESSAGE_POOL_SIZE>
+      _early_published_message_ids{};
+  size_t _early_published_next{0};
+  // 送信するまで測定値を溜めておくファイル(開いていなければメモリに溜める)
+  TelemetrySpool _spool{};
+  // 送信用FIFO待ち行列に読み出したスプールのレコード
+  TelemetrySpool::Range _staged_spool_range{};
+  // 送信用FIFO待ち行列のアイテムをメッセージに変換する
+  TelemetryEncoder _encoder{};
   //
   bool _mqtt_connected{false};
+  // デバイスツインの要求毎に変える
+  uint32_t _twin_request_id{0};
 
 public:
   virtual ~Telemetry() { terminate(); }
   //
   bool begin(std::string_view iothub_fqdn, std::string_view device_id,
              std::string_view device_key);
-  //
-  bool reconnect();
+  // MQTTクライアントがあれば作り直さずに接続し直す
+  // (recreate = true で作り直す)
+  bool reconnect(bool recreate = false);
   //
   bool terminate();
   //
   bool isConnected() const { return _mqtt_connected; };
   //
   bool task_handler();
+  // 複数の測定値をJSON配列にまとめて送信する
+  // (max_items <= 1 で1つずつ送る)
+  void setBatchMode(size_t max_items,
+                    size_t max_bytes = MESSAGE_BUFFER_SIZE) {
+    _encoder.setBatchMode(
+        max_items, std::clamp<size_t>(max_bytes, 64, MESSAGE_BUFFER_SIZE));
+  }
+  //
+  void setEncoding(Encoding encoding) { _encoder.setEncoding(encoding); }
+  //
+  bool beginSpool(std::string_view path) { return _spool.begin(path); }
+  // スプールのヘッダを書いてSDカードに反映させる
+  bool checkpointSpool() { return _spool.checkpoint(); }
+  // スプールが一杯で捨てた測定値の数
+  size_t droppedSpoolRecords() const { return _spool.dropped(); }
+  // デバイスツインのreported propertiesを更新する(QoS0で送りっぱなし)
+  bool updateReportedProperties(std::string_view json);
   //
   bool enqueue(Payload in) {
-    if (_sending_fifo_buffer.size() >= MAX_SEND_FIFO_BUFFER_SIZE) {
+    if (_spool.isOpened()) {
+      return _spool.append(in);
+    } else if (_sending_fifo_buffer.size() >= MAX_SEND_FIFO_BUFFER_SIZE) {
       M5_LOGE("FIFO buffer size limit reached.");
       return false;
     } else {
-      _sending_fifo_buffer.push(std::move(in));
+      _sending_fifo_buffer.push_back(std::move(in));
       return true;
     }
   }
@@ -97,9 +174,36 @@ private:
   bool initializeIoTHubClient();
   bool initializeMqttClient();
   //
+  esp_mqtt_client_config_t mqtt_client_config();
+  // SASトークンを作る
+  bool generate_sas_token();
+  // 次のSASトークンをMQTTクライアントに設定する
+  // (今の接続はそのまま)
+  bool renew_sas_token();
+  // 今のMQTTクライアントのまま接続し直す
+  // (できなければMQTTクライアントを作り直す)
+  bool cycle_connection();
+  // 送信するものも送信中のメッセージも無い
+  bool is_idle() const;
+  //
   static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event);
-  static std::string to_absolute_sensor_id(const std::string &device_id,
-                                           SensorDescriptor descriptor);
-  // 送信用メッセージに変換する
-  template <typename T> std::string to_json_message(const T &in);
+  // プールからバッファを借りる
+  std::optional<size_t> acquire_message_buffer();
+  // 見つからなければfalse
+  bool release_message_buffer(MessageId message_id);
+  // メッセージIDを書いた後に, 先に来ていたPUBLISHEDを片付ける
+  void release_early_published(MessageId message_id);
+  void release_all_message_buffers();
+  // スプールから送信用FIFO待ち行列に読み出す
+  void stage_from_spool();
+  // 送信済みの確認が来ていない所からスプールを読み直す
+  void rewind_spool();
+  // 送信用FIFO待ち行列の先頭からcount個分のスプールのレコード
+  TelemetrySpool::Range take_staged_spool_range(size_t count) {
+    TelemetrySpool::Range taken = _staged_spool_range;
+    taken.count = std::min<uint32_t>(count, _staged_spool_range.count);
+    _staged_spool_range.first += taken.count;
+    _staged_spool_range.count -= taken.count;
+    return taken;
+  }
 };
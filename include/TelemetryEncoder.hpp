@@ -0,0 +1,92 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "Measurement.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+//
+// 測定値を送信用メッセージ(JSON / CBOR)に変換する
+// (MQTTを使わないので単体で試験できる)
+//
+class TelemetryEncoder final {
+public:
+  // メッセージの形式
+  enum class Encoding : uint8_t {
+    Json, // UTF-8のJSON
+    Cbor, // CBOR(時刻は整数, 測定値はセンサーの持つ固定小数点)
+  };
+  //
+  using Payload = Sensor::AnyMeasurement;
+
+private:
+  // "デバイスID-"
+  std::string _sensor_id_prefix{};
+  // センサー毎の"デバイスID-センサーID"
+  std::unordered_map<SensorId, std::string> _sensor_id_texts{};
+  // 同じ時刻の測定値が続くので最後に書いた時刻の文字列を覚えておく
+  std::time_t _measured_at_time{-1};
+  std::array<char, 24> _measured_at_text{};
+  // 1つのメッセージにまとめる最大数(1ならまとめずに1つずつ送る)
+  size_t _batch_max_items{1};
+  // 1つのメッセージにまとめる最大バイト数
+  size_t _batch_max_bytes{std::numeric_limits<size_t>::max()};
+  //
+  Encoding _encoding{Encoding::Json};
+
+public:
+  //
+  void setDeviceId(std::string_view device_id) {
+    _sensor_id_prefix = std::string{device_id} + "-";
+    _sensor_id_texts.clear();
+  }
+  // max_items <= 1 で1つずつ送る
+  void setBatchMode(size_t max_items, size_t max_bytes) {
+    _batch_max_items = std::max<size_t>(max_items, 1);
+    _batch_max_bytes = max_bytes;
+  }
+  //
+  size_t batchMaxItems() const { return _batch_max_items; }
+  //
+  void setEncoding(Encoding encoding) { _encoding = encoding; }
+  //
+  Encoding encoding() const { return _encoding; }
+  // 1つ書く
+  // (書いたバイト数を返す, 入りきらなければ0)
+  size_t write_single_message(const Payload &in, char *out, size_t size);
+  // 先頭から複数を配列(JSON / CBOR)にして書く
+  // (書いたバイト数と書いたアイテムの数を返す)
+  std::pair<size_t, size_t> write_batch_message(const std::deque<Payload> &in,
+                                                char *out, size_t size);
+
+private:
+  //
+  const char *sensor_id_text(const SensorDescriptor &descriptor);
+  //
+  const char *measured_at_text(std::chrono::system_clock::time_point tp);
+  // 送信用メッセージに変換してバッファに書く
+  // (測定値の項目はSensor::Traitsの表で決まる)
+  template <typename V>
+  size_t to_json_message(const Sensor::Measurement<V> &in, char *out,
+                         size_t size);
+  // CBORのmapで書く
+  // (まとめて送る時は, 2つ目からは1つ前との時刻の差を書く)
+  template <typename V>
+  size_t
+  to_cbor_message(const Sensor::Measurement<V> &in,
+                  std::optional<std::chrono::system_clock::time_point> previous,
+                  char *out, size_t size);
+};
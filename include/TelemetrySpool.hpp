@@ -0,0 +1,137 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "Measurement.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <variant>
+
+//
+// 送信するまで測定値をファイルに溜めておく追記型のログ
+// 送信済みの確認(MQTT_EVENT_PUBLISHED)が来るまで読み出し位置は進めない
+// ヘッダの書き込みとSDカードへの反映はcheckpoint()でまとめて行う
+// 送信済みの部分が大きくなったら未送信のレコードだけを写したファイルに置き換える
+// (レコードの番号は通し番号なので置き換えても読み出した範囲はそのまま使える)
+//
+class TelemetrySpool final {
+public:
+  using Payload = Sensor::AnyMeasurement;
+  // 読み出したレコードの範囲
+  struct Range {
+    uint32_t generation{0};
+    uint32_t first{0};
+    uint32_t count{0};
+  };
+  //
+  constexpr static long MAX_FILE_SIZE{16L * 1024L * 1024L};
+  // 送信済みの部分がこれ以上で, 未送信の部分より大きくなったら詰める
+  constexpr static long COMPACTION_MIN_SIZE{1L * 1024L * 1024L};
+  //
+  struct FileCloser {
+    void operator()(std::FILE *fp) const { std::fclose(fp); }
+  };
+  using FilePointerUnique = std::unique_ptr<std::FILE, FileCloser>;
+
+private:
+  constexpr static uint32_t HEADER_MAGIC{0x4c4f5053}; // "SPOL"
+  constexpr static uint16_t FORMAT_VERSION{1};
+  constexpr static uint16_t RECORD_MAGIC{0x5243}; // "CR"
+  constexpr static size_t BODY_SIZE{Sensor::Registered::max_size()};
+  // ファイルの先頭
+  struct Header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    // 送信済みの確認が来ていない最初のレコード
+    uint32_t committed;
+    uint32_t checksum;
+  };
+  // 1つの測定値
+  struct Record {
+    uint16_t magic;
+    uint8_t kind; // Payloadのindex
+    uint8_t reserved;
+    uint32_t checksum;
+    int64_t at; // system_clock::durationのcount
+    std::array<uint8_t, BODY_SIZE> body;
+  };
+  // ファイルは_file_mutexで守る
+  std::string _path{};
+  FilePointerUnique _file{};
+  // SDカードに反映させていない書き込みがある
+  bool _unsynced{false};
+  // 以下は_mutexで守る
+  // ファイルを作り直す度に変える
+  uint32_t _generation{0};
+  // ファイルの先頭のレコードの通し番号(詰める度に進む)
+  uint32_t _base{0};
+  uint32_t _record_count{0};
+  uint32_t _committed{0};
+  // 次に読み出すレコード
+  uint32_t _next{0};
+  // 送信済みの確認が来たが_committedに繋がっていない範囲(first -> end)
+  std::map<uint32_t, uint32_t> _acknowledged{};
+  // ヘッダに書いた_committedが古い
+  bool _header_dirty{false};
+  // ファイルが一杯で捨てたレコードの数
+  uint32_t _dropped{0};
+  // MQTTイベントのタスクはファイルの読み書きを待たない様に分けておく
+  // (_file_mutex -> _mutexの順に取る)
+  std::mutex _file_mutex{};
+  mutable std::mutex _mutex{};
+
+public:
+  //
+  bool begin(std::string_view path);
+  //
+  void terminate();
+  //
+  bool isOpened() const { return static_cast<bool>(_file); }
+  // 末尾に追記する
+  bool append(const Payload &in);
+  // 次に送るレコードを最大max_items個読み出してoutの末尾に追加する
+  Range read(size_t max_items, std::deque<Payload> &out);
+  // 送信済みの確認が来た
+  // (MQTTイベントのタスクから呼ばれるのでファイルには触らない)
+  void acknowledge(Range range);
+  // ヘッダを書いてSDカードに反映させる
+  // 全て送信済みならファイルを作り直す
+  // 送信済みの部分が大きければ詰める
+  bool checkpoint();
+  // 送信済みの確認が来ていない所から読み直す
+  void rewind();
+  // 送信済みの確認が来ていないレコードの数
+  size_t pending() const {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _record_count - _committed;
+  }
+  // ファイルが一杯で捨てたレコードの数
+  size_t dropped() const {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _dropped;
+  }
+
+private:
+  // indexはファイルの中の番号(通し番号 - _base)
+  static long offset_of(uint32_t index) {
+    return static_cast<long>(sizeof(Header)) +
+           static_cast<long>(index) * static_cast<long>(sizeof(Record));
+  }
+  // _mutexを取ってから呼ぶこと
+  void acknowledge_range(uint32_t first, uint32_t end);
+  //
+  bool create_file();
+  bool compact();
+  static bool write_header(std::FILE *fp, uint32_t committed);
+  bool read_record(uint32_t index, Record &out);
+};
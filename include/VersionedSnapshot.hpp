@@ -0,0 +1,47 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+//
+// 書くタスクが1つで読むタスクが複数の二重バッファ(ロック無し)
+// 読んでいる間に2回書かれたら読み直す
+// (書いている途中のバッファも写すので, Tはバイト毎に写せる値であること)
+//
+template <typename T> class VersionedSnapshot final {
+  static_assert(std::is_trivially_copyable_v<T>);
+  std::array<T, 2> _buffers{T(), T()};
+  // 公開済みの版(_buffers[_version & 1]が読める)
+  std::atomic<uint32_t> _version{0};
+
+public:
+  // 書くタスクだけが呼ぶ
+  void publish(const T &in) {
+    uint32_t next = _version.load(std::memory_order_relaxed) + 1;
+    _buffers[next & 1] = in;
+    _version.store(next, std::memory_order_release);
+    // 次に書く値がこの版より先に見えない様にする
+    // (次の次に書くバッファは読む側が写している途中かもしれない)
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  // 読めた版と値
+  std::pair<uint32_t, T> read() const {
+    T out = T();
+    while (true) {
+      uint32_t version = _version.load(std::memory_order_acquire);
+      out = _buffers[version & 1];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_version.load(std::memory_order_relaxed) == version) {
+        return {version, out};
+      }
+    }
+  }
+  //
+  uint32_t version() const { return _version.load(std::memory_order_acquire); }
+};
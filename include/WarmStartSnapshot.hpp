@@ -0,0 +1,142 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "Database.hpp"
+#include "Measurement.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//
+// データーベースに入れた測定値をファイルに溜めておき, 再起動した時に書き戻す
+// 測定値はメモリに溜めておいて, checkpointでまとめて追記する
+// 1時間毎と1日毎の集計は別のファイルに丸ごと書き直す
+// (測定値は1日分しか残さないので, 測定値から集計を作り直すことはできない)
+// (Task:Applicationだけから呼ぶこと)
+//
+class WarmStartSnapshot final {
+public:
+  using system_clock = std::chrono::system_clock;
+  // 同じ時間に測定した値
+  using Callback =
+      std::function<bool(system_clock::time_point at,
+                         const std::vector<Sensor::MeasuredValue> &values)>;
+  //
+  constexpr static long MAX_FILE_SIZE{4L * 1024L * 1024L};
+  // checkpointまでメモリに溜めておく最大のレコード数
+  constexpr static size_t MAX_PENDING_RECORDS{1024};
+  // 残す期間より古いレコードがこれだけ溜まったらファイルを詰め直す
+  constexpr static auto COMPACTION_SLACK = std::chrono::hours{12};
+  // 書き戻す時に1回で読むレコードの数
+  constexpr static size_t READ_CHUNK_RECORDS{64};
+  //
+  struct FileCloser {
+    void operator()(std::FILE *fp) const { std::fclose(fp); }
+  };
+  using FilePointerUnique = std::unique_ptr<std::FILE, FileCloser>;
+
+private:
+  constexpr static uint32_t HEADER_MAGIC{0x4d524157}; // "WARM"
+  constexpr static uint16_t FORMAT_VERSION{1};
+  constexpr static uint16_t RECORD_MAGIC{0x5357}; // "WS"
+  constexpr static size_t BODY_SIZE{Sensor::Registered::max_size()};
+  // ファイルの先頭
+  struct Header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t checksum;
+  };
+  // 1つの測定値
+  struct Record {
+    uint16_t magic;
+    uint8_t kind; // MeasuredValueのindex
+    uint8_t reserved;
+    uint32_t checksum;
+    uint32_t at; // UNIX時間[s]
+    std::array<uint8_t, BODY_SIZE> body;
+  };
+  //
+  constexpr static uint32_t ROLLUP_HEADER_MAGIC{0x4c4c4f52}; // "ROLL"
+  constexpr static uint16_t ROLLUP_RECORD_MAGIC{0x5252};      // "RR"
+  // 集計のファイルの先頭
+  struct RollupHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t watermark; // ここより前の測定値は畳み込み済み(UNIX時間[s])
+    uint32_t count;
+    uint32_t checksum;
+  };
+  // 集計の1行
+  struct RollupRecord {
+    uint16_t magic;
+    uint8_t resolution;
+    uint8_t metric;
+    uint32_t checksum;
+    uint32_t at; // UNIX時間[s]
+    uint32_t samples;
+    uint64_t sensor_id;
+    double minimum;
+    double total;
+    double maximum;
+  };
+  //
+  std::string _path{};
+  FilePointerUnique _file{};
+  uint32_t _record_count{0};
+  // ファイルの先頭のレコードの時刻
+  std::optional<system_clock::time_point> _oldest{};
+  // 次のcheckpointで書くレコード
+  std::vector<Record> _pending{};
+  // 集計のファイル
+  std::string _rollup_path{};
+  // 最後に書いた集計(変わっていなければ書き直さない)
+  std::optional<uint32_t> _rollup_generation{};
+
+public:
+  //
+  bool begin(std::string_view path);
+  //
+  void terminate() { _file.reset(); }
+  //
+  bool isOpened() const { return static_cast<bool>(_file); }
+  // keep_from以降の測定値を古い順に1回で読み通してcallbackに渡す
+  // (書き戻したレコードの数を返す)
+  size_t restore(system_clock::time_point keep_from, Callback callback);
+  // 次のcheckpointで書く
+  void stage(system_clock::time_point at,
+             const std::vector<Sensor::MeasuredValue> &values);
+  // 書いていない測定値がある
+  bool dirty() const { return !_pending.empty(); }
+  // 溜めた測定値を追記する
+  // (keep_fromより古いレコードが溜まっていたら詰め直す)
+  bool checkpoint(system_clock::time_point keep_from);
+  // 集計が変わっていれば集計のファイルを書き直す
+  bool checkpointRollups(Database &database);
+  // 集計のファイルを書き戻す
+  // (データーベースの方が新しければ書き戻さない, 書き戻した行の数を返す)
+  size_t restoreRollups(Database &database);
+
+private:
+  //
+  static long offset_of(uint32_t index) {
+    return static_cast<long>(sizeof(Header)) +
+           static_cast<long>(index) * static_cast<long>(sizeof(Record));
+  }
+  //
+  static bool write_header(std::FILE *fp);
+  static bool valid(const Record &in);
+  //
+  bool create_file();
+  bool compact(system_clock::time_point keep_from);
+};
@@ -3,15 +3,23 @@
 // See LICENSE file in the project root for full license information.
 //
 #include "Application.hpp"
+#include "Diagnostics.hpp"
 #include "Gui.hpp"
 #include <ArduinoOTA.h>
 #include <LittleFS.h>
 #include <SD.h>
 #include <WiFi.h>
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <esp_sntp.h>
+#include <esp_system.h>
 #include <functional>
 #include <future>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <utility>
 #include <lvgl.h>
 
 #include <M5Unified.h>
@@ -77,116 +85,535 @@ std::optional<std::string> Application::getSettings_AzureIoTHub_DeviceKey() {
 }
 
 //
-bool Application::task_handler() {
+std::optional<int> Application::getSettings_AzureIoTHub_BatchSize() {
+  if (settings_json.containsKey("AzureIoTHub")) {
+    if (settings_json["AzureIoTHub"]["BatchSize"].is<int>()) {
+      return settings_json["AzureIoTHub"]["BatchSize"].as<int>();
+    }
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<int> Application::getSettings_AzureIoTHub_BatchBytes() {
+  if (settings_json.containsKey("AzureIoTHub")) {
+    if (settings_json["AzureIoTHub"]["BatchBytes"].is<int>()) {
+      return settings_json["AzureIoTHub"]["BatchBytes"].as<int>();
+    }
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<std::string> Application::getSettings_AzureIoTHub_Encoding() {
+  if (settings_json.containsKey("AzureIoTHub")) {
+    if (settings_json["AzureIoTHub"].containsKey("Encoding")) {
+      return settings_json["AzureIoTHub"]["Encoding"];
+    }
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<int> Application::getSettings_Sensor_AveragingSeconds() {
+  if (settings_json.containsKey("Sensor")) {
+    if (settings_json["Sensor"]["AveragingSeconds"].is<int>()) {
+      return settings_json["Sensor"]["AveragingSeconds"].as<int>();
+    }
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<Sensor::Device::SamplingPolicy>
+Application::getSettings_Sensor_SamplingPolicy(
+    const SensorDescriptor &descriptor) {
+  std::string name = descriptor.str();
+  if (settings_json["Sensor"][name].is<JsonObjectConst>()) {
+    JsonObjectConst policy = settings_json["Sensor"][name];
+    auto interval = [&policy](const char *key) {
+      return policy[key].is<int>() && policy[key].as<int>() > 0
+                 ? seconds{policy[key].as<int>()}
+                 : Sensor::Device::DEFAULT_INTERVAL;
+    };
+    return Sensor::Device::SamplingPolicy{
+        .fast_interval = interval("FastInterval"),
+        .slow_interval = interval("SlowInterval"),
+        .change_threshold = policy["ChangeThreshold"] | 0.0f,
+    };
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<DeadbandFilter::Bands>
+Application::getSettings_Sensor_Deadband() {
+  if (settings_json["Sensor"]["Deadband"].is<JsonObjectConst>()) {
+    JsonObjectConst deadband = settings_json["Sensor"]["Deadband"];
+    DeadbandFilter::Bands bands{};
+    if (deadband["Temperature"].is<float>()) {
+      bands.temperature =
+          round<CentiDegC>(DegC(deadband["Temperature"].as<float>()));
+    }
+    if (deadband["Humidity"].is<float>()) {
+      bands.relative_humidity =
+          round<CentiRH>(PctRH(deadband["Humidity"].as<float>()));
+    }
+    if (deadband["Pressure"].is<float>()) {
+      bands.pressure = round<DeciPa>(Pascal(deadband["Pressure"].as<float>()));
+    }
+    if (deadband["CO2"].is<int>()) {
+      bands.co2 = Ppm(deadband["CO2"].as<int>());
+    }
+    if (deadband["TVOC"].is<int>()) {
+      bands.tvoc = Ppb(deadband["TVOC"].as<int>());
+    }
+    return bands;
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<int> Application::getSettings_Sensor_HeartbeatSeconds() {
+  if (settings_json.containsKey("Sensor")) {
+    if (settings_json["Sensor"]["HeartbeatSeconds"].is<int>()) {
+      return settings_json["Sensor"]["HeartbeatSeconds"].as<int>();
+    }
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<esp_log_level_t>
+Application::getSettings_Log_Level(AsyncLog::Module module) {
+  const std::string_view name =
+      AsyncLog::MODULE_NAMES[static_cast<size_t>(module)];
+  if (settings_json["Log"]["Levels"][name].is<const char *>()) {
+    return AsyncLog::levelOf(
+        settings_json["Log"]["Levels"][name].as<const char *>());
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<bool> Application::getSettings_Log_File() {
+  if (settings_json["Log"]["File"].is<bool>()) {
+    return settings_json["Log"]["File"].as<bool>();
+  }
+  return std::nullopt;
+}
+
+//
+// 起動時のログを画面に出す
+// (起動の段階を進めるタスク毎に作る)
+//
+struct Application::StartupLogBuffer : public std::stringbuf {
+  Application *pApp;
+  StartupLogBuffer(Application *p) : pApp{p} {}
+  virtual int sync() {
+    std::istringstream iss{this->str()};
+    std::string work;
+    std::string tail;
+    while (std::getline(iss, work)) {
+      tail = work;
+    }
+    {
+      std::lock_guard<std::mutex> lock{pApp->_startup_log_mutex};
+      pApp->_startup_log += tail;
+      pApp->_startup_log.push_back('\n');
+      pApp->getGui().update_startup_message(tail);
+    }
+    return std::stringbuf::sync();
+  }
+};
+
+// ボタンとOTA
+// (画面はTask:LVGLが動かすので操作を頼むだけ)
+void Application::input_task_handler() {
   ArduinoOTA.handle();
   M5.update();
   if (M5.BtnA.wasPressed()) {
-    _gui.movePrev();
+    _gui.requestNavigation(Gui::Navigation::Prev);
   } else if (M5.BtnB.wasPressed()) {
-    _gui.home();
+    _gui.requestNavigation(Gui::Navigation::Home);
   } else if (M5.BtnC.wasPressed()) {
-    _gui.moveNext();
+    _gui.requestNavigation(Gui::Navigation::Next);
   }
-  static system_clock::time_point before_db_tp{};
-  auto now_tp = system_clock::now();
-  // 随時測定する
-  _measuring_task.task_handler(now_tp);
-  //
-  if (now_tp - before_db_tp >= 333s) {
-    // データベースの整理
-    system_clock::time_point tp = now_tp - minutes{Gui::CHART_X_POINT_COUNT};
-    if (_data_acquisition_db.delete_old_measurements_from_database(
-            std::chrono::floor<minutes>(tp)) == false) {
-      M5_LOGE("delete old measurements failed.");
+}
+
+// データベースの整理
+// 消し残しがあれば間を置かずに続きを消す
+Scheduler::Duration Application::database_task_handler() {
+  // 書き出しと書き戻しが終わるまで待つ
+  if (_data_acquisition_db.transferring()) {
+    return DATABASE_RETENTION_CONTINUE_INTERVAL;
+  }
+  // 消す前に集計に畳み込む
+  if (_data_acquisition_db.rollup_measurements(system_clock::now()) == false) {
+    M5_LOGE("rollup measurements failed.");
+  }
+  system_clock::time_point tp =
+      system_clock::now() - minutes{Gui::CHART_X_POINT_COUNT};
+  auto result = _data_acquisition_db.delete_old_measurements_from_database(
+      std::chrono::floor<minutes>(tp));
+  if (!result) {
+    M5_LOGE("delete old measurements failed.");
+  } else if (!result->completed) {
+    return DATABASE_RETENTION_CONTINUE_INTERVAL;
+  }
+  return DATABASE_TASK_INTERVAL;
+}
+
+// SDカードへの書き出しと書き戻し
+// 1回にTRANSFER_PAGES_PER_STEP分だけ進めて, 他の仕事に譲る
+Scheduler::Duration Application::transfer_task_handler() {
+  using TransferKind = Database::TransferKind;
+  if (!_data_acquisition_db.transferring()) {
+    if (_transfer_request.load() < 0) {
+      return TRANSFER_IDLE_INTERVAL;
+    }
+    // 頼まれてから終わるまで動いていることにする
+    _transfer_progress = 0;
+    auto kind = static_cast<TransferKind>(_transfer_request.exchange(-1));
+    std::string path{kind == TransferKind::ExportCsv
+                         ? std::string{EXPORT_CSV_FILE_PATH}
+                         : EXPORT_IMPORT_DATABASE_FILE_URI};
+    if (auto error = _data_acquisition_db.begin_transfer(kind, path); error) {
+      finish_transfer(error);
+      return TRANSFER_IDLE_INTERVAL;
     }
-    before_db_tp = now_tp;
   }
-  //
-  static steady_clock::time_point before_epoch{};
-  auto now_epoch = steady_clock::now();
-  if (now_epoch - before_epoch >= 3s) {
-    idle_task_handler();
-    before_epoch = now_epoch;
+  if (_transfer_cancel.exchange(false)) {
+    _data_acquisition_db.cancel_transfer();
+    finish_transfer(std::make_optional("canceled"));
+    return TRANSFER_IDLE_INTERVAL;
+  }
+  auto error = _data_acquisition_db.step_transfer();
+  if (error || !_data_acquisition_db.transferring()) {
+    finish_transfer(error);
+    return TRANSFER_IDLE_INTERVAL;
   }
+  if (auto status = _data_acquisition_db.transfer_status();
+      status && status->total > 0) {
+    _transfer_progress =
+        100 * (status->total - status->remaining) / status->total;
+  }
+  return TRANSFER_STEP_INTERVAL;
+}
 
-  return true;
+// 書き戻す測定値が増えていればファイルに追記する
+// (集計が変わっていれば集計のファイルも書き直す)
+void Application::warm_start_checkpoint_task_handler() {
+  // 書き戻す前に書くとファイルの集計を空の集計で上書きしてしまう
+  if (!_warm_start_restored) {
+    return;
+  }
+  if (!_warm_start_snapshot.checkpointRollups(_data_acquisition_db)) {
+    M5_LOGE("warm start rollup checkpoint failed.");
+  }
+  if (!_warm_start_snapshot.dirty()) {
+    return;
+  }
+  auto keep_from = system_clock::now() - minutes{Gui::CHART_X_POINT_COUNT};
+  if (!_warm_start_snapshot.checkpoint(keep_from)) {
+    M5_LOGE("warm start checkpoint failed.");
+  }
+}
+
+// 時刻が合ったら再起動する前の測定値を書き戻す
+// (書き戻した後は何もしない)
+Scheduler::Duration Application::warm_start_restore_task_handler() {
+  if (_warm_start_restored) {
+    return std::chrono::hours{1};
+  }
+  if (!isTimeValid()) {
+    return WARM_START_RESTORE_POLLING_INTERVAL;
+  }
+  StartupLogBuffer buf{this};
+  std::ostream oss(&buf);
+  restore_warm_start_snapshot(oss);
+  return std::chrono::hours{1};
+}
+
+// 送信済みの確認はMQTTイベントのタスクで来るのでここでまとめて書く
+void Application::telemetry_spool_checkpoint_task_handler() {
+  if (!_telemetry.checkpointSpool()) {
+    M5_LOGE("telemetry spool checkpoint failed.");
+  }
+}
+
+// エラーを置いてから終わったことにする
+void Application::finish_transfer(Database::ErrorString error) {
+  if (error) {
+    M5_LOGE("transfer failed: %s", error->c_str());
+  }
+  {
+    std::lock_guard<std::mutex> lock{_transfer_error_mutex};
+    _transfer_error = error;
+  }
+  _transfer_progress = -1;
 }
 
 //
-void Application::idle_task_handler() {
-  if (WiFi.status() != WL_CONNECTED) {
-    // WiFiが接続されていない場合は接続する。
-    std::string ssid;
-    std::string password;
-    // guard
-    if (getSettings_wifi_SSID()) {
-      ssid = getSettings_wifi_SSID().value();
-    } else {
-      ESP_LOGE("%s", "wifi SSID not set");
-      return;
-    }
-    if (getSettings_wifi_password()) {
-      password = getSettings_wifi_password().value();
-    } else {
-      ESP_LOGE("%s", "wifi password not set");
-      return;
-    }
-    WiFi.begin(ssid.c_str(), password.c_str());
+Database::ErrorString Application::takeTransferError() {
+  auto app = getInstance();
+  std::lock_guard<std::mutex> lock{app->_transfer_error_mutex};
+  return std::exchange(app->_transfer_error, std::nullopt);
+}
+
+// WiFiが接続されていない場合は接続する。
+void Application::wifi_task_handler() {
+  if (WiFi.status() == WL_CONNECTED) {
     return;
   }
-  if (_telemetry.isConnected()) {
-    _telemetry.task_handler();
+  std::string ssid;
+  std::string password;
+  // guard
+  if (getSettings_wifi_SSID()) {
+    ssid = getSettings_wifi_SSID().value();
+  } else {
+    ESP_LOGE("%s", "wifi SSID not set");
     return;
+  }
+  if (getSettings_wifi_password()) {
+    password = getSettings_wifi_password().value();
   } else {
-    static steady_clock::time_point before{steady_clock::now()};
-    // 再接続
-    if (steady_clock::now() - before > 1min) {
-      before = steady_clock::now();
-      //
-      if (!_telemetry.reconnect()) {
-        M5_LOGE("Reconnect telemetry failed.");
-      }
+    ESP_LOGE("%s", "wifi password not set");
+    return;
+  }
+  WiFi.begin(ssid.c_str(), password.c_str());
+}
+
+//
+void Application::telemetry_task_handler() {
+  if (WiFi.status() == WL_CONNECTED && _telemetry.isConnected()) {
+    _telemetry.task_handler();
+  }
+}
+
+// Wi-Fiと時刻が揃ったらテレメトリを始める
+// 接続するまで(TIMEOUTまで)は待たずに次の呼び出しで確かめる
+// 始めた後は何もしない
+Scheduler::Duration Application::telemetry_start_task_handler() {
+  if (_telemetry_connect_deadline) {
+    if (_telemetry.isConnected()) {
+      M5_LOGI("Telemetry connected.");
+    } else if (steady_clock::now() < *_telemetry_connect_deadline) {
+      return TELEMETRY_START_POLLING_INTERVAL;
+    } else {
+      // 後は再接続に任せる
+      M5_LOGE("Telemetry connection timed out.");
     }
+    _telemetry_connect_deadline.reset();
+    return std::chrono::hours{1};
+  }
+  if (_telemetry_started) {
+    return std::chrono::hours{1};
+  }
+  if (WiFi.status() != WL_CONNECTED || !_time_is_synced) {
+    return TELEMETRY_START_POLLING_INTERVAL;
+  }
+  // 設定が無い時も繰り返さない
+  _telemetry_started = true;
+  StartupLogBuffer buf{this};
+  std::ostream oss(&buf);
+  if (!start_telemetry(oss)) {
+    M5_LOGE("start telemetry failed.");
+    return std::chrono::hours{1};
+  }
+  _telemetry_connect_deadline = steady_clock::now() + TIMEOUT;
+  return TELEMETRY_START_POLLING_INTERVAL;
+}
+
+// 再接続
+// (失敗が続くほど間隔を空けて, 一斉に再接続しないように揺らす)
+Scheduler::Duration Application::telemetry_reconnect_task_handler() {
+  if (!_telemetry_started || WiFi.status() != WL_CONNECTED ||
+      _telemetry.isConnected()) {
+    _telemetry_reconnect_attempts = 0;
+    return TELEMETRY_RECONNECT_MIN_INTERVAL;
+  }
+  // 何度も失敗するならMQTTクライアントを作り直して試す
+  bool recreate =
+      _telemetry_reconnect_attempts >= TELEMETRY_RECREATE_AFTER_ATTEMPTS;
+  if (!_telemetry.reconnect(recreate)) {
+    M5_LOGE("Reconnect telemetry failed.");
+  }
+  // 上限 = min(最大, 最小 * 2^回数), 上限の半分から上限までの乱数にする
+  uint32_t shift = std::min<uint32_t>(_telemetry_reconnect_attempts, 10);
+  ++_telemetry_reconnect_attempts;
+  Scheduler::Duration ceiling = std::min<Scheduler::Duration>(
+      TELEMETRY_RECONNECT_MAX_INTERVAL,
+      TELEMETRY_RECONNECT_MIN_INTERVAL * (uint32_t{1} << shift));
+  Scheduler::Duration half = ceiling / 2;
+  return half + Scheduler::Duration{esp_random() % (half.count() + 1)};
+}
+
+// 計った所要時間の分布をデバイスツインのreported propertiesで送る
+// (スプールが一杯で捨てた測定値の数も送る)
+void Application::diagnostics_report_task_handler() {
+  if (WiFi.status() != WL_CONNECTED || !_telemetry.isConnected()) {
     return;
   }
+  JsonDocument doc;
+  JsonObject latency = doc["latency"].to<JsonObject>();
+  for (size_t i = 0; i < Diagnostics::PROBE_NAMES.size(); ++i) {
+    auto summary = Diagnostics::histograms[i].summary();
+    JsonObject probe = latency[Diagnostics::PROBE_NAMES[i]].to<JsonObject>();
+    probe["count"] = summary.count;
+    probe["p50_us"] = summary.p50_us;
+    probe["p99_us"] = summary.p99_us;
+    probe["max_us"] = summary.max_us;
+  }
+  doc["spool"]["dropped"] = _telemetry.droppedSpoolRecords();
+  std::string json;
+  serializeJson(doc, json);
+  if (!_telemetry.updateReportedProperties(json)) {
+    M5_LOGE("Report diagnostics failed.");
+  }
 }
 
-// 起動
-bool Application::startup() {
-  // 起動シーケンス
-  std::vector<std::function<bool(std::ostream &)>> startup_sequence{
-      std::bind(&Application::read_settings_json, this, std::placeholders::_1),
-      std::bind(&Application::start_SD, this, std::placeholders::_1),
-      std::bind(&Application::start_wifi, this, std::placeholders::_1),
-      std::bind(&Application::synchronize_ntp, this, std::placeholders::_1),
-      std::bind(&Application::start_database, this, std::placeholders::_1),
-      std::bind(&Application::start_telemetry, this, std::placeholders::_1),
-      std::bind(&Application::start_sensor_BME280, this, std::placeholders::_1),
-      std::bind(&Application::start_sensor_SGP30, this, std::placeholders::_1),
-      std::bind(&Application::start_sensor_SCD30, this, std::placeholders::_1),
-      std::bind(&Application::start_sensor_SCD41, this, std::placeholders::_1),
-      std::bind(&Application::start_sensor_M5ENV3, this, std::placeholders::_1),
-      std::bind(&Application::start_measuring, this, std::placeholders::_1),
-  };
+// それぞれの周期で実行する
+void Application::schedule_tasks() {
+  _scheduler.every(20ms, [this] { input_task_handler(); });
+  _scheduler.add(0ms, [this] { return telemetry_start_task_handler(); });
+  _scheduler.add(0ms, [this] { return database_task_handler(); });
+  _transfer_job =
+      _scheduler.add(0ms, [this] { return transfer_task_handler(); });
+  _scheduler.every(3s, [this] { wifi_task_handler(); });
+  _scheduler.every(3s, [this] { telemetry_task_handler(); });
+  _scheduler.add(TELEMETRY_RECONNECT_MIN_INTERVAL,
+                 [this] { return telemetry_reconnect_task_handler(); });
+  _scheduler.every(DIAGNOSTICS_REPORT_INTERVAL,
+                   [this] { diagnostics_report_task_handler(); });
+  _scheduler.add(0ms, [this] { return warm_start_restore_task_handler(); });
+  _scheduler.every(WARM_START_CHECKPOINT_INTERVAL,
+                   [this] { warm_start_checkpoint_task_handler(); });
+  _scheduler.every(TELEMETRY_SPOOL_CHECKPOINT_INTERVAL,
+                   [this] { telemetry_spool_checkpoint_task_handler(); });
+  // 随時測定する
+  _measuring_task.schedule(_measuring_scheduler, _scheduler);
+}
+
+//
+// 起動の段階を依存関係の順に並行して進める
+// (タスクが終わるまで持っていられるようにshared_ptrで渡す)
+//
+struct Application::StartupGraph {
+  Application &app;
+  const std::vector<StartupStage> stages;
+  std::mutex mutex{};
+  std::condition_variable condition{};
+  std::vector<bool> started;
+  std::vector<bool> finished;
+  size_t finished_count{0};
   //
-  struct BufWithLogging : public std::stringbuf {
-    Application *pApp;
-    BufWithLogging(Application *p) : pApp{p} {}
-    virtual int sync() {
-      std::istringstream iss{this->str()};
-      std::string work;
-      std::string tail;
-      while (std::getline(iss, work)) {
-        tail = work;
+  StartupGraph(Application &app, std::vector<StartupStage> in)
+      : app{app}, stages{std::move(in)}, started(stages.size(), false),
+        finished(stages.size(), false) {}
+  // 始められる段階を取る(全て始めていればnullopt)
+  std::optional<size_t> take() {
+    std::unique_lock<std::mutex> lock{mutex};
+    while (true) {
+      bool remaining{false};
+      for (size_t i = 0; i < stages.size(); ++i) {
+        if (started[i]) {
+          continue;
+        }
+        remaining = true;
+        if (std::all_of(stages[i].after.begin(), stages[i].after.end(),
+                        [this](size_t j) { return finished[j]; })) {
+          started[i] = true;
+          return i;
+        }
       }
-      pApp->_startup_log += tail;
-      pApp->_startup_log.push_back('\n');
-      pApp->getGui().update_startup_message(tail);
-      return std::stringbuf::sync();
+      if (!remaining) {
+        return std::nullopt;
+      }
+      condition.wait(lock);
     }
+  }
+  //
+  void finish(size_t i) {
+    std::lock_guard<std::mutex> lock{mutex};
+    finished[i] = true;
+    finished_count++;
+    app._gui.update_startup_progress(100 * finished_count / stages.size());
+    condition.notify_all();
+  }
+  // 始められる段階が無くなるまで進める
+  void work() {
+    StartupLogBuffer buf{&app};
+    std::ostream oss(&buf);
+    while (auto i = take()) {
+      stages[*i].start(oss);
+      finish(*i);
+    }
+  }
+  //
+  void wait_all() {
+    std::unique_lock<std::mutex> lock{mutex};
+    condition.wait(lock, [this] { return finished_count == stages.size(); });
+  }
+};
+
+//
+void Application::run_startup_stages(std::vector<StartupStage> stages) {
+  auto graph = std::make_shared<StartupGraph>(*this, std::move(stages));
+  for (size_t n = 1; n < STARTUP_WORKER_COUNT; ++n) {
+    xTaskCreatePinnedToCore(
+        [](void *arg) -> void {
+          std::unique_ptr<std::shared_ptr<StartupGraph>> graph{
+              static_cast<std::shared_ptr<StartupGraph> *>(arg)};
+          (*graph)->work();
+          graph.reset();
+          vTaskDelete(nullptr);
+        },
+        "Task:Startup", STARTUP_TASK_STACK_SIZE,
+        new std::shared_ptr<StartupGraph>{graph}, 1, nullptr, tskNO_AFFINITY);
+  }
+  graph->work();
+  graph->wait_all();
+}
+
+// 起動
+bool Application::startup() {
+  // 起動の段階
+  enum : size_t {
+    StageSettings,
+    StageSD,
+    StageWifi,
+    StageNtp,
+    StageDatabase,
+    StageBme280,
+    StageSgp30,
+    StageScd30,
+    StageScd41,
+    StageM5Env3,
+    StageMeasuring,
+  };
+  auto stage = [this](bool (Application::*fn)(std::ostream &),
+                      std::vector<size_t> after) {
+    return StartupStage{std::bind(fn, this, std::placeholders::_1),
+                        std::move(after)};
+  };
+  // Wi-Fi, SDカードとデーターベース, I2Cのセンサーは互いに待たずに進める
+  // (同じI2Cバスのセンサーは1つずつ調べる)
+  // テレメトリはWi-Fiと時刻が揃ってからTask:Applicationで始める
+  // 測定値は時刻が合ってからTask:Measuringでキューに入れ始める
+  std::vector<StartupStage> stages{
+      stage(&Application::read_settings_json, {}),
+      stage(&Application::start_SD, {StageSettings}),
+      stage(&Application::start_wifi, {StageSettings}),
+      stage(&Application::synchronize_ntp, {StageWifi}),
+      stage(&Application::start_database, {StageSD}),
+      stage(&Application::start_sensor_BME280, {StageSettings}),
+      stage(&Application::start_sensor_SGP30, {StageBme280}),
+      stage(&Application::start_sensor_SCD30, {StageSgp30}),
+      stage(&Application::start_sensor_SCD41, {StageScd30}),
+      stage(&Application::start_sensor_M5ENV3, {StageScd41}),
+      stage(&Application::start_measuring, {StageM5Env3}),
   };
-  BufWithLogging buf{this};
-  std::ostream oss(&buf);
 
   // initializing M5Stack Core2 with M5Unified
   {
@@ -194,6 +621,8 @@ bool Application::startup() {
     M5.begin(cfg);
     M5.Power.setVibration(0); // stop the vibration
   }
+  // ここからのログはTask:Logで書き出す
+  AsyncLog::begin();
 
   //
   if (M5.Rtc.isEnabled()) {
@@ -211,6 +640,8 @@ bool Application::startup() {
       .tv_sec = mktime(&local_tm), .tv_nsec = 0
     };
     clock_settime(CLOCK_REALTIME, &timespec);
+    // 時刻が設定されていれば時間サーバーと同期する前に測定を始める
+    _rtc_time_is_valid = rtc.date.year >= RTC_VALID_SINCE_YEAR;
   }
 
   // file system init
@@ -225,7 +656,7 @@ bool Application::startup() {
   }
 
   // LED
-  _rgb_led.begin();
+  _rgb_led.begin(DATA_PROCESSING_CORE);
   _rgb_led.setBrightness(50);
 
   // Display
@@ -242,52 +673,46 @@ bool Application::startup() {
   xTaskCreatePinnedToCore(
       [](void *arg) -> void {
         while (true) {
-          lv_task_handler();
+          {
+            Diagnostics::ScopedTimer timer{Diagnostics::Probe::LvglTask};
+            lv_task_handler();
+          }
           std::this_thread::sleep_for(10ms);
         }
       },
       "Task:LVGL", LVGL_TASK_STACK_SIZE, nullptr, 5, &_rtos_lvgl_task_handle,
       ARDUINO_RUNNING_CORE);
 
-  //
-  int16_t timer_arg = 0;
-  auto timer = lv_timer_create(
-      [](lv_timer_t *t) -> void {
-        assert(t);
-        auto pValue = static_cast<int16_t *>(t->user_data);
-        Application::getRgbLed().fill(RgbLed::hslToRgb(*pValue, 1, 0.5));
-        *pValue = (*pValue + 1) % 360;
-      },
-      10, &timer_arg);
+  // 起動している間はLEDを虹色に回す
+  _rgb_led.rainbow(STARTUP_RAINBOW_PERIOD);
 
   // プログレスバーを表示しながら起動
-  for (auto it = startup_sequence.begin(); it != startup_sequence.end(); ++it) {
-    std::this_thread::sleep_for(100ms);
-    auto func = *it;
-    auto percent = 100 * std::distance(startup_sequence.begin(), it) /
-                   startup_sequence.size();
-    _gui.update_startup_progress(percent);
-    //
-    func(oss);
-  }
+  _gui.update_startup_progress(0);
+  run_startup_stages(std::move(stages));
   _gui.update_startup_progress(100); // 100%
   std::this_thread::sleep_for(100ms);
-  lv_timer_del(timer);
   _rgb_led.clear();
 
-  //
-  _gui.startUi();
+  // 画面はTask:LVGLが作り替える
+  _gui.requestStartUi();
 
   // create RTOS task for this Application
+  schedule_tasks();
   xTaskCreatePinnedToCore(
       [](void *user_context) -> void {
-        while (true) {
-          Application *app = static_cast<Application *>(user_context);
-          app->task_handler();
-        }
+        Application *app = static_cast<Application *>(user_context);
+        app->_scheduler.run();
       },
       "Task:Application", APPLICATION_TASK_STACK_SIZE, this, 1,
-      &_rtos_application_task_handle, ARDUINO_RUNNING_CORE);
+      &_rtos_application_task_handle, DATA_PROCESSING_CORE);
+  // 測定はデーターベースやMQTTに待たされないように優先度を上げる
+  xTaskCreatePinnedToCore(
+      [](void *user_context) -> void {
+        Application *app = static_cast<Application *>(user_context);
+        app->_measuring_scheduler.run();
+      },
+      "Task:Measuring", MEASURING_TASK_STACK_SIZE, this, 2,
+      &_rtos_measuring_task_handle, DATA_PROCESSING_CORE);
 
   return true;
 }
@@ -302,6 +727,13 @@ bool Application::read_settings_json(std::ostream &os) {
       ss << "Setting file is \"" << SETTINGS_FILE_PATH << "\"";
       os << ss.str() << std::endl;
       M5_LOGI("%s", ss.str().c_str());
+      // 場所毎のログの水準
+      for (size_t i = 0; i < AsyncLog::MODULE_NAMES.size(); ++i) {
+        auto module = static_cast<AsyncLog::Module>(i);
+        if (auto level = getSettings_Log_Level(module); level) {
+          AsyncLog::setLevel(module, *level);
+        }
+      }
     } else {
       std::ostringstream ss;
       ss << "Error; Read \"" << SETTINGS_FILE_PATH << "\" file.";
@@ -344,6 +776,9 @@ bool Application::start_SD(std::ostream &os) {
     std::this_thread::sleep_for(500ms);
   }
   if (steady_clock::now() < timeover) {
+    if (getSettings_Log_File().value_or(false)) {
+      AsyncLog::openFile(LOG_FILE_PATH);
+    }
     return true;
   } else {
     std::ostringstream ss;
@@ -400,12 +835,14 @@ bool Application::start_wifi(std::ostream &os) {
   // Over The Air update
   if (WiFi.status() == WL_CONNECTED) {
     ArduinoOTA
-        .onStart([]() {
+        .onStart([this]() {
           String type;
           if (ArduinoOTA.getCommand() == U_FLASH)
             type = "sketch";
           else // U_SPIFFS
             type = "filesystem";
+          // 更新して再起動する前に書き戻す測定値を書いておく
+          warm_start_checkpoint_task_handler();
 
           // NOTE: if updating SPIFFS this would be the place to unmount
           // SPIFFS using SPIFFS.end()
@@ -460,14 +897,7 @@ bool Application::synchronize_ntp(std::ostream &os) {
   sntp_set_time_sync_notification_cb(time_sync_notification_callback);
   configTzTime(TZ_TIME_ZONE.data(), "time.cloudflare.com",
                "ntp.jst.mfeed.ad.jp", "ntp.nict.jp");
-  //
-  os << "waiting for time sync" << std::endl;
-  M5_LOGI("waiting for time sync");
-  //
-  while (!_time_is_synced) {
-    std::this_thread::sleep_for(100ms);
-  }
-  //
+  // 同期したらtime_sync_notification_callbackが呼ばれる
   return true;
 }
 
@@ -479,7 +909,7 @@ bool Application::start_database(std::ostream &os) {
   for (auto count = 1; count <= 2; ++count) {
     if (Application::_data_acquisition_db.begin(
             std::string(DATA_ACQUISITION_DATABASE_FILE_URI))) {
-      return true;
+      break;
     }
     // 失敗したらデータベースファイルを消去して再度初期化
     if (LittleFS.remove(DATA_ACQUISITION_DATABASE_FILE_URI.data())) {
@@ -499,6 +929,14 @@ bool Application::start_database(std::ostream &os) {
   //
   if (Application::_data_acquisition_db.available()) {
     os << "Database is available." << std::endl;
+    // 再起動する前の測定値を書き戻す
+    // (時刻が合うまではファイルを残したまま後にする)
+    if (isTimeValid()) {
+      restore_warm_start_snapshot(os);
+    } else {
+      os << "warm start snapshot waits for time sync." << std::endl;
+      M5_LOGI("warm start snapshot waits for time sync.");
+    }
     return true;
   } else {
     os << "Database is not available." << std::endl;
@@ -507,6 +945,44 @@ bool Application::start_database(std::ostream &os) {
   }
 }
 
+//
+void Application::restore_warm_start_snapshot(std::ostream &os) {
+  // 開けなくても繰り返さない
+  _warm_start_restored = true;
+  std::string_view path = SD.cardType() != CARD_NONE
+                              ? WARM_START_SNAPSHOT_FILE_PATH_SD
+                              : WARM_START_SNAPSHOT_FILE_PATH_LITTLEFS;
+  if (!_warm_start_snapshot.begin(path)) {
+    std::ostringstream ss;
+    ss << "snapshot file \"" << path << "\" open error.";
+    os << ss.str() << std::endl;
+    M5_LOGE("%s", ss.str().c_str());
+    return;
+  }
+  // 集計を先に書き戻して, 集計に入っていない測定値だけを後で畳み込む
+  if (auto rollups = _warm_start_snapshot.restoreRollups(_data_acquisition_db);
+      rollups > 0) {
+    std::ostringstream ss;
+    ss << "restored " << rollups << " rollups.";
+    os << ss.str() << std::endl;
+    M5_LOGI("%s", ss.str().c_str());
+  }
+  // 1回で読み通して, 同じ時間の測定値を1つのトランザクションで入れる
+  auto keep_from = system_clock::now() - minutes{Gui::CHART_X_POINT_COUNT};
+  auto restored = _warm_start_snapshot.restore(
+      keep_from, [this](system_clock::time_point at,
+                        const std::vector<Sensor::MeasuredValue> &values) {
+        if (!_data_acquisition_db.insert(at, values)) {
+          M5_LOGW("restore measurements failed.");
+        }
+        return true;
+      });
+  std::ostringstream ss;
+  ss << "restored " << restored << " measurements.";
+  os << ss.str() << std::endl;
+  M5_LOGI("%s", ss.str().c_str());
+}
+
 //
 bool Application::start_telemetry(std::ostream &os) {
   {
@@ -547,7 +1023,34 @@ bool Application::start_telemetry(std::ostream &os) {
     M5_LOGE("%s", ss.str().c_str());
     return false;
   }
+  // 設定がなければ1つずつ送る
+  if (auto batch_size = getSettings_AzureIoTHub_BatchSize();
+      batch_size && *batch_size > 1) {
+    auto batch_bytes = getSettings_AzureIoTHub_BatchBytes();
+    _telemetry.setBatchMode(*batch_size,
+                            batch_bytes && *batch_bytes > 0
+                                ? static_cast<size_t>(*batch_bytes)
+                                : std::numeric_limits<size_t>::max());
+    M5_LOGI("Telemetry batch mode; %d items", *batch_size);
+  }
+  // 設定がなければJSONで送る
+  if (auto encoding = getSettings_AzureIoTHub_Encoding();
+      encoding && *encoding == "cbor") {
+    _telemetry.setEncoding(Telemetry::Encoding::Cbor);
+    M5_LOGI("Telemetry encoding; CBOR");
+  }
 
+  // SDカードがあれば送信するまでの測定値をSDカードに溜める
+  if (SD.cardType() != CARD_NONE) {
+    if (_telemetry.beginSpool(TELEMETRY_SPOOL_FILE_PATH)) {
+      M5_LOGI("Telemetry spool is \"%s\"", TELEMETRY_SPOOL_FILE_PATH.data());
+    } else {
+      std::ostringstream ss;
+      ss << "Telemetry spool open failed.";
+      os << ss.str() << std::endl;
+      M5_LOGE("%s", ss.str().c_str());
+    }
+  }
   //
   if (_telemetry.begin(iothub_fqdn, iothub_device_id, iothub_device_key) ==
       false) {
@@ -559,12 +1062,7 @@ bool Application::start_telemetry(std::ostream &os) {
   }
   //
   os << "waiting for Telemetry connection." << std::endl;
-  //
-  auto timeover{steady_clock::now() + TIMEOUT};
-  while (_telemetry.isConnected() == false && steady_clock::now() < timeover) {
-    std::this_thread::sleep_for(1s);
-  }
-  return _telemetry.isConnected();
+  return true;
 }
 
 //
@@ -694,11 +1192,40 @@ bool Application::start_measuring(std::ostream &os) {
   os << ss.str() << std::endl;
   M5_LOGI("%s", ss.str().c_str());
   //
-  while (!_time_is_synced) {
-    std::this_thread::sleep_for(100ms);
+  // RTCの時刻が使えなければ時間サーバーと同期してからキューに入れ始める
+  // (起動は待たせない)
+  if (!isTimeValid()) {
+    os << "measurements wait for time sync" << std::endl;
+    M5_LOGI("measurements wait for time sync");
+  }
+  // センサー毎の測定間隔
+  for (auto &sensor_device : _sensors) {
+    auto descriptor = sensor_device->getSensorDescriptor();
+    if (auto policy = getSettings_Sensor_SamplingPolicy(descriptor); policy) {
+      sensor_device->setSamplingPolicy(*policy);
+      M5_LOGI("%s sampling interval is %d-%d seconds",
+              descriptor.str().c_str(),
+              static_cast<int>(policy->fast_interval.count()),
+              static_cast<int>(policy->slow_interval.count()));
+    }
+  }
+  // 移動平均を取る時間
+  if (auto averaging = getSettings_Sensor_AveragingSeconds();
+      averaging && *averaging > 0) {
+    for (auto &sensor_device : _sensors) {
+      sensor_device->setAveragingWindow(std::chrono::seconds{*averaging});
+    }
+    M5_LOGI("Averaging window is %d seconds", *averaging);
+  }
+  // 変わっていない値は送信も保存もしない
+  if (auto bands = getSettings_Sensor_Deadband(); bands) {
+    auto heartbeat = getSettings_Sensor_HeartbeatSeconds();
+    _measuring_task.enableDeadband(
+        *bands, heartbeat && *heartbeat > 0
+                    ? std::chrono::seconds{*heartbeat}
+                    : DeadbandFilter::DEFAULT_HEARTBEAT);
+    M5_LOGI("Deadband filter is enabled");
   }
-  //
-  _measuring_task.begin(std::chrono::system_clock::now());
   return true;
 }
 
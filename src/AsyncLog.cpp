@@ -0,0 +1,241 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "AsyncLog.hpp"
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <M5Unified.h>
+
+using namespace std::chrono;
+
+namespace {
+// 溜めておけるログの行数(2の累乗), 1行の最大バイト数
+constexpr size_t SLOT_COUNT{64};
+constexpr size_t LINE_SIZE{120};
+static_assert((SLOT_COUNT & (SLOT_COUNT - 1)) == 0);
+//
+constexpr size_t LOG_TASK_STACK_SIZE{4096};
+constexpr UBaseType_t LOG_TASK_PRIORITY{tskIDLE_PRIORITY + 1};
+// 溜まったログを見に行く周期
+constexpr auto DRAIN_INTERVAL = milliseconds{20};
+// ファイルに書いた分を閉じなくても読めるようにする周期
+constexpr auto FILE_FLUSH_INTERVAL = seconds{5};
+
+//
+// 書くタスクが複数で読むタスクが1つの固定長の待ち行列(ロック無し)
+// (sequenceで空き, 書き終わり, 読み終わりを知らせる)
+//
+struct Slot {
+  std::atomic<uint32_t> sequence;
+  uint16_t length;
+  std::array<char, LINE_SIZE> text;
+};
+std::array<Slot, SLOT_COUNT> slots{};
+std::atomic<uint32_t> enqueue_position{0};
+uint32_t dequeue_position{0};
+std::atomic<uint32_t> dropped_count{0};
+
+// 書くタスクで呼ぶ
+// (いっぱいなら捨てる)
+bool push(const char *text, size_t length) {
+  uint32_t position = enqueue_position.load(std::memory_order_relaxed);
+  Slot *slot{nullptr};
+  while (true) {
+    slot = &slots[position % SLOT_COUNT];
+    uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+    int32_t diff =
+        static_cast<int32_t>(sequence) - static_cast<int32_t>(position);
+    if (diff == 0) {
+      if (enqueue_position.compare_exchange_weak(position, position + 1,
+                                                 std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      dropped_count.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      position = enqueue_position.load(std::memory_order_relaxed);
+    }
+  }
+  slot->length = std::min(length, LINE_SIZE);
+  std::memcpy(slot->text.data(), text, slot->length);
+  slot->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+// Task:Logだけが呼ぶ
+template <typename F> bool pop(F f) {
+  Slot &slot = slots[dequeue_position % SLOT_COUNT];
+  if (slot.sequence.load(std::memory_order_acquire) != dequeue_position + 1) {
+    return false;
+  }
+  f(slot.text.data(), slot.length);
+  slot.sequence.store(dequeue_position + SLOT_COUNT, std::memory_order_release);
+  ++dequeue_position;
+  return true;
+}
+
+// M5UNIFIED_LOG_FORMATが書くソースファイル名で分ける
+constexpr std::array<std::pair<std::string_view, AsyncLog::Module>, 12>
+    SOURCE_FILE_MODULES{{
+        {"Application.cpp", AsyncLog::Module::Application},
+        {"main.cpp", AsyncLog::Module::Application},
+        {"Database.cpp", AsyncLog::Module::Database},
+        {"RingBufferStore.cpp", AsyncLog::Module::Database},
+        {"WarmStartSnapshot.cpp", AsyncLog::Module::Database},
+        {"Telemetery.cpp", AsyncLog::Module::Telemetry},
+        {"TelemetrySpool.cpp", AsyncLog::Module::Telemetry},
+        {"SerialLogger.cpp", AsyncLog::Module::Telemetry},
+        {"MeasuringTask.cpp", AsyncLog::Module::Measuring},
+        {"Sensor.cpp", AsyncLog::Module::Measuring},
+        {"Gui.cpp", AsyncLog::Module::Gui},
+        {"RgbLed.cpp", AsyncLog::Module::Gui},
+    }};
+// ソースファイル名はログの頭の方にある
+constexpr size_t SOURCE_FILE_SEARCH_LENGTH{64};
+//
+AsyncLog::Module module_of_text(std::string_view text) {
+  std::string_view head = text.substr(0, SOURCE_FILE_SEARCH_LENGTH);
+  for (const auto &[file, module] : SOURCE_FILE_MODULES) {
+    if (auto found = head.find(file); found != std::string_view::npos &&
+                                      (found == 0 || head[found - 1] == '[' ||
+                                       head[found - 1] == '/')) {
+      return module;
+    }
+  }
+  return AsyncLog::Module::Other;
+}
+
+//
+struct FileDeleter {
+  void operator()(std::FILE *fp) const { std::fclose(fp); }
+};
+std::unique_ptr<std::FILE, FileDeleter> log_file{};
+// 開いたらTask:Logにも書かせる
+std::atomic<bool> log_file_opened{false};
+
+// 溜まったログを書き出す
+void write_out(const char *text, size_t length) {
+  Serial.write(reinterpret_cast<const uint8_t *>(text), length);
+  if (log_file_opened.load(std::memory_order_acquire)) {
+    std::fwrite(text, 1, length, log_file.get());
+  }
+  // 入りきらずに切れた行
+  if (length > 0 && text[length - 1] != '\n') {
+    Serial.write('\n');
+    if (log_file_opened.load(std::memory_order_acquire)) {
+      std::fputc('\n', log_file.get());
+    }
+  }
+}
+
+//
+void log_task(void *) {
+  auto flushed_at = steady_clock::now();
+  uint32_t reported_dropped{0};
+  while (true) {
+    bool written{false};
+    while (pop(write_out)) {
+      written = true;
+    }
+    if (uint32_t dropped = dropped_count.load(std::memory_order_relaxed);
+        dropped != reported_dropped) {
+      std::array<char, 48> line{};
+      int length =
+          std::snprintf(line.data(), line.size(), "[log] %u lines dropped\n",
+                        static_cast<unsigned>(dropped - reported_dropped));
+      reported_dropped = dropped;
+      write_out(line.data(), std::clamp<int>(length, 0, line.size() - 1));
+      written = true;
+    }
+    if (written && log_file_opened.load(std::memory_order_acquire) &&
+        steady_clock::now() - flushed_at >= FILE_FLUSH_INTERVAL) {
+      std::fflush(log_file.get());
+      flushed_at = steady_clock::now();
+    }
+    std::this_thread::sleep_for(DRAIN_INTERVAL);
+  }
+}
+} // namespace
+
+//
+std::optional<AsyncLog::Module> AsyncLog::moduleOf(std::string_view name) {
+  for (size_t i = 0; i < MODULE_NAMES.size(); ++i) {
+    if (MODULE_NAMES[i] == name) {
+      return static_cast<Module>(i);
+    }
+  }
+  return std::nullopt;
+}
+
+//
+std::optional<esp_log_level_t> AsyncLog::levelOf(std::string_view name) {
+  constexpr std::array<std::pair<std::string_view, esp_log_level_t>, 6>
+      LEVEL_NAMES{{
+          {"none", ESP_LOG_NONE},
+          {"error", ESP_LOG_ERROR},
+          {"warn", ESP_LOG_WARN},
+          {"info", ESP_LOG_INFO},
+          {"debug", ESP_LOG_DEBUG},
+          {"verbose", ESP_LOG_VERBOSE},
+      }};
+  for (const auto &[level_name, level] : LEVEL_NAMES) {
+    if (level_name == name) {
+      return level;
+    }
+  }
+  return std::nullopt;
+}
+
+//
+bool AsyncLog::begin() {
+  for (size_t i = 0; i < slots.size(); ++i) {
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  if (xTaskCreatePinnedToCore(log_task, "Task:Log", LOG_TASK_STACK_SIZE,
+                              nullptr, LOG_TASK_PRIORITY, nullptr,
+                              tskNO_AFFINITY) != pdPASS) {
+    M5_LOGE("create log task failed.");
+    return false;
+  }
+  // 出す場所の水準より詳しいログは溜めずに捨てる
+  M5.Log.setCallback([](esp_log_level_t level, bool, const char *text) {
+    std::string_view line{text};
+    if (level <= levels[static_cast<size_t>(module_of_text(line))].load(
+                     std::memory_order_relaxed)) {
+      push(line.data(), line.size());
+    }
+  });
+  M5.Log.setLogLevel(m5::log_target_callback,
+                     static_cast<esp_log_level_t>(CORE_DEBUG_LEVEL));
+  M5.Log.setLogLevel(m5::log_target_serial, ESP_LOG_NONE);
+  return true;
+}
+
+//
+bool AsyncLog::openFile(std::string_view path) {
+  if (log_file_opened.load(std::memory_order_acquire)) {
+    return true;
+  }
+  log_file.reset(std::fopen(std::string{path}.c_str(), "a"));
+  if (!log_file) {
+    M5_LOGE("open log file \"%s\" failed.", std::string{path}.c_str());
+    return false;
+  }
+  log_file_opened.store(true, std::memory_order_release);
+  return true;
+}
+
+//
+uint32_t AsyncLog::dropped() {
+  return dropped_count.load(std::memory_order_relaxed);
+}
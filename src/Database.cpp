@@ -3,18 +3,65 @@
 // See LICENSE file in the project root for full license information.
 //
 #include "Database.hpp"
-#include "Application.hpp"
+#include "AsyncLog.hpp"
+#include "ChartCoordinate.hpp"
+#include "RingBufferStore.hpp"
+#include <array>
 #include <chrono>
+#include <cstdio>
+#include <ctime>
 #include <future>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <tuple>
 
 #include <M5Unified.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 using namespace std::chrono;
 
+// デバッグ用の文字列を組み立てるかどうか
+// (捨てられるログのために組み立てない)
+static bool log_enabled(esp_log_level_t level) {
+  return AsyncLog::enabled(AsyncLog::Module::Database, level);
+}
+
+// ISO8601形式のUTC
+static std::array<char, 24> isoformat_utc(std::time_t utctime) {
+  std::array<char, 24> text{};
+  std::tm tm;
+  gmtime_r(&utctime, &tm);
+  std::strftime(text.data(), text.size(), "%FT%TZ", &tm);
+  return text;
+}
+
+// ORDER BYの句はバインドしても値として比べるだけで並ばないので
+// プレースホルダ:order_byを決まった句に置き換えたクエリを作る
+// (ステートメントのキャッシュのキーになるのでstaticな領域に置く)
+static std::string_view query_with_order_by(std::string_view query,
+                                            Database::OrderBy order) {
+  constexpr std::string_view placeholder{":order_by"};
+  static std::mutex mutex{};
+  static std::map<std::pair<const char *, Database::OrderBy>, std::string>
+      queries{};
+  std::lock_guard<std::mutex> lock{mutex};
+  auto [it, inserted] = queries.try_emplace({query.data(), order});
+  if (inserted) {
+    std::string text{query};
+    if (auto pos = text.find(placeholder); pos != std::string::npos) {
+      text.replace(pos, placeholder.size(),
+                   order == Database::OrderByAtDesc ? "at DESC" : "at ASC");
+    }
+    it->second = std::move(text);
+  }
+  return it->second;
+}
+
 const sqlite3_mem_methods Database::_custom_mem_methods{
     /* Memory allocation function */
     .xMalloc = [](int size) -> void * {
@@ -47,37 +94,43 @@ const sqlite3_mem_methods Database::_custom_mem_methods{
 //
 constexpr static std::string_view schema_temperature{
     "CREATE TABLE IF NOT EXISTS temperature"
-    "(id INTEGER PRIMARY KEY AUTOINCREMENT"
-    ",sensor_id INTEGER NOT NULL"
+    "(sensor_id INTEGER NOT NULL"
     ",at INTEGER NOT NULL"
     ",degc REAL NOT NULL"
-    ");"};
+    ",PRIMARY KEY(sensor_id,at)"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS temperature_at ON temperature(at);"};
+
+//
+constexpr static std::string_view query_insert_temperature{
+    "INSERT OR REPLACE INTO"
+    " temperature(sensor_id,at,degc)"
+    " VALUES(?,?,?);" // values#1, values#2, values#3
+};
+
+//
+constexpr static std::string_view query_select_temperature_at_begin{
+    "SELECT"
+    " sensor_id,at,degc"
+    " FROM temperature"
+    " WHERE at >= :at_begin" // placeholder
+    " ORDER BY :order_by;"   // placeholder
+};
 
 //
 bool Database::insert_temperature(SensorId sensor_id,
                                   system_clock::time_point at, DegC degc) {
-  constexpr static std::string_view query{
-      "INSERT INTO"
-      " temperature(sensor_id,at,degc)"
-      " VALUES(?,?,?);" // values#1, values#2, values#3
-  };
   TimePointAndDouble values{sensor_id, at, degc.count()};
-  return insert_values(query, values);
+  return store_values(Table::Temperature, query_insert_temperature, values);
 }
 
 //
 size_t Database::read_temperatures(OrderBy order,
                                    system_clock::time_point at_begin,
                                    ReadCallback<TimePointAndDouble> callback) {
-  constexpr static std::string_view query{
-      "SELECT"
-      " sensor_id,at,degc"
-      " FROM temperature"
-      " WHERE at >= :at_begin" // placeholder
-      " ORDER BY :order_by;"   // placeholder
-  };
-  if (auto count =
-          read_values(query, std::make_tuple(at_begin, order), callback);
+  if (auto count = load_values(Table::Temperature,
+                               query_select_temperature_at_begin,
+                               std::make_tuple(at_begin, order), callback);
       count) {
     return *count;
   } else {
@@ -97,7 +150,8 @@ size_t Database::read_temperatures(
       " ORDER BY :order_by"         // placeholder
       " LIMIT :limit;"              // placeholder
   };
-  if (auto count = read_values(query, std::make_tuple(sensor_id, order, limit),
+  if (auto count = load_values(Table::Temperature, query,
+                               std::make_tuple(sensor_id, order, limit),
                                callback);
       count) {
     return *count;
@@ -114,7 +168,7 @@ Database::read_temperatures(OrderBy order, SensorId sensor_id, size_t limit) {
   read_temperatures(order, sensor_id, limit,
                     [&vect](size_t counter, TimePointAndDouble item) -> bool {
                       // データー表示(デバッグ用)
-                      if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_VERBOSE) {
+                      if (log_enabled(ESP_LOG_VERBOSE)) {
                         auto &[sensorid, tp, fp_value] = item;
                         //
                         std::time_t time = system_clock::to_time_t(tp);
@@ -140,22 +194,36 @@ Database::read_temperatures(OrderBy order, SensorId sensor_id, size_t limit) {
 //
 constexpr static std::string_view schema_relative_humidity{
     "CREATE TABLE IF NOT EXISTS relative_humidity"
-    "(id INTEGER PRIMARY KEY AUTOINCREMENT"
-    ",sensor_id INTEGER NOT NULL"
+    "(sensor_id INTEGER NOT NULL"
     ",at INTEGER NOT NULL"
     ",rh REAL NOT NULL"
-    ");"};
+    ",PRIMARY KEY(sensor_id,at)"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS relative_humidity_at"
+    " ON relative_humidity(at);"};
+
+//
+constexpr static std::string_view query_insert_relative_humidity{
+    "INSERT OR REPLACE INTO"
+    " relative_humidity(sensor_id,at,rh)"
+    " VALUES(?,?,?);" // values#1, values#2, values#3
+};
+
+//
+constexpr static std::string_view query_select_relative_humidity_at_begin{
+    "SELECT"
+    " sensor_id,at,rh"
+    " FROM relative_humidity"
+    " WHERE at >= :at_begin" // placeholder
+    " ORDER BY :order_by;"   // placeholder
+};
 
 //
 bool Database::insert_relative_humidity(SensorId sensor_id,
                                         system_clock::time_point at, PctRH rh) {
-  constexpr static std::string_view query{
-      "INSERT INTO"
-      " relative_humidity(sensor_id,at,rh)"
-      " VALUES(?,?,?);" // values#1, values#2, values#3
-  };
   TimePointAndDouble values{sensor_id, at, rh.count()};
-  return insert_values(query, values);
+  return store_values(Table::RelativeHumidity, query_insert_relative_humidity,
+                      values);
 }
 
 //
@@ -163,15 +231,9 @@ size_t
 Database::read_relative_humidities(OrderBy order,
                                    system_clock::time_point at_begin,
                                    ReadCallback<TimePointAndDouble> callback) {
-  constexpr static std::string_view query{
-      "SELECT"
-      " sensor_id,at,rh"
-      " FROM relative_humidity"
-      " WHERE at >= :at_begin" // placeholder
-      " ORDER BY :order_by;"   // placeholder
-  };
-  if (auto count =
-          read_values(query, std::make_tuple(at_begin, order), callback);
+  if (auto count = load_values(Table::RelativeHumidity,
+                               query_select_relative_humidity_at_begin,
+                               std::make_tuple(at_begin, order), callback);
       count) {
     return *count;
   } else {
@@ -191,7 +253,8 @@ size_t Database::read_relative_humidities(
       " ORDER BY :order_by"         // placeholder
       " LIMIT :limit;"              // placeholder
   };
-  if (auto count = read_values(query, std::make_tuple(sensor_id, order, limit),
+  if (auto count = load_values(Table::RelativeHumidity, query,
+                               std::make_tuple(sensor_id, order, limit),
                                callback);
       count) {
     return *count;
@@ -210,7 +273,7 @@ Database::read_relative_humidities(OrderBy order, SensorId sensor_id,
       order, sensor_id, limit,
       [&vect](size_t counter, TimePointAndDouble item) -> bool {
         // データー表示(デバッグ用)
-        if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_VERBOSE) {
+        if (log_enabled(ESP_LOG_VERBOSE)) {
           auto &[sensorid, tp, fp_value] = item;
           //
           std::time_t time = system_clock::to_time_t(tp);
@@ -236,37 +299,42 @@ Database::read_relative_humidities(OrderBy order, SensorId sensor_id,
 //
 constexpr static std::string_view schema_pressure{
     "CREATE TABLE IF NOT EXISTS pressure"
-    "(id INTEGER PRIMARY KEY AUTOINCREMENT"
-    ",sensor_id INTEGER NOT NULL"
+    "(sensor_id INTEGER NOT NULL"
     ",at INTEGER NOT NULL"
     ",hpa REAL NOT NULL"
-    ");"};
+    ",PRIMARY KEY(sensor_id,at)"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS pressure_at ON pressure(at);"};
+
+//
+constexpr static std::string_view query_insert_pressure{
+    "INSERT OR REPLACE INTO"
+    " pressure(sensor_id,at,hpa)"
+    " VALUES(?,?,?);" // values#1, values#2, values#3
+};
+
+//
+constexpr static std::string_view query_select_pressure_at_begin{
+    "SELECT"
+    " sensor_id,at,hpa"
+    " FROM pressure"
+    " WHERE at >= :at_begin" // placeholder
+    " ORDER BY :order_by;"   // placeholder
+};
 
 //
 bool Database::insert_pressure(SensorId sensor_id, system_clock::time_point at,
                                HectoPa hpa) {
-  static const std::string_view query{
-      "INSERT INTO"
-      " pressure(sensor_id,at,hpa)"
-      " VALUES(?,?,?);" // values#1, values#2, values#3
-  };
   TimePointAndDouble values{sensor_id, at, hpa.count()};
-  return insert_values(query, values);
+  return store_values(Table::Pressure, query_insert_pressure, values);
 }
 
 //
 size_t Database::read_pressures(OrderBy order,
                                 system_clock::time_point at_begin,
                                 ReadCallback<TimePointAndDouble> callback) {
-  constexpr static std::string_view query{
-      "SELECT"
-      " sensor_id,at,hpa"
-      " FROM pressure"
-      " WHERE at >= :at_begin" // placeholder
-      " ORDER BY :order_by;"   // placeholder
-  };
-  if (auto count =
-          read_values(query, std::make_tuple(at_begin, order), callback);
+  if (auto count = load_values(Table::Pressure, query_select_pressure_at_begin,
+                               std::make_tuple(at_begin, order), callback);
       count) {
     return *count;
   } else {
@@ -286,7 +354,8 @@ Database::read_pressures(OrderBy order, SensorId sensor_id, size_t limit,
       " ORDER BY :order_by"         // placeholder
       " LIMIT :limit;"              // placeholder
   };
-  if (auto count = read_values(query, std::make_tuple(sensor_id, order, limit),
+  if (auto count = load_values(Table::Pressure, query,
+                               std::make_tuple(sensor_id, order, limit),
                                callback);
       count) {
     return *count;
@@ -303,7 +372,7 @@ Database::read_pressures(OrderBy order, SensorId sensor_id, size_t limit) {
   read_pressures(order, sensor_id, limit,
                  [&vect](size_t counter, TimePointAndDouble item) -> bool {
                    // データー表示(デバッグ用)
-                   if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_VERBOSE) {
+                   if (log_enabled(ESP_LOG_VERBOSE)) {
                      auto &[sensorid, tp, fp_value] = item;
                      //
                      std::time_t time = system_clock::to_time_t(tp);
@@ -329,24 +398,37 @@ Database::read_pressures(OrderBy order, SensorId sensor_id, size_t limit) {
 //
 constexpr static std::string_view schema_carbon_dioxide{
     "CREATE TABLE IF NOT EXISTS carbon_dioxide"
-    "(id INTEGER PRIMARY KEY AUTOINCREMENT"
-    ",sensor_id INTEGER NOT NULL"
+    "(sensor_id INTEGER NOT NULL"
     ",at INTEGER NOT NULL"
     ",ppm REAL NOT NULL"
     ",baseline INTEGER"
-    ");"};
+    ",PRIMARY KEY(sensor_id,at)"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS carbon_dioxide_at ON carbon_dioxide(at);"};
+
+//
+constexpr static std::string_view query_insert_carbon_dioxide{
+    "INSERT OR REPLACE INTO"
+    " carbon_dioxide(sensor_id,at,ppm,baseline)"
+    " VALUES(?,?,?,?);" // values#1, values#2, values#3, values#4
+};
+
+//
+constexpr static std::string_view query_select_carbon_dioxide_at_begin{
+    "SELECT"
+    " sensor_id,at,ppm,baseline"
+    " FROM carbon_dioxide"
+    " WHERE at >= :at_begin" // placeholder
+    " ORDER BY :order_by;"   // placeholder
+};
 
 //
 bool Database::insert_carbon_dioxide(SensorId sensor_id,
                                      system_clock::time_point at, Ppm ppm,
                                      std::optional<uint16_t> baseline) {
-  constexpr static std::string_view query{
-      "INSERT INTO"
-      " carbon_dioxide(sensor_id,at,ppm,baseline)"
-      " VALUES(?,?,?,?);" // values#1, values#2, values#3, values#4
-  };
   TimePointAndIntAndOptInt values{sensor_id, at, ppm.value, baseline};
-  return insert_values(query, values);
+  return store_values(Table::CarbonDioxide, query_insert_carbon_dioxide,
+                      values);
 }
 
 //
@@ -360,8 +442,8 @@ Database::read_carbon_deoxides(OrderBy order, system_clock::time_point at_begin,
       " WHERE at >= :at_begin" // placeholder
       " ORDER BY :order_by;"   // placeholder
   };
-  if (auto count =
-          read_values(query, std::make_tuple(at_begin, order), callback);
+  if (auto count = load_values(Table::CarbonDioxide, query,
+                               std::make_tuple(at_begin, order), callback);
       count) {
     return *count;
   } else {
@@ -373,15 +455,9 @@ Database::read_carbon_deoxides(OrderBy order, system_clock::time_point at_begin,
 size_t Database::read_carbon_deoxides(
     OrderBy order, system_clock::time_point at_begin,
     ReadCallback<TimePointAndIntAndOptInt> callback) {
-  constexpr static std::string_view query{
-      "SELECT"
-      " sensor_id,at,ppm,baseline"
-      " FROM carbon_dioxide"
-      " WHERE at >= :at_begin" // placeholder
-      " ORDER BY :order_by;"   // placeholder
-  };
-  if (auto count =
-          read_values(query, std::make_tuple(at_begin, order), callback);
+  if (auto count = load_values(Table::CarbonDioxide,
+                               query_select_carbon_dioxide_at_begin,
+                               std::make_tuple(at_begin, order), callback);
       count) {
     return *count;
   } else {
@@ -401,7 +477,8 @@ size_t Database::read_carbon_deoxides(
       " ORDER BY :order_by"         // placeholder
       " LIMIT :limit;"              // placeholder
   };
-  if (auto count = read_values(query, std::make_tuple(sensor_id, order, limit),
+  if (auto count = load_values(Table::CarbonDioxide, query,
+                               std::make_tuple(sensor_id, order, limit),
                                callback);
       count) {
     return *count;
@@ -420,7 +497,7 @@ Database::read_carbon_deoxides(OrderBy order, SensorId sensor_id,
       order, sensor_id, limit,
       [&vect](size_t counter, TimePointAndIntAndOptInt item) -> bool {
         // データー表示(デバッグ用)
-        if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_VERBOSE) {
+        if (log_enabled(ESP_LOG_VERBOSE)) {
           auto &[sensorid, tp, int_value, opt_int_value] = item;
           //
           std::time_t time = system_clock::to_time_t(tp);
@@ -452,23 +529,35 @@ Database::read_carbon_deoxides(OrderBy order, SensorId sensor_id,
 //
 constexpr static std::string_view schema_total_voc{
     "CREATE TABLE IF NOT EXISTS total_voc"
-    "(id INTEGER PRIMARY KEY AUTOINCREMENT"
-    ",sensor_id INTEGER NOT NULL"
+    "(sensor_id INTEGER NOT NULL"
     ",at INTEGER NOT NULL"
     ",ppb REAL NOT NULL"
     ",baseline INTEGER"
-    ");"};
+    ",PRIMARY KEY(sensor_id,at)"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS total_voc_at ON total_voc(at);"};
+
+//
+constexpr static std::string_view query_insert_total_voc{
+    "INSERT OR REPLACE INTO"
+    " total_voc(sensor_id,at,ppb,baseline)"
+    " VALUES(?,?,?,?);" // values#1, values#2, values#3, values#4
+};
+
+//
+constexpr static std::string_view query_select_total_voc_at_begin{
+    "SELECT"
+    " sensor_id,at,ppb,baseline"
+    " FROM total_voc"
+    " WHERE at >= :at_begin" // placeholder
+    " ORDER BY :order_by;"   // placeholder
+};
 
 //
 bool Database::insert_total_voc(SensorId sensor_id, system_clock::time_point at,
                                 Ppb ppb, std::optional<uint16_t> baseline) {
-  constexpr static std::string_view query{
-      "INSERT INTO"
-      " total_voc(sensor_id,at,ppb,baseline)"
-      " VALUES(?,?,?,?);" // values#1, values#2, values#3, values#4
-  };
   TimePointAndIntAndOptInt values{sensor_id, at, ppb.value, baseline};
-  return insert_values(query, values);
+  return store_values(Table::TotalVoc, query_insert_total_voc, values);
 }
 
 //
@@ -482,8 +571,8 @@ size_t Database::read_total_vocs(OrderBy order,
       " WHERE at >= :at_begin" // placeholder
       " ORDER BY :order_by;"   // placeholder
   };
-  if (auto count =
-          read_values(query, std::make_tuple(at_begin, order), callback);
+  if (auto count = load_values(Table::TotalVoc, query,
+                               std::make_tuple(at_begin, order), callback);
       count) {
     return *count;
   } else {
@@ -495,15 +584,8 @@ size_t Database::read_total_vocs(OrderBy order,
 size_t
 Database::read_total_vocs(OrderBy order, system_clock::time_point at_begin,
                           ReadCallback<TimePointAndIntAndOptInt> callback) {
-  constexpr static std::string_view query{
-      "SELECT"
-      " sensor_id,at,ppb,baseline"
-      " FROM total_voc"
-      " WHERE at >= :at_begin" // placeholder
-      " ORDER BY :order_by;"   // placeholder
-  };
-  if (auto count =
-          read_values(query, std::make_tuple(at_begin, order), callback);
+  if (auto count = load_values(Table::TotalVoc, query_select_total_voc_at_begin,
+                               std::make_tuple(at_begin, order), callback);
       count) {
     return *count;
   } else {
@@ -523,7 +605,8 @@ size_t Database::read_total_vocs(
       " ORDER BY :order_by"         // placeholder
       " LIMIT :limit;"              // placeholder
   };
-  if (auto count = read_values(query, std::make_tuple(sensor_id, order, limit),
+  if (auto count = load_values(Table::TotalVoc, query,
+                               std::make_tuple(sensor_id, order, limit),
                                callback);
       count) {
     return *count;
@@ -541,7 +624,7 @@ Database::read_total_vocs(OrderBy order, SensorId sensor_id, size_t limit) {
       order, sensor_id, limit,
       [&vect](size_t counter, TimePointAndIntAndOptInt item) -> bool {
         // データー表示(デバッグ用)
-        if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_VERBOSE) {
+        if (log_enabled(ESP_LOG_VERBOSE)) {
           auto &[sensorid, tp, int_value, opt_int_value] = item;
           //
           std::time_t time = system_clock::to_time_t(tp);
@@ -594,6 +677,88 @@ void Database::Sqlite3StmtDeleter::operator()(sqlite3_stmt *ptr) const {
   }
 }
 
+//
+//
+//
+void Database::Sqlite3StmtResetter::operator()(sqlite3_stmt *ptr) const {
+  // キャッシュに戻すのでfinalizeせずにリセットする
+  sqlite3_reset(ptr);
+  sqlite3_clear_bindings(ptr);
+}
+
+//
+//
+//
+sqlite3_stmt *Database::prepare_cached_statement(std::string_view query) {
+  // guard
+  if (!_sqlite3_db) {
+    M5_LOGE("sqlite3_db is null");
+    return nullptr;
+  }
+  //
+  if (auto found_itr = _statement_cache.find(query);
+      found_itr != _statement_cache.end()) {
+    _statement_cache_hits++;
+    return found_itr->second.get();
+  }
+  //
+  _statement_cache_misses++;
+  Sqlite3StmtPointerUnique stmt;
+  if (sqlite3_stmt * pStmt{nullptr};
+      sqlite3_prepare_v3(_sqlite3_db.get(), query.data(), query.size(),
+                         SQLITE_PREPARE_PERSISTENT, &pStmt,
+                         nullptr) == SQLITE_OK) {
+    // set statement handle to smartpointer
+    if (pStmt) {
+      stmt.reset(pStmt);
+    }
+  } else {
+    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+    M5_LOGE("%s", query.data());
+    return nullptr;
+  }
+  //
+  auto pStmt = stmt.get();
+  _statement_cache.emplace(query, std::move(stmt));
+  return pStmt;
+}
+
+//
+//
+//
+Database::StatementCacheStatistics
+Database::getStatementCacheStatistics() const {
+  Lock lock{_mutex};
+  return StatementCacheStatistics{
+      .hits = _statement_cache_hits,
+      .misses = _statement_cache_misses,
+      .entries = _statement_cache.size(),
+  };
+}
+
+//
+Database::MemoryStatistics Database::getMemoryStatistics() const {
+  sqlite3_int64 used{0};
+  sqlite3_int64 highwater{0};
+  sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &used, &highwater, false);
+  sqlite3_int64 request{0};
+  sqlite3_int64 largest_request{0};
+  sqlite3_status64(SQLITE_STATUS_MALLOC_SIZE, &request, &largest_request,
+                   false);
+  size_t arena_size{0};
+#ifdef SQLITE_ENABLE_MEMSYS5
+  if (_database_use_preallocated_memory) {
+    arena_size = DATABASE_USE_PREALLOCATED_MEMORY_SIZE;
+  }
+#endif
+  return MemoryStatistics{
+      .arena_size = arena_size,
+      .used = used,
+      .highwater = highwater,
+      .largest_request = largest_request,
+  };
+}
+
 //
 //
 //
@@ -617,17 +782,42 @@ struct Database::Transaction {
     sqlite3_free(errmsg);
     return (onTransaction = false);
   }
-  //
-  ~Transaction() {
+  // COMMITせずに取り消す
+  void abort() {
     if (onTransaction) {
       char *errmsg{nullptr};
-      if (sqlite3_exec(db.get(), "COMMIT;", nullptr, nullptr, &errmsg) !=
+      if (sqlite3_exec(db.get(), "ROLLBACK;", nullptr, nullptr, &errmsg) !=
           SQLITE_OK) {
         if (errmsg) {
           M5_LOGE("%s", errmsg);
         }
         sqlite3_free(errmsg);
       }
+      onTransaction = false;
+    }
+  }
+  // COMMITできなければ取り消してfalseを返す
+  bool commit() {
+    if (!onTransaction) {
+      return false;
+    }
+    char *errmsg{nullptr};
+    if (sqlite3_exec(db.get(), "COMMIT;", nullptr, nullptr, &errmsg) ==
+        SQLITE_OK) {
+      onTransaction = false;
+      return true;
+    }
+    if (errmsg) {
+      M5_LOGE("%s", errmsg);
+    }
+    sqlite3_free(errmsg);
+    abort();
+    return false;
+  }
+  //
+  ~Transaction() {
+    if (onTransaction) {
+      commit();
     }
   }
 };
@@ -636,6 +826,19 @@ struct Database::Transaction {
 //
 //
 bool Database::begin(const std::string &database_file_path) {
+#ifdef DATABASE_USE_RING_BUFFER_STORE
+  // 測定値はリングバッファに保存して, SQLiteのテーブルは書き出しにだけ使う
+  return begin(database_file_path,
+               std::make_unique<RingBufferStore>(Chart::X_POINT_COUNT));
+#else
+  return begin(database_file_path, nullptr);
+#endif
+}
+
+//
+bool Database::begin(const std::string &database_file_path,
+                     std::unique_ptr<MeasurementStore> measurement_store) {
+  Lock lock{_mutex};
   //
   if (psramFound()) {
     //
@@ -656,13 +859,19 @@ bool Database::begin(const std::string &database_file_path) {
     //
     if (_database_use_preallocated_memory) {
       M5_LOGI("Database uses on pre-allocated memory");
-      if (auto result = sqlite3_config(
-              SQLITE_CONFIG_HEAP, _database_use_preallocated_memory,
-              DATABASE_USE_PREALLOCATED_MEMORY_SIZE, 64);
+      if (auto result =
+              sqlite3_config(SQLITE_CONFIG_HEAP,
+                             _database_use_preallocated_memory,
+                             DATABASE_USE_PREALLOCATED_MEMORY_SIZE,
+                             DATABASE_PREALLOCATED_MEMORY_MIN_ALLOCATION);
           result != SQLITE_OK) {
         M5_LOGE("sqlite3_config() failure: %d", result);
+        terminate();
         return false;
       }
+    } else {
+      // 領域が取れなければヒープから割り当てる
+      M5_LOGE("pre-allocated memory is not available");
     }
 #endif
   }
@@ -688,6 +897,8 @@ bool Database::begin(const std::string &database_file_path) {
             SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI,
             nullptr);
         result == SQLITE_OK) {
+      // 古い接続のプリペアドステートメントを先に破棄する
+      _statement_cache.clear();
       // set db handle to smartpointer
       _sqlite3_db.reset(pDatabase);
     } else {
@@ -704,8 +915,8 @@ bool Database::begin(const std::string &database_file_path) {
 
   //
   if (char *error_msg{};
-      sqlite3_exec(_sqlite3_db.get(), "PRAGMA auto_vacuum = full;", nullptr,
-                   nullptr, &error_msg) != SQLITE_OK) {
+      sqlite3_exec(_sqlite3_db.get(), "PRAGMA auto_vacuum = incremental;",
+                   nullptr, nullptr, &error_msg) != SQLITE_OK) {
     if (error_msg) {
       M5_LOGE("%s", error_msg);
     }
@@ -725,26 +936,14 @@ bool Database::begin(const std::string &database_file_path) {
   }
 
   // create tables
-  // temperature
-  // relative humidity
-  // pressure
-  // carbon dioxide
-  // total voc
-  for (auto &query :
-       {schema_temperature, schema_relative_humidity, schema_pressure,
-        schema_carbon_dioxide, schema_total_voc}) {
-    std::this_thread::yield();
-    M5_LOGV("%s", query.data());
-    if (char *error_msg{nullptr};
-        sqlite3_exec(_sqlite3_db.get(), query.data(), nullptr, nullptr,
-                     &error_msg) != SQLITE_OK) {
-      M5_LOGE("create table error");
-      if (error_msg) {
-        M5_LOGE("%s", error_msg);
-      }
-      sqlite3_free(error_msg);
-      return false;
-    }
+  if (!upgrade_schema()) {
+    return false;
+  }
+
+  //
+  _measurement_store = std::move(measurement_store);
+  if (_measurement_store) {
+    M5_LOGI("Database uses measurement store");
   }
 
   // succsessfully exit
@@ -755,6 +954,10 @@ bool Database::begin(const std::string &database_file_path) {
 //
 //
 void Database::terminate() {
+  Lock lock{_mutex};
+  _measurement_store.reset();
+  // sqlite3_close()の前に全てのステートメントをfinalizeする
+  _statement_cache.clear();
   _sqlite3_db.reset();
   sqlite3_shutdown();
 #ifdef SQLITE_ENABLE_MEMSYS5
@@ -764,20 +967,87 @@ void Database::terminate() {
 }
 
 //
+// 測定値のテーブルの一覧
+// (スキーマの移行と古い測定値の削除はこの一覧から処理を作る)
 //
+struct TableSchema {
+  std::string_view name;
+  std::string_view schema;
+  std::string_view columns;
+};
+constexpr static TableSchema measurement_tables[] = {
+    {"temperature", schema_temperature, "sensor_id,at,degc"},
+    {"relative_humidity", schema_relative_humidity, "sensor_id,at,rh"},
+    {"pressure", schema_pressure, "sensor_id,at,hpa"},
+    {"carbon_dioxide", schema_carbon_dioxide, "sensor_id,at,ppm,baseline"},
+    {"total_voc", schema_total_voc, "sensor_id,at,ppb,baseline"},
+};
+
 //
-bool Database::delete_old_measurements_from_database(
-    system_clock::time_point delete_of_older_than_tp) {
-  constexpr static std::string_view queries[] = {
-      {"DELETE FROM temperature WHERE at < ?;"},       // placeholder#1
-      {"DELETE FROM relative_humidity WHERE at < ?;"}, // placeholder#1
-      {"DELETE FROM carbon_dioxide WHERE at < ?;"},    // placeholder#1
-      {"DELETE FROM total_voc WHERE at < ?;"},         // placeholder#1
+// 1時間毎と1日毎の集計
+constexpr static std::string_view schema_rollup{
+    "CREATE TABLE IF NOT EXISTS rollup_hourly"
+    "(metric INTEGER NOT NULL"
+    ",sensor_id INTEGER NOT NULL"
+    ",at INTEGER NOT NULL"
+    ",samples INTEGER NOT NULL"
+    ",minimum REAL NOT NULL"
+    ",total REAL NOT NULL"
+    ",maximum REAL NOT NULL"
+    ",PRIMARY KEY(metric,sensor_id,at)"
+    ") WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS rollup_daily"
+    "(metric INTEGER NOT NULL"
+    ",sensor_id INTEGER NOT NULL"
+    ",at INTEGER NOT NULL"
+    ",samples INTEGER NOT NULL"
+    ",minimum REAL NOT NULL"
+    ",total REAL NOT NULL"
+    ",maximum REAL NOT NULL"
+    ",PRIMARY KEY(metric,sensor_id,at)"
+    ") WITHOUT ROWID;"
+    // ここより前の測定値は畳み込み済み
+    "CREATE TABLE IF NOT EXISTS rollup_watermark"
+    "(id INTEGER PRIMARY KEY CHECK(id = 0)"
+    ",at INTEGER NOT NULL"
+    ");"};
+
+//
+// 古いスキーマのテーブルを(sensor_id, at)をキーにしたテーブルに移す
+//
+bool Database::upgrade_schema() {  //
+  auto exec = [this](const std::string &query) -> bool {
+    M5_LOGV("%s", query.c_str());
+    if (char *error_msg{nullptr};
+        sqlite3_exec(_sqlite3_db.get(), query.c_str(), nullptr, nullptr,
+                     &error_msg) != SQLITE_OK) {
+      if (error_msg) {
+        M5_LOGE("%s", error_msg);
+      }
+      sqlite3_free(error_msg);
+      return false;
+    }
+    return true;
   };
 
   // guard
   if (!_sqlite3_db) {
-    M5_LOGI("sqlite3_db is not available.");
+    M5_LOGE("sqlite3_db is null");
+    return false;
+  }
+
+  int version{0};
+  {
+    Sqlite3StmtPointerCached stmt{
+        prepare_cached_statement("PRAGMA user_version;")};
+    if (!stmt || sqlite3_step(stmt.get()) != SQLITE_ROW) {
+      M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+      return false;
+    }
+    version = sqlite3_column_int(stmt.get(), 0);
+  }
+  if (version > SCHEMA_VERSION) {
+    M5_LOGE("unknown schema version: %d", version);
     return false;
   }
 
@@ -785,277 +1055,1017 @@ bool Database::delete_old_measurements_from_database(
   if (!transaction.begin()) {
     return false;
   }
-
-  M5_LOGI("delete old rows.");
-
-  // delete old rows
-  for (auto &query : queries) {
-    std::this_thread::yield();
-    //
-    Sqlite3StmtPointerUnique stmt;
-    if (sqlite3_stmt * pStmt{nullptr};
-        sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                           nullptr) == SQLITE_OK) {
-      // set statement handle to smartpointer
-      if (pStmt) {
-        stmt.reset(pStmt);
+  // version 0 -> 1
+  // id INTEGER PRIMARY KEY AUTOINCREMENT のテーブルを作り直す
+  if (version < 1) {
+    for (const auto &table : measurement_tables) {
+      std::string name{table.name};
+      std::string columns{table.columns};
+      if (!table_exists(table.name)) {
+        continue;
       }
-    } else {
-      M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-      M5_LOGE("%s", query.data());
-      return false;
-    }
-    if (sqlite3_bind_int64(stmt.get(), 1,
-                           static_cast<int64_t>(system_clock::to_time_t(
-                               delete_of_older_than_tp))) != SQLITE_OK) {
-      M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-      return false;
-    }
-    // SQL表示(デバッグ用)
-    if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
-      std::time_t time = system_clock::to_time_t(delete_of_older_than_tp);
-      std::tm local_time;
-      localtime_r(&time, &local_time);
-      std::ostringstream oss;
-      //
-      if (auto p = sqlite3_expanded_sql(stmt.get()); p) {
-        oss << std::string_view(p);
-        sqlite3_free(p);
+      M5_LOGI("migrate table \"%s\"", name.c_str());
+      if (!exec("ALTER TABLE " + name + " RENAME TO " + name + "_v0;") ||
+          !exec(std::string{table.schema}) ||
+          !exec("INSERT OR REPLACE INTO " + name + "(" + columns + ") SELECT " +
+                columns + " FROM " + name + "_v0;") ||
+          !exec("DROP TABLE " + name + "_v0;")) {
+        M5_LOGE("migrate table error");
+        transaction.abort();
+        return false;
       }
-      //
-      oss << " (" << static_cast<int64_t>(time) << " is "
-          << std::put_time(&local_time, "%F %T %Z") << ")";
-      M5_LOGD("%s", oss.str().c_str());
     }
-    //
-    auto timeover{steady_clock::now() + LOOP_TIMEOUT};
-    while (steady_clock::now() < timeover &&
-           sqlite3_step(stmt.get()) != SQLITE_DONE) {
-      std::this_thread::yield();
+  }
+  // create tables
+  // temperature
+  // relative humidity
+  // pressure
+  // carbon dioxide
+  // total voc
+  for (const auto &table : measurement_tables) {
+    if (!exec(std::string{table.schema})) {
+      M5_LOGE("create table error");
+      transaction.abort();
+      return false;
     }
-    if (steady_clock::now() > timeover) {
-      M5_LOGE("sqlite3_step() timeover");
-      M5_LOGE("query is \"%s\"", query.data());
+  }
+  // version 1 -> 2
+  // 1時間毎と1日毎の集計のテーブルを追加する
+  if (!exec(std::string{schema_rollup})) {
+    M5_LOGE("create table error");
+    transaction.abort();
+    return false;
+  }
+  //
+  if (!exec("PRAGMA user_version = " + std::to_string(SCHEMA_VERSION) + ";")) {
+    transaction.abort();
+    return false;
+  }
+  if (!transaction.commit()) {
+    M5_LOGE("upgrade schema commit failure.");
+    return false;
+  }
+  // 前からあるファイルはVACUUMで作り直すまでauto_vacuumが変わらない
+  // (incremental(2)でなければincremental_vacuumで空いたページを返せない)
+  int auto_vacuum{0};
+  {
+    Sqlite3StmtPointerCached stmt{
+        prepare_cached_statement("PRAGMA auto_vacuum;")};
+    if (!stmt || sqlite3_step(stmt.get()) != SQLITE_ROW) {
       M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
       return false;
     }
+    auto_vacuum = sqlite3_column_int(stmt.get(), 0);
+  }
+  if (auto_vacuum != 2) {
+    M5_LOGI("vacuum to change auto_vacuum from %d to incremental",
+            auto_vacuum);
+    // 失敗しても測定値はそのまま使える
+    if (!exec("VACUUM;")) {
+      M5_LOGW("vacuum failure; free pages are kept in the file");
+    }
   }
-
   return true;
 }
 
 //
-Database::ErrorString Database::save_to_file(std::string_view to_file_path) {
-  // guard
-  if (!_sqlite3_db) {
-    M5_LOGI("sqlite3_db is not available.");
-    return std::make_optional("sqlite3_db is not available.");
+bool Database::table_exists(std::string_view name) {
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      "SELECT name FROM sqlite_master WHERE type='table' AND name=?;")};
+  if (!stmt) {
+    return false;
+  }
+  if (sqlite3_bind_text(stmt.get(), 1, name.data(), name.size(),
+                        SQLITE_STATIC) != SQLITE_OK) {
+    return false;
   }
+  return sqlite3_step(stmt.get()) == SQLITE_ROW;
+}
 
-  // Open a new one
-  Sqlite3PointerUnique dst_database;
-  {
-    sqlite3 *db{nullptr};
-    auto rc = sqlite3_open(to_file_path.data(), &db);
-    // set db handle to smartpointer
-    dst_database.reset(db);
-    if (rc != SQLITE_OK) {
-      M5_LOGE("destination file open error");
-      return std::make_optional(sqlite3_errstr(rc));
+//
+// 古い測定値を消す
+// 一度に消す行数を抑えて, 消し残しは次の呼び出しで消す
+//
+std::optional<Database::RetentionResult>
+Database::delete_old_measurements_from_database(
+    system_clock::time_point delete_of_older_than_tp) {
+  Lock lock{_mutex};
+  // テーブル毎に(sensor_id, at)で消す行を選ぶ
+  // (prepare_cached_statementのキーになるので静的な記憶域に置く)
+  static const auto measurement_queries = [] {
+    std::array<std::string, std::size(measurement_tables)> queries{};
+    for (size_t i = 0; i < queries.size(); ++i) {
+      std::string name{measurement_tables[i].name};
+      queries[i] = "DELETE FROM " + name +
+                   " WHERE (sensor_id,at) IN (SELECT sensor_id,at FROM " +
+                   name + " WHERE at < ? LIMIT ?);"; // placeholder#1, #2
     }
+    return queries;
+  }();
+  constexpr static std::string_view query_delete_rollup_hourly{
+      "DELETE FROM rollup_hourly WHERE (metric,sensor_id,at) IN"
+      " (SELECT metric,sensor_id,at FROM rollup_hourly"
+      " WHERE at < ? LIMIT ?);" // placeholder#1, #2
+  };
+  constexpr static std::string_view query_delete_rollup_daily{
+      "DELETE FROM rollup_daily WHERE (metric,sensor_id,at) IN"
+      " (SELECT metric,sensor_id,at FROM rollup_daily"
+      " WHERE at < ? LIMIT ?);" // placeholder#1, #2
+  };
+
+  Diagnostics::ScopedTimer timer{Diagnostics::Probe::DatabaseRetention};
+  // guard
+  if (!_sqlite3_db) {
+    M5_LOGI("sqlite3_db is not available.");
+    return std::nullopt;
   }
-  if (!dst_database) {
-    M5_LOGE("nullptr");
-    return std::make_optional("nullptr");
+  // 書き戻し中は消さずに次の呼び出しに回す
+  if (importing()) {
+    return RetentionResult{
+        .deleted_rows = 0, .reclaimed_bytes = 0, .completed = false};
   }
-  // Backup
-  std::shared_ptr<sqlite3_backup> backup;
-  backup.reset(sqlite3_backup_init(dst_database.get(), "main",
-                                   _sqlite3_db.get(), "main"),
-               sqlite3_backup_finish);
-  if (backup) {
-    // Loop
-    while (sqlite3_backup_step(backup.get(), 1) != SQLITE_DONE) {
-      std::this_thread::yield();
+
+  struct Target {
+    std::string_view query;
+    system_clock::time_point older_than;
+  };
+  std::vector<Target> targets{};
+  if (_measurement_store) {
+    if (!_measurement_store->delete_older_than(delete_of_older_than_tp)) {
+      return std::nullopt;
     }
-  }
-  // Done
-  if (auto rc = sqlite3_errcode(dst_database.get()); rc == SQLITE_OK) {
-    return std::nullopt; // OK
   } else {
-    return std::make_optional(sqlite3_errstr(rc));
+    for (const auto &query : measurement_queries) {
+      targets.push_back({query, delete_of_older_than_tp});
+    }
   }
-}
+  // 集計は測定値より長く残す
+  targets.push_back({query_delete_rollup_hourly,
+                     delete_of_older_than_tp - ROLLUP_HOURLY_RETENTION});
+  targets.push_back({query_delete_rollup_daily,
+                     delete_of_older_than_tp - ROLLUP_DAILY_RETENTION});
 
-//
-Database::ErrorString
-Database::restore_from_file(std::string_view from_file_path) {
-  // guard
-  if (!_sqlite3_db) {
-    M5_LOGI("sqlite3_db is not available.");
-    return std::make_optional("sqlite3_db is not available.");
+  auto page_count = [this]() -> std::optional<int64_t> {
+    Sqlite3StmtPointerCached stmt{
+        prepare_cached_statement("PRAGMA page_count;")};
+    if (!stmt || sqlite3_step(stmt.get()) != SQLITE_ROW) {
+      M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+      return std::nullopt;
+    }
+    return sqlite3_column_int64(stmt.get(), 0);
+  };
+  auto pages_before = page_count();
+  if (!pages_before) {
+    return std::nullopt;
   }
 
-  // Open a new one
-  Sqlite3PointerUnique src_database;
-  {
-    sqlite3 *db{nullptr};
-    auto rc = sqlite3_open(from_file_path.data(), &db);
-    // set db handle to smartpointer
-    src_database.reset(db);
-    if (rc != SQLITE_OK) {
-      M5_LOGE("destination file open error");
-      return std::make_optional(sqlite3_errstr(rc));
+  // 1つのDELETEが1つのトランザクションになる
+  RetentionResult result{.deleted_rows = 0,
+                         .reclaimed_bytes = 0,
+                         .completed = true};
+  size_t budget{RETENTION_CHUNK_ROWS};
+  for (const auto &target : targets) {
+    if (budget == 0) {
+      result.completed = false;
+      break;
+    }
+    //
+    Sqlite3StmtPointerCached stmt{prepare_cached_statement(target.query)};
+    if (!stmt) {
+      return std::nullopt;
+    }
+    if (sqlite3_bind_int64(stmt.get(), 1,
+                           static_cast<int64_t>(system_clock::to_time_t(
+                               target.older_than))) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt.get(), 2, budget) != SQLITE_OK) {
+      M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+      return std::nullopt;
+    }
+    // SQL表示(デバッグ用)
+    if (log_enabled(ESP_LOG_DEBUG)) {
+      if (auto p = sqlite3_expanded_sql(stmt.get()); p) {
+        M5_LOGD("%s", p);
+        sqlite3_free(p);
+      }
+    }
+    if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+      M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+      return std::nullopt;
     }
+    auto deleted = static_cast<size_t>(sqlite3_changes(_sqlite3_db.get()));
+    result.deleted_rows += deleted;
+    budget -= std::min(budget, deleted);
   }
-  if (!src_database) {
-    M5_LOGE("nullptr");
-    return std::make_optional("nullptr");
+  // 予算を使い切ったなら消し残しがあるかもしれない
+  if (budget == 0) {
+    result.completed = false;
   }
-  // Backup
-  std::shared_ptr<sqlite3_backup> backup;
-  backup.reset(sqlite3_backup_init(_sqlite3_db.get(), "main",
-                                   src_database.get(), "main"),
-               sqlite3_backup_finish);
-  if (backup) {
-    // Loop
-    while (sqlite3_backup_step(backup.get(), 1) != SQLITE_DONE) {
-      std::this_thread::yield();
+
+  // 空いたページを返す(auto_vacuum = incremental)
+  if (result.deleted_rows > 0) {
+    if (char *error_msg{nullptr};
+        sqlite3_exec(_sqlite3_db.get(), "PRAGMA incremental_vacuum;", nullptr,
+                     nullptr, &error_msg) != SQLITE_OK) {
+      if (error_msg) {
+        M5_LOGE("%s", error_msg);
+      }
+      sqlite3_free(error_msg);
+      return std::nullopt;
+    }
+    auto pages_after = page_count();
+    Sqlite3StmtPointerCached stmt{
+        prepare_cached_statement("PRAGMA page_size;")};
+    if (pages_after && stmt && sqlite3_step(stmt.get()) == SQLITE_ROW &&
+        *pages_before > *pages_after) {
+      result.reclaimed_bytes = (*pages_before - *pages_after) *
+                               sqlite3_column_int64(stmt.get(), 0);
     }
   }
-  // Done
-  if (auto rc = sqlite3_errcode(_sqlite3_db.get()); rc == SQLITE_OK) {
-    return std::nullopt; // OK
-  } else {
-    return std::make_optional(sqlite3_errstr(rc));
-  }
+  M5_LOGI("deleted %u rows, reclaimed %u bytes%s",
+          static_cast<unsigned>(result.deleted_rows),
+          static_cast<unsigned>(result.reclaimed_bytes),
+          result.completed ? "" : " (continued)");
+  return result;
 }
 
 //
+// 1時間毎と1日毎の集計
+//
+// 同じ区間の集計があれば足し合わせる
+constexpr static std::string_view query_upsert_rollup_hourly{
+    "INSERT INTO"
+    " rollup_hourly(metric,sensor_id,at,samples,minimum,total,maximum)"
+    " VALUES(?,?,?,?,?,?,?)" // values#1 - values#7
+    " ON CONFLICT(metric,sensor_id,at) DO UPDATE SET"
+    " samples=samples+excluded.samples"
+    ",minimum=min(minimum,excluded.minimum)"
+    ",total=total+excluded.total"
+    ",maximum=max(maximum,excluded.maximum);"};
+constexpr static std::string_view query_upsert_rollup_daily{
+    "INSERT INTO"
+    " rollup_daily(metric,sensor_id,at,samples,minimum,total,maximum)"
+    " VALUES(?,?,?,?,?,?,?)" // values#1 - values#7
+    " ON CONFLICT(metric,sensor_id,at) DO UPDATE SET"
+    " samples=samples+excluded.samples"
+    ",minimum=min(minimum,excluded.minimum)"
+    ",total=total+excluded.total"
+    ",maximum=max(maximum,excluded.maximum);"};
+
+//
+struct Database::Accumulator {
+  uint32_t samples{0};
+  double minimum{0.0};
+  double total{0.0};
+  double maximum{0.0};
+  //
+  void push(double value) {
+    minimum = samples == 0 ? value : std::min(minimum, value);
+    maximum = samples == 0 ? value : std::max(maximum, value);
+    total += value;
+    ++samples;
+  }
+};
+
 //
+bool Database::accumulate_store_rows(
+    system_clock::time_point from, system_clock::time_point until,
+    std::map<RollupKey, Accumulator> &hourly) {
+  auto accumulate = [&hourly, until](Table table, SensorId sensor_id,
+                                     system_clock::time_point at,
+                                     double value) -> bool {
+    if (at >= until) {
+      return true; // 終わっていない時間は次に回す
+    }
+    hourly[RollupKey{table, sensor_id, floor<hours>(at)}].push(value);
+    return true;
+  };
+  // 最後に入れた時刻の測定値を返す近道を通らずに保存先から読む
+  const std::tuple<system_clock::time_point, OrderBy> placeholder{
+      from, OrderByAtAsc};
+  for (auto table :
+       {Table::Temperature, Table::RelativeHumidity, Table::Pressure}) {
+    if (!_measurement_store->read(
+            table, placeholder,
+            ReadCallback<TimePointAndDouble>{
+                [&accumulate, table](size_t, TimePointAndDouble item) -> bool {
+                  auto &[sensor_id, at, value] = item;
+                  return accumulate(table, sensor_id, at, value);
+                }})) {
+      return false;
+    }
+  }
+  for (auto table : {Table::CarbonDioxide, Table::TotalVoc}) {
+    if (!_measurement_store->read(
+            table, placeholder,
+            ReadCallback<TimePointAndUInt16>{
+                [&accumulate, table](size_t, TimePointAndUInt16 item) -> bool {
+                  auto &[sensor_id, at, value] = item;
+                  return accumulate(table, sensor_id, at, value);
+                }})) {
+      return false;
+    }
+  }
+  return true;
+}
+
 //
-bool Database::insert(const Sensor::MeasurementBme280 &m) {
+bool Database::rollup_measurements(system_clock::time_point now) {
+  Lock lock{_mutex};
   // guard
   if (!_sqlite3_db) {
     M5_LOGI("sqlite3_db is not available.");
     return false;
   }
+  // 書き戻し中のテーブルは読まずに, 書き戻した後で畳み込む
+  if (importing()) {
+    return true;
+  }
+  // 終わった時間だけを畳み込む
+  const auto until = floor<hours>(now);
+  auto watermark = read_rollup_watermark();
+  if (!watermark) {
+    return false;
+  }
+  if (*watermark >= until) {
+    return true; // nothing to do
+  }
+
+  // (項目, センサーID, 時間)毎に集める
+  std::map<RollupKey, Accumulator> hourly{};
+  if (_measurement_store) {
+    if (!accumulate_store_rows(*watermark, until, hourly)) {
+      return false;
+    }
+  } else {
+    // 畳み込み専用のクエリで集計する
+    // (グラフが読んでいるステートメントを借りない)
+    static const auto rollup_queries = [] {
+      std::array<std::string, std::size(measurement_tables)> queries{};
+      for (size_t i = 0; i < queries.size(); ++i) {
+        // 3番目の列が測定値
+        std::string_view columns{measurement_tables[i].columns};
+        auto first = columns.find(',', columns.find(',') + 1) + 1;
+        std::string value{
+            columns.substr(first, columns.find(',', first) - first)};
+        std::string hour{"at-at%3600"};
+        queries[i] = "SELECT sensor_id," + hour + ",COUNT(*),MIN(" + value +
+                     "),SUM(" + value + "),MAX(" + value + ") FROM " +
+                     std::string{measurement_tables[i].name} +
+                     " WHERE at >= ? AND at < ?" // placeholder#1, #2
+                     " GROUP BY sensor_id," +
+                     hour + ";";
+      }
+      return queries;
+    }();
+    for (size_t i = 0; i < rollup_queries.size(); ++i) {
+      Sqlite3StmtPointerCached stmt{
+          prepare_cached_statement(rollup_queries[i])};
+      if (!stmt) {
+        return false;
+      }
+      if (sqlite3_bind_int64(stmt.get(), 1,
+                             static_cast<int64_t>(system_clock::to_time_t(
+                                 *watermark))) != SQLITE_OK ||
+          sqlite3_bind_int64(stmt.get(), 2,
+                             static_cast<int64_t>(
+                                 system_clock::to_time_t(until))) !=
+              SQLITE_OK) {
+        M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+        return false;
+      }
+      int code{SQLITE_ROW};
+      while ((code = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+        SensorId sensor_id = sqlite3_column_int64(stmt.get(), 0);
+        auto at =
+            system_clock::from_time_t(sqlite3_column_int64(stmt.get(), 1));
+        auto samples =
+            static_cast<uint32_t>(sqlite3_column_int64(stmt.get(), 2));
+        // measurement_tablesはTableの順に並んでいる
+        hourly[RollupKey{static_cast<Table>(i), sensor_id, at}] = Accumulator{
+            .samples = samples,
+            .minimum = sqlite3_column_double(stmt.get(), 3),
+            .total = sqlite3_column_double(stmt.get(), 4),
+            .maximum = sqlite3_column_double(stmt.get(), 5),
+        };
+      }
+      if (code != SQLITE_DONE) {
+        M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+        return false;
+      }
+    }
+  }
 
+  //
   Transaction transaction{_sqlite3_db};
   if (!transaction.begin()) {
     return false;
   }
+  for (const auto &[key, accumulator] : hourly) {
+    auto &[table, sensor_id, at] = key;
+    if (!upsert_rollup(query_upsert_rollup_hourly, table, sensor_id, at,
+                       accumulator) ||
+        !upsert_rollup(query_upsert_rollup_daily, table, sensor_id,
+                       floor<Days>(at), accumulator)) {
+      transaction.abort();
+      return false;
+    }
+  }
+  if (!write_rollup_watermark(until)) {
+    transaction.abort();
+    return false;
+  }
+  if (!transaction.commit()) {
+    return false;
+  }
+  M5_LOGI("rollup %u rows.", static_cast<unsigned>(hourly.size()));
+  _rollup_generation++;
+  return true;
+}
 
-  const auto &[timepoint, it] = m;
-  const auto sensorid = SensorId{it.sensor_descriptor};
+//
+std::optional<Database::system_clock::time_point>
+Database::read_rollup_watermark() {
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      "SELECT at FROM rollup_watermark WHERE id = 0;")};
+  if (!stmt) {
+    return std::nullopt;
+  }
+  switch (sqlite3_step(stmt.get())) {
+  case SQLITE_ROW:
+    return system_clock::from_time_t(sqlite3_column_int64(stmt.get(), 0));
+  case SQLITE_DONE:
+    return system_clock::time_point{}; // まだ畳み込んでいない
+  default:
+    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+    return std::nullopt;
+  }
+}
 
-  if (!insert_temperature(sensorid, timepoint, it.temperature)) {
-    M5_LOGE("insert_temperature() failure.");
+//
+bool Database::write_rollup_watermark(system_clock::time_point at) {
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      "INSERT OR REPLACE INTO rollup_watermark(id,at) VALUES(0,?);")};
+  if (!stmt) {
     return false;
   }
-
-  if (!insert_pressure(sensorid, timepoint, it.pressure)) {
-    M5_LOGE("insert_pressure() failure.");
+  if (sqlite3_bind_int64(stmt.get(), 1,
+                         static_cast<int64_t>(system_clock::to_time_t(at))) !=
+      SQLITE_OK) {
     return false;
   }
-
-  if (!insert_relative_humidity(sensorid, timepoint, it.relative_humidity)) {
-    M5_LOGE("insert_relative_humidity() failure.");
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
     return false;
   }
+  return true;
+}
 
-  _latestMeasurementBme280 = m;
-  M5_LOGD("insert Bme280 is success.");
+//
+bool Database::upsert_rollup(std::string_view query, Table table,
+                             SensorId sensor_id, system_clock::time_point at,
+                             const Accumulator &accumulator) {
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(query)};
+  if (!stmt) {
+    return false;
+  }
+  if (sqlite3_bind_int(stmt.get(), 1, static_cast<int>(table)) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt.get(), 2, sensor_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt.get(), 3,
+                         static_cast<int64_t>(system_clock::to_time_t(at))) !=
+          SQLITE_OK ||
+      sqlite3_bind_int64(stmt.get(), 4, accumulator.samples) != SQLITE_OK ||
+      sqlite3_bind_double(stmt.get(), 5, accumulator.minimum) != SQLITE_OK ||
+      sqlite3_bind_double(stmt.get(), 6, accumulator.total) != SQLITE_OK ||
+      sqlite3_bind_double(stmt.get(), 7, accumulator.maximum) != SQLITE_OK) {
+    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+    return false;
+  }
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+    return false;
+  }
   return true;
 }
 
 //
+size_t
+Database::read_aggregates(Resolution resolution, Table table, OrderBy order,
+                          system_clock::time_point at_begin,
+                          ReadCallback<TimePointAndAggregate> callback) {
+  Lock lock{_mutex};
+  constexpr static std::string_view query_hourly[] = {
+      // OrderByAtAsc
+      {"SELECT sensor_id,at,samples,minimum,total,maximum"
+       " FROM rollup_hourly WHERE metric = ? AND at >= ? ORDER BY at ASC;"},
+      // OrderByAtDesc
+      {"SELECT sensor_id,at,samples,minimum,total,maximum"
+       " FROM rollup_hourly WHERE metric = ? AND at >= ? ORDER BY at DESC;"},
+  };
+  constexpr static std::string_view query_daily[] = {
+      // OrderByAtAsc
+      {"SELECT sensor_id,at,samples,minimum,total,maximum"
+       " FROM rollup_daily WHERE metric = ? AND at >= ? ORDER BY at ASC;"},
+      // OrderByAtDesc
+      {"SELECT sensor_id,at,samples,minimum,total,maximum"
+       " FROM rollup_daily WHERE metric = ? AND at >= ? ORDER BY at DESC;"},
+  };
+  // guard
+  if (!_sqlite3_db) {
+    M5_LOGI("sqlite3_db is not available.");
+    return 0;
+  }
+  // 書き戻し中の集計は読まない
+  if (importing()) {
+    return 0;
+  }
+  auto query = resolution == Resolution::Hourly ? query_hourly[order]
+                                                : query_daily[order];
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(query)};
+  if (!stmt) {
+    return 0;
+  }
+  if (sqlite3_bind_int(stmt.get(), 1, static_cast<int>(table)) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt.get(), 2,
+                         static_cast<int64_t>(system_clock::to_time_t(
+                             at_begin))) != SQLITE_OK) {
+    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
+    return 0;
+  }
+  //
+  size_t counter{1}; // 1 start
+  while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+    SensorId sensor_id = sqlite3_column_int64(stmt.get(), 0);
+    auto at = system_clock::from_time_t(sqlite3_column_int64(stmt.get(), 1));
+    auto samples = static_cast<uint32_t>(sqlite3_column_int64(stmt.get(), 2));
+    Aggregate aggregate{
+        .samples = samples,
+        .min = sqlite3_column_double(stmt.get(), 3),
+        .mean = samples > 0 ? sqlite3_column_double(stmt.get(), 4) / samples
+                            : 0.0,
+        .max = sqlite3_column_double(stmt.get(), 5),
+    };
+    if (callback(counter, TimePointAndAggregate{sensor_id, at, aggregate}) ==
+        false) {
+      break;
+    }
+    counter++;
+  }
+  return counter;
+}
+
 //
+// 集計をファイルに写して再起動しても残す
 //
-bool Database::insert(const Sensor::MeasurementSgp30 &m) {
+std::optional<Database::system_clock::time_point> Database::rollup_watermark() {
+  Lock lock{_mutex};
   // guard
   if (!_sqlite3_db) {
     M5_LOGI("sqlite3_db is not available.");
-    return false;
+    return std::nullopt;
+  }
+  // 書き戻し中の集計は読まない
+  if (importing()) {
+    return std::nullopt;
   }
+  return read_rollup_watermark();
+}
 
-  Transaction transaction{_sqlite3_db};
-  if (!transaction.begin()) {
+//
+bool Database::read_rollups(ReadCallback<RollupRow> callback) {
+  Lock lock{_mutex};
+  constexpr static std::pair<Resolution, std::string_view> queries[] = {
+      {Resolution::Hourly,
+       "SELECT metric,sensor_id,at,samples,minimum,total,maximum"
+       " FROM rollup_hourly;"},
+      {Resolution::Daily,
+       "SELECT metric,sensor_id,at,samples,minimum,total,maximum"
+       " FROM rollup_daily;"},
+  };
+  // guard
+  if (!_sqlite3_db) {
+    M5_LOGI("sqlite3_db is not available.");
     return false;
   }
-
-  const auto &[timepoint, it] = m;
-  const auto sensorid = SensorId{it.sensor_descriptor};
-
-  {
-    std::optional<uint16_t> tvoc_base =
-        it.tvoc_baseline ? std::make_optional(it.tvoc_baseline->value)
-                         : std::nullopt;
-    if (!insert_total_voc(sensorid, timepoint, it.tvoc, tvoc_base)) {
-      M5_LOGE("insert_total_voc() failure.");
+  // 書き戻し中の集計は読まない
+  if (importing()) {
+    return false;
+  }
+  size_t counter{1}; // 1 start
+  for (const auto &[resolution, query] : queries) {
+    Sqlite3StmtPointerCached stmt{prepare_cached_statement(query)};
+    if (!stmt) {
       return false;
     }
-  }
-  {
-    std::optional<uint16_t> eco2_base =
-        it.eCo2_baseline ? std::make_optional(it.eCo2_baseline->value)
-                         : std::nullopt;
-    if (!insert_carbon_dioxide(sensorid, timepoint, it.eCo2, eco2_base)) {
-      M5_LOGE("insert_carbon_dioxide() failure.");
+    int code{SQLITE_ROW};
+    while ((code = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+      RollupRow row{
+          .resolution = resolution,
+          .table = static_cast<Table>(sqlite3_column_int(stmt.get(), 0)),
+          .sensor_id = static_cast<SensorId>(
+              sqlite3_column_int64(stmt.get(), 1)),
+          .at =
+              system_clock::from_time_t(sqlite3_column_int64(stmt.get(), 2)),
+          .samples =
+              static_cast<uint32_t>(sqlite3_column_int64(stmt.get(), 3)),
+          .minimum = sqlite3_column_double(stmt.get(), 4),
+          .total = sqlite3_column_double(stmt.get(), 5),
+          .maximum = sqlite3_column_double(stmt.get(), 6),
+      };
+      if (callback(counter, row) == false) {
+        return false;
+      }
+      counter++;
+    }
+    if (code != SQLITE_DONE) {
+      M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
       return false;
     }
   }
-
-  _latestMeasurementSgp30 = m;
-  M5_LOGI("insert Sgp30 is success.");
   return true;
 }
 
 //
-//
-//
-bool Database::insert(const Sensor::MeasurementScd30 &m) {
+bool Database::restore_rollups(system_clock::time_point watermark,
+                               const std::vector<RollupRow> &rows) {
+  Lock lock{_mutex};
+  // 足し合わせずに置き換える
+  constexpr static std::string_view query_replace_rollup_hourly{
+      "INSERT OR REPLACE INTO"
+      " rollup_hourly(metric,sensor_id,at,samples,minimum,total,maximum)"
+      " VALUES(?,?,?,?,?,?,?);"}; // values#1 - values#7
+  constexpr static std::string_view query_replace_rollup_daily{
+      "INSERT OR REPLACE INTO"
+      " rollup_daily(metric,sensor_id,at,samples,minimum,total,maximum)"
+      " VALUES(?,?,?,?,?,?,?);"}; // values#1 - values#7
   // guard
   if (!_sqlite3_db) {
     M5_LOGI("sqlite3_db is not available.");
     return false;
   }
-
+  if (importing()) {
+    return false;
+  }
+  //
   Transaction transaction{_sqlite3_db};
   if (!transaction.begin()) {
     return false;
   }
-
-  const auto &[timepoint, it] = m;
-  const auto sensorid = SensorId{it.sensor_descriptor};
-
-  if (!insert_temperature(sensorid, timepoint, it.temperature)) {
-    M5_LOGE("insert_temperature() failure.");
+  for (const auto &row : rows) {
+    auto query = row.resolution == Resolution::Hourly
+                     ? query_replace_rollup_hourly
+                     : query_replace_rollup_daily;
+    Accumulator accumulator{
+        .samples = row.samples,
+        .minimum = row.minimum,
+        .total = row.total,
+        .maximum = row.maximum,
+    };
+    if (!upsert_rollup(query, row.table, row.sensor_id, row.at,
+                       accumulator)) {
+      transaction.abort();
+      return false;
+    }
+  }
+  // 書き戻した集計に入っている測定値は二度畳み込まない
+  if (!write_rollup_watermark(watermark)) {
+    transaction.abort();
     return false;
   }
-
-  if (!insert_relative_humidity(sensorid, timepoint, it.relative_humidity)) {
-    M5_LOGE("insert_relative_humidity() failure.");
+  if (!transaction.commit()) {
     return false;
   }
+  _rollup_generation++;
+  return true;
+}
 
-  if (!insert_carbon_dioxide(sensorid, timepoint, it.co2, std::nullopt)) {
-    M5_LOGE("insert_carbon_dioxide() failure.");
-    return false;
+//
+// 書き出しと書き戻しは少しずつ進める関数を最後まで回す
+// (一歩ごとに1tick休んで低い優先度のタスクにも譲る)
+//
+Database::ErrorString Database::save_to_file(std::string_view to_file_path) {
+  Lock lock{_mutex};
+  if (auto error = begin_transfer(TransferKind::ExportDatabase, to_file_path);
+      error) {
+    return error;
+  }
+  while (transferring()) {
+    if (auto error = step_transfer(); error) {
+      return error;
+    }
+    vTaskDelay(1);
   }
+  return std::nullopt; // OK
+}
 
-  _latestMeasurementScd30 = m;
-  M5_LOGI("insert Scd30 is success.");
-  return true;
+//
+Database::ErrorString
+Database::restore_from_file(std::string_view from_file_path) {
+  Lock lock{_mutex};
+  if (auto error =
+          begin_transfer(TransferKind::ImportDatabase, from_file_path);
+      error) {
+    return error;
+  }
+  while (transferring()) {
+    if (auto error = step_transfer(); error) {
+      return error;
+    }
+    vTaskDelay(1);
+  }
+  return std::nullopt; // OK
 }
 
 //
 //
 //
-bool Database::insert(const Sensor::MeasurementScd41 &m) {
+void Database::Sqlite3BackupDeleter::operator()(sqlite3_backup *ptr) const {
+  // 終わる前に後始末すると書き込み先は元のまま
+  if (auto result = sqlite3_backup_finish(ptr); result != SQLITE_OK) {
+    M5_LOGE("sqlite3_backup_finish() failure: %d", result);
+  }
+}
+
+//
+//
+//
+void Database::FileCloser::operator()(std::FILE *ptr) const {
+  if (std::fclose(ptr) != 0) {
+    M5_LOGE("fclose() failure");
+  }
+}
+
+//
+Database::ErrorString Database::begin_transfer(TransferKind kind,
+                                               std::string_view file_path) {
+  Lock lock{_mutex};
+  // テーブル毎の行数(CSVの進み具合に使う)
+  static const auto count_queries = [] {
+    std::array<std::string, std::size(measurement_tables)> queries{};
+    for (size_t i = 0; i < queries.size(); ++i) {
+      queries[i] = "SELECT COUNT(*) FROM " +
+                   std::string{measurement_tables[i].name} + ";";
+    }
+    return queries;
+  }();
+
   // guard
   if (!_sqlite3_db) {
     M5_LOGI("sqlite3_db is not available.");
+    return std::make_optional("sqlite3_db is not available.");
+  }
+  if (_transfer) {
+    return std::make_optional("transfer is already in progress.");
+  }
+
+  _transfer.reset(new Transfer{kind, {}, {}, {}, 0, std::nullopt, 0, 0});
+  // Open a new one
+  if (kind == TransferKind::ExportCsv) {
+    _transfer->csv_file.reset(std::fopen(file_path.data(), "w"));
+    if (!_transfer->csv_file) {
+      M5_LOGE("destination file open error");
+      _transfer.reset();
+      return std::make_optional("file open error");
+    }
+  } else {
+    sqlite3 *db{nullptr};
+    auto rc = sqlite3_open(file_path.data(), &db);
+    // set db handle to smartpointer
+    _transfer->file_db.reset(db);
+    if (rc != SQLITE_OK) {
+      M5_LOGE("file open error");
+      _transfer.reset();
+      return std::make_optional(sqlite3_errstr(rc));
+    }
+  }
+  // 保存先の測定値をSQLiteのテーブルに写してから書き出す
+  if (kind != TransferKind::ImportDatabase && _measurement_store &&
+      !copy_store_to_tables()) {
+    cancel_transfer();
+    return std::make_optional("copy to tables failure");
+  }
+  //
+  switch (kind) {
+  case TransferKind::ExportDatabase:
+    _transfer->backup.reset(sqlite3_backup_init(
+        _transfer->file_db.get(), "main", _sqlite3_db.get(), "main"));
+    if (!_transfer->backup) {
+      std::string error{sqlite3_errmsg(_transfer->file_db.get())};
+      cancel_transfer();
+      return std::make_optional(error);
+    }
+    break;
+  case TransferKind::ImportDatabase:
+    // 書き戻すデーターベースのステートメントは使えなくなるので破棄する
+    _statement_cache.clear();
+    // 最後に入れた時刻の測定値も使えなくなる
+    _latest_tick_stale = true;
+    _transfer->backup.reset(sqlite3_backup_init(
+        _sqlite3_db.get(), "main", _transfer->file_db.get(), "main"));
+    if (!_transfer->backup) {
+      std::string error{sqlite3_errmsg(_sqlite3_db.get())};
+      cancel_transfer();
+      return std::make_optional(error);
+    }
+    break;
+  case TransferKind::ExportCsv:
+    for (const auto &query : count_queries) {
+      Sqlite3StmtPointerCached stmt{prepare_cached_statement(query)};
+      if (!stmt || sqlite3_step(stmt.get()) != SQLITE_ROW) {
+        std::string error{sqlite3_errmsg(_sqlite3_db.get())};
+        M5_LOGE("%s", error.c_str());
+        stmt.reset();
+        cancel_transfer();
+        return std::make_optional(error);
+      }
+      _transfer->csv_rows_total += sqlite3_column_int(stmt.get(), 0);
+    }
+    if (std::fputs("table,sensor,at,value,baseline\n",
+                   _transfer->csv_file.get()) < 0) {
+      cancel_transfer();
+      return std::make_optional("file write error");
+    }
+    break;
+  }
+  return std::nullopt; // OK
+}
+
+//
+Database::ErrorString Database::step_transfer(int pages) {
+  Lock lock{_mutex};
+  // guard
+  if (!_transfer) {
+    return std::make_optional("transfer is not in progress.");
+  }
+  if (_transfer->kind == TransferKind::ExportCsv) {
+    return step_csv_transfer(pages);
+  }
+  switch (auto rc = sqlite3_backup_step(_transfer->backup.get(), pages); rc) {
+  case SQLITE_OK:
+    [[fallthrough]];
+  case SQLITE_BUSY:
+    [[fallthrough]];
+  case SQLITE_LOCKED:
+    return std::nullopt; // 次の呼び出しで続ける
+  case SQLITE_DONE:
+    return finish_transfer();
+  default:
+    M5_LOGE("sqlite3_backup_step() failure: %d", rc);
+    cancel_transfer();
+    return std::make_optional(sqlite3_errstr(rc));
+  }
+}
+
+//
+void Database::cancel_transfer() {
+  Lock lock{_mutex};
+  if (!_transfer) {
+    return;
+  }
+  auto kind = _transfer->kind;
+  _transfer.reset();
+  // 書き出すために写したテーブルは空に戻す
+  if (kind != TransferKind::ImportDatabase && _measurement_store) {
+    clear_tables();
+  }
+}
+
+//
+std::optional<Database::TransferStatus> Database::transfer_status() const {
+  Lock lock{_mutex};
+  if (!_transfer) {
+    return std::nullopt;
+  }
+  if (auto backup = _transfer->backup.get(); backup) {
+    // 最初のstep_transferまでは両方とも0
+    return TransferStatus{_transfer->kind, sqlite3_backup_remaining(backup),
+                          sqlite3_backup_pagecount(backup)};
+  }
+  return TransferStatus{_transfer->kind,
+                        _transfer->csv_rows_total -
+                            _transfer->csv_rows_written,
+                        _transfer->csv_rows_total};
+}
+
+//
+Database::ErrorString Database::finish_transfer() {
+  auto kind = _transfer->kind;
+  int rc{SQLITE_OK};
+  if (auto backup = _transfer->backup.release(); backup) {
+    rc = sqlite3_backup_finish(backup);
+  }
+  bool file_error{false};
+  if (auto file = _transfer->csv_file.release(); file) {
+    file_error = std::fclose(file) != 0;
+  }
+  _transfer.reset();
+  //
+  if (kind != TransferKind::ImportDatabase) {
+    if (_measurement_store) {
+      clear_tables();
+    }
+    if (file_error) {
+      return std::make_optional("file write error");
+    }
+    return rc == SQLITE_OK ? std::nullopt
+                           : std::make_optional(sqlite3_errstr(rc));
+  }
+  // Done
+  if (rc != SQLITE_OK) {
+    return std::make_optional(sqlite3_errstr(rc));
+  }
+  // 古いスキーマのファイルなら移行する
+  if (!upgrade_schema()) {
+    return std::make_optional("schema upgrade failure");
+  }
+  // 書き戻したテーブルの測定値を保存先に写す
+  if (_measurement_store) {
+    bool success = copy_tables_to_store();
+    clear_tables();
+    if (!success) {
+      return std::make_optional("copy from tables failure");
+    }
+  }
+  // 書き戻した集計をGUIに読み直させる
+  _rollup_generation++;
+  return std::nullopt; // OK
+}
+
+//
+// テーブル毎に(sensor_id, at)の順で続きの行をCSVに書く
+//
+Database::ErrorString Database::step_csv_transfer(int rows) {
+  // (prepare_cached_statementのキーになるので静的な記憶域に置く)
+  static const auto select_queries = [] {
+    std::array<std::string, std::size(measurement_tables)> queries{};
+    for (size_t i = 0; i < queries.size(); ++i) {
+      queries[i] = "SELECT " + std::string{measurement_tables[i].columns} +
+                   " FROM " + std::string{measurement_tables[i].name} +
+                   " WHERE (sensor_id,at) > (?,?)" // placeholder#1, #2
+                   " ORDER BY sensor_id,at LIMIT ?;"; // placeholder#3
+    }
+    return queries;
+  }();
+
+  auto &transfer = *_transfer;
+  if (transfer.csv_table >= std::size(measurement_tables)) {
+    return finish_transfer();
+  }
+  const auto &table = measurement_tables[transfer.csv_table];
+  auto [last_sensor_id, last_at] = transfer.csv_last_key.value_or(
+      std::make_pair(std::numeric_limits<int64_t>::min(),
+                     std::numeric_limits<int64_t>::min()));
+  int count{0};
+  ErrorString error{};
+  {
+    Sqlite3StmtPointerCached stmt{
+        prepare_cached_statement(select_queries[transfer.csv_table])};
+    if (!stmt || sqlite3_bind_int64(stmt.get(), 1, last_sensor_id) ||
+        sqlite3_bind_int64(stmt.get(), 2, last_at) ||
+        sqlite3_bind_int(stmt.get(), 3, rows)) {
+      error = std::make_optional(sqlite3_errmsg(_sqlite3_db.get()));
+    }
+    int rc{SQLITE_DONE};
+    while (!error && (rc = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+      auto sensor_id = sqlite3_column_int64(stmt.get(), 0);
+      auto at = sqlite3_column_int64(stmt.get(), 1);
+      auto value = sqlite3_column_text(stmt.get(), 2);
+      auto baseline = sqlite3_column_count(stmt.get()) > 3
+                          ? sqlite3_column_text(stmt.get(), 3)
+                          : nullptr;
+      auto descriptor = SensorDescriptor(static_cast<SensorId>(sensor_id));
+      auto iso8601 = isoformat_utc(static_cast<std::time_t>(at));
+      if (std::fprintf(transfer.csv_file.get(), "%s,%s,%s,%s,%s\n",
+                       table.name.data(), descriptor.str().c_str(),
+                       iso8601.data(), value ? (const char *)value : "",
+                       baseline ? (const char *)baseline : "") < 0) {
+        error = std::make_optional("file write error");
+      }
+      transfer.csv_last_key = std::make_pair(sensor_id, at);
+      ++count;
+    }
+    if (!error && rc != SQLITE_DONE) {
+      error = std::make_optional(sqlite3_errmsg(_sqlite3_db.get()));
+    }
+  }
+  if (error) {
+    M5_LOGE("%s", error->c_str());
+    cancel_transfer();
+    return error;
+  }
+  transfer.csv_rows_written += count;
+  // 残りが無ければ次のテーブル
+  if (count < rows) {
+    ++transfer.csv_table;
+    transfer.csv_last_key.reset();
+  }
+  return std::nullopt; // OK
+}
+
+//
+// 保存先の測定値をSQLiteのテーブルに写す
+//
+bool Database::copy_store_to_tables() {
+  if (!_measurement_store || !clear_tables()) {
     return false;
   }
 
@@ -1064,65 +2074,264 @@ bool Database::insert(const Sensor::MeasurementScd41 &m) {
     return false;
   }
 
-  const auto &[timepoint, it] = m;
-  const auto sensorid = SensorId{it.sensor_descriptor};
+  bool success{true};
+  auto all_rows = std::make_tuple(system_clock::time_point{}, OrderByAtAsc);
+  auto double_rows = [this, &success](std::string_view query) {
+    return ReadCallback<TimePointAndDouble>{
+        [this, query, &success](size_t, TimePointAndDouble item) -> bool {
+          return (success = insert_values(query, item));
+        }};
+  };
+  auto int_rows = [this, &success](std::string_view query) {
+    return ReadCallback<TimePointAndIntAndOptInt>{
+        [this, query, &success](size_t, TimePointAndIntAndOptInt item) -> bool {
+          return (success = insert_values(query, item));
+        }};
+  };
+  //
+  _measurement_store->read(Table::Temperature, all_rows,
+                           double_rows(query_insert_temperature));
+  _measurement_store->read(Table::RelativeHumidity, all_rows,
+                           double_rows(query_insert_relative_humidity));
+  _measurement_store->read(Table::Pressure, all_rows,
+                           double_rows(query_insert_pressure));
+  _measurement_store->read(Table::CarbonDioxide, all_rows,
+                           int_rows(query_insert_carbon_dioxide));
+  _measurement_store->read(Table::TotalVoc, all_rows,
+                           int_rows(query_insert_total_voc));
+  return success;
+}
 
-  if (!insert_temperature(sensorid, timepoint, it.temperature)) {
-    M5_LOGE("insert_temperature() failure.");
+//
+// SQLiteのテーブルの測定値を保存先に写す
+//
+bool Database::copy_tables_to_store() {
+  if (!_measurement_store) {
     return false;
   }
+  _measurement_store->clear();
+
+  auto all_rows = std::make_tuple(system_clock::time_point{}, OrderByAtAsc);
+  auto double_rows = [this](Table table) {
+    return ReadCallback<TimePointAndDouble>{
+        [this, table](size_t, TimePointAndDouble item) -> bool {
+          // 保持期間より古い値は捨てられる
+          _measurement_store->insert(table, item);
+          return true;
+        }};
+  };
+  auto int_rows = [this](Table table) {
+    return ReadCallback<TimePointAndIntAndOptInt>{
+        [this, table](size_t, TimePointAndIntAndOptInt item) -> bool {
+          // 保持期間より古い値は捨てられる
+          _measurement_store->insert(table, item);
+          return true;
+        }};
+  };
+  //
+  return read_values(query_select_temperature_at_begin, all_rows,
+                     double_rows(Table::Temperature)) &&
+         read_values(query_select_relative_humidity_at_begin, all_rows,
+                     double_rows(Table::RelativeHumidity)) &&
+         read_values(query_select_pressure_at_begin, all_rows,
+                     double_rows(Table::Pressure)) &&
+         read_values(query_select_carbon_dioxide_at_begin, all_rows,
+                     int_rows(Table::CarbonDioxide)) &&
+         read_values(query_select_total_voc_at_begin, all_rows,
+                     int_rows(Table::TotalVoc));
+}
 
-  if (!insert_relative_humidity(sensorid, timepoint, it.relative_humidity)) {
-    M5_LOGE("insert_relative_humidity() failure.");
+//
+bool Database::clear_tables() {
+  constexpr static std::string_view query{"DELETE FROM temperature;"
+                                          "DELETE FROM relative_humidity;"
+                                          "DELETE FROM pressure;"
+                                          "DELETE FROM carbon_dioxide;"
+                                          "DELETE FROM total_voc;"};
+  // guard
+  if (!_sqlite3_db) {
+    M5_LOGE("sqlite3_db is null");
     return false;
   }
 
-  if (!insert_carbon_dioxide(sensorid, timepoint, it.co2, std::nullopt)) {
-    M5_LOGE("insert_carbon_dioxide() failure.");
+  if (char *error_msg{nullptr};
+      sqlite3_exec(_sqlite3_db.get(), query.data(), nullptr, nullptr,
+                   &error_msg) != SQLITE_OK) {
+    if (error_msg) {
+      M5_LOGE("%s", error_msg);
+    }
+    sqlite3_free(error_msg);
     return false;
   }
-
-  _latestMeasurementScd41 = m;
-  M5_LOGI("insert Scd41 is success.");
   return true;
 }
 
 //
+// 同じ時間に測定した値をまとめて1つのトランザクションで入れる
 //
+struct Database::InsertVisitor {
+  Database &db;
+  system_clock::time_point time_point;
+  InsertVisitor(Database &arg1, system_clock::time_point arg2)
+      : db{arg1}, time_point{arg2} {}
+  // Not Available (N/A)
+  bool operator()(std::monostate) { return true; }
+  //
+  template <typename V> bool operator()(const V &in) {
+    return db.insert_rows(time_point, in);
+  }
+};
+
 //
-bool Database::insert(const Sensor::MeasurementM5Env3 &m) {
+//
+//
+struct Database::PublishVisitor {
+  Database &db;
+  system_clock::time_point time_point;
+  PublishVisitor(Database &arg1, system_clock::time_point arg2)
+      : db{arg1}, time_point{arg2} {}
+  // Not Available (N/A)
+  void operator()(std::monostate) {}
+  //
+  template <typename V> void operator()(const V &in) {
+    std::get<LatestSnapshot<V>>(db._latest_measurements)
+        .publish({time_point, in});
+    db._latest_measurements_generation.fetch_add(1,
+                                                 std::memory_order_release);
+  }
+};
+
+//
+bool Database::insert(system_clock::time_point at,
+                      const std::vector<Sensor::MeasuredValue> &values) {
+  Diagnostics::ScopedTimer timer{Diagnostics::Probe::DatabaseInsert};
+  Lock lock{_mutex};
   // guard
   if (!_sqlite3_db) {
     M5_LOGI("sqlite3_db is not available.");
     return false;
   }
+  if (importing()) {
+    M5_LOGI("database is importing.");
+    return false;
+  }
+
+  // 書き戻した後はそれより前に入れた時刻を信用しない
+  if (_latest_tick_stale.exchange(false)) {
+    _last_inserted_at.reset();
+  }
+  system_clock::time_point at_sec = floor<seconds>(at);
+  _pending_tick = LatestTick{};
+  _pending_tick->valid = _last_inserted_at && *_last_inserted_at < at_sec;
+  _pending_tick->at = at_sec;
+  _pending_tick->previous_at =
+      _last_inserted_at.value_or(system_clock::time_point{});
+
+  _pending_store_rows.clear();
 
   Transaction transaction{_sqlite3_db};
   if (!transaction.begin()) {
+    _pending_tick.reset();
     return false;
   }
-
-  const auto &[timepoint, it] = m;
-  const auto sensorid = SensorId{it.sensor_descriptor};
-
-  if (!insert_temperature(sensorid, timepoint, it.temperature)) {
-    M5_LOGE("insert_temperature() failure.");
+  for (const auto &value : values) {
+    if (!std::visit(InsertVisitor{*this, at}, value)) {
+      // 1つでも失敗したら全部取り消す
+      transaction.abort();
+      _pending_tick.reset();
+      _pending_store_rows.clear();
+      return false;
+    }
+  }
+  if (!transaction.commit()) {
+    M5_LOGE("commit failure.");
+    _pending_tick.reset();
+    _pending_store_rows.clear();
     return false;
   }
+  // COMMITしたので保存先にも入れる
+  // (保持期間より古くて入らない行は保存先に無いだけなので取り消さない)
+  for (const auto &[table, row] : _pending_store_rows) {
+    std::visit(
+        [this, table = table](const auto &values_to_insert) {
+          if (!_measurement_store->insert(table, values_to_insert)) {
+            M5_LOGW("store rejected a row of table %d.",
+                    static_cast<int>(table));
+          }
+        },
+        row);
+  }
+  _pending_store_rows.clear();
+  // COMMITしたので公開する
+  for (const auto &value : values) {
+    std::visit(PublishVisitor{*this, at}, value);
+  }
+  _latest_tick.publish(*_pending_tick);
+  _pending_tick.reset();
+  _last_inserted_at =
+      std::max(_last_inserted_at.value_or(system_clock::time_point{}), at_sec);
+  return true;
+}
 
-  if (!insert_pressure(sensorid, timepoint, it.pressure)) {
-    M5_LOGE("insert_pressure() failure.");
-    return false;
+//
+template <typename V>
+bool Database::insert_rows(system_clock::time_point at, const V &in) {
+  const auto sensorid = SensorId{in.sensor_descriptor};
+  for (const auto &field : Sensor::Traits<V>::fields) {
+    auto baseline = field.baseline ? field.baseline(in) : std::nullopt;
+    if (!insert_field(field.metric, sensorid, at, field.value(in), baseline)) {
+      M5_LOGE("insert %s failure.", field.name);
+      return false;
+    }
   }
+  M5_LOGD("insert %s is success.", Sensor::Traits<V>::name.data());
+  return true;
+}
 
-  if (!insert_relative_humidity(sensorid, timepoint, it.relative_humidity)) {
-    M5_LOGE("insert_relative_humidity() failure.");
+//
+bool Database::insert_field(Table table, SensorId sensor_id,
+                            system_clock::time_point at, double value,
+                            std::optional<uint16_t> baseline) {
+  switch (table) {
+  case Table::Temperature:
+    return insert_temperature(sensor_id, at, DegC(value));
+  case Table::RelativeHumidity:
+    return insert_relative_humidity(sensor_id, at, PctRH(value));
+  case Table::Pressure:
+    return insert_pressure(sensor_id, at, HectoPa(value));
+  case Table::CarbonDioxide:
+    return insert_carbon_dioxide(sensor_id, at,
+                                 Ppm(static_cast<uint16_t>(value)), baseline);
+  case Table::TotalVoc:
+    return insert_total_voc(sensor_id, at, Ppb(static_cast<uint16_t>(value)),
+                            baseline);
+  }
+  return false;
+}
+
+// 待てば済む時(BUSY, LOCKED)だけ繰り返す
+bool Database::step_insert(sqlite3_stmt *stmt, std::string_view query) {
+  auto timeover{steady_clock::now() + LOOP_TIMEOUT};
+  while (true) {
+    switch (sqlite3_step(stmt)) {
+    case SQLITE_DONE:
+      // sqlite3_last_insert_rowid(sqlite3_db);
+      return true;
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+      if (steady_clock::now() < timeover) {
+        vTaskDelay(1);
+        continue;
+      }
+      M5_LOGE("sqlite3_step() timeover");
+      break;
+    default:
+      break;
+    }
+    M5_LOGE("query is \"%s\"", query.data());
+    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
     return false;
   }
-
-  _latestMeasurementM5Env3 = m;
-  M5_LOGD("insert M5Env3 is success.");
-  return true;
 }
 
 //
@@ -1137,17 +2346,8 @@ bool Database::insert_values(std::string_view query,
     return false;
   }
 
-  Sqlite3StmtPointerUnique stmt;
-  if (sqlite3_stmt * pStmt{nullptr};
-      sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                         nullptr) == SQLITE_OK) {
-    // set statement handle to smartpointer
-    if (pStmt) {
-      stmt.reset(pStmt);
-    }
-  } else {
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    M5_LOGE("%s", query.data());
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(query)};
+  if (!stmt) {
     return false;
   }
 
@@ -1165,7 +2365,7 @@ bool Database::insert_values(std::string_view query,
   }
 
   // SQL表示(デバッグ用)
-  if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
+  if (log_enabled(ESP_LOG_DEBUG)) {
     //
     std::time_t time = system_clock::to_time_t(tp_to_insert);
     std::tm local_time;
@@ -1183,20 +2383,7 @@ bool Database::insert_values(std::string_view query,
   }
 
   //
-  auto timeover{steady_clock::now() + LOOP_TIMEOUT};
-  while (steady_clock::now() < timeover &&
-         sqlite3_step(stmt.get()) != SQLITE_DONE) {
-    std::this_thread::yield();
-  }
-  if (steady_clock::now() > timeover) {
-    M5_LOGE("sqlite3_step() timeover");
-    M5_LOGE("query is \"%s\"", query.data());
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    return false;
-  }
-
-  // sqlite3_last_insert_rowid(sqlite3_db);
-  return true;
+  return step_insert(stmt.get(), query);
 }
 
 //
@@ -1211,17 +2398,8 @@ bool Database::insert_values(std::string_view query,
     return false;
   }
 
-  Sqlite3StmtPointerUnique stmt;
-  if (sqlite3_stmt * pStmt{nullptr};
-      sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                         nullptr) == SQLITE_OK) {
-    // set statement handle to smartpointer
-    if (pStmt) {
-      stmt.reset(pStmt);
-    }
-  } else {
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    M5_LOGE("%s", query.data());
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(query)};
+  if (!stmt) {
     return false;
   }
 
@@ -1248,7 +2426,7 @@ bool Database::insert_values(std::string_view query,
     }
   }
   // SQL表示(デバッグ用)
-  if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
+  if (log_enabled(ESP_LOG_DEBUG)) {
     //
     std::time_t time = system_clock::to_time_t(tp_to_insert);
     std::tm local_time;
@@ -1266,20 +2444,7 @@ bool Database::insert_values(std::string_view query,
   }
 
   //
-  auto timeover{steady_clock::now() + LOOP_TIMEOUT};
-  while (steady_clock::now() < timeover &&
-         sqlite3_step(stmt.get()) != SQLITE_DONE) {
-    std::this_thread::yield();
-  }
-  if (steady_clock::now() > timeover) {
-    M5_LOGE("sqlite3_step() timeover");
-    M5_LOGE("query is \"%s\"", query.data());
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    return false;
-  }
-
-  // sqlite3_last_insert_rowid(sqlite3_db);
-  return true;
+  return step_insert(stmt.get(), query);
 }
 
 //
@@ -1295,17 +2460,9 @@ Database::read_values(std::string_view query,
     return std::nullopt;
   }
 
-  Sqlite3StmtPointerUnique stmt;
-  if (sqlite3_stmt * pStmt{nullptr};
-      sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                         nullptr) == SQLITE_OK) {
-    // set statement handle to smartpointer
-    if (pStmt) {
-      stmt.reset(pStmt);
-    }
-  } else {
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    M5_LOGE("%s", query.data());
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      query_with_order_by(query, orderby))};
+  if (!stmt) {
     return std::nullopt;
   }
 
@@ -1316,17 +2473,8 @@ Database::read_values(std::string_view query,
       SQLITE_OK) {
     return std::nullopt;
   }
-  {
-    std::string_view order_text{orderby == OrderByAtDesc ? "at DESC"
-                                                         : "at ASC"};
-    if (sqlite3_bind_text(stmt.get(),
-                          sqlite3_bind_parameter_index(stmt.get(), ":order_by"),
-                          order_text.data(), -1, SQLITE_STATIC) != SQLITE_OK) {
-      return std::nullopt;
-    }
-  }
   // SQL表示(デバッグ用)
-  if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
+  if (log_enabled(ESP_LOG_DEBUG)) {
     if (auto p = sqlite3_expanded_sql(stmt.get()); p) {
       M5_LOGD("%s", p);
       sqlite3_free(p);
@@ -1364,17 +2512,9 @@ Database::read_values(std::string_view query,
     return std::nullopt;
   }
 
-  Sqlite3StmtPointerUnique stmt;
-  if (sqlite3_stmt * pStmt{nullptr};
-      sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                         nullptr) == SQLITE_OK) {
-    // set statement handle to smartpointer
-    if (pStmt) {
-      stmt.reset(pStmt);
-    }
-  } else {
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    M5_LOGE("%s", query.data());
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      query_with_order_by(query, orderby))};
+  if (!stmt) {
     return std::nullopt;
   }
 
@@ -1384,22 +2524,13 @@ Database::read_values(std::string_view query,
                          sensorid) != SQLITE_OK) {
     return std::nullopt;
   }
-  {
-    std::string_view order_text{orderby == OrderByAtDesc ? "at DESC"
-                                                         : "at ASC"};
-    if (sqlite3_bind_text(stmt.get(),
-                          sqlite3_bind_parameter_index(stmt.get(), ":order_by"),
-                          order_text.data(), -1, SQLITE_STATIC) != SQLITE_OK) {
-      return std::nullopt;
-    }
-  }
   if (sqlite3_bind_int(stmt.get(),
                        sqlite3_bind_parameter_index(stmt.get(), ":limit"),
                        limit) != SQLITE_OK) {
     return std::nullopt;
   }
   // SQL表示(デバッグ用)
-  if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
+  if (log_enabled(ESP_LOG_DEBUG)) {
     if (auto p = sqlite3_expanded_sql(stmt.get()); p) {
       M5_LOGD("%s", p);
       sqlite3_free(p);
@@ -1437,17 +2568,9 @@ Database::read_values(std::string_view query,
     return std::nullopt;
   }
 
-  Sqlite3StmtPointerUnique stmt;
-  if (sqlite3_stmt * pStmt{nullptr};
-      sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                         nullptr) == SQLITE_OK) {
-    // set statement handle to smartpointer
-    if (pStmt) {
-      stmt.reset(pStmt);
-    }
-  } else {
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    M5_LOGE("%s", query.data());
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      query_with_order_by(query, orderby))};
+  if (!stmt) {
     return std::nullopt;
   }
 
@@ -1458,17 +2581,8 @@ Database::read_values(std::string_view query,
       SQLITE_OK) {
     return std::nullopt;
   }
-  {
-    std::string_view order_text{orderby == OrderByAtDesc ? "at DESC"
-                                                         : "at ASC"};
-    if (sqlite3_bind_text(stmt.get(),
-                          sqlite3_bind_parameter_index(stmt.get(), ":order_by"),
-                          order_text.data(), -1, SQLITE_STATIC) != SQLITE_OK) {
-      return std::nullopt;
-    }
-  }
   // SQL表示(デバッグ用)
-  if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
+  if (log_enabled(ESP_LOG_DEBUG)) {
     if (auto p = sqlite3_expanded_sql(stmt.get()); p) {
       M5_LOGD("%s", p);
       sqlite3_free(p);
@@ -1506,17 +2620,9 @@ Database::read_values(std::string_view query,
     return std::nullopt;
   }
 
-  Sqlite3StmtPointerUnique stmt;
-  if (sqlite3_stmt * pStmt{nullptr};
-      sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                         nullptr) == SQLITE_OK) {
-    // set statement handle to smartpointer
-    if (pStmt) {
-      stmt.reset(pStmt);
-    }
-  } else {
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    M5_LOGE("%s", query.data());
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      query_with_order_by(query, orderby))};
+  if (!stmt) {
     return std::nullopt;
   }
 
@@ -1527,17 +2633,8 @@ Database::read_values(std::string_view query,
       SQLITE_OK) {
     return std::nullopt;
   }
-  {
-    std::string_view order_text{orderby == OrderByAtDesc ? "at DESC"
-                                                         : "at ASC"};
-    if (sqlite3_bind_text(stmt.get(),
-                          sqlite3_bind_parameter_index(stmt.get(), ":order_by"),
-                          order_text.data(), -1, SQLITE_STATIC) != SQLITE_OK) {
-      return std::nullopt;
-    }
-  }
   // SQL表示(デバッグ用)
-  if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
+  if (log_enabled(ESP_LOG_DEBUG)) {
     if (auto p = sqlite3_expanded_sql(stmt.get()); p) {
       M5_LOGD("%s", p);
       sqlite3_free(p);
@@ -1579,17 +2676,9 @@ Database::read_values(std::string_view query,
     return std::nullopt;
   }
 
-  Sqlite3StmtPointerUnique stmt;
-  if (sqlite3_stmt * pStmt{nullptr};
-      sqlite3_prepare_v2(_sqlite3_db.get(), query.data(), -1, &pStmt,
-                         nullptr) == SQLITE_OK) {
-    // set statement handle to smartpointer
-    if (pStmt) {
-      stmt.reset(pStmt);
-    }
-  } else {
-    M5_LOGE("%s", sqlite3_errmsg(_sqlite3_db.get()));
-    M5_LOGE("%s", query.data());
+  Sqlite3StmtPointerCached stmt{prepare_cached_statement(
+      query_with_order_by(query, orderby))};
+  if (!stmt) {
     return std::nullopt;
   }
 
@@ -1599,20 +2688,13 @@ Database::read_values(std::string_view query,
                          sensorid) != SQLITE_OK) {
     return std::nullopt;
   }
-  if (std::string_view order_text{orderby == OrderByAtDesc ? "at DESC"
-                                                           : "at ASC"};
-      sqlite3_bind_text(stmt.get(),
-                        sqlite3_bind_parameter_index(stmt.get(), ":order_by"),
-                        order_text.data(), -1, SQLITE_STATIC) != SQLITE_OK) {
-    return std::nullopt;
-  }
   if (sqlite3_bind_int(stmt.get(),
                        sqlite3_bind_parameter_index(stmt.get(), ":limit"),
                        limit) != SQLITE_OK) {
     return std::nullopt;
   }
   // SQL表示(デバッグ用)
-  if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_DEBUG) {
+  if (log_enabled(ESP_LOG_DEBUG)) {
     if (auto p = sqlite3_expanded_sql(stmt.get()); p) {
       M5_LOGD("%s", p);
       sqlite3_free(p);
@@ -0,0 +1,62 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "DeadbandFilter.hpp"
+#include "SensorTraits.hpp"
+#include <cmath>
+#include <cstdlib>
+
+// Metric毎の幅(センサーの持つ固定小数点の値で)
+static int32_t band_of(const DeadbandFilter::Bands &bands,
+                       Sensor::Metric metric) {
+  switch (metric) {
+  case Sensor::Metric::Temperature:
+    return bands.temperature.count();
+  case Sensor::Metric::RelativeHumidity:
+    return bands.relative_humidity.count();
+  case Sensor::Metric::Pressure:
+    return bands.pressure.count();
+  case Sensor::Metric::CarbonDioxide:
+    return bands.co2.value;
+  case Sensor::Metric::TotalVoc:
+    return bands.tvoc.value;
+  }
+  return 0;
+}
+
+// 前回通した値からどれか1つでも変わったらtrue
+// (項目はSensor::Traitsの表で決まる)
+struct DeadbandFilter::ChangedVisitor {
+  const Bands &bands;
+  const Sensor::MeasuredValue &last;
+  //
+  bool operator()(std::monostate) { return false; }
+  //
+  template <typename V> bool operator()(const V &in) {
+    const auto &prev = std::get<V>(last);
+    for (const auto &field : Sensor::Traits<V>::fields) {
+      auto scale = Sensor::fixedPointScale(field.metric);
+      auto delta = std::lround((field.value(in) - field.value(prev)) * scale);
+      if (std::abs(delta) >= band_of(bands, field.metric)) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+//
+bool DeadbandFilter::pass(std::chrono::system_clock::time_point at,
+                          const Sensor::MeasuredValue &in) {
+  if (!_enabled || std::holds_alternative<std::monostate>(in)) {
+    return true;
+  }
+  auto &last = _last[in.index()];
+  if (last && at - last->first < _heartbeat &&
+      !std::visit(ChangedVisitor{_bands, last->second}, in)) {
+    return false;
+  }
+  last = std::make_pair(at, in);
+  return true;
+}
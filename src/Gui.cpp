@@ -5,6 +5,7 @@
 #include "Gui.hpp"
 #include "Application.hpp"
 #include "Database.hpp"
+#include "Diagnostics.hpp"
 #include <WebServer.h>
 #include <WiFi.h>
 #include <algorithm>
@@ -27,26 +28,69 @@ using namespace std::literals::string_literals;
 using namespace std::literals::string_view_literals;
 
 //
-lv_color_t Gui::LvglUseArea::draw_buf_1[];
-lv_color_t Gui::LvglUseArea::draw_buf_2[];
-
+// 転送はDMAに任せて, その間にLVGLはもう片方のバッファを描く
 //
 void Gui::lvgl_use_display_flush_callback(lv_disp_drv_t *disp_drv,
                                           const lv_area_t *area,
                                           lv_color_t *color_p) {
-  M5GFX &gfx = *static_cast<M5GFX *>(disp_drv->user_data);
+  Gui &gui = *static_cast<Gui *>(disp_drv->user_data);
 
   int32_t width = area->x2 - area->x1 + 1;
   int32_t height = area->y2 - area->y1 + 1;
 
-  gfx.startWrite();
-  gfx.setAddrWindow(area->x1, area->y1, width, height);
-  gfx.writePixels(reinterpret_cast<uint16_t *>(color_p), width * height, true);
-  gfx.endWrite();
+  // 転送が終わるまでバスを離さない
+  gui.gfx.startWrite();
+  gui.gfx.pushImageDMA(area->x1, area->y1, width, height,
+                       reinterpret_cast<lgfx::rgb565_t *>(color_p));
+  gui._display_monitor.flushing = true;
+  gui._display_monitor.flush_started_at = std::chrono::steady_clock::now();
+  // lv_disp_flush_ready()は転送が終わってからcomplete_flush()で呼ぶ
+}
+
+// LVGLが次のバッファを渡すまで待っている間に呼ばれる
+void Gui::lvgl_use_display_wait_callback(lv_disp_drv_t *disp_drv) {
+  static_cast<Gui *>(disp_drv->user_data)->complete_flush();
+}
 
+//
+void Gui::complete_flush() {
+  auto &monitor = _display_monitor;
+  if (!monitor.flushing || gfx.dmaBusy()) {
+    return;
+  }
+  gfx.endWrite();
+  monitor.flushing = false;
+  auto flush_time = std::chrono::steady_clock::now() - monitor.flush_started_at;
+  monitor.flush_total += flush_time;
+  Diagnostics::histogram(Diagnostics::Probe::DisplayFlush)
+      .record(duration_cast<microseconds>(flush_time).count());
+  monitor.flushes++;
   /*IMPORTANT!!!
    *Inform the graphics library that you are ready with the flushing*/
-  lv_disp_flush_ready(disp_drv);
+  lv_disp_flush_ready(&lvgl_use.disp_drv);
+}
+
+// 画面を描き直す度に呼ばれる
+void Gui::lvgl_use_display_monitor_callback(lv_disp_drv_t *disp_drv,
+                                            uint32_t time, uint32_t px) {
+  auto &monitor = static_cast<Gui *>(disp_drv->user_data)->_display_monitor;
+  auto now = std::chrono::steady_clock::now();
+  monitor.frames++;
+  monitor.latest.render_ms = time;
+  if (auto elapsed = now - monitor.window_started_at;
+      elapsed >= std::chrono::seconds{1}) {
+    monitor.latest.fps = monitor.frames * std::chrono::seconds{1} / elapsed;
+    if (monitor.flushes > 0) {
+      monitor.latest.flush_us =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              monitor.flush_total / monitor.flushes)
+              .count();
+    }
+    monitor.window_started_at = now;
+    monitor.frames = 0;
+    monitor.flushes = 0;
+    monitor.flush_total = std::chrono::steady_clock::duration::zero();
+  }
 }
 
 //
@@ -71,18 +115,49 @@ bool Gui::begin() {
   // LVGL init
   lv_init();
   // LVGL draw buffer
-  lv_disp_draw_buf_init(&lvgl_use.draw_buf_dsc, lvgl_use.draw_buf_1,
-                        lvgl_use.draw_buf_2, std::size(lvgl_use.draw_buf_1));
+  const size_t buffer_pixels = gfx.width() * LVGL_BUFFER_ONE_LINES;
+  auto allocate = [buffer_pixels](uint32_t caps) {
+    return static_cast<lv_color_t *>(
+        heap_caps_malloc(buffer_pixels * sizeof(lv_color_t), caps));
+  };
+  lvgl_use.draw_buf_1.reset(allocate(LVGL_BUFFER_CAPS));
+  lvgl_use.draw_buf_2.reset(allocate(LVGL_BUFFER_CAPS));
+  if (!lvgl_use.draw_buf_1 || !lvgl_use.draw_buf_2) {
+    // 置けなければどこでもよい
+    M5_LOGE("draw buffer allocation failed; fallback to default heap");
+    lvgl_use.draw_buf_1.reset(allocate(MALLOC_CAP_8BIT));
+    lvgl_use.draw_buf_2.reset(allocate(MALLOC_CAP_8BIT));
+  }
+  if (!lvgl_use.draw_buf_1 || !lvgl_use.draw_buf_2) {
+    M5_LOGE("memory allocation error");
+    return false;
+  }
+  lv_disp_draw_buf_init(&lvgl_use.draw_buf_dsc, lvgl_use.draw_buf_1.get(),
+                        lvgl_use.draw_buf_2.get(), buffer_pixels);
 
   // LVGL display driver
   lv_disp_drv_init(&lvgl_use.disp_drv);
-  lvgl_use.disp_drv.user_data = &gfx;
+  lvgl_use.disp_drv.user_data = this;
   lvgl_use.disp_drv.hor_res = gfx.width();
   lvgl_use.disp_drv.ver_res = gfx.height();
   lvgl_use.disp_drv.flush_cb = lvgl_use_display_flush_callback;
+  lvgl_use.disp_drv.wait_cb = lvgl_use_display_wait_callback;
+  lvgl_use.disp_drv.monitor_cb = lvgl_use_display_monitor_callback;
   lvgl_use.disp_drv.draw_buf = &lvgl_use.draw_buf_dsc;
   // register the display driver
   lv_disp_drv_register(&lvgl_use.disp_drv);
+  // 描き終わった後の転送もバスを離すまで見届ける
+  lv_timer_create(
+      [](lv_timer_t *timer) -> void {
+        static_cast<Gui *>(timer->user_data)->complete_flush();
+      },
+      LVGL_FLUSH_POLLING_PERIOD, this);
+  // 他のタスクから頼まれたボタンの操作はLVGLのタスクで行う
+  lv_timer_create(
+      [](lv_timer_t *timer) -> void {
+        static_cast<Gui *>(timer->user_data)->navigate();
+      },
+      NAVIGATION_POLLING_PERIOD, this);
 
   // LVGL (touchpad) input device driver
   lv_indev_drv_init(&lvgl_use.indev_drv);
@@ -95,6 +170,14 @@ bool Gui::begin() {
   // 起動画面
   _startup_widget =
       std::make_unique<Widget::Startup>(gfx.width(), gfx.height());
+  // 起動の段階を進めるタスクが書いた進み具合をLVGLのタスクで出す
+  lv_timer_create(
+      [](lv_timer_t *timer) -> void {
+        if (!static_cast<Gui *>(timer->user_data)->apply_startup()) {
+          lv_timer_del(timer);
+        }
+      },
+      STARTUP_POLLING_PERIOD, this);
   //
   return true;
 }
@@ -116,15 +199,30 @@ bool Gui::startUi() {
     add_tile<Widget::Clock>({_tileview_obj, col++, 0, LV_DIR_HOR});
   }
   add_tile<Widget::SystemHealthy>({_tileview_obj, col++, 0, LV_DIR_HOR});
+  add_tile<Widget::LatencyHistograms>({_tileview_obj, col++, 0, LV_DIR_HOR});
   add_tile<Widget::ExportImportData>({_tileview_obj, col++, 0, LV_DIR_HOR});
+  _home_col = col;
   add_tile<Widget::Summary>({_tileview_obj, col++, 0, LV_DIR_HOR});
   add_tile<Widget::TemperatureChart>({_tileview_obj, col++, 0, LV_DIR_HOR});
   add_tile<Widget::RelativeHumidityChart>(
       {_tileview_obj, col++, 0, LV_DIR_HOR});
   add_tile<Widget::PressureChart>({_tileview_obj, col++, 0, LV_DIR_HOR});
   add_tile<Widget::CarbonDeoxidesChart>({_tileview_obj, col++, 0, LV_DIR_HOR});
+  add_tile<Widget::TotalVocChart>({_tileview_obj, col++, 0, LV_DIR_HOR});
+  // 長い期間の推移は集計から描く
+  add_tile<Widget::HistoryChart>({_tileview_obj, col++, 0, LV_DIR_HOR},
+                                 Database::Table::Temperature,
+                                 Database::Resolution::Hourly);
+  add_tile<Widget::HistoryChart>({_tileview_obj, col++, 0, LV_DIR_HOR},
+                                 Database::Table::Temperature,
+                                 Database::Resolution::Daily);
+  add_tile<Widget::HistoryChart>({_tileview_obj, col++, 0, LV_DIR_HOR},
+                                 Database::Table::CarbonDioxide,
+                                 Database::Resolution::Hourly);
   // 最後のタイルだけ右移動を禁止する
-  add_tile<Widget::TotalVocChart>({_tileview_obj, col++, 0, LV_DIR_LEFT});
+  add_tile<Widget::HistoryChart>({_tileview_obj, col++, 0, LV_DIR_LEFT},
+                                 Database::Table::CarbonDioxide,
+                                 Database::Resolution::Daily);
   //
   if (_startup_widget) {
     _startup_widget.reset();
@@ -136,6 +234,30 @@ bool Gui::startUi() {
   return true;
 }
 
+//
+bool Gui::apply_startup() {
+  std::optional<int16_t> progress{};
+  std::optional<std::string> message{};
+  {
+    std::lock_guard<std::mutex> lock{_startup_mutex};
+    std::swap(progress, _startup_progress);
+    std::swap(message, _startup_message);
+  }
+  if (_startup_widget) {
+    if (progress) {
+      _startup_widget->updateProgress(*progress);
+    }
+    if (message) {
+      _startup_widget->updateMessage(*message);
+    }
+  }
+  if (_start_ui_requested.exchange(false)) {
+    startUi();
+    return false;
+  }
+  return true;
+}
+
 //
 void Gui::home() {
   if (!_tileview_obj) {
@@ -143,9 +265,8 @@ void Gui::home() {
     return;
   }
   vibrate();
-  constexpr auto COL_ID = 3;
   constexpr auto ROW_ID = 0;
-  lv_obj_set_tile_id(_tileview_obj.get(), COL_ID, ROW_ID, LV_ANIM_OFF);
+  lv_obj_set_tile_id(_tileview_obj.get(), _home_col, ROW_ID, LV_ANIM_OFF);
 }
 
 //
@@ -176,6 +297,23 @@ void Gui::moveNext() {
   }
 }
 
+//
+void Gui::navigate() {
+  switch (_navigation_request.exchange(Navigation::None)) {
+  case Navigation::Prev:
+    movePrev();
+    break;
+  case Navigation::Home:
+    home();
+    break;
+  case Navigation::Next:
+    moveNext();
+    break;
+  default:
+    break;
+  }
+}
+
 //
 void Gui::vibrate() {
   constexpr auto MILLISECONDS = 120;
@@ -452,250 +590,122 @@ Widget::Summary::Summary(Widget::InitArg init) : TileBase{init, "Summary"} {
 }
 
 void Widget::Summary::update() {
-  auto present = Measurements{
-      Application::getDataAcquisitionDB().getLatestMeasurementBme280(),
-      Application::getDataAcquisitionDB().getLatestMeasurementSgp30(),
-      Application::getDataAcquisitionDB().getLatestMeasurementScd30(),
-      Application::getDataAcquisitionDB().getLatestMeasurementScd41(),
-      Application::getDataAcquisitionDB().getLatestMeasurementM5Env3()};
-  if (present != _latest) {
+  // 測定値を読むのは世代が変わった時だけ
+  auto present =
+      Application::getDataAcquisitionDB().getLatestMeasurementsGeneration();
+  if (present != _generation) {
     render();
-    _latest = present;
+    _generation = present;
   }
 }
 
-void Widget::Summary::render() {
-  if (_table_obj) {
-    std::ostringstream oss;
-    oss << std::fixed << std::setprecision(2);
-    auto row = 0;
-    for (const auto &p : Application::getSensors()) {
-      if (p.get() == nullptr) {
-        continue;
-      }
-      switch (p->getSensorDescriptor()) {
-      case Application::SENSOR_DESCRIPTOR_M5ENV3: { // M5 unit ENV3
-        auto m5env3 =
-            Application::getDataAcquisitionDB().getLatestMeasurementM5Env3();
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "ENV3 Temp");
-        if (auto temp = m5env3 ? std::make_optional(m5env3->second.temperature)
-                               : std::nullopt;
-            temp) {
-          const DegC t = static_cast<DegC>(*temp);
-          oss.str("");
-          oss << +t.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "C");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "ENV3 Humi");
-        if (auto humi =
-                m5env3 ? std::make_optional(m5env3->second.relative_humidity)
-                       : std::nullopt;
-            humi) {
-          const PctRH rh = *humi;
-          oss.str("");
-          oss << +rh.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "%RH");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "ENV3 Pres");
-        if (auto pres = m5env3 ? std::make_optional(m5env3->second.pressure)
-                               : std::nullopt;
-            pres) {
-          const HectoPa hpa = *pres;
-          oss.str("");
-          oss << +hpa.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "hPa");
-        row++;
-      } break;
-      case Application::SENSOR_DESCRIPTOR_BME280: { // BME280
-        auto bme280 =
-            Application::getDataAcquisitionDB().getLatestMeasurementBme280();
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "BME280 Temp");
-        if (auto temp = bme280 ? std::make_optional(bme280->second.temperature)
-                               : std::nullopt;
-            temp) {
-          const DegC t{*temp};
-          oss.str("");
-          oss << +t.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "C");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "BME280 Humi");
-        if (auto humi =
-                bme280 ? std::make_optional(bme280->second.relative_humidity)
-                       : std::nullopt;
-            humi) {
-          const PctRH rh{*humi};
-          oss.str("");
-          oss << +rh.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "%RH");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "BME280 Pres");
-        if (auto pres = bme280 ? std::make_optional(bme280->second.pressure)
-                               : std::nullopt;
-            pres) {
-          const HectoPa hpa{*pres};
-          oss.str("");
-          oss << +hpa.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "hPa");
-        row++;
-      } break;
-      case Application::SENSOR_DESCRIPTOR_SCD30: { // SCD30
-        auto scd30 =
-            Application::getDataAcquisitionDB().getLatestMeasurementScd30();
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SCD30 Temp");
-        if (auto temp = scd30 ? std::make_optional(scd30->second.temperature)
-                              : std::nullopt;
-            temp) {
-          const DegC t{*temp};
-          oss.str("");
-          oss << +t.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "C");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SCD30 Humi");
-        if (auto humi =
-                scd30 ? std::make_optional(scd30->second.relative_humidity)
-                      : std::nullopt;
-            humi) {
-          const PctRH rh{*humi};
-          oss.str("");
-          oss << +rh.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "%RH");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SCD30 CO2");
-        if (auto carbon_dioxide =
-                scd30 ? std::make_optional(scd30->second.co2) : std::nullopt;
-            carbon_dioxide) {
-          const Ppm co2{*carbon_dioxide};
-          oss.str("");
-          oss << +co2.value;
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "ppm");
-        row++;
-      } break;
-      case Application::SENSOR_DESCRIPTOR_SCD41: { // SCD41
-        auto scd41 =
-            Application::getDataAcquisitionDB().getLatestMeasurementScd41();
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SCD41 Temp");
-        if (auto temp = scd41 ? std::make_optional(scd41->second.temperature)
-                              : std::nullopt;
-            temp) {
-          const DegC t{*temp};
-          oss.str("");
-          oss << +t.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "C");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SCD41 Humi");
-        if (auto humi =
-                scd41 ? std::make_optional(scd41->second.relative_humidity)
-                      : std::nullopt;
-            humi) {
-          const PctRH rh{*humi};
-          oss.str("");
-          oss << +rh.count();
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "%RH");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SCD41 CO2");
-        if (auto carbon_dioxide =
-                scd41 ? std::make_optional(scd41->second.co2) : std::nullopt;
-            carbon_dioxide) {
-          const Ppm co2{*carbon_dioxide};
-          oss.str("");
-          oss << +co2.value;
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "ppm");
-        row++;
-      } break;
-      case Application::SENSOR_DESCRIPTOR_SGP30: { // SGP30
-        auto sgp30 =
-            Application::getDataAcquisitionDB().getLatestMeasurementSgp30();
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SGP30 eCO2");
-        if (auto equivalent_carbon_dioxide =
-                sgp30 ? std::make_optional(sgp30->second.eCo2) : std::nullopt;
-            equivalent_carbon_dioxide) {
-          const Ppm eco2{*equivalent_carbon_dioxide};
-          oss.str("");
-          oss << +eco2.value;
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "ppm");
-        row++;
-        //
-        lv_table_set_cell_value(_table_obj.get(), row, 0, "SGP30 TVOC");
-        if (auto total_voc =
-                sgp30 ? std::make_optional(sgp30->second.tvoc) : std::nullopt;
-            total_voc) {
-          const Ppb tvoc{*total_voc};
-          oss.str("");
-          oss << +tvoc.value;
-          lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
-        } else {
-          lv_table_set_cell_value(_table_obj.get(), row, 1, "-");
-        }
-        lv_table_set_cell_value(_table_obj.get(), row, 2, "ppb");
-        row++;
-      } break;
-      //
-      default:
-        break;
-      }
-    }
+// 前回表示した文字列と同じセルはそのままにする
+// (セルを変えると表全体を描き直すので)
+void Widget::Summary::set_cell(uint16_t row, uint16_t col, const char *text) {
+  if (_cells.size() <= row) {
+    _cells.resize(row + 1);
+  }
+  if (auto &cell = _cells[row][col]; !cell || *cell != text) {
+    cell = std::string{text};
+    lv_table_set_cell_value(_table_obj.get(), row, col, text);
+  }
+}
+
+// 表示する値
+using CellText = std::array<char, 16>;
+static CellText cell_text(Sensor::Metric metric, double value) {
+  CellText text{};
+  if (Sensor::isIntegral(metric)) {
+    std::snprintf(text.data(), text.size(), "%ld", std::lround(value));
   } else {
+    std::snprintf(text.data(), text.size(), "%.2f", value);
+  }
+  return text;
+}
+// 項目名(センサー名の後に付ける)
+static const char *metric_label(Sensor::Metric metric) {
+  switch (metric) {
+  case Sensor::Metric::Temperature:
+    return "Temp";
+  case Sensor::Metric::RelativeHumidity:
+    return "Humi";
+  case Sensor::Metric::Pressure:
+    return "Pres";
+  case Sensor::Metric::CarbonDioxide:
+    return "CO2";
+  case Sensor::Metric::TotalVoc:
+    return "TVOC";
+  }
+  return "";
+}
+// 単位
+static const char *metric_unit(Sensor::Metric metric) {
+  switch (metric) {
+  case Sensor::Metric::Temperature:
+    return "C";
+  case Sensor::Metric::RelativeHumidity:
+    return "%RH";
+  case Sensor::Metric::Pressure:
+    return "hPa";
+  case Sensor::Metric::CarbonDioxide:
+    return "ppm";
+  case Sensor::Metric::TotalVoc:
+    return "ppb";
+  }
+  return "";
+}
+
+//
+template <typename... Vs>
+void Widget::Summary::put_rows(SensorDescriptor descriptor, uint16_t &row,
+                               Sensor::MeasurementTypes<Vs...>) {
+  (put_rows<Vs>(descriptor, row), ...);
+}
+
+// 項目名, 最新の測定値の1つ, 単位の行
+template <typename V>
+void Widget::Summary::put_rows(SensorDescriptor descriptor, uint16_t &row) {
+  using Traits = Sensor::Traits<V>;
+  if (descriptor != Traits::descriptor) {
+    return;
+  }
+  auto latest = Application::getDataAcquisitionDB().getLatestMeasurement<V>();
+  // 項目はMetricの順に並べる
+  std::array<const Sensor::Field<V> *, Traits::fields.size()> fields{};
+  for (size_t i = 0; i < fields.size(); ++i) {
+    fields[i] = &Traits::fields[i];
+  }
+  std::stable_sort(fields.begin(), fields.end(),
+                   [](const auto *a, const auto *b) {
+                     return a->metric < b->metric;
+                   });
+  for (const auto *field : fields) {
+    CellText label{};
+    std::snprintf(label.data(), label.size(), "%s %s",
+                  reinterpret_cast<const char *>(
+                      descriptor.strDescriptor.data()),
+                  metric_label(field->metric));
+    set_cell(row, 0, label.data());
+    set_cell(row, 1,
+             latest ? cell_text(field->metric, field->value(latest->second))
+                          .data()
+                    : "-");
+    set_cell(row, 2, metric_unit(field->metric));
+    row++;
+  }
+}
+
+void Widget::Summary::render() {
+  if (!_table_obj) {
     M5_LOGE("null pointer");
+    return;
+  }
+  uint16_t row = 0;
+  for (const auto &p : Application::getSensors()) {
+    if (p.get() == nullptr) {
+      continue;
+    }
+    put_rows(p->getSensorDescriptor(), row, Sensor::Registered{});
   }
 }
 
@@ -966,6 +976,16 @@ void Widget::SystemHealthy::render() {
       lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
     }
     row++;
+    { // Display refresh rate
+      auto display = Application::getGui().getDisplayStatistics();
+      lv_table_set_cell_value(_table_obj.get(), row, 0, "Display");
+      std::ostringstream oss;
+      oss << +display.fps << " fps" << std::endl
+          << "render " << +display.render_ms << "ms" << std::endl
+          << "flush " << +display.flush_us << "us";
+      lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
+    }
+    row++;
     { // Free Heap Memory
       lv_table_set_cell_value(_table_obj.get(), row, 0, "Free Heap");
       std::ostringstream oss;
@@ -1037,6 +1057,27 @@ void Widget::SystemHealthy::render() {
       lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
     }
     row++;
+    { // SQLite Memory Used
+      auto memory = Application::getDataAcquisitionDB().getMemoryStatistics();
+      lv_table_set_cell_value(_table_obj.get(), row, 0, "SQLite Memory Used");
+      std::ostringstream oss;
+      oss << +memory.used << "B";
+      if (memory.arena_size > 0) {
+        oss << std::endl << "/ " << +memory.arena_size << "B arena";
+      } else {
+        oss << std::endl << "on heap";
+      }
+      lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
+      row++;
+      //
+      lv_table_set_cell_value(_table_obj.get(), row, 0,
+                              "SQLite Memory High Mark");
+      oss.str("");
+      oss << +memory.highwater << "B" << std::endl
+          << "largest " << +memory.largest_request << "B";
+      lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
+    }
+    row++;
     { // LVGL task stack mark
       lv_table_set_cell_value(_table_obj.get(), row, 0,
                               "Stack High Mark(LVGL Task)");
@@ -1061,6 +1102,73 @@ void Widget::SystemHealthy::render() {
   }
 }
 
+//
+//
+//
+Widget::LatencyHistograms::LatencyHistograms(Widget::InitArg init)
+    : TileBase{init, "Latency"} {
+  if (_tile_obj) {
+    // create
+    _table_obj.reset(lv_table_create(_tile_obj.get()), lv_obj_del);
+  } else {
+    M5_LOGE("null pointer");
+  }
+  //
+  if (_table_obj && _title_obj) {
+    auto w = lv_obj_get_content_width(_tile_obj.get());
+    lv_table_set_col_cnt(_table_obj.get(), 3);
+    lv_table_set_col_width(_table_obj.get(), 0, w * 5 / 12);
+    lv_table_set_col_width(_table_obj.get(), 1, w * 4 / 12);
+    lv_table_set_col_width(_table_obj.get(), 2, w * 3 / 12);
+    lv_obj_set_width(_table_obj.get(), w);
+    lv_obj_set_height(_table_obj.get(),
+                      lv_obj_get_content_height(_tile_obj.get()));
+    lv_obj_set_style_text_font(_table_obj.get(), &lv_font_montserrat_14,
+                               LV_PART_ITEMS | LV_STATE_DEFAULT);
+    lv_obj_align_to(_table_obj.get(), _title_obj.get(),
+                    LV_ALIGN_OUT_BOTTOM_LEFT, 0, MARGIN);
+    lv_obj_set_x(_table_obj.get(), 0);
+    //
+    lv_table_set_cell_value(_table_obj.get(), 0, 0, "probe / count");
+    lv_table_set_cell_value(_table_obj.get(), 0, 1, "p50 / p99");
+    lv_table_set_cell_value(_table_obj.get(), 0, 2, "max");
+  } else {
+    M5_LOGE("null pointer");
+  }
+}
+
+//
+void Widget::LatencyHistograms::render() {
+  _rendered_at = steady_clock::now();
+  if (!_table_obj) {
+    M5_LOGE("null pointer");
+    return;
+  }
+  auto format = [](uint32_t us) -> std::string {
+    std::ostringstream oss;
+    if (us < 1000) {
+      oss << +us << "us";
+    } else if (us < 1000 * 1000) {
+      oss << std::fixed << std::setprecision(1) << us / 1000.0f << "ms";
+    } else {
+      oss << std::fixed << std::setprecision(1) << us / 1000000.0f << "s";
+    }
+    return oss.str();
+  };
+  for (size_t i = 0; i < Diagnostics::PROBE_NAMES.size(); ++i) {
+    auto row = i + 1;
+    auto summary = Diagnostics::histograms[i].summary();
+    std::ostringstream oss;
+    oss << Diagnostics::PROBE_NAMES[i] << std::endl << +summary.count;
+    lv_table_set_cell_value(_table_obj.get(), row, 0, oss.str().c_str());
+    oss.str("");
+    oss << format(summary.p50_us) << std::endl << format(summary.p99_us);
+    lv_table_set_cell_value(_table_obj.get(), row, 1, oss.str().c_str());
+    lv_table_set_cell_value(_table_obj.get(), row, 2,
+                            format(summary.max_us).c_str());
+  }
+}
+
 //
 void Widget::SystemHealthy::event_draw_part_begin_callback(lv_event_t *event) {
   lv_obj_t *obj{event ? lv_event_get_target(event) : nullptr};
@@ -1192,34 +1300,104 @@ Widget::ExportImportData::ExportImportData(Widget::InitArg init)
   } else {
     M5_LOGE("null pointer");
   }
+  // 進み具合はボタンの代わりに見せる
+  if (_tile_obj && _title_obj) {
+    _progress_label_obj.reset(lv_label_create(_tile_obj.get()), lv_obj_del);
+    _progress_bar_obj.reset(lv_bar_create(_tile_obj.get()), lv_obj_del);
+    _cancel_button_obj.reset(lv_btn_create(_tile_obj.get()), lv_obj_del);
+  }
+  if (_progress_label_obj && _progress_bar_obj && _cancel_button_obj) {
+    lv_label_set_text(_progress_label_obj.get(), "");
+    lv_obj_align_to(_progress_label_obj.get(), _title_obj.get(),
+                    LV_ALIGN_OUT_BOTTOM_MID, 0, GUTTER);
+    lv_obj_set_width(_progress_bar_obj.get(), lv_pct(80));
+    lv_obj_align_to(_progress_bar_obj.get(), _progress_label_obj.get(),
+                    LV_ALIGN_OUT_BOTTOM_MID, 0, GUTTER / 2);
+    if (lv_obj_t *label = lv_label_create(_cancel_button_obj.get()); label) {
+      lv_label_set_text(label, "Cancel");
+    }
+    lv_obj_add_event_cb(_cancel_button_obj.get(), event_all_callback,
+                        LV_EVENT_ALL, this);
+    lv_obj_align_to(_cancel_button_obj.get(), _progress_bar_obj.get(),
+                    LV_ALIGN_OUT_BOTTOM_MID, 0, GUTTER);
+    showProgress(false);
+  } else {
+    M5_LOGE("null pointer");
+  }
 }
 
 //
 void Widget::ExportImportData::update() {
-  if (_tile_obj && _error_msg_at_exec) {
-    _messagebox.reset(new Widget::MessageBox(
-        _tile_obj.get(), "Error", _error_msg_at_exec->c_str(), {"OK"}));
-    _error_msg_at_exec = std::nullopt;
+  bool busy = Application::isTransferBusy();
+  if (busy) {
+    auto progress = Application::getTransferProgress().value_or(0);
+    if (progress != _progress && _progress_label_obj && _progress_bar_obj) {
+      _progress = progress;
+      lv_label_set_text_fmt(_progress_label_obj.get(), "%s %d%%",
+                            _transfer_caption, progress);
+      lv_bar_set_value(_progress_bar_obj.get(), progress, LV_ANIM_OFF);
+    }
+  }
+  if (busy == _transfer_busy) {
+    return;
+  }
+  // 終わったら結果を見せる
+  _transfer_busy = busy;
+  showProgress(busy);
+  if (!busy && _tile_obj) {
+    if (auto error = Application::takeTransferError(); error) {
+      _messagebox.reset(new Widget::MessageBox(_tile_obj.get(), "Error",
+                                               error->c_str(), {"OK"}));
+    } else {
+      _messagebox.reset(new Widget::MessageBox(_tile_obj.get(), "Done",
+                                               _transfer_caption, {"OK"}));
+    }
   }
 }
 
+//
+void Widget::ExportImportData::requestTransfer(Database::TransferKind kind,
+                                               const char *caption) {
+  _transfer_caption = caption;
+  _progress = -1;
+  Application::requestTransfer(kind);
+}
+
+//
+void Widget::ExportImportData::showProgress(bool busy) {
+  auto show = [](const std::shared_ptr<lv_obj_t> &obj, bool visible) {
+    if (!obj) {
+      M5_LOGE("null pointer");
+    } else if (visible) {
+      lv_obj_clear_flag(obj.get(), LV_OBJ_FLAG_HIDDEN);
+    } else {
+      lv_obj_add_flag(obj.get(), LV_OBJ_FLAG_HIDDEN);
+    }
+  };
+  show(_export_button_obj, !busy);
+  show(_import_button_obj, !busy);
+  show(_progress_label_obj, busy);
+  show(_progress_bar_obj, busy);
+  show(_cancel_button_obj, busy);
+}
+
 //
 void Widget::ExportImportData::showExportMessageBox() {
   if (_tile_obj) {
     _messagebox.reset(new Widget::MessageBox(
-        _tile_obj.get(), "Export Data", "Insert SD card and click OK",
-        {"OK", "Cancel"}, [this](uint16_t button_id) {
+        _tile_obj.get(), "Export Data", "Insert SD card and choose format",
+        {"SQLite", "CSV", "Cancel"}, [this](uint16_t button_id) {
           switch (button_id) {
           case 0:
-            M5_LOGD("Export: OK");
-            if (_error_msg_at_exec =
-                    Application::getDataAcquisitionDB().save_to_file(
-                        Application::EXPORT_IMPORT_DATABASE_FILE_URI);
-                _error_msg_at_exec) {
-              M5_LOGE("%s", _error_msg_at_exec->c_str());
-            }
+            M5_LOGD("Export: SQLite");
+            requestTransfer(Database::TransferKind::ExportDatabase,
+                            "Export");
             break;
           case 1:
+            M5_LOGD("Export: CSV");
+            requestTransfer(Database::TransferKind::ExportCsv, "Export CSV");
+            break;
+          case 2:
             M5_LOGD("Export: Cancel");
             break;
           }
@@ -1238,12 +1416,8 @@ void Widget::ExportImportData::showImportMessageBox() {
           switch (button_id) {
           case 0:
             M5_LOGD("Import: OK");
-            if (_error_msg_at_exec =
-                    Application::getDataAcquisitionDB().restore_from_file(
-                        Application::EXPORT_IMPORT_DATABASE_FILE_URI);
-                _error_msg_at_exec) {
-              M5_LOGE("%s", _error_msg_at_exec->c_str());
-            }
+            requestTransfer(Database::TransferKind::ImportDatabase,
+                            "Import");
             break;
           case 1:
             M5_LOGD("Import: Cancel");
@@ -1271,6 +1445,8 @@ void Widget::ExportImportData::event_all_callback(lv_event_t *event) {
         it->showExportMessageBox();
       } else if (target_obj == it->_import_button_obj.get()) {
         it->showImportMessageBox();
+      } else if (target_obj == it->_cancel_button_obj.get()) {
+        Application::cancelTransfer();
       }
       break;
     default:
@@ -1371,6 +1547,22 @@ Widget::ChartLineColor::getAssignedColor32(SensorId sensor_id) {
            : std::nullopt;
 }
 
+//
+// 1区間の分数
+// CHART_X_POINT_COUNTを割り切り, 点の数(区間の数の2倍)が
+// チャートの幅以下になる最小の値(1ピクセルに何本も線を引かない)
+static uint16_t minutesPerBucket(lv_coord_t chart_width) {
+  for (uint16_t m = 1; m < Gui::CHART_X_POINT_COUNT; ++m) {
+    if (Gui::CHART_X_POINT_COUNT % m == 0 &&
+        ChartSeriesWrapper::POINTS_PER_BUCKET *
+                (Gui::CHART_X_POINT_COUNT / m) <=
+            static_cast<size_t>(chart_width)) {
+      return m;
+    }
+  }
+  return Gui::CHART_X_POINT_COUNT;
+}
+
 //
 template <typename T>
 Widget::BasicChart<T>::BasicChart(std::shared_ptr<lv_obj_t> parent_obj,
@@ -1413,9 +1605,12 @@ Widget::BasicChart<T>::BasicChart(std::shared_ptr<lv_obj_t> parent_obj,
     constexpr auto X_TICK_LABEL_LEN = 30;
     constexpr auto Y_TICK_LABEL_LEN = 60;
     constexpr auto RIGHT_PADDING = 20;
+    lv_coord_t chart_width = lv_obj_get_content_width(parent_obj.get()) //
+                             - MARGIN - RIGHT_PADDING - Y_TICK_LABEL_LEN;
+    _minutes_per_bucket = minutesPerBucket(chart_width);
+    _bucket_count = Gui::CHART_X_POINT_COUNT / _minutes_per_bucket;
     lv_obj_set_size(_chart_obj.get(),
-                    lv_obj_get_content_width(parent_obj.get())             //
-                        - MARGIN - RIGHT_PADDING - Y_TICK_LABEL_LEN,       //
+                    chart_width,                                           //
                     lv_obj_get_content_height(parent_obj.get())            //
                         - MARGIN * 2 - lv_obj_get_height(title_obj.get())  //
                         - MARGIN * 2 - lv_obj_get_height(_label_obj.get()) //
@@ -1449,7 +1644,7 @@ Widget::BasicChart<T>::BasicChart(std::shared_ptr<lv_obj_t> parent_obj,
                                           LV_CHART_AXIS_PRIMARY_Y);
         if (series) {
           auto chart_series_wrapper =
-              ChartSeriesWrapper{series, Gui::CHART_X_POINT_COUNT};
+              ChartSeriesWrapper{series, _bucket_count};
           lv_chart_set_ext_y_array(_chart_obj.get(), series,
                                    chart_series_wrapper.y_points.data());
           _chart_series_map.emplace(sensor_id, std::move(chart_series_wrapper));
@@ -1457,7 +1652,9 @@ Widget::BasicChart<T>::BasicChart(std::shared_ptr<lv_obj_t> parent_obj,
       }
     }
     //
-    lv_chart_set_point_count(_chart_obj.get(), Gui::CHART_X_POINT_COUNT);
+    lv_chart_set_point_count(_chart_obj.get(),
+                             _bucket_count *
+                                 ChartSeriesWrapper::POINTS_PER_BUCKET);
   }
 }
 
@@ -1480,75 +1677,181 @@ void Widget::BasicChart<T>::event_draw_part_begin_callback(lv_event_t *event) {
 //
 template <typename T> void Widget::BasicChart<T>::render() {
   if (_chart_obj) {
-    // 初期化
-    for (auto &pair : _chart_series_map) {
-      pair.second.fill(LV_CHART_POINT_NONE);
-    }
-    //
     system_clock::time_point now_min = floor<minutes>(system_clock::now());
-    _begin_x_tp = now_min - minutes(Gui::CHART_X_POINT_COUNT);
-
-    // データーベースより測定データーを得て
-    // 各々のsensoridのchart seriesにセットする関数
-    auto coordinateChartSeries = [this](size_t counter, DataType item) -> bool {
-      auto &[sensorid, tp, value] = item;
-      // 各々のsensoridのchart seriesにセットする。
-      if (auto found_itr = _chart_series_map.find(sensorid);
-          found_itr != _chart_series_map.end()) {
-        auto coord = coordinateXY(_begin_x_tp, item);
-        M5_LOGV("%d,%d", coord.x, coord.y);
-        try {
-          found_itr->second.y_points.at(coord.x) = coord.y;
-        } catch (std::out_of_range &ex) {
-          M5_LOGE("out of range:%d; (size:%d)", coord.x,
-                  found_itr->second.y_points.size());
-        }
-      }
-      // データー表示(デバッグ用)
-      if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_VERBOSE) {
-        //
-        std::time_t time = system_clock::to_time_t(tp);
-        std::tm local_time;
-        localtime_r(&time, &local_time);
-        std::ostringstream oss;
-        //
-        oss << "(" << +counter << ") ";
-        oss << SensorDescriptor(sensorid).str() << ", ";
-        oss << std::put_time(&local_time, "%F %T %Z");
-        oss << ", " << +value;
-        M5_LOGV("%s", oss.str().c_str());
-      }
-      return true; // always true
-    };
-
-    // データーベースより測定データーを得る
-    if (read_measurements_from_database(Database::OrderByAtAsc, _begin_x_tp,
-                                        coordinateChartSeries) >= 1) {
-      // 下限、上限
-      auto y_min = std::numeric_limits<lv_coord_t>::max();
-      auto y_max = std::numeric_limits<lv_coord_t>::min();
-      for (auto &pair : _chart_series_map) {
-        auto [min, max] = pair.second.getMinMaxOfYPoints();
-        y_min = std::min(y_min, min);
-        y_max = std::max(y_max, max);
+    // タイルを表示するたびにこのオブジェクトは作り直されるので
+    // リストア後も含めて最初の1回は全期間を読む
+    if (_latest_rendered_tp.has_value()) {
+      shift_in(now_min);
+    } else {
+      rebuild(now_min);
+    }
+  } else {
+    M5_LOGE("null pointer");
+  }
+}
+
+// nowを含む区間が右端になる様に, 区間の境目に揃えた左端の時刻
+template <typename T>
+system_clock::time_point
+Widget::BasicChart<T>::beginOfBuckets(system_clock::time_point now_min) const {
+  auto now_bucket = floor<minutes>(now_min).time_since_epoch().count() /
+                    _minutes_per_bucket;
+  return system_clock::time_point{
+      minutes{(now_bucket - (_bucket_count - 1)) * _minutes_per_bucket}};
+}
+
+//
+template <typename T>
+void Widget::BasicChart<T>::rebuild(system_clock::time_point now_min) {
+  // 初期化
+  for (auto &pair : _chart_series_map) {
+    pair.second.fill(LV_CHART_POINT_NONE);
+    pair.second.clearBuckets();
+    pair.second.min_max.clear();
+    lv_chart_set_x_start_point(_chart_obj.get(), pair.second.chart_series, 0);
+  }
+  //
+  _begin_x_tp = beginOfBuckets(now_min);
+  _latest_rendered_tp = _begin_x_tp - minutes{1};
+  auto begin_minute =
+      duration_cast<minutes>(_begin_x_tp.time_since_epoch()).count();
+
+  // データーベースより測定データーを得て
+  // 各々のsensoridのchart seriesにセットする関数
+  auto coordinateChartSeries = [this, begin_minute](size_t counter,
+                                                    DataType item) -> bool {
+    auto &[sensorid, tp, value] = item;
+    // 各々のsensoridのchart seriesにセットする。
+    if (auto found_itr = _chart_series_map.find(sensorid);
+        found_itr != _chart_series_map.end()) {
+      auto &wrapper = found_itr->second;
+      auto coord = coordinateXY(_begin_x_tp, item);
+      M5_LOGV("%d,%d", coord.x, coord.y);
+      try {
+        wrapper.putIntoBucket(0, coord.x / _minutes_per_bucket,
+                              begin_minute + coord.x, coord.y);
+        wrapper.min_max.push(begin_minute + coord.x, coord.y);
+      } catch (std::out_of_range &ex) {
+        M5_LOGE("out of range:%d; (size:%d)", coord.x,
+                wrapper.buckets.size());
       }
+    }
+    _latest_rendered_tp = std::max<system_clock::time_point>(
+        *_latest_rendered_tp, floor<minutes>(tp));
+    // データー表示(デバッグ用)
+    if constexpr (CORE_DEBUG_LEVEL >= ESP_LOG_VERBOSE) {
       //
-      if (y_min == std::numeric_limits<lv_coord_t>::max() &&
-          y_max == std::numeric_limits<lv_coord_t>::min()) {
-        lv_chart_set_range(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y, 0, 1);
-      } else {
-        // 5刻みにまるめる
-        y_min = floor(y_min / 500.0f) * 500.0f;
-        y_max = ceil(y_max / 500.0f) * 500.0f;
-        lv_chart_set_range(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y, y_min,
-                           y_max);
-        M5_LOGV("y_min:%d, y_max:%d", y_min, y_max);
-      }
+      std::time_t time = system_clock::to_time_t(tp);
+      std::tm local_time;
+      localtime_r(&time, &local_time);
+      std::ostringstream oss;
+      //
+      oss << "(" << +counter << ") ";
+      oss << SensorDescriptor(sensorid).str() << ", ";
+      oss << std::put_time(&local_time, "%F %T %Z");
+      oss << ", " << +value;
+      M5_LOGV("%s", oss.str().c_str());
     }
-    //
+    return true; // always true
+  };
+
+  // データーベースより測定データーを得る
+  read_measurements_from_database(Database::OrderByAtAsc, _begin_x_tp,
+                                  coordinateChartSeries);
+  //
+  update_y_range();
+  lv_chart_refresh(_chart_obj.get());
+}
+
+//
+template <typename T>
+void Widget::BasicChart<T>::shift_in(system_clock::time_point now_min) {
+  auto new_begin_x_tp = beginOfBuckets(now_min);
+  auto shift = duration_cast<minutes>(new_begin_x_tp - _begin_x_tp).count() /
+               _minutes_per_bucket;
+  // 時計が戻ったか, 表示範囲を丸ごと越えたら全期間を読み直す
+  if (shift < 0 || shift >= _bucket_count) {
+    rebuild(now_min);
+    return;
+  }
+  // 空の区間を右から入れて左にずらす
+  for (auto &pair : _chart_series_map) {
+    auto &wrapper = pair.second;
+    for (size_t i = 0; i < shift * ChartSeriesWrapper::POINTS_PER_BUCKET;
+         ++i) {
+      lv_chart_set_next_value(_chart_obj.get(), wrapper.chart_series,
+                              LV_CHART_POINT_NONE);
+    }
+    auto start_point =
+        lv_chart_get_x_start_point(_chart_obj.get(), wrapper.chart_series);
+    for (auto n = _bucket_count - shift; n < _bucket_count; ++n) {
+      wrapper.bucketAt(start_point, n).clear();
+    }
+  }
+  _begin_x_tp = new_begin_x_tp;
+  auto begin_minute =
+      duration_cast<minutes>(_begin_x_tp.time_since_epoch()).count();
+  for (auto &pair : _chart_series_map) {
+    pair.second.min_max.expire(begin_minute);
+  }
+
+  // 表示済みより新しい測定データーだけを得る
+  std::vector<std::pair<int64_t, DataType>> arrivals{};
+  auto at_begin = std::max(*_latest_rendered_tp + minutes{1}, _begin_x_tp);
+  read_measurements_from_database(
+      Database::OrderByAtAsc, at_begin,
+      [&arrivals](size_t counter, DataType item) -> bool {
+        auto minute = duration_cast<minutes>(
+                          floor<minutes>(std::get<1>(item)).time_since_epoch())
+                          .count();
+        arrivals.emplace_back(minute, item);
+        return true; // always true
+      });
+  // 単調キューには時刻順に入れる
+  std::sort(arrivals.begin(), arrivals.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  for (auto &[minute, item] : arrivals) {
+    auto &sensorid = std::get<0>(item);
+    if (auto found_itr = _chart_series_map.find(sensorid);
+        found_itr != _chart_series_map.end()) {
+      auto &wrapper = found_itr->second;
+      auto coord = coordinateXY(_begin_x_tp, item);
+      M5_LOGV("%d,%d", coord.x, coord.y);
+      wrapper.putIntoBucket(lv_chart_get_x_start_point(_chart_obj.get(),
+                                                       wrapper.chart_series),
+                            coord.x / _minutes_per_bucket, minute, coord.y);
+      wrapper.min_max.push(minute, coord.y);
+    }
+    _latest_rendered_tp = std::max(*_latest_rendered_tp,
+                                   system_clock::time_point{minutes{minute}});
+  }
+  //
+  if (shift > 0 || !arrivals.empty()) {
+    update_y_range();
     lv_chart_refresh(_chart_obj.get());
+  }
+}
+
+//
+template <typename T> void Widget::BasicChart<T>::update_y_range() {
+  // 下限、上限
+  auto y_min = std::numeric_limits<lv_coord_t>::max();
+  auto y_max = std::numeric_limits<lv_coord_t>::min();
+  for (auto &pair : _chart_series_map) {
+    auto [min, max] = pair.second.min_max.getMinMaxOfYPoints();
+    y_min = std::min(y_min, min);
+    y_max = std::max(y_max, max);
+  }
+  //
+  if (y_min == std::numeric_limits<lv_coord_t>::max() &&
+      y_max == std::numeric_limits<lv_coord_t>::min()) {
+    lv_chart_set_range(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y, 0, 1);
   } else {
-    M5_LOGE("null pointer");
+    // 5刻みにまるめる
+    y_min = floor(y_min / 500.0f) * 500.0f;
+    y_max = ceil(y_max / 500.0f) * 500.0f;
+    lv_chart_set_range(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y, y_min, y_max);
+    M5_LOGV("y_min:%d, y_max:%d", y_min, y_max);
   }
 }
 
@@ -1560,17 +1863,20 @@ Widget::TemperatureChart::TemperatureChart(InitArg init)
 
 //
 void Widget::TemperatureChart::update() {
-  auto bme280 =
-      Application::getDataAcquisitionDB().getLatestMeasurementBme280();
-  auto scd30 = Application::getDataAcquisitionDB().getLatestMeasurementScd30();
-  auto scd41 = Application::getDataAcquisitionDB().getLatestMeasurementScd41();
-  auto m5env3 =
-      Application::getDataAcquisitionDB().getLatestMeasurementM5Env3();
-  auto present = Measurements{bme280, scd30, scd41, m5env3};
+  auto &db = Application::getDataAcquisitionDB();
+  // 測定値を読むのは世代が変わった時だけ
+  auto present = decltype(generations){
+      db.getLatestMeasurementGeneration<Sensor::Bme280>(),
+      db.getLatestMeasurementGeneration<Sensor::Scd30>(),
+      db.getLatestMeasurementGeneration<Sensor::Scd41>(),
+      db.getLatestMeasurementGeneration<Sensor::M5Env3>()};
 
   //
-  if (present != latest) {
-    latest = present;
+  if (present != generations) {
+    generations = present;
+    latest = Measurements{
+        db.getLatestMeasurementBme280(), db.getLatestMeasurementScd30(),
+        db.getLatestMeasurementScd41(), db.getLatestMeasurementM5Env3()};
     render();
   }
 }
@@ -1637,16 +1943,11 @@ size_t Widget::TemperatureChart::BC::read_measurements_from_database(
 // データを座標に変換する関数
 lv_point_t Widget::TemperatureChart::BC::coordinateXY(
     system_clock::time_point tp_zero, const Database::TimePointAndDouble &in) {
-  auto [sensorid, timepoint, fp_value] = in;
-  auto degc = DegC(fp_value);
-  auto centi_degc = std::chrono::duration_cast<CentiDegC>(degc);
-  uint32_t timediff =
-      duration_cast<minutes>(floor<minutes>(timepoint) - tp_zero).count();
-  lv_coord_t x =
-      std::clamp(timediff, 0U, uint32_t(Gui::CHART_X_POINT_COUNT - 1));
-  lv_coord_t y = static_cast<lv_coord_t>(centi_degc.count());
-  return lv_point_t{.x = x, .y = y};
-};
+  auto [sensorid, timepoint, value] = in;
+  auto coord = Chart::coordinateXY(Sensor::Metric::Temperature, tp_zero,
+                                   timepoint, value);
+  return lv_point_t{.x = coord.x, .y = coord.y};
+}
 
 //
 void Widget::TemperatureChart::BC::chart_draw_part_tick_label(
@@ -1685,17 +1986,20 @@ Widget::RelativeHumidityChart::RelativeHumidityChart(InitArg init)
 
 //
 void Widget::RelativeHumidityChart::update() {
-  auto bme280 =
-      Application::getDataAcquisitionDB().getLatestMeasurementBme280();
-  auto scd30 = Application::getDataAcquisitionDB().getLatestMeasurementScd30();
-  auto scd41 = Application::getDataAcquisitionDB().getLatestMeasurementScd41();
-  auto m5env3 =
-      Application::getDataAcquisitionDB().getLatestMeasurementM5Env3();
-  auto present = Measurements{bme280, scd30, scd41, m5env3};
+  auto &db = Application::getDataAcquisitionDB();
+  // 測定値を読むのは世代が変わった時だけ
+  auto present = decltype(generations){
+      db.getLatestMeasurementGeneration<Sensor::Bme280>(),
+      db.getLatestMeasurementGeneration<Sensor::Scd30>(),
+      db.getLatestMeasurementGeneration<Sensor::Scd41>(),
+      db.getLatestMeasurementGeneration<Sensor::M5Env3>()};
 
   //
-  if (present != latest) {
-    latest = present;
+  if (present != generations) {
+    generations = present;
+    latest = Measurements{
+        db.getLatestMeasurementBme280(), db.getLatestMeasurementScd30(),
+        db.getLatestMeasurementScd41(), db.getLatestMeasurementM5Env3()};
     //
     render();
   }
@@ -1763,16 +2067,11 @@ size_t Widget::RelativeHumidityChart::BC::read_measurements_from_database(
 // データを座標に変換する関数
 lv_point_t Widget::RelativeHumidityChart::BC::coordinateXY(
     system_clock::time_point tp_zero, const Database::TimePointAndDouble &in) {
-  auto [sensorid, timepoint, fp_value] = in;
-  auto percentRelativeHumidity = PctRH(fp_value);
-  auto rh = std::chrono::duration_cast<CentiRH>(percentRelativeHumidity);
-  uint32_t timediff =
-      duration_cast<minutes>(floor<minutes>(timepoint) - tp_zero).count();
-  lv_coord_t x =
-      std::clamp(timediff, 0U, uint32_t(Gui::CHART_X_POINT_COUNT - 1));
-  lv_coord_t y = static_cast<lv_coord_t>(rh.count());
-  return lv_point_t{.x = x, .y = y};
-};
+  auto [sensorid, timepoint, value] = in;
+  auto coord = Chart::coordinateXY(Sensor::Metric::RelativeHumidity, tp_zero,
+                                   timepoint, value);
+  return lv_point_t{.x = coord.x, .y = coord.y};
+}
 
 void Widget::RelativeHumidityChart::BC::chart_draw_part_tick_label(
     lv_obj_draw_part_dsc_t *dsc) {
@@ -1810,15 +2109,17 @@ Widget::PressureChart::PressureChart(InitArg init)
 
 //
 void Widget::PressureChart::update() {
-  auto bme280 =
-      Application::getDataAcquisitionDB().getLatestMeasurementBme280();
-  auto m5env3 =
-      Application::getDataAcquisitionDB().getLatestMeasurementM5Env3();
-  auto present = Measurements{bme280, m5env3};
+  auto &db = Application::getDataAcquisitionDB();
+  // 測定値を読むのは世代が変わった時だけ
+  auto present = decltype(generations){
+      db.getLatestMeasurementGeneration<Sensor::Bme280>(),
+      db.getLatestMeasurementGeneration<Sensor::M5Env3>()};
 
   //
-  if (present != latest) {
-    latest = present;
+  if (present != generations) {
+    generations = present;
+    latest = Measurements{db.getLatestMeasurementBme280(),
+                          db.getLatestMeasurementM5Env3()};
     //
     render();
   }
@@ -1874,16 +2175,11 @@ size_t Widget::PressureChart::BC::read_measurements_from_database(
 // データを座標に変換する関数
 lv_point_t Widget::PressureChart::BC::coordinateXY(
     system_clock::time_point tp_zero, const Database::TimePointAndDouble &in) {
-  auto [sensorid, timepoint, fp_value] = in;
-  auto hpa = HectoPa(fp_value);
-  auto pascal = std::chrono::duration_cast<Pascal>(hpa - BIAS);
-  uint32_t timediff =
-      duration_cast<minutes>(floor<minutes>(timepoint) - tp_zero).count();
-  lv_coord_t x =
-      std::clamp(timediff, 0U, uint32_t(Gui::CHART_X_POINT_COUNT - 1));
-  lv_coord_t y = static_cast<lv_coord_t>(pascal.count());
-  return lv_point_t{.x = x, .y = y};
-};
+  auto [sensorid, timepoint, value] = in;
+  auto coord = Chart::coordinateXY(Sensor::Metric::Pressure, tp_zero,
+                                   timepoint, value);
+  return lv_point_t{.x = coord.x, .y = coord.y};
+}
 
 //
 void Widget::PressureChart::BC::chart_draw_part_tick_label(
@@ -1922,14 +2218,19 @@ Widget::CarbonDeoxidesChart::CarbonDeoxidesChart(InitArg init)
 
 //
 void Widget::CarbonDeoxidesChart::update() {
-  auto sgp30 = Application::getDataAcquisitionDB().getLatestMeasurementSgp30();
-  auto scd30 = Application::getDataAcquisitionDB().getLatestMeasurementScd30();
-  auto scd41 = Application::getDataAcquisitionDB().getLatestMeasurementScd41();
-  auto present = Measurements{sgp30, scd30, scd41};
+  auto &db = Application::getDataAcquisitionDB();
+  // 測定値を読むのは世代が変わった時だけ
+  auto present = decltype(generations){
+      db.getLatestMeasurementGeneration<Sensor::Sgp30>(),
+      db.getLatestMeasurementGeneration<Sensor::Scd30>(),
+      db.getLatestMeasurementGeneration<Sensor::Scd41>()};
 
   //
-  if (present != latest) {
-    latest = present;
+  if (present != generations) {
+    generations = present;
+    latest = Measurements{db.getLatestMeasurementSgp30(),
+                          db.getLatestMeasurementScd30(),
+                          db.getLatestMeasurementScd41()};
     //
     render();
   }
@@ -1990,14 +2291,11 @@ size_t Widget::CarbonDeoxidesChart::BC::read_measurements_from_database(
 // データを座標に変換する関数
 lv_point_t Widget::CarbonDeoxidesChart::BC::coordinateXY(
     system_clock::time_point tp_zero, const Database::TimePointAndUInt16 &in) {
-  auto [sensorid, timepoint, int_value] = in;
-  uint32_t timediff =
-      duration_cast<minutes>(floor<minutes>(timepoint) - tp_zero).count();
-  lv_coord_t x =
-      std::clamp(timediff, 0U, uint32_t(Gui::CHART_X_POINT_COUNT - 1));
-  lv_coord_t y = static_cast<lv_coord_t>(int_value);
-  return lv_point_t{.x = x, .y = y};
-};
+  auto [sensorid, timepoint, value] = in;
+  auto coord = Chart::coordinateXY(Sensor::Metric::CarbonDioxide, tp_zero,
+                                   timepoint, value);
+  return lv_point_t{.x = coord.x, .y = coord.y};
+}
 
 //
 void Widget::CarbonDeoxidesChart::BC::chart_draw_part_tick_label(
@@ -2036,12 +2334,14 @@ Widget::TotalVocChart::TotalVocChart(InitArg init)
 
 //
 void Widget::TotalVocChart::update() {
-  auto sgp30 = Application::getDataAcquisitionDB().getLatestMeasurementSgp30();
-  auto present = sgp30;
+  auto &db = Application::getDataAcquisitionDB();
+  // 測定値を読むのは世代が変わった時だけ
+  auto present = db.getLatestMeasurementGeneration<Sensor::Sgp30>();
 
   //
-  if (present != latest) {
-    latest = present;
+  if (present != generation) {
+    generation = present;
+    latest = db.getLatestMeasurementSgp30();
     //
     render();
   }
@@ -2088,14 +2388,11 @@ size_t Widget::TotalVocChart::BC::read_measurements_from_database(
 // データを座標に変換する関数
 lv_point_t Widget::TotalVocChart::BC::coordinateXY(
     system_clock::time_point tp_zero, const Database::TimePointAndUInt16 &in) {
-  auto [sensorid, timepoint, int_value] = in;
-  uint32_t timediff =
-      duration_cast<minutes>(floor<minutes>(timepoint) - tp_zero).count();
-  lv_coord_t x =
-      std::clamp(timediff, 0U, uint32_t(Gui::CHART_X_POINT_COUNT - 1));
-  lv_coord_t y = static_cast<lv_coord_t>(int_value / DIVIDER);
-  return lv_point_t{.x = x, .y = y};
-};
+  auto [sensorid, timepoint, value] = in;
+  auto coord = Chart::coordinateXY(Sensor::Metric::TotalVoc, tp_zero,
+                                   timepoint, value);
+  return lv_point_t{.x = coord.x, .y = coord.y};
+}
 
 //
 void Widget::TotalVocChart::BC::chart_draw_part_tick_label(
@@ -2125,3 +2422,207 @@ void Widget::TotalVocChart::BC::chart_draw_part_tick_label(
     break;
   }
 }
+
+//
+// 長い期間の推移
+//
+static std::string history_title(Database::Table table,
+                                 Database::Resolution resolution) {
+  std::string name{};
+  switch (table) {
+  case Database::Table::Temperature:
+    name = "Temperature";
+    break;
+  case Database::Table::RelativeHumidity:
+    name = "Relative Humidity";
+    break;
+  case Database::Table::Pressure:
+    name = "Pressure";
+    break;
+  case Database::Table::CarbonDioxide:
+    name = "CO2";
+    break;
+  case Database::Table::TotalVoc:
+    name = "Total VOC";
+    break;
+  }
+  return name + (resolution == Database::Resolution::Hourly ? " (7 days)"
+                                                             : " (31 days)");
+}
+
+// 集計の値とy座標の倍率
+static double history_y_scale(Database::Table table) {
+  switch (table) {
+  case Database::Table::Temperature:      // 0.01℃
+  case Database::Table::RelativeHumidity: // 0.01%RH
+    return 100.0;
+  case Database::Table::Pressure: // 0.1hPa
+    return 10.0;
+  default:
+    return 1.0;
+  }
+}
+
+//
+Widget::HistoryChart::HistoryChart(InitArg init, Database::Table table,
+                                   Database::Resolution resolution)
+    : TileBase{init, history_title(table, resolution)},
+      _table{table},
+      _resolution{resolution},
+      _point_count{resolution == Database::Resolution::Hourly
+                       ? WEEKLY_POINT_COUNT
+                       : MONTHLY_POINT_COUNT} {}
+
+//
+void Widget::HistoryChart::onActivate() {
+  if (_tile_obj == nullptr || _title_obj == nullptr) {
+    M5_LOGE("tile had null");
+    return;
+  }
+  if (_chart_obj) {
+    render();
+    return;
+  }
+  // create
+  _chart_obj.reset(lv_chart_create(_tile_obj.get()), lv_obj_del);
+  if (!_chart_obj) {
+    M5_LOGE("memory allocation error");
+    return;
+  }
+  //
+  constexpr auto X_TICK_LABEL_LEN = 30;
+  constexpr auto Y_TICK_LABEL_LEN = 60;
+  constexpr auto RIGHT_PADDING = 20;
+  lv_obj_set_style_bg_color(_chart_obj.get(),
+                            lv_palette_lighten(LV_PALETTE_LIGHT_GREEN, 2),
+                            LV_PART_MAIN);
+  lv_obj_set_size(_chart_obj.get(),
+                  lv_obj_get_content_width(_tile_obj.get())              //
+                      - MARGIN - RIGHT_PADDING - Y_TICK_LABEL_LEN,       //
+                  lv_obj_get_content_height(_tile_obj.get())             //
+                      - MARGIN * 2 - lv_obj_get_height(_title_obj.get()) //
+                      - MARGIN - X_TICK_LABEL_LEN);
+  lv_obj_align_to(_chart_obj.get(), _title_obj.get(),
+                  LV_ALIGN_OUT_BOTTOM_RIGHT, -MARGIN - RIGHT_PADDING, MARGIN);
+  // Do not display points on the data
+  lv_obj_set_style_size(_chart_obj.get(), 0, LV_PART_INDICATOR);
+  lv_chart_set_type(_chart_obj.get(), LV_CHART_TYPE_LINE);
+  lv_chart_set_point_count(_chart_obj.get(), _point_count);
+  lv_chart_set_range(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y, 0, 1);
+  lv_chart_set_axis_tick(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_X, 8, 4,
+                         X_AXIS_TICK_COUNT, 2, true, X_TICK_LABEL_LEN);
+  lv_chart_set_axis_tick(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y, 4, 2,
+                         Y_AXIS_TICK_COUNT, 2, true, Y_TICK_LABEL_LEN);
+  lv_obj_add_event_cb(_chart_obj.get(), event_draw_part_begin_callback,
+                      LV_EVENT_DRAW_PART_BEGIN, this);
+  //
+  for (const auto &sensor : Application::getSensors()) {
+    if (sensor) {
+      SensorId sensor_id{sensor->getSensorDescriptor()};
+      auto opt_color = ChartLineColor::getAssignedColor(sensor_id);
+      auto color = opt_color ? *opt_color : lv_color_black();
+      if (auto series = lv_chart_add_series(_chart_obj.get(), color,
+                                            LV_CHART_AXIS_PRIMARY_Y);
+          series) {
+        auto &y_points = _y_points_map[sensor_id];
+        y_points.assign(_point_count, LV_CHART_POINT_NONE);
+        lv_chart_set_ext_y_array(_chart_obj.get(), series, y_points.data());
+      }
+    }
+  }
+  render();
+}
+
+//
+void Widget::HistoryChart::update() {
+  // 集計が畳み込まれた時だけ読み直す
+  if (auto present = Application::getDataAcquisitionDB().getRollupGeneration();
+      present != _generation) {
+    _generation = present;
+    render();
+  }
+}
+
+//
+void Widget::HistoryChart::render() {
+  if (!_chart_obj) {
+    return;
+  }
+  // 右端は1時間毎なら最後に終わった時間, 1日毎なら今日
+  auto now = system_clock::now();
+  auto rightmost =
+      _resolution == Database::Resolution::Hourly
+          ? system_clock::time_point{floor<hours>(now) - hours{1}}
+          : system_clock::time_point{floor<Database::Days>(now)};
+  _begin_x_tp = rightmost - interval() * (_point_count - 1);
+  for (auto &pair : _y_points_map) {
+    std::fill(pair.second.begin(), pair.second.end(), LV_CHART_POINT_NONE);
+  }
+  //
+  const auto scale = history_y_scale(_table);
+  auto y_min = std::numeric_limits<lv_coord_t>::max();
+  auto y_max = std::numeric_limits<lv_coord_t>::min();
+  Application::getDataAcquisitionDB().read_aggregates(
+      _resolution, _table, Database::OrderByAtAsc, _begin_x_tp,
+      [&](size_t counter, Database::TimePointAndAggregate item) -> bool {
+        auto &[sensor_id, at, aggregate] = item;
+        auto found_itr = _y_points_map.find(sensor_id);
+        if (found_itr == _y_points_map.end() || aggregate.samples == 0) {
+          return true;
+        }
+        auto x = (at - _begin_x_tp) / interval();
+        if (x < 0 || x >= _point_count) {
+          return true;
+        }
+        auto y = static_cast<lv_coord_t>(std::lround(aggregate.mean * scale));
+        found_itr->second[x] = y;
+        y_min = std::min(y_min, y);
+        y_max = std::max(y_max, y);
+        return true;
+      });
+  //
+  if (y_min > y_max) {
+    lv_chart_set_range(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y, 0, 1);
+  } else {
+    // 上下に1割の余白を取る
+    auto margin = std::max<lv_coord_t>(1, (y_max - y_min) / 10);
+    lv_chart_set_range(_chart_obj.get(), LV_CHART_AXIS_PRIMARY_Y,
+                       y_min - margin, y_max + margin);
+  }
+  lv_chart_refresh(_chart_obj.get());
+}
+
+//
+void Widget::HistoryChart::event_draw_part_begin_callback(lv_event_t *event) {
+  auto it = static_cast<Widget::HistoryChart *>(event->user_data);
+  if (it == nullptr) {
+    M5_LOGE("user_data had null");
+    return;
+  }
+  lv_obj_draw_part_dsc_t *dsc = lv_event_get_draw_part_dsc(event);
+  if (!lv_obj_draw_part_check_type(dsc, &lv_chart_class,
+                                   LV_CHART_DRAW_PART_TICK_LABEL) ||
+      dsc->text == nullptr) {
+    return;
+  }
+  switch (dsc->id) {
+  case LV_CHART_AXIS_PRIMARY_X: {
+    auto span = it->interval() * (it->_point_count - 1);
+    system_clock::time_point tp =
+        it->_begin_x_tp + span * dsc->value / (X_AXIS_TICK_COUNT - 1);
+    std::time_t time = system_clock::to_time_t(tp);
+    std::tm local_time;
+    localtime_r(&time, &local_time);
+    lv_snprintf(dsc->text, dsc->text_length, "%02d/%02d",
+                local_time.tm_mon + 1, local_time.tm_mday);
+  } break;
+  case LV_CHART_AXIS_PRIMARY_Y:
+    lv_snprintf(dsc->text, dsc->text_length,
+                it->_table == Database::Table::Temperature ? "%.1f" : "%.0f",
+                dsc->value / history_y_scale(it->_table));
+    break;
+  default:
+    M5_LOGD("axis id:%d is ignored.", dsc->id);
+    break;
+  }
+}
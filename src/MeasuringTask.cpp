@@ -1,111 +1,157 @@
-// Copyright (c) 2021 Akihiro Yamamoto.
-// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
-// See LICENSE file in the project root for full license information.
-//
-#include "MeasuringTask.hpp"
-#include "Application.hpp"
-#include "Database.hpp"
-#include "Sensor.hpp"
-#include <chrono>
-#include <future>
-
-using namespace std::chrono;
-using namespace std::chrono_literals;
-
-//
-// それぞれの測定値毎にIoTHubに送信＆データーベースに入れる
-//
-struct MeasuringTask::Visitor {
-  system_clock::time_point time_point;
-  Visitor(system_clock::time_point arg) : time_point{arg} {}
-  // Not Available (N/A)
-  bool operator()(std::monostate) { return false; }
-  // Bosch BME280: Temperature and Humidity and Pressure Sensor
-  bool operator()(const Sensor::Bme280 &in) {
-    Sensor::MeasurementBme280 m = {time_point, in};
-    Application::getTelemetry().enqueue(m);
-    Application::getDataAcquisitionDB().insert(m);
-    return true;
-  }
-  // Sensirion SGP30: Air Quality Sensor
-  bool operator()(const Sensor::Sgp30 &in) {
-    Sensor::MeasurementSgp30 m = {time_point, in};
-    Application::getTelemetry().enqueue(m);
-    Application::getDataAcquisitionDB().insert(m);
-    return true;
-  }
-  // Sensirion SCD30: NDIR CO2 and Temperature and Humidity Sensor
-  bool operator()(const Sensor::Scd30 &in) {
-    Sensor::MeasurementScd30 m = {time_point, in};
-    // CO2の値でLEDの色を変える
-    Application::getRgbLed().fill(RgbLed::colorFromCarbonDioxide(in.co2.value));
-    //
-    Application::getTelemetry().enqueue(m);
-    Application::getDataAcquisitionDB().insert(m);
-    return true;
-  }
-  // Sensirion SCD41: PASens CO2 and Temperature and Humidity Sensor
-  bool operator()(const Sensor::Scd41 &in) {
-    Sensor::MeasurementScd41 m = {time_point, in};
-    Application::getTelemetry().enqueue(m);
-    Application::getDataAcquisitionDB().insert(m);
-    return true;
-  }
-  // M5Stack ENV.iii unit: Temperature and Humidity and Pressure Sensor
-  bool operator()(const Sensor::M5Env3 &in) {
-    Sensor::MeasurementM5Env3 m = {time_point, in};
-    Application::getTelemetry().enqueue(m);
-    Application::getDataAcquisitionDB().insert(m);
-    return true;
-  }
-};
-
-// 測定
-void MeasuringTask::measure() {
-  for (auto &sensor_device : Application::getSensors()) {
-    if (sensor_device->readyToRead()) {
-      sensor_device->read();
-    }
-  }
-}
-
-// 現在値をキューに入れる
-void MeasuringTask::queueIn(system_clock::time_point nowtp) {
-  for (auto &sensor_device : Application::getSensors()) {
-    _queue.emplace(std::make_pair(nowtp, sensor_device->calculateSMA()));
-  }
-}
-
-// キューに値があれば, IoTHubに送信＆データーベースに入れる
-void MeasuringTask::queueOut() {
-  if (_queue.empty() == false) {
-    auto &[tp, m] = _queue.front();
-    std::visit(Visitor{tp}, m);
-    _queue.pop();
-  }
-}
-
-//
-bool MeasuringTask::begin(std::chrono::system_clock::time_point nowtp) {
-  auto extra_sec =
-      std::chrono::duration_cast<seconds>(nowtp.time_since_epoch()) % 60s;
-  //
-  next_queue_in_tp = nowtp + 1min - extra_sec;
-  next_run_tp = nowtp + 1s; // 次回の実行予定時間
-  return true;
-}
-
-// 測定関数
-void MeasuringTask::task_handler(std::chrono::system_clock::time_point nowtp) {
-  if (nowtp >= next_queue_in_tp) {
-    auto extra_sec =
-        std::chrono::duration_cast<seconds>(nowtp.time_since_epoch()) % 60s;
-    next_queue_in_tp = nowtp + 1min - extra_sec;
-    //
-    queueIn(nowtp); // 現在値をキューに入れる
-  } else if (nowtp >= next_run_tp) {
-    next_run_tp = nowtp + 1s; // 次回の実行予定時間
-    measure();                // 測定
-    queueOut();               // コミット
-  }
-}
+// Copyright (c) 2021 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "MeasuringTask.hpp"
+#include "Application.hpp"
+#include "Database.hpp"
+#include "Diagnostics.hpp"
+#include "Sensor.hpp"
+#include "SensorTraits.hpp"
+#include <algorithm>
+#include <chrono>
+#include <future>
+
+#include <M5Unified.h>
+
+using namespace std::chrono;
+using namespace std::chrono_literals;
+
+//
+// それぞれの測定値毎にIoTHubに送信する
+//
+struct MeasuringTask::Visitor {
+  system_clock::time_point time_point;
+  Visitor(system_clock::time_point arg) : time_point{arg} {}
+  // Not Available (N/A)
+  bool operator()(std::monostate) { return false; }
+  // 測定値の扱いはSensor::Traitsの表で決まる
+  template <typename V> bool operator()(const V &in) {
+    if constexpr (Sensor::Traits<V>::indicates_co2) {
+      // CO2の値でLEDの色をゆっくり変える
+      Application::getRgbLed().fadeTo(
+          RgbLed::colorFromCarbonDioxide(in.co2.value), RgbLed::CO2_TRANSITION);
+    }
+    Application::getTelemetry().enqueue(Sensor::Measurement<V>{time_point, in});
+    return true;
+  }
+};
+
+// 測定
+Scheduler::Duration MeasuringTask::measure() {
+  Diagnostics::ScopedTimer timer{Diagnostics::Probe::Measure};
+  auto now = steady_clock::now();
+  // 読み出せるようになったセンサーの変換を一斉に始める
+  for (auto &sensor_device : Application::getSensors()) {
+    Sensor::Device *device = sensor_device.get();
+    bool converting = std::any_of(
+        _conversions.begin(), _conversions.end(),
+        [device](const Conversion &c) { return c.device == device; });
+    if (!converting && device->readyToRead()) {
+      if (auto wait = device->startConversion(); wait) {
+        _conversions.push_back(Conversion{device, now + *wait});
+      }
+    }
+  }
+  // 変換の終わったセンサーから読み出す
+  for (auto itr = _conversions.begin(); itr != _conversions.end();) {
+    now = steady_clock::now();
+    if (now >= itr->due && itr->device->conversionComplete()) {
+      Diagnostics::ScopedTimer timer{Diagnostics::Probe::SensorRead};
+      itr->device->collect();
+      itr = _conversions.erase(itr);
+    } else if (now >= itr->due + CONVERSION_TIMEOUT) {
+      M5_LOGE("sensor conversion timed out.");
+      itr = _conversions.erase(itr);
+    } else {
+      ++itr;
+    }
+  }
+  // 次に変換が終わる頃まで眠る
+  Scheduler::Duration interval = POLLING_INTERVAL;
+  for (const auto &c : _conversions) {
+    auto remain = std::max(ceil<milliseconds>(c.due - now), milliseconds{1});
+    interval = std::min(interval, remain);
+  }
+  return interval;
+}
+
+// 現在値をキューに入れる
+void MeasuringTask::queueIn(system_clock::time_point nowtp) {
+  std::vector<Sensor::MeasuredValue> values{};
+  values.reserve(Application::getSensors().size());
+  for (auto &sensor_device : Application::getSensors()) {
+    auto value = sensor_device->calculateSMA();
+    if (_deadband.pass(nowtp, value)) {
+      values.emplace_back(std::move(value));
+    }
+  }
+  if (values.empty()) {
+    return;
+  }
+  if (!_queue.push(std::make_pair(nowtp, std::move(values)))) {
+    M5_LOGE("measurement queue is full; values are discarded");
+    return;
+  }
+  if (_storing) {
+    _storing->notify(_queue_out_job);
+  }
+}
+
+// キューに値があれば, IoTHubに送信＆データーベースに入れる
+Scheduler::Duration MeasuringTask::queueOut() {
+  // 書き戻しが終わるまでキューに溜めておく
+  if (Application::getDataAcquisitionDB().importing()) {
+    return IMPORT_POLLING_INTERVAL;
+  }
+  if (auto item = _queue.pop(); item) {
+    auto &[tp, values] = *item;
+    for (const auto &m : values) {
+      std::visit(Visitor{tp}, m);
+    }
+    // 同じ時間の測定値は1つのトランザクションで入れる
+    if (Application::getDataAcquisitionDB().insert(tp, values)) {
+      // 再起動した時に書き戻せるように溜めておく
+      Application::getWarmStartSnapshot().stage(tp, values);
+    }
+  }
+  // 溜まっていれば続けて出す
+  return _queue.empty() ? Scheduler::Duration{QUEUE_OUT_IDLE_INTERVAL}
+                        : Scheduler::Duration::zero();
+}
+
+//
+void MeasuringTask::begin(std::chrono::system_clock::time_point nowtp) {
+  auto extra_sec =
+      std::chrono::duration_cast<seconds>(nowtp.time_since_epoch()) % 60s;
+  //
+  next_queue_in_tp = nowtp + 1min - extra_sec;
+}
+
+//
+void MeasuringTask::schedule(Scheduler &sampling, Scheduler &storing) {
+  // 測定
+  sampling.add(1s, [this]() -> Scheduler::Duration { return measure(); });
+  // コミット(キューに入れた時に起こされる)
+  _storing = &storing;
+  _queue_out_job =
+      storing.add(1s, [this]() -> Scheduler::Duration { return queueOut(); });
+  // 毎分0秒に現在値をキューに入れる
+  // (時刻が合うまでは測定だけして, キューに入れない)
+  sampling.add(1s, [this]() -> Scheduler::Duration {
+    if (!Application::isTimeValid()) {
+      return TIME_POLLING_INTERVAL;
+    }
+    auto nowtp = system_clock::now();
+    if (!next_queue_in_tp) {
+      begin(nowtp);
+    } else if (nowtp >= *next_queue_in_tp) {
+      begin(nowtp);
+      //
+      queueIn(nowtp); // 現在値をキューに入れる
+    }
+    // 時計が合わされても1分以内に追いつく
+    auto interval = ceil<milliseconds>(*next_queue_in_tp - nowtp);
+    return std::clamp<Scheduler::Duration>(interval, 1ms, 1min);
+  });
+}
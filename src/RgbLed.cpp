@@ -7,18 +7,82 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <thread>
+
+using namespace std::chrono;
 
 //
-void RgbLed::begin() {
+void RgbLed::begin(BaseType_t core) {
   FastLED.addLeds<SK6812, GPIO_PIN_SK6815, GRB>(leds.data(), leds.size());
   FastLED.setBrightness(255);
   clear();
+  xTaskCreatePinnedToCore(task, "Task:RgbLed", TASK_STACK_SIZE, this, 1,
+                          nullptr, core);
+}
+
+//
+void RgbLed::setBrightness(uint8_t scale) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  _brightness = scale;
 }
 
 //
-void RgbLed::fill(CRGB color) {
-  std::fill(leds.begin(), leds.end(), color);
-  FastLED.show();
+void RgbLed::fadeTo(CRGB color, milliseconds duration) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto now = steady_clock::now();
+  _from = color_at(now);
+  _to = color;
+  _transition_start = now;
+  _transition_duration = duration;
+  _rainbow_period.reset();
+}
+
+//
+void RgbLed::rainbow(milliseconds period) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  _rainbow_period = std::max(period, milliseconds{1});
+  _rainbow_start = steady_clock::now();
+}
+
+//
+CRGB RgbLed::color_at(steady_clock::time_point now) const {
+  if (_rainbow_period) {
+    auto elapsed = duration_cast<milliseconds>(now - _rainbow_start);
+    return hueToRgb(elapsed % *_rainbow_period * 360 / *_rainbow_period);
+  }
+  auto elapsed = duration_cast<milliseconds>(now - _transition_start);
+  if (elapsed >= _transition_duration) {
+    return _to;
+  }
+  return blend(_from, _to,
+               static_cast<fract8>(elapsed * 256 / _transition_duration));
+}
+
+//
+bool RgbLed::animating(steady_clock::time_point now) const {
+  return _rainbow_period || now - _transition_start < _transition_duration;
+}
+
+// 前に送ったのと同じ色と明るさならLEDに送らない
+void RgbLed::task(void *arg) {
+  RgbLed &self = *static_cast<RgbLed *>(arg);
+  while (true) {
+    std::pair<CRGB, uint8_t> frame;
+    bool animating{false};
+    {
+      std::lock_guard<std::mutex> lock{self._mutex};
+      auto now = steady_clock::now();
+      frame = std::make_pair(self.color_at(now), self._brightness);
+      animating = self.animating(now);
+    }
+    if (self._shown != frame) {
+      std::fill(self.leds.begin(), self.leds.end(), frame.first);
+      FastLED.setBrightness(frame.second);
+      FastLED.show();
+      self._shown = frame;
+    }
+    std::this_thread::sleep_for(animating ? FRAME_INTERVAL : IDLE_INTERVAL);
+  }
 }
 
 //
@@ -36,7 +100,21 @@ CRGB RgbLed::colorFromCarbonDioxide(uint16_t ppm) {
   constexpr float_t saturation = 1.0;
   constexpr float_t lightness = 0.5;
 
-  return hslToRgb(hue >= 360.0 ? hue - 360.0 : hue, saturation, lightness);
+  static_assert(saturation == 1.0 && lightness == 0.5);
+  return hueToRgb(static_cast<uint16_t>(hue >= 360.0 ? hue - 360.0 : hue));
+}
+
+//
+CRGB RgbLed::hueToRgb(uint16_t hue /* 0 < 360*/) {
+  // 初めて呼んだ時に作る
+  static const std::array<CRGB, 360> table = [] {
+    std::array<CRGB, 360> colors{};
+    for (size_t i = 0; i < colors.size(); ++i) {
+      colors[i] = hslToRgb(i, 1.0, 0.5);
+    }
+    return colors;
+  }();
+  return table[hue % table.size()];
 }
 
 //
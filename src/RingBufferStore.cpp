@@ -0,0 +1,322 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "RingBufferStore.hpp"
+#include <chrono>
+#include <limits>
+#include <optional>
+#include <tuple>
+
+#include <M5Unified.h>
+
+using namespace std::chrono;
+
+namespace {
+//
+using OrderBy = Database::OrderBy;
+using TimePointAndDouble = Database::TimePointAndDouble;
+using TimePointAndUInt16 = Database::TimePointAndUInt16;
+using TimePointAndIntAndOptInt = Database::TimePointAndIntAndOptInt;
+
+// at_begin以降の最初の分
+uint32_t ceil_minute(system_clock::time_point tp) {
+  auto m = ceil<minutes>(tp.time_since_epoch()).count();
+  return m > 0 ? static_cast<uint32_t>(m) : 0;
+}
+
+// 分の範囲[first, last]を並び順に走査する
+// visitがfalseを返したら打ち切る
+template <typename F>
+void for_each_minute(uint32_t first, uint32_t last, OrderBy order, F visit) {
+  if (first > last) {
+    return;
+  }
+  if (order == Database::OrderByAtDesc) {
+    for (uint32_t minute = last; visit(minute) && minute != first; --minute) {
+    }
+  } else {
+    for (uint32_t minute = first; visit(minute) && minute != last; ++minute) {
+    }
+  }
+}
+
+// 全センサーのリングバッファを時刻順に読む
+template <typename MAP, typename DECODE, typename CALLBACK>
+size_t read_by_time(const MAP &rings, uint32_t first_minute, OrderBy order,
+                    DECODE decode, CALLBACK &callback) {
+  uint32_t oldest{std::numeric_limits<uint32_t>::max()};
+  uint32_t latest{0};
+  for (const auto &[sensor_id, ring] : rings) {
+    oldest = std::min(oldest, ring.oldest_minute());
+    latest = std::max(latest, ring.latest_minute());
+  }
+  //
+  size_t counter{1}; // 1 start
+  for_each_minute(std::max(first_minute, oldest), latest, order,
+                  [&](uint32_t minute) -> bool {
+                    for (const auto &[sensor_id, ring] : rings) {
+                      if (auto item = decode(sensor_id, ring, minute); item) {
+                        if (callback(counter, *item) == false) {
+                          return false;
+                        }
+                        counter++;
+                      }
+                    }
+                    return true;
+                  });
+  return counter;
+}
+
+// 1つのセンサーのリングバッファを読む
+template <typename MAP, typename DECODE, typename CALLBACK>
+size_t read_by_sensor(const MAP &rings, SensorId sensor_id,
+                      uint32_t floor_minute, OrderBy order, size_t limit,
+                      DECODE decode, CALLBACK &callback) {
+  size_t counter{1}; // 1 start
+  auto found = rings.find(sensor_id);
+  if (found == rings.end()) {
+    return counter;
+  }
+  const auto &ring = found->second;
+  for_each_minute(std::max(floor_minute, ring.oldest_minute()),
+                  ring.latest_minute(), order, [&](uint32_t minute) -> bool {
+                    if (counter > limit) {
+                      return false;
+                    }
+                    if (auto item = decode(sensor_id, ring, minute); item) {
+                      if (callback(counter, *item) == false) {
+                        return false;
+                      }
+                      counter++;
+                    }
+                    return true;
+                  });
+  return counter;
+}
+
+// 詰めて持っている値を元の単位に戻す
+template <typename To, typename From> struct DecodeDouble {
+  template <typename RING>
+  std::optional<TimePointAndDouble>
+  operator()(SensorId sensor_id, const RING &ring, uint32_t minute) const {
+    if (auto v = ring.get(minute); v) {
+      return TimePointAndDouble{sensor_id, RingBufferStore::from_minute(minute),
+                                To{From{*v}}.count()};
+    }
+    return std::nullopt;
+  }
+};
+
+//
+struct DecodeUInt16 {
+  std::optional<TimePointAndUInt16>
+  operator()(SensorId sensor_id, const RingBufferStore::RingWithBaseline &ring,
+             uint32_t minute) const {
+    if (auto v = ring.value.get(minute); v) {
+      return TimePointAndUInt16{sensor_id, RingBufferStore::from_minute(minute),
+                                *v};
+    }
+    return std::nullopt;
+  }
+};
+
+//
+struct DecodeIntAndOptInt {
+  std::optional<TimePointAndIntAndOptInt>
+  operator()(SensorId sensor_id, const RingBufferStore::RingWithBaseline &ring,
+             uint32_t minute) const {
+    if (auto v = ring.value.get(minute); v) {
+      return TimePointAndIntAndOptInt{sensor_id,
+                                      RingBufferStore::from_minute(minute), *v,
+                                      ring.baseline.get(minute)};
+    }
+    return std::nullopt;
+  }
+};
+
+// 最新の分が削除済みになったリングバッファを取り除く
+template <typename MAP> void erase_expired(MAP &rings, uint32_t floor_minute) {
+  for (auto it = rings.begin(); it != rings.end();) {
+    if (it->second.latest_minute() < floor_minute) {
+      it = rings.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+} // namespace
+
+//
+//
+//
+bool RingBufferStore::insert(Table table, TimePointAndDouble values) {
+  auto [sensor_id, tp, fp_value] = values;
+  auto minute = to_minute(tp);
+  std::lock_guard<std::mutex> lock{_mutex};
+  switch (table) {
+  case Table::Temperature: {
+    auto [it, _] = _temperature.try_emplace(sensor_id, _capacity);
+    return it->second.put(minute, round<CentiDegC>(DegC(fp_value)).count());
+  }
+  case Table::RelativeHumidity: {
+    auto [it, _] = _relative_humidity.try_emplace(sensor_id, _capacity);
+    return it->second.put(minute, round<CentiRH>(PctRH(fp_value)).count());
+  }
+  case Table::Pressure: {
+    auto [it, _] = _pressure.try_emplace(sensor_id, _capacity);
+    return it->second.put(minute, round<DeciPa>(HectoPa(fp_value)).count());
+  }
+  default:
+    M5_LOGE("table %d does not have REAL values", static_cast<int>(table));
+    return false;
+  }
+}
+
+//
+bool RingBufferStore::insert(Table table, TimePointAndIntAndOptInt values) {
+  auto [sensor_id, tp, u16_value, optional_u16_value] = values;
+  auto minute = to_minute(tp);
+  if (table != Table::CarbonDioxide && table != Table::TotalVoc) {
+    M5_LOGE("table %d does not have INTEGER values", static_cast<int>(table));
+    return false;
+  }
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto &rings = table == Table::CarbonDioxide ? _carbon_dioxide : _total_voc;
+  auto [it, _] = rings.try_emplace(sensor_id, _capacity);
+  if (!it->second.value.put(minute, u16_value)) {
+    return false;
+  }
+  if (optional_u16_value) {
+    it->second.baseline.put(minute, *optional_u16_value);
+  }
+  return true;
+}
+
+//
+//
+//
+std::optional<size_t> RingBufferStore::read(
+    Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+    ReadCallback<TimePointAndDouble> callback) {
+  auto [at_begin, order] = placeholder;
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto first = std::max(ceil_minute(at_begin), _floor_minute);
+  switch (table) {
+  case Table::Temperature:
+    return read_by_time(_temperature, first, order,
+                        DecodeDouble<DegC, CentiDegC>{}, callback);
+  case Table::RelativeHumidity:
+    return read_by_time(_relative_humidity, first, order,
+                        DecodeDouble<PctRH, CentiRH>{}, callback);
+  case Table::Pressure:
+    return read_by_time(_pressure, first, order,
+                        DecodeDouble<HectoPa, DeciPa>{}, callback);
+  default:
+    return std::nullopt;
+  }
+}
+
+//
+std::optional<size_t>
+RingBufferStore::read(Table table,
+                      std::tuple<SensorId, OrderBy, size_t> placeholder,
+                      ReadCallback<TimePointAndDouble> callback) {
+  auto [sensor_id, order, limit] = placeholder;
+  std::lock_guard<std::mutex> lock{_mutex};
+  switch (table) {
+  case Table::Temperature:
+    return read_by_sensor(_temperature, sensor_id, _floor_minute, order, limit,
+                          DecodeDouble<DegC, CentiDegC>{}, callback);
+  case Table::RelativeHumidity:
+    return read_by_sensor(_relative_humidity, sensor_id, _floor_minute, order,
+                          limit, DecodeDouble<PctRH, CentiRH>{}, callback);
+  case Table::Pressure:
+    return read_by_sensor(_pressure, sensor_id, _floor_minute, order, limit,
+                          DecodeDouble<HectoPa, DeciPa>{}, callback);
+  default:
+    return std::nullopt;
+  }
+}
+
+//
+std::optional<size_t> RingBufferStore::read(
+    Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+    ReadCallback<TimePointAndUInt16> callback) {
+  auto [at_begin, order] = placeholder;
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto first = std::max(ceil_minute(at_begin), _floor_minute);
+  switch (table) {
+  case Table::CarbonDioxide:
+    return read_by_time(_carbon_dioxide, first, order, DecodeUInt16{},
+                        callback);
+  case Table::TotalVoc:
+    return read_by_time(_total_voc, first, order, DecodeUInt16{}, callback);
+  default:
+    return std::nullopt;
+  }
+}
+
+//
+std::optional<size_t> RingBufferStore::read(
+    Table table, std::tuple<system_clock::time_point, OrderBy> placeholder,
+    ReadCallback<TimePointAndIntAndOptInt> callback) {
+  auto [at_begin, order] = placeholder;
+  std::lock_guard<std::mutex> lock{_mutex};
+  auto first = std::max(ceil_minute(at_begin), _floor_minute);
+  switch (table) {
+  case Table::CarbonDioxide:
+    return read_by_time(_carbon_dioxide, first, order, DecodeIntAndOptInt{},
+                        callback);
+  case Table::TotalVoc:
+    return read_by_time(_total_voc, first, order, DecodeIntAndOptInt{},
+                        callback);
+  default:
+    return std::nullopt;
+  }
+}
+
+//
+std::optional<size_t>
+RingBufferStore::read(Table table,
+                      std::tuple<SensorId, OrderBy, size_t> placeholder,
+                      ReadCallback<TimePointAndIntAndOptInt> callback) {
+  auto [sensor_id, order, limit] = placeholder;
+  std::lock_guard<std::mutex> lock{_mutex};
+  switch (table) {
+  case Table::CarbonDioxide:
+    return read_by_sensor(_carbon_dioxide, sensor_id, _floor_minute, order,
+                          limit, DecodeIntAndOptInt{}, callback);
+  case Table::TotalVoc:
+    return read_by_sensor(_total_voc, sensor_id, _floor_minute, order, limit,
+                          DecodeIntAndOptInt{}, callback);
+  default:
+    return std::nullopt;
+  }
+}
+
+//
+//
+//
+bool RingBufferStore::delete_older_than(system_clock::time_point tp) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  // 値は上書きで消えるので読み出しの下限を上げるだけ
+  _floor_minute = std::max(_floor_minute, ceil_minute(tp));
+  erase_expired(_temperature, _floor_minute);
+  erase_expired(_relative_humidity, _floor_minute);
+  erase_expired(_pressure, _floor_minute);
+  erase_expired(_carbon_dioxide, _floor_minute);
+  erase_expired(_total_voc, _floor_minute);
+  return true;
+}
+
+//
+void RingBufferStore::clear() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  _floor_minute = 0;
+  _temperature.clear();
+  _relative_humidity.clear();
+  _pressure.clear();
+  _carbon_dioxide.clear();
+  _total_voc.clear();
+}
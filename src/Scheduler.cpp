@@ -0,0 +1,76 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "Scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+using namespace std::chrono;
+
+//
+Scheduler::JobId Scheduler::add(Duration first_delay, Job job) {
+  JobId id = _jobs.size();
+  _jobs.emplace_back(std::move(job));
+  _due.emplace_back(steady_clock::now() + first_delay);
+  _notified.emplace_back(false);
+  _deadlines.push(Deadline{_due[id], id});
+  return id;
+}
+
+//
+void Scheduler::notify(JobId id) {
+  if (id >= _notified.size()) {
+    return;
+  }
+  _notified[id] = true;
+  if (TaskHandle_t task = _task.load(); task) {
+    xTaskNotifyGive(task);
+  }
+}
+
+//
+Scheduler::Duration Scheduler::run_pending(steady_clock::time_point now) {
+  // 起こされた仕事は今が期限
+  for (JobId id = 0; id < _notified.size(); ++id) {
+    if (_notified[id].exchange(false) && _due[id] > now) {
+      _due[id] = now;
+      _deadlines.push(Deadline{now, id});
+    }
+  }
+  while (!_deadlines.empty() && _deadlines.top().due <= now) {
+    Deadline deadline = _deadlines.top();
+    _deadlines.pop();
+    if (deadline.due != _due[deadline.job_index]) {
+      continue; // 起こされて前倒しした残り
+    }
+    Duration interval = _jobs[deadline.job_index]();
+    // 次の期限は実行を終えた時から数える
+    deadline.due = steady_clock::now() + interval;
+    _due[deadline.job_index] = deadline.due;
+    _deadlines.push(deadline);
+  }
+  // 古い期限を先頭から捨てる
+  while (!_deadlines.empty() &&
+         _deadlines.top().due != _due[_deadlines.top().job_index]) {
+    _deadlines.pop();
+  }
+  if (_deadlines.empty()) {
+    return MAX_SLEEP;
+  }
+  auto sleep = ceil<Duration>(_deadlines.top().due - steady_clock::now());
+  return std::clamp(sleep, Duration::zero(), MAX_SLEEP);
+}
+
+//
+void Scheduler::run() {
+  _task = xTaskGetCurrentTaskHandle();
+  while (true) {
+    Duration sleep = run_pending(steady_clock::now());
+    // 次の期限かnotifyされるまで眠る(最低1tick)
+    ulTaskNotifyTake(pdTRUE,
+                     std::max<TickType_t>(pdMS_TO_TICKS(sleep.count()), 1));
+  }
+}
@@ -6,11 +6,65 @@
 #include "Application.hpp"
 #include <M5Unified.h>
 
+#include <array>
 #include <cmath>
+#include <thread>
 #include <variant>
 
 using namespace std::chrono;
 
+// Sensirionのセンサーが2バイト毎に付けるCRC-8
+static uint8_t sensirion_crc8(const uint8_t *data, size_t length) {
+  uint8_t crc = 0xff;
+  for (size_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// 変換開始のコマンドを送る(変換の完了は待たない)
+static bool sensirion_send_command(TwoWire &wire, uint8_t address,
+                                   uint16_t command) {
+  wire.beginTransmission(address);
+  wire.write(static_cast<uint8_t>(command >> 8));
+  wire.write(static_cast<uint8_t>(command & 0xff));
+  return wire.endTransmission() == 0;
+}
+
+// 変換の終わった値(CRC付きの2バイトの値がN個)を読み出す
+template <size_t N>
+static bool sensirion_read_words(TwoWire &wire, uint8_t address,
+                                 std::array<uint16_t, N> &out) {
+  constexpr auto length = static_cast<uint8_t>(N * 3);
+  if (wire.requestFrom(address, length) != length) {
+    return false;
+  }
+  for (auto &word : out) {
+    std::array<uint8_t, 3> buffer{};
+    for (auto &octet : buffer) {
+      octet = static_cast<uint8_t>(wire.read());
+    }
+    if (sensirion_crc8(buffer.data(), 2) != buffer[2]) {
+      return false;
+    }
+    word = static_cast<uint16_t>(buffer[0] << 8 | buffer[1]);
+  }
+  return true;
+}
+
+// 移動平均の窓の中のばらつき
+template <typename SMA>
+static void log_statistics(const char *sensor, const char *name,
+                           const SMA &sma) {
+  auto stat = sma.statistics();
+  M5_LOGD("%s %s: n=%u mean=%d min=%d max=%d sd=%.2f", sensor, name,
+          stat.count, static_cast<int>(stat.mean), static_cast<int>(stat.min),
+          static_cast<int>(stat.max), std::sqrt(stat.variance));
+}
+
 //
 // Bosch BME280 Humidity and Pressure Sensor
 //
@@ -26,7 +80,7 @@ bool Sensor::Bme280Device::begin() {
 
 //
 bool Sensor::Bme280Device::readyToRead() {
-  return available() && (steady_clock::now() - last_measured_at >= INTERVAL);
+  return available() && (steady_clock::now() - last_measured_at >= interval);
 }
 
 //
@@ -59,6 +113,7 @@ Sensor::MeasuredValue Sensor::Bme280Device::read() {
     auto pa = round<DeciPa>(Pascal(pressure));
     // successfully
     last_measured_at = steady_clock::now();
+    adaptInterval(DegC(t).count());
     sma_temperature.push_back(t.count());
     sma_relative_humidity.push_back(rh.count());
     sma_pressure.push_back(pa.count());
@@ -82,6 +137,9 @@ error_exit:
 Sensor::MeasuredValue Sensor::Bme280Device::calculateSMA() {
   if (sma_temperature.ready() && sma_relative_humidity.ready() &&
       sma_pressure.ready()) {
+    log_statistics("BME280", "temperature", sma_temperature);
+    log_statistics("BME280", "relative_humidity", sma_relative_humidity);
+    log_statistics("BME280", "pressure", sma_pressure);
     return Bme280({
         .sensor_descriptor = getSensorDescriptor(),
         .temperature = CentiDegC(sma_temperature.calculate()),
@@ -93,6 +151,14 @@ Sensor::MeasuredValue Sensor::Bme280Device::calculateSMA() {
   }
 }
 
+//
+void Sensor::Bme280Device::resizeAveragingWindow() {
+  auto samples = samplesInWindow(averaging_window, interval, SMA_CAPACITY);
+  sma_temperature.resize(samples);
+  sma_relative_humidity.resize(samples);
+  sma_pressure.resize(samples);
+}
+
 //
 // Sensirion SGP30: Air Quality Sensor
 //
@@ -106,18 +172,40 @@ bool Sensor::Sgp30Device::begin() {
 }
 //
 bool Sensor::Sgp30Device::readyToRead() {
-  return available() && (steady_clock::now() - last_measured_at >= INTERVAL);
+  return available() && (steady_clock::now() - last_measured_at >= interval);
 }
 //
 Sensor::MeasuredValue Sensor::Sgp30Device::read() {
+  if (auto wait = startConversion(); wait) {
+    std::this_thread::sleep_for(*wait);
+    return collect();
+  }
+  return std::monostate{};
+}
+
+//
+std::optional<std::chrono::milliseconds>
+Sensor::Sgp30Device::startConversion() {
   if (!available()) {
     M5_LOGE("SGP30 sensor inactived.");
-    return std::monostate{};
+    return std::nullopt;
   }
-  if (!sgp30.IAQmeasure()) {
+  // Measure_iaq
+  if (!sensirion_send_command(two_wire, SGP30_I2C_ADDRESS, 0x2008)) {
+    M5_LOGE("SGP30 sensing failed.");
+    return std::nullopt;
+  }
+  return MEASURE_IAQ_DURATION;
+}
+
+//
+Sensor::MeasuredValue Sensor::Sgp30Device::collect() {
+  std::array<uint16_t, 2> words{};
+  if (!sensirion_read_words(two_wire, SGP30_I2C_ADDRESS, words)) {
     M5_LOGE("SGP30 sensing failed.");
     return std::monostate{};
   }
+  auto [measured_eco2, measured_tvoc] = words;
   // 稼働時間が 12hour　を超えている状態のときにベースラインを取得する
   constexpr auto half_day = seconds{12 * 60 * 60}; // 43200 seconds
   if (Application::uptime() > half_day) {
@@ -129,12 +217,13 @@ Sensor::MeasuredValue Sensor::Sgp30Device::read() {
 
   // successfully
   last_measured_at = steady_clock::now();
-  sma_eCo2.push_back(sgp30.eCO2);
-  sma_tvoc.push_back(sgp30.TVOC);
+  adaptInterval(measured_eco2);
+  sma_eCo2.push_back(measured_eco2);
+  sma_tvoc.push_back(measured_tvoc);
   return Sgp30({
       .sensor_descriptor = getSensorDescriptor(),
-      .eCo2 = Ppm(sgp30.eCO2),
-      .tvoc = Ppb(sgp30.TVOC),
+      .eCo2 = Ppm(measured_eco2),
+      .tvoc = Ppb(measured_tvoc),
       .eCo2_baseline = last_eco2_baseline,
       .tvoc_baseline = last_tvoc_baseline,
   });
@@ -143,6 +232,8 @@ Sensor::MeasuredValue Sensor::Sgp30Device::read() {
 //
 Sensor::MeasuredValue Sensor::Sgp30Device::calculateSMA() {
   if (sma_eCo2.ready() && sma_tvoc.ready()) {
+    log_statistics("SGP30", "eCo2", sma_eCo2);
+    log_statistics("SGP30", "tvoc", sma_tvoc);
     return Sgp30({
         .sensor_descriptor = getSensorDescriptor(),
         .eCo2 = Ppm(sma_eCo2.calculate()),
@@ -155,6 +246,13 @@ Sensor::MeasuredValue Sensor::Sgp30Device::calculateSMA() {
   }
 }
 
+//
+void Sensor::Sgp30Device::resizeAveragingWindow() {
+  auto samples = samplesInWindow(averaging_window, interval, SMA_CAPACITY);
+  sma_eCo2.resize(samples);
+  sma_tvoc.resize(samples);
+}
+
 //
 bool Sensor::Sgp30Device::setIAQBaseline(BaselineECo2 eco2_base,
                                          BaselineTotalVoc tvoc_base) {
@@ -199,7 +297,7 @@ bool Sensor::Scd30Device::begin() {
 
 //
 bool Sensor::Scd30Device::readyToRead() {
-  return available() && (steady_clock::now() - last_measured_at >= INTERVAL) &&
+  return available() && (steady_clock::now() - last_measured_at >= interval) &&
          scd30.dataReady();
 }
 //
@@ -239,6 +337,7 @@ Sensor::MeasuredValue Sensor::Scd30Device::read() {
 
   // successfully
   last_measured_at = steady_clock::now();
+  adaptInterval(co2);
   CentiDegC tCelcius = CentiDegC(static_cast<int16_t>(100.0f * temperature));
   CentiRH mRH = CentiRH(static_cast<int16_t>(100.0f * relative_humidity));
   sma_co2.push_back(static_cast<uint16_t>(co2));
@@ -256,6 +355,9 @@ Sensor::MeasuredValue Sensor::Scd30Device::read() {
 Sensor::MeasuredValue Sensor::Scd30Device::calculateSMA() {
   if (sma_co2.ready() && sma_temperature.ready() &&
       sma_relative_humidity.ready()) {
+    log_statistics("SCD30", "co2", sma_co2);
+    log_statistics("SCD30", "temperature", sma_temperature);
+    log_statistics("SCD30", "relative_humidity", sma_relative_humidity);
     return Scd30({
         .sensor_descriptor = getSensorDescriptor(),
         .co2 = Ppm(sma_co2.calculate()),
@@ -267,6 +369,14 @@ Sensor::MeasuredValue Sensor::Scd30Device::calculateSMA() {
   }
 }
 
+//
+void Sensor::Scd30Device::resizeAveragingWindow() {
+  auto samples = samplesInWindow(averaging_window, interval, SMA_CAPACITY);
+  sma_co2.resize(samples);
+  sma_temperature.resize(samples);
+  sma_relative_humidity.resize(samples);
+}
+
 //
 // Sensirion SCD41: PASens CO2 and Temperature and Humidity Sensor
 //
@@ -308,7 +418,7 @@ Sensor::Scd41Device::SensorStatus Sensor::Scd41Device::getSensorStatus() {
 
 //
 bool Sensor::Scd41Device::readyToRead() {
-  return available() && (steady_clock::now() - last_measured_at >= INTERVAL) &&
+  return available() && (steady_clock::now() - last_measured_at >= interval) &&
          getSensorStatus() == SensorStatus::DataReady;
 }
 
@@ -339,6 +449,7 @@ Sensor::MeasuredValue Sensor::Scd41Device::read() {
 
   // successfully
   last_measured_at = steady_clock::now();
+  adaptInterval(co2);
   CentiDegC tCelcius = CentiDegC(static_cast<int16_t>(100.0f * temperature));
   CentiRH mRH = CentiRH(static_cast<int16_t>(100.0f * relative_humidity));
   sma_co2.push_back(static_cast<uint16_t>(co2));
@@ -356,6 +467,9 @@ Sensor::MeasuredValue Sensor::Scd41Device::read() {
 Sensor::MeasuredValue Sensor::Scd41Device::calculateSMA() {
   if (sma_co2.ready() && sma_temperature.ready() &&
       sma_relative_humidity.ready()) {
+    log_statistics("SCD41", "co2", sma_co2);
+    log_statistics("SCD41", "temperature", sma_temperature);
+    log_statistics("SCD41", "relative_humidity", sma_relative_humidity);
     return Scd41({
         .sensor_descriptor = getSensorDescriptor(),
         .co2 = Ppm(sma_co2.calculate()),
@@ -367,6 +481,14 @@ Sensor::MeasuredValue Sensor::Scd41Device::calculateSMA() {
   }
 }
 
+//
+void Sensor::Scd41Device::resizeAveragingWindow() {
+  auto samples = samplesInWindow(averaging_window, interval, SMA_CAPACITY);
+  sma_co2.resize(samples);
+  sma_temperature.resize(samples);
+  sma_relative_humidity.resize(samples);
+}
+
 //
 // M5Stack ENV.iii unit: Temperature and Humidity and Pressure Sensor
 //
@@ -386,17 +508,38 @@ bool Sensor::M5Env3Device::begin() {
 
 //
 bool Sensor::M5Env3Device::readyToRead() {
-  return available() && (steady_clock::now() - last_measured_at >= INTERVAL);
+  return available() && (steady_clock::now() - last_measured_at >= interval);
 }
 
 //
 Sensor::MeasuredValue Sensor::M5Env3Device::read() {
+  if (auto wait = startConversion(); wait) {
+    std::this_thread::sleep_for(*wait);
+    return collect();
+  }
+  return std::monostate{};
+}
+
+//
+std::optional<std::chrono::milliseconds>
+Sensor::M5Env3Device::startConversion() {
   if (!available()) {
     M5_LOGE("M5Env3 sensor inactived.");
-    return std::monostate{};
+    return std::nullopt;
   }
-  //
-  if (sht31.update() == false) {
+  // SHT31: single shot, high repeatability, clock stretching disabled
+  if (!sensirion_send_command(two_wire, ENV3_I2C_ADDRESS_SHT31, 0x2400)) {
+    sht31.begin(&two_wire, ENV3_I2C_ADDRESS_SHT31, sda_pin, scl_pin);
+    M5_LOGD("SHT31 sensor: error to re-initialize.");
+    return std::nullopt;
+  }
+  return SHT31_MEASURE_DURATION;
+}
+
+//
+Sensor::MeasuredValue Sensor::M5Env3Device::collect() {
+  std::array<uint16_t, 2> words{};
+  if (!sensirion_read_words(two_wire, ENV3_I2C_ADDRESS_SHT31, words)) {
     sht31.begin(&two_wire, ENV3_I2C_ADDRESS_SHT31, sda_pin, scl_pin);
     M5_LOGD("SHT31 sensor: error to re-initialize.");
     return std::monostate{};
@@ -408,11 +551,15 @@ Sensor::MeasuredValue Sensor::M5Env3Device::read() {
   }
   //
   {
-    auto t = round<CentiDegC>(DegC(sht31.cTemp));
-    auto rh = round<CentiRH>(PctRH(sht31.humidity));
+    auto [raw_temperature, raw_humidity] = words;
+    float cTemp = -45.0f + 175.0f * raw_temperature / 65535.0f;
+    float humidity = 100.0f * raw_humidity / 65535.0f;
+    auto t = round<CentiDegC>(DegC(cTemp));
+    auto rh = round<CentiRH>(PctRH(humidity));
     auto pa = round<DeciPa>(Pascal(qmp6988.pressure));
     // successfully
     last_measured_at = steady_clock::now();
+    adaptInterval(DegC(t).count());
     sma_temperature.push_back(t.count());
     sma_relative_humidity.push_back(rh.count());
     sma_pressure.push_back(pa.count());
@@ -429,6 +576,9 @@ Sensor::MeasuredValue Sensor::M5Env3Device::read() {
 Sensor::MeasuredValue Sensor::M5Env3Device::calculateSMA() {
   if (sma_temperature.ready() && sma_relative_humidity.ready() &&
       sma_pressure.ready()) {
+    log_statistics("M5Env3", "temperature", sma_temperature);
+    log_statistics("M5Env3", "relative_humidity", sma_relative_humidity);
+    log_statistics("M5Env3", "pressure", sma_pressure);
     return M5Env3({
         .sensor_descriptor = getSensorDescriptor(),
         .temperature = CentiDegC(sma_temperature.calculate()),
@@ -438,4 +588,12 @@ Sensor::MeasuredValue Sensor::M5Env3Device::calculateSMA() {
   } else {
     return std::monostate{};
   }
+}
+
+//
+void Sensor::M5Env3Device::resizeAveragingWindow() {
+  auto samples = samplesInWindow(averaging_window, interval, SMA_CAPACITY);
+  sma_temperature.resize(samples);
+  sma_relative_humidity.resize(samples);
+  sma_pressure.resize(samples);
 }
\ No newline at end of file
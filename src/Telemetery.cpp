@@ -4,16 +4,19 @@
 //
 #include "Application.hpp"
 #include "AzIoTSasToken.h"
+#include "Diagnostics.hpp"
 #include "Sensor.hpp"
 #include "Telemetry.hpp"
-#include <ArduinoJson.h>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <esp_sntp.h>
+#include <esp_system.h>
 #include <mqtt_client.h>
 #include <optional>
-#include <queue>
+#include <deque>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -39,94 +42,86 @@ void Telemetry::EspMqttClientDeleter::operator()(esp_mqtt_client *ptr) const {
 }
 
 //
-std::string Telemetry::to_absolute_sensor_id(const std::string &device_id,
-                                             SensorDescriptor descriptor) {
-  return device_id + "-"s + descriptor.str();
+std::optional<size_t> Telemetry::acquire_message_buffer() {
+  auto now = steady_clock::now();
+  for (size_t i = 0; i < _in_flight_message_ids.size(); ++i) {
+    MessageId id = _in_flight_message_ids[i].load();
+    if (id > MESSAGE_BUFFER_FREE &&
+        now - _in_flight_since[i] > IN_FLIGHT_TIMEOUT) {
+      // PUBLISHEDが来なかった
+      M5_LOGW("message id:%d timed out", id);
+      if (_in_flight_message_ids[i].compare_exchange_strong(
+              id, MESSAGE_BUFFER_FREE) &&
+          _in_flight_spool_ranges[i].count > 0) {
+        // スプールに残っているので送り直す
+        rewind_spool();
+      }
+    }
+    MessageId expected{MESSAGE_BUFFER_FREE};
+    if (_in_flight_message_ids[i].compare_exchange_strong(
+            expected, MESSAGE_BUFFER_RESERVED)) {
+      _in_flight_spool_ranges[i] = TelemetrySpool::Range{};
+      return i;
+    }
+  }
+  return std::nullopt;
 }
 
-// 送信用メッセージに変換する
-template <>
-std::string Telemetry::to_json_message<Sensor::MeasurementBme280>(
-    const Sensor::MeasurementBme280 &in) {
-  JsonDocument doc;
-  doc["sensorId"] =
-      to_absolute_sensor_id(config.device_id, in.second.sensor_descriptor);
-  doc["measuredAt"] = Application::isoformatUTC(in.first);
-  doc["temperature"] = DegC(in.second.temperature).count();
-  doc["humidity"] = PctRH(in.second.relative_humidity).count();
-  doc["pressure"] = HectoPa(in.second.pressure).count();
-  std::string output;
-  serializeJson(doc, output);
-  return output;
+//
+bool Telemetry::release_message_buffer(MessageId message_id) {
+  for (size_t i = 0; i < _in_flight_message_ids.size(); ++i) {
+    if (_in_flight_message_ids[i].load() != message_id) {
+      continue;
+    }
+    // 戻した後は上書きされるので先に取っておく
+    TelemetrySpool::Range range = _in_flight_spool_ranges[i];
+    if (MessageId expected{message_id};
+        _in_flight_message_ids[i].compare_exchange_strong(
+            expected, MESSAGE_BUFFER_FREE)) {
+      // 送信が終わったのでスプールから消す
+      _spool.acknowledge(range);
+      return true;
+    }
+  }
+  return false;
 }
 
 //
-template <>
-std::string Telemetry::to_json_message<Sensor::MeasurementM5Env3>(
-    const Sensor::MeasurementM5Env3 &in) {
-  JsonDocument doc;
-  doc["sensorId"] =
-      to_absolute_sensor_id(config.device_id, in.second.sensor_descriptor);
-  doc["measuredAt"] = Application::isoformatUTC(in.first);
-  doc["temperature"] = DegC(in.second.temperature).count();
-  doc["humidity"] = PctRH(in.second.relative_humidity).count();
-  doc["pressure"] = HectoPa(in.second.pressure).count();
-  std::string output;
-  serializeJson(doc, output);
-  return output;
+void Telemetry::release_early_published(MessageId message_id) {
+  for (auto &id : _early_published_message_ids) {
+    if (MessageId expected{message_id};
+        id.compare_exchange_strong(expected, MESSAGE_BUFFER_FREE)) {
+      release_message_buffer(message_id);
+      return;
+    }
+  }
 }
 
 //
-template <>
-std::string Telemetry::to_json_message<Sensor::MeasurementSgp30>(
-    const Sensor::MeasurementSgp30 &in) {
-  JsonDocument doc;
-  doc["sensorId"] =
-      to_absolute_sensor_id(config.device_id, in.second.sensor_descriptor);
-  doc["measuredAt"] = Application::isoformatUTC(in.first);
-  doc["tvoc"] = in.second.tvoc.value;
-  doc["eCo2"] = in.second.eCo2.value;
-  if (in.second.tvoc_baseline.has_value()) {
-    doc["tvoc_baseline"] = in.second.tvoc_baseline->value;
-  }
-  if (in.second.eCo2_baseline.has_value()) {
-    doc["eCo2_baseline"] = in.second.eCo2_baseline->value;
-  }
-  std::string output;
-  serializeJson(doc, output);
-  return output;
+void Telemetry::release_all_message_buffers() {
+  for (auto &id : _in_flight_message_ids) {
+    id.store(MESSAGE_BUFFER_FREE);
+  }
+  for (auto &id : _early_published_message_ids) {
+    id.store(MESSAGE_BUFFER_FREE);
+  }
+  // 送信中だったものはスプールから送り直す
+  rewind_spool();
 }
 
 //
-template <>
-std::string Telemetry::to_json_message<Sensor::MeasurementScd30>(
-    const Sensor::MeasurementScd30 &in) {
-  JsonDocument doc;
-  doc["sensorId"] =
-      to_absolute_sensor_id(config.device_id, in.second.sensor_descriptor);
-  doc["measuredAt"] = Application::isoformatUTC(in.first);
-  doc["co2"] = in.second.co2.value;
-  doc["temperature"] = DegC(in.second.temperature).count();
-  doc["humidity"] = PctRH(in.second.relative_humidity).count();
-  std::string output;
-  serializeJson(doc, output);
-  return output;
+void Telemetry::stage_from_spool() {
+  _staged_spool_range =
+      _spool.read(_encoder.batchMaxItems(), _sending_fifo_buffer);
 }
 
 //
-template <>
-std::string Telemetry::to_json_message<Sensor::MeasurementScd41>(
-    const Sensor::MeasurementScd41 &in) {
-  JsonDocument doc;
-  doc["sensorId"] =
-      to_absolute_sensor_id(config.device_id, in.second.sensor_descriptor);
-  doc["measuredAt"] = Application::isoformatUTC(in.first);
-  doc["co2"] = in.second.co2.value;
-  doc["temperature"] = DegC(in.second.temperature).count();
-  doc["humidity"] = PctRH(in.second.relative_humidity).count();
-  std::string output;
-  serializeJson(doc, output);
-  return output;
+void Telemetry::rewind_spool() {
+  if (_spool.isOpened()) {
+    _spool.rewind();
+    _sending_fifo_buffer.clear();
+    _staged_spool_range = TelemetrySpool::Range{};
+  }
 }
 
 // When developing for your own Arduino-based platform,
@@ -174,15 +169,20 @@ esp_err_t Telemetry::mqtt_event_handler(esp_mqtt_event_handle_t event) {
     break;
   case MQTT_EVENT_PUBLISHED:
     M5_LOGD("MQTT event MQTT_EVENT_PUBLISHED; message id:%d", event->msg_id);
-    if (event->msg_id >= 0) {
-      auto found_itr = telemetry._sent_messages.find(event->msg_id);
-      if (found_itr != telemetry._sent_messages.end()) {
-        M5_LOGD("[PUBLISHED]:%s", found_itr->second.c_str());
+    if (event->msg_id > MESSAGE_BUFFER_FREE) {
+      // 送った側がメッセージIDを書く前かもしれないので先に残しておく
+      // (メッセージIDを書いた側が後で見つけて片付ける)
+      auto &early = telemetry._early_published_message_ids
+          [telemetry._early_published_next++ %
+           telemetry._early_published_message_ids.size()];
+      early.store(event->msg_id);
+      // 実際にMQTT送信が終わったので不要になったバッファを戻す
+      if (telemetry.release_message_buffer(event->msg_id)) {
+        MessageId expected{event->msg_id};
+        early.compare_exchange_strong(expected, MESSAGE_BUFFER_FREE);
       } else {
-        M5_LOGE("PUBLISHED message ID is not found");
+        M5_LOGD("PUBLISHED message ID is not found yet");
       }
-      // 実際にMQTT送信が終わったので不要になったメッセージを消す
-      telemetry._sent_messages.erase(event->msg_id);
     }
     break;
   case MQTT_EVENT_DATA:
@@ -245,25 +245,30 @@ bool Telemetry::initializeIoTHubClient() {
 }
 
 //
-bool Telemetry::initializeMqttClient() {
+bool Telemetry::generate_sas_token() {
   // Using SAS
-  if (auto azIoTSasToken =
-          AzIoTSasToken{
-              &iot_hub_client,
-              az_span_create(
-                  reinterpret_cast<uint8_t *>(config.device_key.data()),
-                  config.device_key.length()),
-              az_span_create(sas_signature_buffer.data(),
-                             sas_signature_buffer.size()),
-              az_span_create(sas_token_buffer.data(), sas_token_buffer.size())};
-      azIoTSasToken.Generate(SAS_TOKEN_DURATION_IN_MINUTES) != 0) {
+  if (!optAzIoTSasToken.has_value()) {
+    optAzIoTSasToken.emplace(
+        &iot_hub_client,
+        az_span_create(reinterpret_cast<uint8_t *>(config.device_key.data()),
+                       config.device_key.length()),
+        az_span_create(sas_signature_buffer.data(),
+                       sas_signature_buffer.size()),
+        az_span_create(sas_token_buffer.data(), sas_token_buffer.size()));
+  }
+  if (optAzIoTSasToken->Generate(SAS_TOKEN_DURATION_IN_MINUTES) != 0) {
     M5_LOGE("Failed generating SAS token");
     optAzIoTSasToken = std::nullopt;
     return false;
-  } else {
-    optAzIoTSasToken = std::make_optional(azIoTSasToken);
   }
+  _sas_token_renew_at = steady_clock::now() +
+                        minutes{SAS_TOKEN_DURATION_IN_MINUTES} -
+                        SAS_TOKEN_RENEW_BEFORE_EXPIRY;
+  return true;
+}
 
+//
+esp_mqtt_client_config_t Telemetry::mqtt_client_config() {
   esp_mqtt_client_config_t mqtt_config{0};
 
   mqtt_config.uri = mqtt_broker_uri.c_str();
@@ -272,6 +277,7 @@ bool Telemetry::initializeMqttClient() {
   mqtt_config.username = mqtt_username.c_str();
 
   // Using SAS key
+  // (esp_mqtt_client_init / esp_mqtt_set_config は文字列を複製して持つ)
   if (optAzIoTSasToken.has_value()) {
     auto &azIoTSasToken = optAzIoTSasToken.value();
     mqtt_config.password =
@@ -283,9 +289,21 @@ bool Telemetry::initializeMqttClient() {
   mqtt_config.keepalive = 180;
   mqtt_config.disable_clean_session = 0;
   mqtt_config.disable_auto_reconnect = false;
+  mqtt_config.reconnect_timeout_ms = _mqtt_reconnect_timeout.count();
   mqtt_config.event_handle = mqtt_event_handler;
   mqtt_config.user_context = this;
   mqtt_config.cert_pem = reinterpret_cast<const char *>(ca_pem);
+  return mqtt_config;
+}
+
+//
+bool Telemetry::initializeMqttClient() {
+  _reconnect_deadline.reset();
+  optAzIoTSasToken = std::nullopt;
+  if (!generate_sas_token()) {
+    return false;
+  }
+  esp_mqtt_client_config_t mqtt_config = mqtt_client_config();
 
   _mqtt_connected = false;
   if (esp_mqtt_client_handle_t p = esp_mqtt_client_init(&mqtt_config); p) {
@@ -310,10 +328,62 @@ bool Telemetry::initializeMqttClient() {
   return true;
 }
 
+//
+bool Telemetry::renew_sas_token() {
+  // guard
+  if (!mqtt_client) {
+    M5_LOGE("mqtt client is null");
+    return false;
+  }
+  if (!generate_sas_token()) {
+    return false;
+  }
+  esp_mqtt_client_config_t mqtt_config = mqtt_client_config();
+  if (esp_err_t result_code =
+          esp_mqtt_set_config(mqtt_client.get(), &mqtt_config);
+      result_code != ESP_OK) {
+    std::array<char, 256> buffer;
+    M5_LOGE("Could not set mqtt config; %s",
+            esp_err_to_name_r(result_code, buffer.data(), buffer.size()));
+    return false;
+  }
+  M5_LOGI("SAS token renewed");
+  return true;
+}
+
+//
+bool Telemetry::cycle_connection() {
+  _reconnect_deadline.reset();
+  // 切断してすぐに再接続させる
+  // (送信済みの確認が来ていないQoS1のメッセージはMQTTクライアントが送り直す)
+  if (mqtt_client && esp_mqtt_client_disconnect(mqtt_client.get()) == ESP_OK &&
+      esp_mqtt_client_reconnect(mqtt_client.get()) == ESP_OK) {
+    M5_LOGI("MQTT reconnecting with the renewed SAS token");
+    return true;
+  }
+  M5_LOGW("Could not reconnect; MQTT client is recreated.");
+  mqtt_client.reset();
+  release_all_message_buffers();
+  return initializeMqttClient();
+}
+
+//
+bool Telemetry::is_idle() const {
+  if (!_sending_fifo_buffer.empty() ||
+      (_spool.isOpened() && _spool.pending() > 0)) {
+    return false;
+  }
+  return std::none_of(_in_flight_message_ids.begin(),
+                      _in_flight_message_ids.end(),
+                      [](const std::atomic<MessageId> &id) {
+                        return id.load() != MESSAGE_BUFFER_FREE;
+                      });
+}
+
 //
 bool Telemetry::begin(std::string_view iothub_fqdn, std::string_view device_id,
                       std::string_view device_key) {
-  _sent_messages.clear();
+  release_all_message_buffers();
   //
   iot_hub_client_options = az_iot_hub_client_options_default();
   iot_hub_client_options.user_agent =
@@ -322,34 +392,77 @@ bool Telemetry::begin(std::string_view iothub_fqdn, std::string_view device_id,
   config.iothub_fqdn = std::string(iothub_fqdn);
   config.device_id = std::string(device_id);
   config.device_key = std::string(device_key);
+  _encoder.setDeviceId(config.device_id);
   mqtt_broker_uri = std::string("mqtts://") + config.iothub_fqdn;
+  _mqtt_reconnect_timeout =
+      MQTT_RECONNECT_TIMEOUT_MIN +
+      milliseconds{esp_random() % milliseconds{MQTT_RECONNECT_TIMEOUT_JITTER}
+                                      .count()};
   //
   return (initializeIoTHubClient() && initializeMqttClient());
 }
 
 //
-bool Telemetry::reconnect() {
-  _sent_messages.clear();
+bool Telemetry::reconnect(bool recreate) {
+  if (mqtt_client && !recreate) {
+    // 切れている間に期限が近づいているかもしれないのでSASトークンを新しくする
+    if (!renew_sas_token()) {
+      return false;
+    }
+    _reconnect_deadline.reset();
+    // 再接続を待っている所なら待たずに再接続させる
+    // (接続しようとしている所ならそのまま任せる)
+    if (esp_mqtt_client_reconnect(mqtt_client.get()) != ESP_OK) {
+      M5_LOGD("MQTT client is not waiting for reconnection.");
+    }
+    return true;
+  }
+  mqtt_client.reset();
+  release_all_message_buffers();
   return (initializeIoTHubClient() && initializeMqttClient());
 }
 
 //
 bool Telemetry::terminate() {
-  _sent_messages.clear();
+  release_all_message_buffers();
   mqtt_client.reset();
+  _spool.terminate();
+  return true;
+}
+
+//
+bool Telemetry::updateReportedProperties(std::string_view json) {
+  // guard
+  if (!mqtt_client || !_mqtt_connected) {
+    return false;
+  }
+  std::array<char, 16> request_id{};
+  std::snprintf(request_id.data(), request_id.size(), "%u",
+                static_cast<unsigned>(++_twin_request_id));
+  std::array<char, 128> twin_topic{};
+  if (az_result_failed(az_iot_hub_client_twin_patch_get_publish_topic(
+          &iot_hub_client, az_span_create_from_str(request_id.data()),
+          twin_topic.data(), twin_topic.size(), nullptr))) {
+    M5_LOGE("Failed az_iot_hub_client_twin_patch_get_publish_topic");
+    return false;
+  }
+  constexpr auto MQTT_QOS{0};
+  constexpr auto DO_NOT_RETAIN_MSG{0};
+  if (esp_mqtt_client_enqueue(mqtt_client.get(), twin_topic.data(),
+                              json.data(), json.size(), MQTT_QOS,
+                              DO_NOT_RETAIN_MSG, true) < 0) {
+    M5_LOGE("Failed publishing reported properties");
+    return false;
+  }
   return true;
 }
 
 //
 bool Telemetry::task_handler() {
+  Diagnostics::ScopedTimer timer{Diagnostics::Probe::Telemetry};
   if (!WiFi.isConnected() || !_mqtt_connected) {
     return false;
   }
-  if (optAzIoTSasToken.has_value() && optAzIoTSasToken->IsExpired()) {
-    M5_LOGI("SAS token expired; reconnecting with a new one.");
-    mqtt_client.reset();
-    return initializeMqttClient();
-  }
 
   // guard
   if (!mqtt_client) {
@@ -357,41 +470,127 @@ bool Telemetry::task_handler() {
     return false;
   }
 
-  // The topic could be obtained just once during setup,
-  // however if properties are used the topic need to be generated again to
-  // reflect the current values of the properties.
-  std::array<char, 128> telemetry_topic{};
-  if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(
-          &iot_hub_client, nullptr, telemetry_topic.data(),
-          telemetry_topic.size(), nullptr))) {
-    M5_LOGE("Failed az_iot_hub_client_telemetry_get_publish_topic");
-    return false;
+  // 有効期限が近づいたら, 接続したまま次のSASトークンに入れ替えておいて
+  // 送信が途切れた所で(遅くとも期限までに)新しいSASトークンで接続し直す
+  // (MQTTクライアントは作り直さない)
+  if (auto now = steady_clock::now();
+      !_reconnect_deadline && now >= _sas_token_renew_at) {
+    if (renew_sas_token()) {
+      _reconnect_deadline = now + SAS_TOKEN_RECONNECT_GRACE;
+    } else {
+      // 次の機会にもう一度
+      _sas_token_renew_at = now + SAS_TOKEN_RECONNECT_GRACE;
+    }
+  }
+  if (optAzIoTSasToken.has_value() && optAzIoTSasToken->IsExpired()) {
+    M5_LOGI("SAS token expired; reconnecting with a new one.");
+    return renew_sas_token() ? cycle_connection() : reconnect(true);
+  }
+  if (_reconnect_deadline &&
+      (is_idle() || steady_clock::now() >= *_reconnect_deadline)) {
+    return cycle_connection();
   }
+
   // 送信するべき測定値があれば送信する
   constexpr auto MQTT_QOS{1};
   constexpr auto DO_NOT_RETAIN_MSG{0};
+  if (_spool.isOpened() && _sending_fifo_buffer.empty()) {
+    stage_from_spool();
+  }
   if (_sending_fifo_buffer.empty()) {
     // nothing to do
   } else {
-    // 送信用FIFO待ち行列から先頭のアイテムを得る
-    auto item = _sending_fifo_buffer.front();
-    // メッセージに変換する
-    std::string datum =
-        std::visit([this](const auto &x) { return to_json_message(x); }, item);
+    const bool batch_mode = _encoder.batchMaxItems() > 1;
+    // The topic could be obtained just once during setup,
+    // however if properties are used the topic need to be generated again to
+    // reflect the current values of the properties.
+    std::array<uint8_t, 96> properties_buffer{};
+    az_iot_message_properties properties{};
+    if (az_result_failed(az_iot_message_properties_init(
+            &properties,
+            az_span_create(properties_buffer.data(), properties_buffer.size()),
+            0))) {
+      M5_LOGE("Failed az_iot_message_properties_init");
+      return false;
+    }
+    // メッセージの形式と配列にまとめたメッセージであることを受信側に知らせる
+    // (値はURLエンコードしておく)
+    const bool cbor = _encoder.encoding() == Encoding::Cbor;
+    if (az_result_failed(az_iot_message_properties_append(
+            &properties,
+            AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_TYPE),
+            cbor ? AZ_SPAN_FROM_STR("application%2Fcbor")
+                 : AZ_SPAN_FROM_STR("application%2Fjson"))) ||
+        (!cbor && az_result_failed(az_iot_message_properties_append(
+                      &properties,
+                      AZ_SPAN_FROM_STR(
+                          AZ_IOT_MESSAGE_PROPERTIES_CONTENT_ENCODING),
+                      AZ_SPAN_FROM_STR("utf-8")))) ||
+        (batch_mode && az_result_failed(az_iot_message_properties_append(
+                           &properties, AZ_SPAN_FROM_STR("batch"),
+                           AZ_SPAN_FROM_STR("true"))))) {
+      M5_LOGE("Failed az_iot_message_properties_append");
+      return false;
+    }
+    std::array<char, 256> telemetry_topic{};
+    if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(
+            &iot_hub_client, &properties, telemetry_topic.data(),
+            telemetry_topic.size(), nullptr))) {
+      M5_LOGE("Failed az_iot_hub_client_telemetry_get_publish_topic");
+      return false;
+    }
+    // 送信中のメッセージでプールが埋まっていたら次の機会にする
+    auto handle = acquire_message_buffer();
+    if (!handle.has_value()) {
+      M5_LOGD("message buffer pool is exhausted");
+      return false;
+    }
+    if (_sending_fifo_buffer.empty()) {
+      // スプールを巻き戻したので次の機会に読み直す
+      _in_flight_message_ids[*handle].store(MESSAGE_BUFFER_FREE);
+      return false;
+    }
+    auto &buffer = _message_pool[*handle];
+    // 送信用FIFO待ち行列の先頭からアイテムを得てメッセージに変換する
+    auto [length, items] =
+        batch_mode ? _encoder.write_batch_message(
+                         _sending_fifo_buffer, buffer.data(), buffer.size())
+                   : std::make_pair(_encoder.write_single_message(
+                                        _sending_fifo_buffer.front(),
+                                        buffer.data(), buffer.size()),
+                                    size_t{1});
+    if (length == 0) {
+      M5_LOGE("message buffer overflow; item is discarded");
+      _in_flight_message_ids[*handle].store(MESSAGE_BUFFER_FREE);
+      _sending_fifo_buffer.pop_front();
+      _spool.acknowledge(take_staged_spool_range(1));
+      return false;
+    }
+    // PUBLISHEDはenqueueから戻る前に来ることがあるので先に用意しておく
+    const TelemetrySpool::Range staged = _staged_spool_range;
+    _in_flight_since[*handle] = steady_clock::now();
+    _in_flight_spool_ranges[*handle] = take_staged_spool_range(items);
     // MQTT待ち行列に入れる
     if (MessageId message_id = esp_mqtt_client_enqueue(
-            mqtt_client.get(), telemetry_topic.data(), datum.c_str(), 0,
+            mqtt_client.get(), telemetry_topic.data(), buffer.data(), length,
             MQTT_QOS, DO_NOT_RETAIN_MSG, true);
         message_id < 0) {
       M5_LOGE("Failed publishing");
+      _staged_spool_range = staged;
+      _in_flight_message_ids[*handle].store(MESSAGE_BUFFER_FREE);
       return false;
     } else {
-      M5_LOGD("MQTT enqueued; message id: %d", message_id);
-      M5_LOGV("MQTT enqueued; %s", datum.c_str());
-      // MQTT待ち行列に送った後も、実際にMQTT送信が終わるまでポインタが指すメッセージの実体を保持しておく
-      _sent_messages.insert({message_id, std::move(datum)});
-      // MQTT待ち行列に送ったので送信用FIFO待ち行列から先頭のアイテムを消す
-      _sending_fifo_buffer.pop();
+      M5_LOGD("MQTT enqueued; message id: %d, items: %u", message_id,
+              static_cast<unsigned>(items));
+      if (!cbor) {
+        M5_LOGV("MQTT enqueued; %s", buffer.data());
+      }
+      // MQTT待ち行列に送った後も、実際にMQTT送信が終わるまでメッセージの実体を保持しておく
+      _in_flight_message_ids[*handle].store(message_id);
+      release_early_published(message_id);
+      // MQTT待ち行列に送ったので送信用FIFO待ち行列から送ったアイテムを消す
+      _sending_fifo_buffer.erase(_sending_fifo_buffer.begin(),
+                                 _sending_fifo_buffer.begin() + items);
       return true;
     }
   }
@@ -0,0 +1,162 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "TelemetryEncoder.hpp"
+#include "MessageWriter.hpp"
+#include "SensorTraits.hpp"
+#include <chrono>
+#include <ctime>
+#include <variant>
+
+using namespace std::chrono;
+
+// デバイスIDを前に付けたセンサーID
+const char *
+TelemetryEncoder::sensor_id_text(const SensorDescriptor &descriptor) {
+  auto [it, inserted] = _sensor_id_texts.try_emplace(descriptor);
+  if (inserted) {
+    it->second = _sensor_id_prefix + descriptor.str();
+  }
+  return it->second.c_str();
+}
+
+// ISO8601形式のUTC
+const char *TelemetryEncoder::measured_at_text(system_clock::time_point tp) {
+  if (std::time_t time = system_clock::to_time_t(tp);
+      time != _measured_at_time) {
+    std::tm utc;
+    gmtime_r(&time, &utc);
+    std::strftime(_measured_at_text.data(), _measured_at_text.size(),
+                  "%FT%TZ", &utc);
+    _measured_at_time = time;
+  }
+  return _measured_at_text.data();
+}
+
+// 送信用メッセージに変換する
+template <typename V>
+size_t TelemetryEncoder::to_json_message(const Sensor::Measurement<V> &in,
+                                         char *out, size_t size) {
+  JsonWriter json{out, size};
+  json.beginObject();
+  json.field("sensorId", sensor_id_text(in.second.sensor_descriptor));
+  json.field("measuredAt", measured_at_text(in.first));
+  for (const auto &field : Sensor::Traits<V>::fields) {
+    if (Sensor::isIntegral(field.metric)) {
+      json.field(field.name, static_cast<uint16_t>(field.value(in.second)));
+    } else {
+      json.field(field.name, static_cast<float>(field.value(in.second)));
+    }
+  }
+  // ベースラインは測定値の後に書く
+  for (const auto &field : Sensor::Traits<V>::fields) {
+    if (field.baseline) {
+      if (auto baseline = field.baseline(in.second); baseline) {
+        json.field(field.baseline_name, *baseline);
+      }
+    }
+  }
+  json.endObject();
+  return json.length();
+}
+
+// 送信用メッセージに変換する
+template <typename V>
+size_t TelemetryEncoder::to_cbor_message(
+    const Sensor::Measurement<V> &in,
+    std::optional<system_clock::time_point> previous, char *out, size_t size) {
+  size_t baselines{0};
+  for (const auto &field : Sensor::Traits<V>::fields) {
+    if (field.baseline && field.baseline(in.second)) {
+      baselines++;
+    }
+  }
+  CborWriter cbor{out, size};
+  cbor.beginMap(2 + Sensor::Traits<V>::fields.size() + baselines);
+  cbor.text("s");
+  cbor.text(reinterpret_cast<const char *>(
+      in.second.sensor_descriptor.strDescriptor.data()));
+  if (previous) {
+    cbor.field("dt", duration_cast<seconds>(in.first - *previous).count());
+  } else {
+    cbor.field("t", system_clock::to_time_t(in.first));
+  }
+  for (const auto &field : Sensor::Traits<V>::fields) {
+    cbor.field(field.name, field.value(in.second),
+               Sensor::fixedPointScale(field.metric));
+  }
+  // ベースラインは測定値の後に書く
+  for (const auto &field : Sensor::Traits<V>::fields) {
+    if (field.baseline) {
+      if (auto baseline = field.baseline(in.second); baseline) {
+        cbor.field(field.baseline_name, *baseline);
+      }
+    }
+  }
+  return cbor.length();
+}
+
+//
+size_t TelemetryEncoder::write_single_message(const Payload &in, char *out,
+                                              size_t size) {
+  return std::visit(
+      [this, out, size](const auto &x) {
+        return _encoding == Encoding::Cbor
+                   ? to_cbor_message(x, std::nullopt, out, size)
+                   : to_json_message(x, out, size);
+      },
+      in);
+}
+
+//
+std::pair<size_t, size_t>
+TelemetryEncoder::write_batch_message(const std::deque<Payload> &in,
+                                      char *out, size_t size) {
+  const bool cbor = _encoding == Encoding::Cbor;
+  // 閉じ括弧と終端の分を残しておく(CBORは終端の分だけ)
+  const size_t limit = std::min(_batch_max_bytes, size);
+  if (limit < 3) {
+    return {0, 0};
+  }
+  const size_t budget = limit - (cbor ? 1 : 2);
+  size_t length{0};
+  size_t items{0};
+  std::optional<system_clock::time_point> previous{};
+  out[length++] = cbor ? CBOR_INDEFINITE_ARRAY : '[';
+  for (const auto &payload : in) {
+    if (items >= _batch_max_items) {
+      break;
+    }
+    size_t separator = items == 0 || cbor ? 0 : 1;
+    if (length + separator >= budget) {
+      break;
+    }
+    size_t n = std::visit(
+        [this, out, at = length + separator, budget, cbor,
+         previous](const auto &x) {
+          return cbor ? to_cbor_message(x, previous, out + at, budget - at)
+                      : to_json_message(x, out + at, budget - at);
+        },
+        payload);
+    if (n == 0) {
+      break; // 次の機会にする
+    }
+    if (separator) {
+      out[length] = ',';
+    }
+    length += separator + n;
+    items++;
+    previous = std::visit([](const auto &x) { return x.first; }, payload);
+  }
+  if (items == 0) {
+    return {0, 0};
+  }
+  if (cbor) {
+    out[length++] = CBOR_BREAK;
+    return {length, items};
+  }
+  out[length++] = ']';
+  out[length] = '\0';
+  return {length, items};
+}
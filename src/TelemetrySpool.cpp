@@ -0,0 +1,408 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "RecordChecksum.hpp"
+#include "TelemetrySpool.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+
+#include <M5Unified.h>
+
+using namespace std::chrono;
+
+namespace {
+// レコードから測定値を戻す
+template <typename RECORD, size_t I>
+TelemetrySpool::Payload decode_as(const RECORD &in) {
+  using Measurement = std::variant_alternative_t<I, TelemetrySpool::Payload>;
+  using Value = typename Measurement::second_type;
+  static_assert(std::is_trivially_copyable_v<Value>);
+  Value value;
+  std::memcpy(&value, in.body.data(), sizeof(Value));
+  return Measurement{system_clock::time_point{system_clock::duration{in.at}},
+                     value};
+}
+
+//
+template <typename RECORD, size_t... Is>
+std::optional<TelemetrySpool::Payload> decode(const RECORD &in,
+                                              std::index_sequence<Is...>) {
+  std::optional<TelemetrySpool::Payload> out{};
+  ((in.kind == Is ? (out = decode_as<RECORD, Is>(in), true) : false) || ...);
+  return out;
+}
+
+// 書き込んだ内容をSDカードに反映させる
+bool flush(std::FILE *fp) {
+  return std::fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+// 詰めたファイルに置き換える途中で止まっていたら置き換えを終わらせる
+void finish_replacement(const std::string &path) {
+  std::string temporary{path + ".tmp"};
+  if (std::FILE *fp = std::fopen(path.c_str(), "rb"); fp) {
+    std::fclose(fp);
+    std::remove(temporary.c_str());
+  } else {
+    std::rename(temporary.c_str(), path.c_str());
+  }
+}
+} // namespace
+
+//
+bool TelemetrySpool::begin(std::string_view path) {
+  std::lock_guard<std::mutex> file_lock{_file_mutex};
+  _path = std::string{path};
+  finish_replacement(_path);
+  _file.reset(std::fopen(_path.c_str(), "r+b"));
+  if (!_file) {
+    return create_file();
+  }
+  Header header{};
+  if (std::fread(&header, sizeof(header), 1, _file.get()) != 1 ||
+      header.magic != HEADER_MAGIC || header.version != FORMAT_VERSION ||
+      header.record_size != sizeof(Record) ||
+      header.checksum != checksum_of(header)) {
+    M5_LOGW("spool file \"%s\" is broken; recreate it.", _path.c_str());
+    if (!create_file()) {
+      _file.reset();
+      return false;
+    }
+    return true;
+  }
+  // 書きかけの末尾のレコードは捨てる
+  std::fseek(_file.get(), 0, SEEK_END);
+  long size = std::ftell(_file.get());
+  uint32_t record_count =
+      size > offset_of(0) ? (size - offset_of(0)) / sizeof(Record) : 0;
+  uint32_t committed = std::min(header.committed, record_count);
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _base = 0;
+    _record_count = record_count;
+    _committed = committed;
+    _next = committed;
+    _acknowledged.clear();
+    _header_dirty = false;
+  }
+  if (committed == record_count) {
+    // 全て送信済み(作り直せなければ今のファイルに追記する)
+    create_file();
+    return true;
+  }
+  M5_LOGI("spool file \"%s\" has %u records to replay.", _path.c_str(),
+          static_cast<unsigned>(record_count - committed));
+  return true;
+}
+
+//
+void TelemetrySpool::terminate() {
+  checkpoint();
+  std::lock_guard<std::mutex> file_lock{_file_mutex};
+  _file.reset();
+}
+
+//
+bool TelemetrySpool::append(const Payload &in) {
+  std::lock_guard<std::mutex> file_lock{_file_mutex};
+  // guard
+  if (!_file) {
+    return false;
+  }
+  // _record_countと_baseを変えるのは_file_mutexを持っている時だけ
+  uint32_t index{0};
+  uint32_t base{0};
+  uint32_t committed{0};
+  auto load = [&] {
+    std::lock_guard<std::mutex> lock{_mutex};
+    index = _record_count;
+    base = _base;
+    committed = _committed;
+  };
+  load();
+  // 一杯なら送信済みの部分を詰めて空ける
+  if (offset_of(index + 1 - base) > MAX_FILE_SIZE && committed > base &&
+      compact()) {
+    load();
+  }
+  if (!_file) {
+    return false;
+  }
+  if (offset_of(index + 1 - base) > MAX_FILE_SIZE) {
+    uint32_t dropped = [this] {
+      std::lock_guard<std::mutex> lock{_mutex};
+      return ++_dropped;
+    }();
+    M5_LOGW("spool file is full; %u records dropped.",
+            static_cast<unsigned>(dropped));
+    return false;
+  }
+  Record record{};
+  record.magic = RECORD_MAGIC;
+  record.kind = static_cast<uint8_t>(in.index());
+  std::visit(
+      [&record](const auto &m) {
+        using Value = std::decay_t<decltype(m.second)>;
+        static_assert(std::is_trivially_copyable_v<Value>);
+        static_assert(sizeof(Value) <= BODY_SIZE);
+        record.at = m.first.time_since_epoch().count();
+        std::memcpy(record.body.data(), &m.second, sizeof(Value));
+      },
+      in);
+  record.checksum = checksum_of(record);
+  // SDカードへの反映はcheckpoint()で行う
+  if (std::fseek(_file.get(), offset_of(index - base), SEEK_SET) != 0 ||
+      std::fwrite(&record, sizeof(record), 1, _file.get()) != 1) {
+    M5_LOGE("write to spool file failed.");
+    return false;
+  }
+  _unsynced = true;
+  std::lock_guard<std::mutex> lock{_mutex};
+  _record_count++;
+  return true;
+}
+
+//
+TelemetrySpool::Range TelemetrySpool::read(size_t max_items,
+                                           std::deque<Payload> &out) {
+  std::lock_guard<std::mutex> file_lock{_file_mutex};
+  Range range{};
+  uint32_t base{0};
+  uint32_t record_count{0};
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _next = std::max(_next, _committed);
+    range = Range{_generation, _next, 0};
+    base = _base;
+    record_count = _record_count;
+  }
+  // guard
+  if (!_file) {
+    return range;
+  }
+  // 読んでいる間は_mutexを離す
+  const uint32_t skipped_from = range.first;
+  uint32_t next = range.first;
+  while (range.count < max_items && next < record_count) {
+    Record record{};
+    std::optional<Payload> item{};
+    if (read_record(next - base, record)) {
+      item = decode(record,
+                    std::make_index_sequence<std::variant_size_v<Payload>>{});
+    }
+    if (item) {
+      out.push_back(std::move(*item));
+      range.count++;
+      next++;
+    } else if (range.count == 0) {
+      // 壊れたレコードは送信済みとして読み飛ばす
+      M5_LOGE("spool record #%u is broken; skipped.",
+              static_cast<unsigned>(next));
+      next++;
+      range.first = next;
+    } else {
+      break; // 次の機会に読み飛ばす
+    }
+  }
+  std::lock_guard<std::mutex> lock{_mutex};
+  if (range.first > skipped_from) {
+    acknowledge_range(skipped_from, range.first);
+  }
+  _next = std::max(_next, next);
+  return range;
+}
+
+//
+void TelemetrySpool::acknowledge(Range range) {
+  std::lock_guard<std::mutex> lock{_mutex};
+  // guard
+  if (range.generation != _generation || range.count == 0) {
+    return;
+  }
+  acknowledge_range(range.first, range.first + range.count);
+}
+
+//
+void TelemetrySpool::acknowledge_range(uint32_t first, uint32_t end) {
+  auto [it, inserted] = _acknowledged.try_emplace(first, end);
+  if (!inserted) {
+    it->second = std::max(it->second, end);
+  }
+  // _committedに繋がった範囲を取り込む
+  uint32_t committed = _committed;
+  while (!_acknowledged.empty() &&
+         _acknowledged.begin()->first <= committed) {
+    committed = std::max(committed, _acknowledged.begin()->second);
+    _acknowledged.erase(_acknowledged.begin());
+  }
+  if (committed != _committed) {
+    _committed = std::min(committed, _record_count);
+    _header_dirty = true;
+  }
+}
+
+//
+void TelemetrySpool::rewind() {
+  std::lock_guard<std::mutex> lock{_mutex};
+  _next = _committed;
+}
+
+//
+bool TelemetrySpool::checkpoint() {
+  std::lock_guard<std::mutex> file_lock{_file_mutex};
+  // guard
+  if (!_file) {
+    return true;
+  }
+  bool all_committed{false};
+  bool compaction{false};
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    all_committed = _record_count > 0 && _committed == _record_count;
+    // 送信済みの部分が未送信の部分より大きい
+    compaction = offset_of(_committed - _base) - offset_of(0) >=
+                     COMPACTION_MIN_SIZE &&
+                 _committed - _base > _record_count - _committed;
+  }
+  // 全て送信済みになったのでファイルを空にする
+  if (all_committed && create_file()) {
+    return true;
+  }
+  // 詰められなければ今のファイルを使い続ける
+  if (compaction && !compact() && !_file) {
+    return false;
+  }
+  uint32_t committed{0};
+  bool header_dirty{false};
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    committed = _committed - _base;
+    header_dirty = std::exchange(_header_dirty, false);
+  }
+  if (!header_dirty && !_unsynced) {
+    return true;
+  }
+  if ((header_dirty && !write_header(_file.get(), committed)) ||
+      !flush(_file.get())) {
+    M5_LOGE("write to spool file failed.");
+    std::lock_guard<std::mutex> lock{_mutex};
+    _header_dirty = _header_dirty || header_dirty;
+    return false;
+  }
+  _unsynced = false;
+  return true;
+}
+
+// _file_mutexを取ってから呼ぶこと
+// 作れなければ今のファイルを使い続ける
+bool TelemetrySpool::create_file() {
+  if (_file) {
+    std::fflush(_file.get());
+  }
+  FilePointerUnique file{std::fopen(_path.c_str(), "w+b")};
+  if (!file) {
+    M5_LOGE("create spool file \"%s\" failed.", _path.c_str());
+    return false;
+  }
+  _file = std::move(file);
+  _unsynced = false;
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _generation++;
+    _base = 0;
+    _record_count = 0;
+    _committed = 0;
+    _next = 0;
+    _acknowledged.clear();
+    _header_dirty = false;
+  }
+  if (!write_header(_file.get(), 0) || !flush(_file.get())) {
+    M5_LOGE("write to spool file failed.");
+    return false;
+  }
+  return true;
+}
+
+// _file_mutexを取ってから呼ぶこと
+// 送信済みの確認が来ていないレコードを別のファイルに写してから置き換える
+bool TelemetrySpool::compact() {
+  uint32_t base{0};
+  uint32_t committed{0};
+  uint32_t record_count{0};
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    base = _base;
+    committed = _committed;
+    record_count = _record_count;
+  }
+  std::string temporary{_path + ".tmp"};
+  FilePointerUnique out{std::fopen(temporary.c_str(), "w+b")};
+  if (!out || !write_header(out.get(), 0)) {
+    M5_LOGE("create spool file \"%s\" failed.", temporary.c_str());
+    return false;
+  }
+  // 壊れたレコードもそのまま写す(読み出す時に読み飛ばす)
+  bool success = std::fseek(_file.get(), offset_of(committed - base),
+                            SEEK_SET) == 0;
+  for (uint32_t index = committed; success && index < record_count; ++index) {
+    Record record{};
+    success = std::fread(&record, sizeof(record), 1, _file.get()) == 1 &&
+              std::fwrite(&record, sizeof(record), 1, out.get()) == 1;
+  }
+  success = success && flush(out.get());
+  out.reset();
+  if (!success) {
+    M5_LOGE("compact spool file failed.");
+    std::remove(temporary.c_str());
+    return false;
+  }
+  // 置き換える途中で止まってもbeginで置き換えを終わらせる
+  _file.reset();
+  if (std::remove(_path.c_str()) != 0 ||
+      std::rename(temporary.c_str(), _path.c_str()) != 0) {
+    M5_LOGE("replace spool file \"%s\" failed.", _path.c_str());
+    // 消す前なら今のファイルを使い続ける
+    _file.reset(std::fopen(_path.c_str(), "r+b"));
+    if (_file) {
+      std::remove(temporary.c_str());
+    }
+    return false;
+  }
+  _file.reset(std::fopen(_path.c_str(), "r+b"));
+  _unsynced = false;
+  {
+    // 新しいファイルのヘッダは写した時の_committedを指している
+    std::lock_guard<std::mutex> lock{_mutex};
+    _base = committed;
+  }
+  M5_LOGI("spool file \"%s\" compacted; %u records.", _path.c_str(),
+          static_cast<unsigned>(record_count - committed));
+  return static_cast<bool>(_file);
+}
+
+//
+bool TelemetrySpool::write_header(std::FILE *fp, uint32_t committed) {
+  Header header{};
+  header.magic = HEADER_MAGIC;
+  header.version = FORMAT_VERSION;
+  header.record_size = sizeof(Record);
+  header.committed = committed;
+  header.checksum = checksum_of(header);
+  return std::fseek(fp, 0, SEEK_SET) == 0 &&
+         std::fwrite(&header, sizeof(header), 1, fp) == 1;
+}
+
+//
+bool TelemetrySpool::read_record(uint32_t index, Record &out) {
+  if (std::fseek(_file.get(), offset_of(index), SEEK_SET) != 0 ||
+      std::fread(&out, sizeof(out), 1, _file.get()) != 1) {
+    return false;
+  }
+  return out.magic == RECORD_MAGIC && out.checksum == checksum_of(out);
+}
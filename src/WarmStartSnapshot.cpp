@@ -0,0 +1,444 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "WarmStartSnapshot.hpp"
+#include "RecordChecksum.hpp"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <variant>
+
+#include <M5Unified.h>
+
+using namespace std::chrono;
+
+namespace {
+// レコードから測定値を戻す
+template <typename RECORD, size_t I>
+Sensor::MeasuredValue decode_as(const RECORD &in) {
+  using Value = std::variant_alternative_t<I, Sensor::MeasuredValue>;
+  if constexpr (std::is_same_v<Value, std::monostate>) {
+    return std::monostate{};
+  } else {
+    static_assert(std::is_trivially_copyable_v<Value>);
+    Value value;
+    std::memcpy(&value, in.body.data(), sizeof(Value));
+    return value;
+  }
+}
+
+//
+template <typename RECORD, size_t... Is>
+Sensor::MeasuredValue decode(const RECORD &in, std::index_sequence<Is...>) {
+  Sensor::MeasuredValue out{};
+  ((in.kind == Is ? (out = decode_as<RECORD, Is>(in), true) : false) || ...);
+  return out;
+}
+
+// 書き込んだ内容をファイルに反映させる
+bool flush(std::FILE *fp) {
+  return std::fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+// 書き直したファイルに置き換える途中で止まっていたら置き換えを終わらせる
+void finish_replacement(const std::string &path) {
+  std::string temporary{path + ".tmp"};
+  if (std::FILE *fp = std::fopen(path.c_str(), "rb"); fp) {
+    std::fclose(fp);
+    std::remove(temporary.c_str());
+  } else {
+    std::rename(temporary.c_str(), path.c_str());
+  }
+}
+} // namespace
+
+//
+bool WarmStartSnapshot::begin(std::string_view path) {
+  _path = std::string{path};
+  _rollup_path = _path + ".rollup";
+  _pending.clear();
+  _rollup_generation.reset();
+  finish_replacement(_path);
+  finish_replacement(_rollup_path);
+  _record_count = 0;
+  _oldest.reset();
+  _file.reset(std::fopen(_path.c_str(), "r+b"));
+  if (!_file) {
+    return create_file();
+  }
+  Header header{};
+  if (std::fread(&header, sizeof(header), 1, _file.get()) != 1 ||
+      header.magic != HEADER_MAGIC || header.version != FORMAT_VERSION ||
+      header.record_size != sizeof(Record) ||
+      header.checksum != checksum_of(header)) {
+    M5_LOGW("snapshot file \"%s\" is broken; recreate it.", _path.c_str());
+    return create_file();
+  }
+  // 書きかけの末尾のレコードは次の追記で上書きする
+  std::fseek(_file.get(), 0, SEEK_END);
+  long size = std::ftell(_file.get());
+  _record_count =
+      size > offset_of(0) ? (size - offset_of(0)) / sizeof(Record) : 0;
+  if (Record record{};
+      _record_count > 0 &&
+      std::fseek(_file.get(), offset_of(0), SEEK_SET) == 0 &&
+      std::fread(&record, sizeof(record), 1, _file.get()) == 1 &&
+      valid(record)) {
+    _oldest = system_clock::from_time_t(record.at);
+  }
+  M5_LOGI("snapshot file \"%s\" has %u records.", _path.c_str(),
+          static_cast<unsigned>(_record_count));
+  return true;
+}
+
+//
+size_t WarmStartSnapshot::restore(system_clock::time_point keep_from,
+                                  Callback callback) {
+  // guard
+  if (!_file || std::fseek(_file.get(), offset_of(0), SEEK_SET) != 0) {
+    return 0;
+  }
+  constexpr size_t KINDS{std::variant_size_v<Sensor::MeasuredValue>};
+  const std::time_t keep_from_sec = system_clock::to_time_t(keep_from);
+  std::vector<Record> chunk(READ_CHUNK_RECORDS);
+  std::vector<Sensor::MeasuredValue> values{};
+  std::optional<uint32_t> at{};
+  size_t restored{0};
+  bool proceed{true};
+  // 同じ時間の測定値をまとめて渡す
+  auto deliver = [&]() {
+    if (at && !values.empty()) {
+      proceed = callback(system_clock::from_time_t(*at), values);
+      restored += values.size();
+    }
+    values.clear();
+  };
+  for (uint32_t index = 0; proceed && index < _record_count;) {
+    size_t n = std::fread(chunk.data(), sizeof(Record),
+                          std::min<size_t>(chunk.size(), _record_count - index),
+                          _file.get());
+    if (n == 0) {
+      break;
+    }
+    index += n;
+    for (size_t i = 0; proceed && i < n; ++i) {
+      const Record &record = chunk[i];
+      // 壊れたレコードと残す期間より古いレコードは読み飛ばす
+      if (!valid(record) ||
+          static_cast<std::time_t>(record.at) < keep_from_sec) {
+        continue;
+      }
+      if (at != record.at) {
+        deliver();
+        at = record.at;
+      }
+      auto value = decode(record, std::make_index_sequence<KINDS>{});
+      if (!std::holds_alternative<std::monostate>(value)) {
+        values.push_back(value);
+      }
+    }
+  }
+  if (proceed) {
+    deliver();
+  }
+  return restored;
+}
+
+//
+void WarmStartSnapshot::stage(
+    system_clock::time_point at,
+    const std::vector<Sensor::MeasuredValue> &values) {
+  // guard
+  if (!_file) {
+    return;
+  }
+  for (const auto &value : values) {
+    if (std::holds_alternative<std::monostate>(value)) {
+      continue;
+    }
+    if (_pending.size() >= MAX_PENDING_RECORDS) {
+      M5_LOGE("snapshot pending records are full; discarded.");
+      return;
+    }
+    Record record{};
+    record.magic = RECORD_MAGIC;
+    record.kind = static_cast<uint8_t>(value.index());
+    record.at = static_cast<uint32_t>(system_clock::to_time_t(at));
+    std::visit(
+        [&record](const auto &v) {
+          using Value = std::decay_t<decltype(v)>;
+          if constexpr (!std::is_same_v<Value, std::monostate>) {
+            static_assert(std::is_trivially_copyable_v<Value>);
+            static_assert(sizeof(Value) <= BODY_SIZE);
+            std::memcpy(record.body.data(), &v, sizeof(Value));
+          }
+        },
+        value);
+    record.checksum = checksum_of(record);
+    _pending.push_back(record);
+  }
+}
+
+//
+bool WarmStartSnapshot::checkpoint(system_clock::time_point keep_from) {
+  // guard
+  if (!_file) {
+    return false;
+  }
+  if (_pending.empty()) {
+    return true;
+  }
+  if ((_oldest && *_oldest < keep_from - COMPACTION_SLACK) ||
+      offset_of(_record_count + _pending.size()) > MAX_FILE_SIZE) {
+    return compact(keep_from);
+  }
+  // 失敗したら次のcheckpointで同じ所から書き直す
+  if (std::fseek(_file.get(), offset_of(_record_count), SEEK_SET) != 0 ||
+      std::fwrite(_pending.data(), sizeof(Record), _pending.size(),
+                  _file.get()) != _pending.size() ||
+      !flush(_file.get())) {
+    M5_LOGE("write to snapshot file failed.");
+    return false;
+  }
+  if (!_oldest) {
+    _oldest = system_clock::from_time_t(_pending.front().at);
+  }
+  _record_count += _pending.size();
+  _pending.clear();
+  return true;
+}
+
+//
+// 残す期間のレコードと溜めたレコードを別のファイルに写してから置き換える
+//
+bool WarmStartSnapshot::compact(system_clock::time_point keep_from) {
+  std::string temporary{_path + ".tmp"};
+  FilePointerUnique out{std::fopen(temporary.c_str(), "w+b")};
+  if (!out || !write_header(out.get())) {
+    M5_LOGE("create snapshot file \"%s\" failed.", temporary.c_str());
+    return false;
+  }
+  const std::time_t keep_from_sec = system_clock::to_time_t(keep_from);
+  uint32_t count{0};
+  std::optional<uint32_t> oldest{};
+  auto keep = [&](const Record &record) -> bool {
+    if (!valid(record) ||
+        static_cast<std::time_t>(record.at) < keep_from_sec) {
+      return true; // 捨てる
+    }
+    if (offset_of(count + 1) > MAX_FILE_SIZE) {
+      return false;
+    }
+    oldest = oldest.value_or(record.at);
+    count++;
+    return std::fwrite(&record, sizeof(record), 1, out.get()) == 1;
+  };
+  bool success = std::fseek(_file.get(), offset_of(0), SEEK_SET) == 0;
+  std::vector<Record> chunk(READ_CHUNK_RECORDS);
+  for (uint32_t index = 0; success && index < _record_count;) {
+    size_t n = std::fread(chunk.data(), sizeof(Record),
+                          std::min<size_t>(chunk.size(), _record_count - index),
+                          _file.get());
+    if (n == 0) {
+      break;
+    }
+    index += n;
+    for (size_t i = 0; success && i < n; ++i) {
+      success = keep(chunk[i]);
+    }
+  }
+  for (const auto &record : _pending) {
+    success = success && keep(record);
+  }
+  success = success && flush(out.get());
+  out.reset();
+  if (!success) {
+    M5_LOGE("compact snapshot file failed.");
+    std::remove(temporary.c_str());
+    return false;
+  }
+  // 置き換える途中で止まってもbeginで置き換えを終わらせる
+  _file.reset();
+  if (std::remove(_path.c_str()) != 0 ||
+      std::rename(temporary.c_str(), _path.c_str()) != 0) {
+    M5_LOGE("replace snapshot file \"%s\" failed.", _path.c_str());
+    return false;
+  }
+  _file.reset(std::fopen(_path.c_str(), "r+b"));
+  _record_count = count;
+  _oldest = oldest ? std::make_optional(system_clock::from_time_t(*oldest))
+                   : std::nullopt;
+  _pending.clear();
+  M5_LOGI("snapshot file \"%s\" compacted; %u records.", _path.c_str(),
+          static_cast<unsigned>(count));
+  return static_cast<bool>(_file);
+}
+
+//
+// 集計は行の数が少ないので, 変わる度に別のファイルに丸ごと書いてから置き換える
+//
+bool WarmStartSnapshot::checkpointRollups(Database &database) {
+  // guard
+  if (!_file) {
+    return false;
+  }
+  auto generation = database.getRollupGeneration();
+  if (_rollup_generation == generation) {
+    return true; // nothing to do
+  }
+  auto watermark = database.rollup_watermark();
+  if (!watermark) {
+    return false;
+  }
+  std::string temporary{_rollup_path + ".tmp"};
+  FilePointerUnique out{std::fopen(temporary.c_str(), "wb")};
+  if (!out) {
+    M5_LOGE("create snapshot file \"%s\" failed.", temporary.c_str());
+    return false;
+  }
+  // 行の数は最後に書く
+  RollupHeader header{};
+  bool success =
+      std::fwrite(&header, sizeof(header), 1, out.get()) == 1 &&
+      database.read_rollups([&header, &out](size_t, Database::RollupRow row) {
+        RollupRecord record{};
+        record.magic = ROLLUP_RECORD_MAGIC;
+        record.resolution = static_cast<uint8_t>(row.resolution);
+        record.metric = static_cast<uint8_t>(row.table);
+        record.at = static_cast<uint32_t>(system_clock::to_time_t(row.at));
+        record.samples = row.samples;
+        record.sensor_id = row.sensor_id;
+        record.minimum = row.minimum;
+        record.total = row.total;
+        record.maximum = row.maximum;
+        record.checksum = checksum_of(record);
+        header.count++;
+        return std::fwrite(&record, sizeof(record), 1, out.get()) == 1;
+      });
+  header.magic = ROLLUP_HEADER_MAGIC;
+  header.version = FORMAT_VERSION;
+  header.record_size = sizeof(RollupRecord);
+  header.watermark =
+      static_cast<uint32_t>(system_clock::to_time_t(*watermark));
+  header.checksum = checksum_of(header);
+  success = success && std::fseek(out.get(), 0, SEEK_SET) == 0 &&
+            std::fwrite(&header, sizeof(header), 1, out.get()) == 1 &&
+            flush(out.get());
+  out.reset();
+  if (!success) {
+    M5_LOGE("write to snapshot file \"%s\" failed.", temporary.c_str());
+    std::remove(temporary.c_str());
+    return false;
+  }
+  // 置き換える途中で止まってもbeginで置き換えを終わらせる
+  std::remove(_rollup_path.c_str());
+  if (std::rename(temporary.c_str(), _rollup_path.c_str()) != 0) {
+    M5_LOGE("replace snapshot file \"%s\" failed.", _rollup_path.c_str());
+    return false;
+  }
+  _rollup_generation = generation;
+  M5_LOGI("snapshot file \"%s\" has %u rollups.", _rollup_path.c_str(),
+          static_cast<unsigned>(header.count));
+  return true;
+}
+
+//
+size_t WarmStartSnapshot::restoreRollups(Database &database) {
+  FilePointerUnique in{std::fopen(_rollup_path.c_str(), "rb")};
+  // guard
+  if (!in) {
+    return 0;
+  }
+  RollupHeader header{};
+  if (std::fread(&header, sizeof(header), 1, in.get()) != 1 ||
+      header.magic != ROLLUP_HEADER_MAGIC ||
+      header.version != FORMAT_VERSION ||
+      header.record_size != sizeof(RollupRecord) ||
+      header.checksum != checksum_of(header)) {
+    M5_LOGW("snapshot file \"%s\" is broken; ignored.", _rollup_path.c_str());
+    return 0;
+  }
+  // データーベースの方が先まで畳み込んでいれば書き戻さない
+  auto watermark = system_clock::from_time_t(header.watermark);
+  if (auto present = database.rollup_watermark();
+      !present || *present >= watermark) {
+    return 0;
+  }
+  std::vector<RollupRecord> chunk(READ_CHUNK_RECORDS);
+  std::vector<Database::RollupRow> rows{};
+  size_t restored{0};
+  uint32_t index{0};
+  // 行が無くても畳み込み済みの時間は書き戻す
+  do {
+    size_t n = std::fread(chunk.data(), sizeof(RollupRecord),
+                          std::min<size_t>(chunk.size(), header.count - index),
+                          in.get());
+    index += n;
+    rows.clear();
+    for (size_t i = 0; i < n; ++i) {
+      const RollupRecord &record = chunk[i];
+      // 壊れたレコードは読み飛ばす
+      if (record.magic != ROLLUP_RECORD_MAGIC ||
+          record.checksum != checksum_of(record)) {
+        continue;
+      }
+      rows.push_back(Database::RollupRow{
+          .resolution = static_cast<Database::Resolution>(record.resolution),
+          .table = static_cast<Database::Table>(record.metric),
+          .sensor_id = record.sensor_id,
+          .at = system_clock::from_time_t(record.at),
+          .samples = record.samples,
+          .minimum = record.minimum,
+          .total = record.total,
+          .maximum = record.maximum,
+      });
+    }
+    if (!database.restore_rollups(watermark, rows)) {
+      M5_LOGE("restore rollups failed.");
+      break;
+    }
+    restored += rows.size();
+    if (n == 0) {
+      break;
+    }
+  } while (index < header.count);
+  // 書き戻したものと同じ集計は書き直さない
+  _rollup_generation = database.getRollupGeneration();
+  return restored;
+}
+
+//
+bool WarmStartSnapshot::create_file() {
+  _file.reset(std::fopen(_path.c_str(), "w+b"));
+  _record_count = 0;
+  _oldest.reset();
+  if (!_file) {
+    M5_LOGE("create snapshot file \"%s\" failed.", _path.c_str());
+    return false;
+  }
+  return write_header(_file.get());
+}
+
+//
+bool WarmStartSnapshot::write_header(std::FILE *fp) {
+  Header header{};
+  header.magic = HEADER_MAGIC;
+  header.version = FORMAT_VERSION;
+  header.record_size = sizeof(Record);
+  header.checksum = checksum_of(header);
+  if (std::fseek(fp, 0, SEEK_SET) != 0 ||
+      std::fwrite(&header, sizeof(header), 1, fp) != 1 || !flush(fp)) {
+    M5_LOGE("write to snapshot file failed.");
+    return false;
+  }
+  return true;
+}
+
+//
+bool WarmStartSnapshot::valid(const Record &in) {
+  return in.magic == RECORD_MAGIC && in.checksum == checksum_of(in);
+}
@@ -23,4 +23,7 @@ void setup() {
 }
 
 // Arduinoのloop()関数
-void loop() { /* nothing to do */ }
+void loop() {
+  // 仕事はTask:Applicationで行うので, 空回りするloopTaskを消す
+  vTaskDelete(nullptr);
+}
@@ -0,0 +1,392 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "ChartCoordinate.hpp"
+#include "Database.hpp"
+#include "DeadbandFilter.hpp"
+#include "Diagnostics.hpp"
+#include "MessageWriter.hpp"
+#include "RingBufferStore.hpp"
+#include "Scheduler.hpp"
+#include "SensorTraits.hpp"
+#include "SimpleMovingAverage.hpp"
+#include "SpscQueue.hpp"
+#include "TelemetryEncoder.hpp"
+#include "TelemetrySpool.hpp"
+#include "VersionedSnapshot.hpp"
+#include "WarmStartSnapshot.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <new>
+#include <string>
+#include <unity.h>
+
+//
+// 1回あたりの所要時間と1秒あたりの回数と, 1回あたりのoperator newの回数を
+// 1行1つのJSONで標準出力に書く
+// {"benchmark":"<名前>","iterations":<回数>,"ns_per_op":<ナノ秒>,
+//  "ops_per_sec":<回数>,"allocs_per_op":<回数>}
+// (pio test -e native -f native/test_benchmark -v の出力から
+//  '{"benchmark"'で始まる行を拾う)
+//
+using namespace std::chrono;
+
+void setUp() {}
+void tearDown() {}
+
+namespace {
+// 最適化で消されないように結果を書く
+volatile uint32_t sink{0};
+// operator newが呼ばれた回数
+std::atomic<uint64_t> allocations{0};
+} // namespace
+
+// ヒープからの割り当てを数える
+// (呼び出し側に展開されると-Wmismatched-new-deleteになるので展開させない)
+[[gnu::noinline]] void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size == 0 ? 1 : size); ptr) {
+    return ptr;
+  }
+  throw std::bad_alloc{};
+}
+[[gnu::noinline]] void operator delete(void *ptr) noexcept { std::free(ptr); }
+[[gnu::noinline]] void operator delete(void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+//
+template <typename F>
+void benchmark(const char *name, uint32_t iterations, F f) {
+  // 温める
+  for (uint32_t i = 0; i < iterations / 10; ++i) {
+    f(i);
+  }
+  auto allocated = allocations.load();
+  auto start = steady_clock::now();
+  for (uint32_t i = 0; i < iterations; ++i) {
+    f(i);
+  }
+  auto elapsed = duration<double, std::nano>(steady_clock::now() - start);
+  allocated = allocations.load() - allocated;
+  std::printf("{\"benchmark\":\"%s\",\"iterations\":%u,\"ns_per_op\":%.1f,"
+              "\"ops_per_sec\":%.0f,\"allocs_per_op\":%.2f}\n",
+              name, static_cast<unsigned>(iterations),
+              elapsed.count() / iterations,
+              iterations / elapsed.count() * 1e9,
+              static_cast<double>(allocated) / iterations);
+  std::fflush(stdout);
+  TEST_ASSERT_TRUE(elapsed.count() > 0.0);
+}
+//
+const system_clock::time_point T0{seconds{1700000000}};
+//
+Sensor::Bme280 bme280(uint32_t i) {
+  return Sensor::Bme280{Sensor::Traits<Sensor::Bme280>::descriptor,
+                        CentiDegC(static_cast<int16_t>(2000 + i % 64)),
+                        CentiRH(static_cast<int16_t>(5000 - i % 256)),
+                        DeciPa(static_cast<int32_t>(101300 + i % 1024))};
+}
+//
+Sensor::Scd30 scd30(uint32_t i) {
+  return Sensor::Scd30{Sensor::Traits<Sensor::Scd30>::descriptor,
+                       Ppm(static_cast<uint16_t>(400 + i % 512)),
+                       CentiDegC(static_cast<int16_t>(2100 + i % 64)),
+                       CentiRH(static_cast<int16_t>(4000 + i % 256))};
+}
+//
+Sensor::Sgp30 sgp30(uint32_t i) {
+  return Sensor::Sgp30{Sensor::Traits<Sensor::Sgp30>::descriptor,
+                       Ppm(static_cast<uint16_t>(400 + i % 512)),
+                       Ppb(static_cast<uint16_t>(i % 128)),
+                       BaselineECo2(0x8a00), BaselineTotalVoc(0x8b00)};
+}
+//
+std::string temporary_path(const char *name) {
+  return (std::filesystem::temp_directory_path() / name).string();
+}
+} // namespace
+
+//
+void bench_simple_moving_average() {
+  SimpleMovingAverage<25, int16_t, int32_t> sma{5};
+  benchmark("sma_push_back", 1000000, [&sma](uint32_t i) {
+    sma.push_back(static_cast<int16_t>(i & 0x3ff));
+    sink = sma.calculate();
+  });
+  benchmark("sma_statistics", 1000000, [&sma](uint32_t i) {
+    sma.push_back(static_cast<int16_t>(i & 0x3ff));
+    sink = sma.statistics().max;
+  });
+  benchmark("sma_resize", 100000, [&sma](uint32_t i) {
+    sma.resize(static_cast<uint8_t>(1 + i % 25));
+    sink = sma.getWindow();
+  });
+}
+
+//
+void bench_spsc_queue() {
+  SpscQueue<uint32_t, 64> queue{};
+  benchmark("spsc_push_pop", 1000000, [&queue](uint32_t i) {
+    queue.push(i);
+    sink = queue.pop().value_or(0);
+  });
+}
+
+//
+void bench_versioned_snapshot() {
+  // Database::LatestMeasurementと同じ形
+  struct Latest {
+    system_clock::time_point at;
+    Sensor::Bme280 value;
+  };
+  VersionedSnapshot<Latest> snapshot{};
+  benchmark("snapshot_publish", 1000000, [&snapshot](uint32_t i) {
+    snapshot.publish({T0 + seconds{i}, bme280(i)});
+  });
+  benchmark("snapshot_read", 1000000, [&snapshot](uint32_t) {
+    sink = snapshot.read().first;
+  });
+}
+
+//
+void bench_deadband_filter() {
+  DeadbandFilter filter{};
+  filter.enable(DeadbandFilter::Bands{}, seconds{600});
+  benchmark("deadband_pass", 1000000, [&filter](uint32_t i) {
+    sink = filter.pass(T0 + seconds{i}, bme280(i));
+  });
+}
+
+//
+void bench_latency_histogram() {
+  Diagnostics::LatencyHistogram histogram{};
+  benchmark("histogram_record", 1000000, [&histogram](uint32_t i) {
+    histogram.record(i & 0xffff);
+  });
+  benchmark("histogram_summary", 100000, [&histogram](uint32_t) {
+    sink = histogram.summary().p99_us;
+  });
+}
+
+//
+void bench_ring_buffer_store() {
+  RingBufferStore::Ring<int16_t> ring{1440};
+  benchmark("ring_put_get", 1000000, [&ring](uint32_t i) {
+    ring.put(1 + i, static_cast<int16_t>(i));
+    sink = ring.get(1 + i / 2).value_or(0);
+  });
+  RingBufferStore store{1440};
+  for (uint32_t i = 0; i < 1440; ++i) {
+    store.insert(Database::Table::Temperature,
+                 {SensorId{1}, T0 + minutes{i}, 20.0 + i % 10});
+  }
+  benchmark("store_read_1440", 1000, [&store](uint32_t) {
+    store.read(
+        Database::Table::Temperature, {T0, Database::OrderByAtAsc},
+        RingBufferStore::ReadCallback<RingBufferStore::TimePointAndDouble>{
+            [](size_t counter, RingBufferStore::TimePointAndDouble) {
+              sink = counter;
+              return true;
+            }});
+  });
+}
+
+//
+void bench_message_writers() {
+  std::array<char, 256> buffer{};
+  benchmark("json_writer_message", 1000000, [&buffer](uint32_t i) {
+    JsonWriter json{buffer.data(), buffer.size()};
+    json.beginObject();
+    json.field("sensorId", "BME280");
+    json.field("measuredAt", "2024-01-01T00:00:00Z");
+    json.field("temperature", 20.0f + i % 64 / 100.0f);
+    json.field("humidity", 50.0f - i % 256 / 100.0f);
+    json.field("pressure", 1013.0f + i % 1024 / 100.0f);
+    json.endObject();
+    sink = json.length();
+  });
+  benchmark("cbor_writer_message", 1000000, [&buffer](uint32_t i) {
+    CborWriter cbor{buffer.data(), buffer.size()};
+    cbor.beginMap(5);
+    cbor.text("s");
+    cbor.text("BME280");
+    cbor.field("dt", int64_t{12});
+    cbor.field("temperature", 20.0 + i % 64 / 100.0, 100);
+    cbor.field("humidity", 50.0 - i % 256 / 100.0, 100);
+    cbor.field("pressure", 1013.0 + i % 1024 / 100.0, 1000);
+    sink = cbor.length();
+  });
+}
+
+//
+void bench_scheduler() {
+  Scheduler scheduler{};
+  for (int i = 0; i < 8; ++i) {
+    scheduler.every(Scheduler::Duration{0}, []() { sink = sink + 1; });
+  }
+  benchmark("scheduler_run_pending_8_jobs", 100000, [&scheduler](uint32_t) {
+    sink = scheduler.run_pending(steady_clock::now()).count();
+  });
+}
+
+// ファイルに書く度にfsyncするので回数は少なくする
+void bench_telemetry_spool() {
+  auto path = temporary_path("bench_telemetry_spool.bin");
+  std::remove(path.c_str());
+  TelemetrySpool spool{};
+  spool.begin(path);
+  benchmark("spool_append", 200, [&spool](uint32_t i) {
+    spool.append(Sensor::MeasurementBme280{T0 + seconds{i}, bme280(i)});
+  });
+  std::deque<TelemetrySpool::Payload> out{};
+  benchmark("spool_read", 200, [&spool, &out](uint32_t) {
+    spool.rewind();
+    out.clear();
+    sink = spool.read(1, out).count;
+  });
+  spool.terminate();
+  std::remove(path.c_str());
+}
+
+//
+void bench_warm_start_snapshot() {
+  auto path = temporary_path("bench_warm_start_snapshot.bin");
+  std::remove(path.c_str());
+  WarmStartSnapshot snapshot{};
+  snapshot.begin(path);
+  std::vector<Sensor::MeasuredValue> values{};
+  benchmark("warm_start_stage_checkpoint_64", 50, [&](uint32_t i) {
+    for (uint32_t j = 0; j < 64; ++j) {
+      values.assign(1, bme280(i * 64 + j));
+      snapshot.stage(T0 + seconds{i * 64 + j}, values);
+    }
+    sink = snapshot.checkpoint(T0);
+  });
+  benchmark("warm_start_restore", 20, [&snapshot](uint32_t) {
+    sink = snapshot.restore(
+        T0, [](system_clock::time_point,
+               const std::vector<Sensor::MeasuredValue> &) { return true; });
+  });
+  snapshot.terminate();
+  std::remove(path.c_str());
+}
+
+// 1分毎の測定値(BME280, SCD30, SGP30)を1トランザクションで入れる
+// (ファイルに書く度にCOMMITするので回数は少なくする)
+void bench_database() {
+  auto path = temporary_path("bench_database.db");
+  std::remove(path.c_str());
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  uint32_t tick{0};
+  std::vector<Sensor::MeasuredValue> values{};
+  benchmark("database_insert_tick", 1440, [&](uint32_t) {
+    values.assign({bme280(tick), scd30(tick), sgp30(tick)});
+    sink = db.insert(T0 + minutes{tick}, values);
+    tick++;
+  });
+  // グラフの表示範囲(24時間)を読む
+  auto latest = T0 + minutes{tick - 1};
+  auto at_begin = latest - minutes{Chart::X_POINT_COUNT - 1};
+  benchmark("database_read_24h_window", 50, [&db, at_begin](uint32_t) {
+    db.read_temperatures(Database::OrderByAtAsc, at_begin,
+                         [](size_t counter, Database::TimePointAndDouble) {
+                           sink = counter;
+                           return true;
+                         });
+  });
+  // 最後に入れた時刻の測定値はSQLiteを読まない
+  benchmark("database_read_latest_tick", 100000, [&db, latest](uint32_t) {
+    db.read_temperatures(Database::OrderByAtAsc, latest,
+                         [](size_t counter, Database::TimePointAndDouble) {
+                           sink = counter;
+                           return true;
+                         });
+  });
+  db.terminate();
+  std::remove(path.c_str());
+}
+
+//
+void bench_telemetry_encoder() {
+  std::array<char, 1024> buffer{};
+  for (auto encoding :
+       {TelemetryEncoder::Encoding::Json, TelemetryEncoder::Encoding::Cbor}) {
+    bool cbor = encoding == TelemetryEncoder::Encoding::Cbor;
+    TelemetryEncoder encoder{};
+    encoder.setDeviceId("m5stack-core2");
+    encoder.setEncoding(encoding);
+    benchmark(cbor ? "telemetry_cbor_message" : "telemetry_json_message",
+              1000000, [&encoder, &buffer](uint32_t i) {
+                sink = encoder.write_single_message(
+                    Sensor::MeasurementBme280{T0 + minutes{i / 3}, bme280(i)},
+                    buffer.data(), buffer.size());
+              });
+    // 1回で8つの測定値を1つのメッセージにする
+    std::deque<TelemetryEncoder::Payload> fifo{};
+    for (uint32_t i = 0; i < 8; ++i) {
+      fifo.push_back(i % 2 ? TelemetryEncoder::Payload{Sensor::MeasurementScd30{
+                                 T0 + minutes{i}, scd30(i)}}
+                           : TelemetryEncoder::Payload{
+                                 Sensor::MeasurementBme280{T0 + minutes{i},
+                                                           bme280(i)}});
+    }
+    encoder.setBatchMode(8, buffer.size());
+    benchmark(cbor ? "telemetry_cbor_batch_8" : "telemetry_json_batch_8",
+              100000, [&encoder, &buffer, &fifo](uint32_t) {
+                sink = encoder
+                           .write_batch_message(fifo, buffer.data(),
+                                                buffer.size())
+                           .second;
+              });
+  }
+}
+
+// グラフの1日分(1440点)を座標にして区間毎の最小値と最大値を集める
+void bench_chart_coordinate() {
+  std::vector<Chart::MinMaxBucket> buckets(240);
+  Chart::MinMaxQueue queue{};
+  benchmark("chart_coordinate_1440", 1000, [&](uint32_t i) {
+    for (auto &bucket : buckets) {
+      bucket.clear();
+    }
+    queue.clear();
+    for (uint32_t minute = 0; minute < Chart::X_POINT_COUNT; ++minute) {
+      auto coord = Chart::coordinateXY(Sensor::Metric::Temperature, T0,
+                                       T0 + minutes{minute},
+                                       20.0 + (minute + i) % 97 / 10.0);
+      buckets[coord.x / 6].push(minute, coord.y);
+      queue.push(minute, coord.y);
+    }
+    queue.expire(i % Chart::X_POINT_COUNT);
+    sink = queue.getMinMaxOfYPoints().second;
+  });
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(bench_simple_moving_average);
+  RUN_TEST(bench_spsc_queue);
+  RUN_TEST(bench_versioned_snapshot);
+  RUN_TEST(bench_deadband_filter);
+  RUN_TEST(bench_latency_histogram);
+  RUN_TEST(bench_ring_buffer_store);
+  RUN_TEST(bench_message_writers);
+  RUN_TEST(bench_scheduler);
+  RUN_TEST(bench_telemetry_spool);
+  RUN_TEST(bench_warm_start_snapshot);
+  RUN_TEST(bench_database);
+  RUN_TEST(bench_telemetry_encoder);
+  RUN_TEST(bench_chart_coordinate);
+  return UNITY_END();
+}
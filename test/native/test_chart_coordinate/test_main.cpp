@@ -0,0 +1,104 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "ChartCoordinate.hpp"
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <unity.h>
+
+using namespace std::chrono;
+
+namespace {
+//
+const system_clock::time_point T0{seconds{1700000000}};
+} // namespace
+
+void setUp() {}
+void tearDown() {}
+
+// 分に切り捨てて, 表示範囲の中に収める
+void test_coordinate_x_clamps_to_window() {
+  auto tp_zero = floor<minutes>(T0);
+  TEST_ASSERT_EQUAL_INT16(0, Chart::coordinateX(tp_zero, tp_zero));
+  TEST_ASSERT_EQUAL_INT16(0, Chart::coordinateX(tp_zero, tp_zero + 59s));
+  TEST_ASSERT_EQUAL_INT16(90, Chart::coordinateX(tp_zero, tp_zero + 90min));
+  TEST_ASSERT_EQUAL_INT16(0, Chart::coordinateX(tp_zero, tp_zero - 5min));
+  TEST_ASSERT_EQUAL_INT16(Chart::X_POINT_COUNT - 1,
+                          Chart::coordinateX(tp_zero, tp_zero + 48h));
+}
+
+//
+void test_coordinate_y_per_metric() {
+  using Sensor::Metric;
+  TEST_ASSERT_EQUAL_INT16(2350, Chart::coordinateY(Metric::Temperature, 23.5));
+  TEST_ASSERT_EQUAL_INT16(-525, Chart::coordinateY(Metric::Temperature, -5.25));
+  TEST_ASSERT_EQUAL_INT16(4550,
+                          Chart::coordinateY(Metric::RelativeHumidity, 45.5));
+  // 1000hPaとの差[Pa]
+  TEST_ASSERT_EQUAL_INT16(1325, Chart::coordinateY(Metric::Pressure, 1013.25));
+  TEST_ASSERT_EQUAL_INT16(-2000, Chart::coordinateY(Metric::Pressure, 980.0));
+  TEST_ASSERT_EQUAL_INT16(415, Chart::coordinateY(Metric::CarbonDioxide, 415));
+  TEST_ASSERT_EQUAL_INT16(60, Chart::coordinateY(Metric::TotalVoc, 121));
+}
+
+// 最小値と最大値を時刻順に並べる
+void test_min_max_bucket_keeps_time_order() {
+  Chart::MinMaxBucket bucket{};
+  auto [none1, none2] = bucket.points();
+  TEST_ASSERT_EQUAL_INT16(Chart::POINT_NONE, none1);
+  TEST_ASSERT_EQUAL_INT16(Chart::POINT_NONE, none2);
+  bucket.push(10, 50);
+  bucket.push(11, 90);
+  bucket.push(12, 20);
+  auto [first, second] = bucket.points();
+  TEST_ASSERT_EQUAL_INT16(90, first);
+  TEST_ASSERT_EQUAL_INT16(20, second);
+  bucket.clear();
+  bucket.push(13, 30);
+  auto [only1, only2] = bucket.points();
+  TEST_ASSERT_EQUAL_INT16(30, only1);
+  TEST_ASSERT_EQUAL_INT16(30, only2);
+}
+
+//
+void test_min_max_queue_empty() {
+  Chart::MinMaxQueue queue{};
+  auto [y_min, y_max] = queue.getMinMaxOfYPoints();
+  TEST_ASSERT_EQUAL_INT16(std::numeric_limits<Chart::Coord>::max(), y_min);
+  TEST_ASSERT_EQUAL_INT16(std::numeric_limits<Chart::Coord>::min(), y_max);
+}
+
+// 表示範囲から外れた値は下限と上限から外れる
+void test_min_max_queue_slides_with_window() {
+  Chart::MinMaxQueue queue{};
+  const Chart::Coord ys[]{5, 1, 9, 3, 7, 2};
+  for (int64_t minute = 0; minute < 6; ++minute) {
+    queue.push(minute, ys[minute]);
+  }
+  auto [min0, max0] = queue.getMinMaxOfYPoints();
+  TEST_ASSERT_EQUAL_INT16(1, min0);
+  TEST_ASSERT_EQUAL_INT16(9, max0);
+  queue.expire(2);
+  auto [min2, max2] = queue.getMinMaxOfYPoints();
+  TEST_ASSERT_EQUAL_INT16(2, min2);
+  TEST_ASSERT_EQUAL_INT16(9, max2);
+  queue.expire(3);
+  auto [min3, max3] = queue.getMinMaxOfYPoints();
+  TEST_ASSERT_EQUAL_INT16(2, min3);
+  TEST_ASSERT_EQUAL_INT16(7, max3);
+  queue.clear();
+  TEST_ASSERT_TRUE(queue.min_queue.empty() && queue.max_queue.empty());
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_coordinate_x_clamps_to_window);
+  RUN_TEST(test_coordinate_y_per_metric);
+  RUN_TEST(test_min_max_bucket_keeps_time_order);
+  RUN_TEST(test_min_max_queue_empty);
+  RUN_TEST(test_min_max_queue_slides_with_window);
+  return UNITY_END();
+}
@@ -0,0 +1,290 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "ChartCoordinate.hpp"
+#include "Database.hpp"
+#include "RingBufferStore.hpp"
+#include "SensorTraits.hpp"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <unity.h>
+
+using namespace std::chrono;
+
+namespace {
+//
+const std::string path{
+    (std::filesystem::temp_directory_path() / "test_database.db").string()};
+// 時間の境目
+const system_clock::time_point T0{seconds{1699999200}};
+//
+Sensor::MeasuredValue bme280(int i) {
+  return Sensor::Bme280{Sensor::Traits<Sensor::Bme280>::descriptor,
+                        CentiDegC(2000 + i), CentiRH(5000 - i),
+                        DeciPa(1013000 + i)};
+}
+//
+Sensor::MeasuredValue scd30(int i) {
+  return Sensor::Scd30{Sensor::Traits<Sensor::Scd30>::descriptor,
+                       Ppm(400 + i), CentiDegC(2150), CentiRH(4000)};
+}
+// 1分毎にBME280の測定値を入れる
+void insert_minutes(Database &db, int count) {
+  for (int i = 0; i < count; ++i) {
+    TEST_ASSERT_TRUE(db.insert(T0 + minutes{i}, {bme280(i)}));
+  }
+}
+//
+std::vector<Database::TimePointAndDouble>
+read_temperatures(Database &db, system_clock::time_point at_begin) {
+  std::vector<Database::TimePointAndDouble> rows{};
+  db.read_temperatures(Database::OrderByAtAsc, at_begin,
+                       [&rows](size_t, Database::TimePointAndDouble item) {
+                         rows.push_back(item);
+                         return true;
+                       });
+  return rows;
+}
+} // namespace
+
+void setUp() { std::remove(path.c_str()); }
+void tearDown() { std::remove(path.c_str()); }
+
+//
+void test_insert_reads_back_one_tick() {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  TEST_ASSERT_TRUE(db.insert(T0, {bme280(0), scd30(0)}));
+  auto rows = read_temperatures(db, T0);
+  TEST_ASSERT_EQUAL_size_t(2, rows.size());
+  for (const auto &[sensor_id, at, degc] : rows) {
+    TEST_ASSERT_TRUE(at == T0);
+    if (sensor_id == SensorId{Sensor::Traits<Sensor::Bme280>::descriptor}) {
+      TEST_ASSERT_FLOAT_WITHIN(0.001, 20.0, degc);
+    } else {
+      TEST_ASSERT_FLOAT_WITHIN(0.001, 21.5, degc);
+    }
+  }
+}
+
+//
+void test_read_window_in_time_order() {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  insert_minutes(db, 60);
+  std::vector<system_clock::time_point> ats{};
+  db.read_pressures(Database::OrderByAtAsc, T0 + minutes{30},
+                    [&ats](size_t, Database::TimePointAndDouble item) {
+                      ats.push_back(std::get<1>(item));
+                      return true;
+                    });
+  TEST_ASSERT_EQUAL_size_t(30, ats.size());
+  for (size_t i = 0; i < ats.size(); ++i) {
+    TEST_ASSERT_TRUE(ats[i] == T0 + minutes{30 + i});
+  }
+}
+
+// 最後に入れた時刻だけならSQLiteを読まずに返すが, 結果は同じ
+void test_latest_tick_matches_table() {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  insert_minutes(db, 2);
+  auto rows = read_temperatures(db, T0 + minutes{1});
+  TEST_ASSERT_EQUAL_size_t(1, rows.size());
+  TEST_ASSERT_TRUE(std::get<1>(rows[0]) == T0 + minutes{1});
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 20.01, std::get<2>(rows[0]));
+  TEST_ASSERT_EQUAL_size_t(0, read_temperatures(db, T0 + minutes{2}).size());
+}
+
+//
+void test_latest_measurement_snapshot() {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  TEST_ASSERT_FALSE(db.getLatestMeasurement<Sensor::Bme280>().has_value());
+  TEST_ASSERT_EQUAL_UINT32(0,
+                           db.getLatestMeasurementGeneration<Sensor::Bme280>());
+  insert_minutes(db, 3);
+  auto latest = db.getLatestMeasurement<Sensor::Bme280>();
+  TEST_ASSERT_TRUE(latest.has_value());
+  TEST_ASSERT_TRUE(latest->first == T0 + minutes{2});
+  TEST_ASSERT_TRUE(latest->second == std::get<Sensor::Bme280>(bme280(2)));
+  TEST_ASSERT_EQUAL_UINT32(3,
+                           db.getLatestMeasurementGeneration<Sensor::Bme280>());
+  TEST_ASSERT_EQUAL_UINT32(0,
+                           db.getLatestMeasurementGeneration<Sensor::Scd30>());
+}
+
+// 1つでも入らなければその時刻の測定値は全部取り消して公開しない
+void test_failed_insert_rolls_back_tick() {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  TEST_ASSERT_TRUE(db.insert(T0, {bme280(0)}));
+  // 別の接続から気圧のテーブルを消して, BME280を入れられなくする
+  sqlite3 *other{nullptr};
+  TEST_ASSERT_EQUAL_INT(SQLITE_OK, sqlite3_open(path.c_str(), &other));
+  auto result = sqlite3_exec(other, "DROP TABLE pressure;", nullptr, nullptr,
+                             nullptr);
+  sqlite3_close(other);
+  TEST_ASSERT_EQUAL_INT(SQLITE_OK, result);
+  // 待っても入らないので, LOOP_TIMEOUTを待たずにすぐ諦める
+  auto started = steady_clock::now();
+  TEST_ASSERT_FALSE(db.insert(T0 + minutes{1}, {scd30(1), bme280(1)}));
+  TEST_ASSERT_TRUE(steady_clock::now() - started < seconds{5});
+  TEST_ASSERT_EQUAL_size_t(0, read_temperatures(db, T0 + minutes{1}).size());
+  TEST_ASSERT_FALSE(db.getLatestMeasurement<Sensor::Scd30>().has_value());
+  auto latest = db.getLatestMeasurement<Sensor::Bme280>();
+  TEST_ASSERT_TRUE(latest.has_value());
+  TEST_ASSERT_TRUE(latest->first == T0);
+}
+
+//
+void test_rollup_hourly_aggregates() {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  insert_minutes(db, 120);
+  TEST_ASSERT_TRUE(db.rollup_measurements(T0 + minutes{150}));
+  std::vector<Database::TimePointAndAggregate> rows{};
+  db.read_aggregates(Database::Resolution::Hourly, Database::Table::Temperature,
+                     Database::OrderByAtAsc, T0,
+                     [&rows](size_t, Database::TimePointAndAggregate item) {
+                       rows.push_back(item);
+                       return true;
+                     });
+  TEST_ASSERT_EQUAL_size_t(2, rows.size());
+  auto &[sensor_id, at, aggregate] = rows[1];
+  TEST_ASSERT_TRUE(at == T0 + hours{1});
+  TEST_ASSERT_EQUAL_UINT32(60, aggregate.samples);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 20.60, aggregate.min);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 20.895, aggregate.mean);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 21.19, aggregate.max);
+  // 同じ時間を二度畳み込まない
+  TEST_ASSERT_TRUE(db.rollup_measurements(T0 + minutes{150}));
+  rows.clear();
+  db.read_aggregates(Database::Resolution::Hourly, Database::Table::Temperature,
+                     Database::OrderByAtAsc, T0,
+                     [&rows](size_t, Database::TimePointAndAggregate item) {
+                       rows.push_back(item);
+                       return true;
+                     });
+  TEST_ASSERT_EQUAL_size_t(2, rows.size());
+  TEST_ASSERT_EQUAL_UINT32(60, std::get<2>(rows[0]).samples);
+}
+
+//
+void test_delete_old_measurements() {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  insert_minutes(db, 60);
+  auto result = db.delete_old_measurements_from_database(T0 + minutes{45});
+  TEST_ASSERT_TRUE(result.has_value());
+  TEST_ASSERT_TRUE(result->completed);
+  // 気温, 湿度, 気圧の3行ずつ
+  TEST_ASSERT_EQUAL_size_t(45 * 3, result->deleted_rows);
+  TEST_ASSERT_EQUAL_size_t(15, read_temperatures(db, T0).size());
+}
+
+//
+void test_rows_survive_reopen() {
+  {
+    Database db{};
+    TEST_ASSERT_TRUE(db.begin(path));
+    insert_minutes(db, 10);
+  }
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path));
+  TEST_ASSERT_EQUAL_size_t(10, read_temperatures(db, T0).size());
+}
+
+// 前からあるファイルもincremental_vacuumで空きを返せるように作り直す
+void test_existing_file_switches_to_incremental_vacuum() {
+  sqlite3 *other{nullptr};
+  TEST_ASSERT_EQUAL_INT(SQLITE_OK, sqlite3_open(path.c_str(), &other));
+  auto result = sqlite3_exec(other,
+                             "PRAGMA auto_vacuum = NONE;"
+                             "CREATE TABLE filler(x);",
+                             nullptr, nullptr, nullptr);
+  sqlite3_close(other);
+  // Database::beginの前に初期化していない状態に戻す
+  sqlite3_shutdown();
+  TEST_ASSERT_EQUAL_INT(SQLITE_OK, result);
+  {
+    Database db{};
+    TEST_ASSERT_TRUE(db.begin(path));
+  }
+  TEST_ASSERT_EQUAL_INT(SQLITE_OK, sqlite3_open(path.c_str(), &other));
+  sqlite3_stmt *stmt{nullptr};
+  sqlite3_prepare_v2(other, "PRAGMA auto_vacuum;", -1, &stmt, nullptr);
+  TEST_ASSERT_EQUAL_INT(SQLITE_ROW, sqlite3_step(stmt));
+  int auto_vacuum = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  sqlite3_close(other);
+  sqlite3_shutdown();
+  TEST_ASSERT_EQUAL_INT(2, auto_vacuum);
+}
+
+// 気圧を新しい順に, 時刻からとセンサーから読む
+using PressureRows = std::pair<std::vector<Database::TimePointAndDouble>,
+                               std::vector<Database::TimePointAndDouble>>;
+void read_pressures_desc(std::unique_ptr<Database::MeasurementStore> store,
+                         PressureRows &rows) {
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(path, std::move(store)));
+  insert_minutes(db, 30);
+  db.read_pressures(Database::OrderByAtDesc, T0 + minutes{10},
+                    [&rows](size_t, Database::TimePointAndDouble item) {
+                      rows.first.push_back(item);
+                      return true;
+                    });
+  db.read_pressures(Database::OrderByAtDesc,
+                    SensorId{Sensor::Traits<Sensor::Bme280>::descriptor}, 5,
+                    [&rows](size_t, Database::TimePointAndDouble item) {
+                      rows.second.push_back(item);
+                      return true;
+                    });
+}
+
+// SQLiteのテーブルでもリングバッファでも同じ読み方で同じ並びが返る
+void test_backends_return_same_order() {
+  PressureRows sqlite{};
+  read_pressures_desc(nullptr, sqlite);
+  std::remove(path.c_str());
+  PressureRows ring{};
+  read_pressures_desc(std::make_unique<RingBufferStore>(Chart::X_POINT_COUNT),
+                      ring);
+  TEST_ASSERT_EQUAL_size_t(20, sqlite.first.size());
+  TEST_ASSERT_EQUAL_size_t(5, sqlite.second.size());
+  TEST_ASSERT_TRUE(std::get<1>(sqlite.first.front()) == T0 + minutes{29});
+  TEST_ASSERT_TRUE(std::get<1>(sqlite.second.back()) == T0 + minutes{25});
+  for (const auto &[expected, actual] :
+       {std::pair{sqlite.first, ring.first},
+        std::pair{sqlite.second, ring.second}}) {
+    TEST_ASSERT_EQUAL_size_t(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      TEST_ASSERT_TRUE(std::get<0>(expected[i]) == std::get<0>(actual[i]));
+      TEST_ASSERT_TRUE(std::get<1>(expected[i]) == std::get<1>(actual[i]));
+      TEST_ASSERT_FLOAT_WITHIN(0.01, std::get<2>(expected[i]),
+                               std::get<2>(actual[i]));
+    }
+  }
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_insert_reads_back_one_tick);
+  RUN_TEST(test_read_window_in_time_order);
+  RUN_TEST(test_latest_tick_matches_table);
+  RUN_TEST(test_latest_measurement_snapshot);
+  RUN_TEST(test_failed_insert_rolls_back_tick);
+  RUN_TEST(test_rollup_hourly_aggregates);
+  RUN_TEST(test_delete_old_measurements);
+  RUN_TEST(test_rows_survive_reopen);
+  RUN_TEST(test_existing_file_switches_to_incremental_vacuum);
+  RUN_TEST(test_backends_return_same_order);
+  return UNITY_END();
+}
@@ -0,0 +1,121 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "DeadbandFilter.hpp"
+#include "SensorTraits.hpp"
+#include <chrono>
+#include <cstdint>
+#include <unity.h>
+
+using namespace std::chrono;
+
+void setUp() {}
+void tearDown() {}
+
+namespace {
+//
+const system_clock::time_point T0{seconds{1700000000}};
+//
+Sensor::MeasuredValue bme280(int16_t centi_degc, int16_t centi_rh,
+                             int32_t deci_pa) {
+  return Sensor::Bme280{Sensor::Traits<Sensor::Bme280>::descriptor,
+                        CentiDegC{centi_degc}, CentiRH{centi_rh},
+                        DeciPa{deci_pa}};
+}
+//
+Sensor::MeasuredValue sgp30(uint16_t eco2, uint16_t tvoc) {
+  return Sensor::Sgp30{Sensor::Traits<Sensor::Sgp30>::descriptor,
+                       Ppm{eco2},
+                       Ppb{tvoc},
+                       std::nullopt,
+                       std::nullopt};
+}
+//
+DeadbandFilter enabled_filter() {
+  DeadbandFilter filter{};
+  filter.enable(DeadbandFilter::Bands{}, seconds{600});
+  return filter;
+}
+} // namespace
+
+//
+void test_disabled_filter_passes_everything() {
+  DeadbandFilter filter{};
+  TEST_ASSERT_FALSE(filter.isEnabled());
+  TEST_ASSERT_TRUE(filter.pass(T0, bme280(2000, 5000, 101300)));
+  TEST_ASSERT_TRUE(filter.pass(T0, bme280(2000, 5000, 101300)));
+}
+
+//
+void test_first_value_passes() {
+  DeadbandFilter filter = enabled_filter();
+  TEST_ASSERT_TRUE(filter.isEnabled());
+  TEST_ASSERT_TRUE(filter.pass(T0, bme280(2000, 5000, 101300)));
+}
+
+//
+void test_small_changes_are_dropped() {
+  DeadbandFilter filter = enabled_filter();
+  filter.pass(T0, bme280(2000, 5000, 101300));
+  // 0.09℃, 0.99%RH, 9.9Pa
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{12}, bme280(2009, 5099, 101399)));
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{24}, bme280(1991, 4901, 101201)));
+}
+
+// どれか1つでも幅を超えたら通す
+void test_change_beyond_band_passes() {
+  DeadbandFilter filter = enabled_filter();
+  filter.pass(T0, bme280(2000, 5000, 101300));
+  TEST_ASSERT_TRUE(filter.pass(T0 + seconds{12}, bme280(2010, 5000, 101300)));
+  TEST_ASSERT_TRUE(filter.pass(T0 + seconds{24}, bme280(2010, 4900, 101300)));
+  TEST_ASSERT_TRUE(filter.pass(T0 + seconds{36}, bme280(2010, 4900, 101200)));
+}
+
+// 変化は前回通した値から測る
+void test_slow_drift_accumulates() {
+  DeadbandFilter filter = enabled_filter();
+  filter.pass(T0, sgp30(400, 0));
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{1}, sgp30(405, 0)));
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{2}, sgp30(409, 9)));
+  TEST_ASSERT_TRUE(filter.pass(T0 + seconds{3}, sgp30(410, 9)));
+}
+
+//
+void test_heartbeat_passes_unchanged_value() {
+  DeadbandFilter filter = enabled_filter();
+  filter.pass(T0, sgp30(400, 0));
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{599}, sgp30(400, 0)));
+  TEST_ASSERT_TRUE(filter.pass(T0 + seconds{600}, sgp30(400, 0)));
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{601}, sgp30(400, 0)));
+}
+
+// 測定値の種類毎に前回の値を持つ
+void test_kinds_are_filtered_independently() {
+  DeadbandFilter filter = enabled_filter();
+  TEST_ASSERT_TRUE(filter.pass(T0, bme280(2000, 5000, 101300)));
+  TEST_ASSERT_TRUE(filter.pass(T0, sgp30(400, 0)));
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{1}, bme280(2000, 5000, 101300)));
+  TEST_ASSERT_FALSE(filter.pass(T0 + seconds{1}, sgp30(400, 0)));
+}
+
+//
+void test_monostate_passes() {
+  DeadbandFilter filter = enabled_filter();
+  TEST_ASSERT_TRUE(filter.pass(T0, std::monostate{}));
+  TEST_ASSERT_TRUE(filter.pass(T0, std::monostate{}));
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_disabled_filter_passes_everything);
+  RUN_TEST(test_first_value_passes);
+  RUN_TEST(test_small_changes_are_dropped);
+  RUN_TEST(test_change_beyond_band_passes);
+  RUN_TEST(test_slow_drift_accumulates);
+  RUN_TEST(test_heartbeat_passes_unchanged_value);
+  RUN_TEST(test_kinds_are_filtered_independently);
+  RUN_TEST(test_monostate_passes);
+  return UNITY_END();
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "Diagnostics.hpp"
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <unity.h>
+
+using Diagnostics::LatencyHistogram;
+
+void setUp() {}
+void tearDown() {}
+
+//
+void test_empty_histogram() {
+  LatencyHistogram histogram{};
+  auto summary = histogram.summary();
+  TEST_ASSERT_EQUAL_UINT32(0, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(0, summary.p50_us);
+  TEST_ASSERT_EQUAL_UINT32(0, summary.p99_us);
+  TEST_ASSERT_EQUAL_UINT32(0, summary.max_us);
+}
+
+// 百分位は区間の上端(最大値を超えない)で見積もる
+void test_percentiles_use_bucket_upper_bound() {
+  LatencyHistogram histogram{};
+  for (int i = 0; i < 99; ++i) {
+    histogram.record(100); // [64, 128)
+  }
+  histogram.record(5000); // [4096, 8192)
+  auto summary = histogram.summary();
+  TEST_ASSERT_EQUAL_UINT32(100, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(128, summary.p50_us);
+  TEST_ASSERT_EQUAL_UINT32(128, summary.p99_us);
+  TEST_ASSERT_EQUAL_UINT32(5000, summary.max_us);
+  histogram.record(5000);
+  TEST_ASSERT_EQUAL_UINT32(5000, histogram.summary().p99_us);
+}
+
+//
+void test_zero_and_one_share_first_bucket() {
+  LatencyHistogram histogram{};
+  histogram.record(0);
+  histogram.record(1);
+  auto summary = histogram.summary();
+  TEST_ASSERT_EQUAL_UINT32(2, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(1, summary.p99_us);
+  TEST_ASSERT_EQUAL_UINT32(1, summary.max_us);
+}
+
+// 最後の区間より長い時間は最大値で見積もる
+void test_long_latency_goes_to_last_bucket() {
+  LatencyHistogram histogram{};
+  histogram.record(UINT32_MAX);
+  auto summary = histogram.summary();
+  TEST_ASSERT_EQUAL_UINT32(1, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, summary.p50_us);
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, summary.max_us);
+}
+
+//
+void test_concurrent_records_are_counted() {
+  LatencyHistogram histogram{};
+  auto work = [&histogram]() {
+    for (uint32_t i = 0; i < 10000; ++i) {
+      histogram.record(i);
+    }
+  };
+  std::thread t1{work};
+  std::thread t2{work};
+  t1.join();
+  t2.join();
+  auto summary = histogram.summary();
+  TEST_ASSERT_EQUAL_UINT32(20000, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(9999, summary.max_us);
+}
+
+//
+void test_scoped_timer_records_elapsed_time() {
+  auto &histogram = Diagnostics::histogram(Diagnostics::Probe::Measure);
+  {
+    Diagnostics::ScopedTimer timer{Diagnostics::Probe::Measure};
+    std::this_thread::sleep_for(std::chrono::milliseconds{2});
+  }
+  auto summary = histogram.summary();
+  TEST_ASSERT_EQUAL_UINT32(1, summary.count);
+  TEST_ASSERT_GREATER_OR_EQUAL(2000, summary.max_us);
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_histogram);
+  RUN_TEST(test_percentiles_use_bucket_upper_bound);
+  RUN_TEST(test_zero_and_one_share_first_bucket);
+  RUN_TEST(test_long_latency_goes_to_last_bucket);
+  RUN_TEST(test_concurrent_records_are_counted);
+  RUN_TEST(test_scoped_timer_records_elapsed_time);
+  return UNITY_END();
+}
@@ -0,0 +1,135 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "MessageWriter.hpp"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+//
+void test_json_object() {
+  std::array<char, 128> buffer{};
+  JsonWriter json{buffer.data(), buffer.size()};
+  json.beginObject();
+  json.field("sensorId", "BME280");
+  json.field("co2", uint16_t{415});
+  json.field("temperature", 23.456f);
+  json.endObject();
+  const char *expected{
+      R"({"sensorId":"BME280","co2":415,"temperature":23.46})"};
+  TEST_ASSERT_EQUAL_STRING(expected, buffer.data());
+  TEST_ASSERT_EQUAL_size_t(std::strlen(expected), json.length());
+}
+
+// JSONには無限大と非数が無い
+void test_json_non_finite_is_null() {
+  std::array<char, 64> buffer{};
+  JsonWriter json{buffer.data(), buffer.size()};
+  json.beginObject();
+  json.field("a", NAN);
+  json.field("b", INFINITY);
+  json.endObject();
+  TEST_ASSERT_EQUAL_STRING(R"({"a":null,"b":null})", buffer.data());
+}
+
+// 終端も入らなければ0
+void test_json_overflow_returns_zero() {
+  std::array<char, 12> buffer{};
+  JsonWriter json{buffer.data(), buffer.size()};
+  json.beginObject();
+  json.field("abc", uint16_t{1});
+  json.endObject();
+  TEST_ASSERT_EQUAL_size_t(9, json.length());
+  json.field("d", uint16_t{2});
+  TEST_ASSERT_EQUAL_size_t(0, json.length());
+}
+
+// RFC 8949 Appendix Aの例
+void test_cbor_integer_heads() {
+  std::array<char, 64> buffer{};
+  CborWriter cbor{buffer.data(), buffer.size()};
+  cbor.integer(0);
+  cbor.integer(23);
+  cbor.integer(24);
+  cbor.integer(255);
+  cbor.integer(256);
+  cbor.integer(65536);
+  cbor.integer(4294967296);
+  cbor.integer(-1);
+  cbor.integer(-25);
+  cbor.integer(-1000);
+  const uint8_t expected[]{
+      0x00,                                           // 0
+      0x17,                                           // 23
+      0x18, 0x18,                                     // 24
+      0x18, 0xff,                                     // 255
+      0x19, 0x01, 0x00,                               // 256
+      0x1a, 0x00, 0x01, 0x00, 0x00,                   // 65536
+      0x1b, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, // 4294967296
+      0x00,                                           //
+      0x20,                                           // -1
+      0x38, 0x18,                                     // -25
+      0x39, 0x03, 0xe7,                               // -1000
+  };
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), cbor.length());
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer.data(), sizeof(expected));
+}
+
+//
+void test_cbor_map_with_fields() {
+  std::array<char, 64> buffer{};
+  CborWriter cbor{buffer.data(), buffer.size()};
+  cbor.beginMap(3);
+  cbor.text("s");
+  cbor.text("SCD41");
+  cbor.field("t", int64_t{10});
+  // 固定小数点の整数で書く
+  cbor.field("temperature", 23.456, 100);
+  const uint8_t expected[]{
+      0xa3,                                                       // map(3)
+      0x61, 's',                                                  //
+      0x65, 'S', 'C', 'D', '4', '1',                              //
+      0x61, 't', 0x0a,                                            //
+      0x6b, 't', 'e', 'm', 'p', 'e', 'r', 'a', 't', 'u', 'r', 'e', //
+      0x19, 0x09, 0x2a,                                           // 2346
+  };
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), cbor.length());
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer.data(), sizeof(expected));
+}
+
+//
+void test_cbor_non_finite_is_null() {
+  std::array<char, 8> buffer{};
+  CborWriter cbor{buffer.data(), buffer.size()};
+  cbor.field("h", NAN, 100);
+  const uint8_t expected[]{0x61, 'h', CBOR_NULL};
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), cbor.length());
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer.data(), sizeof(expected));
+}
+
+//
+void test_cbor_overflow_returns_zero() {
+  std::array<char, 4> buffer{};
+  CborWriter cbor{buffer.data(), buffer.size()};
+  cbor.integer(65536);
+  TEST_ASSERT_EQUAL_size_t(0, cbor.length());
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_json_object);
+  RUN_TEST(test_json_non_finite_is_null);
+  RUN_TEST(test_json_overflow_returns_zero);
+  RUN_TEST(test_cbor_integer_heads);
+  RUN_TEST(test_cbor_map_with_fields);
+  RUN_TEST(test_cbor_non_finite_is_null);
+  RUN_TEST(test_cbor_overflow_returns_zero);
+  return UNITY_END();
+}
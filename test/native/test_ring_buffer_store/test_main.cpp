@@ -0,0 +1,161 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "RingBufferStore.hpp"
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <unity.h>
+
+using namespace std::chrono;
+
+void setUp() {}
+void tearDown() {}
+
+namespace {
+using Ring = RingBufferStore::Ring<int16_t>;
+//
+constexpr SensorId SENSOR_A{0x4100000000000000};
+constexpr SensorId SENSOR_B{0x4200000000000000};
+//
+const system_clock::time_point T0{minutes{28000000}};
+} // namespace
+
+//
+void test_empty_ring() {
+  Ring ring{4};
+  TEST_ASSERT_EQUAL_size_t(4, ring.capacity());
+  TEST_ASSERT_EQUAL_UINT32(0, ring.latest_minute());
+  TEST_ASSERT_FALSE(ring.get(1).has_value());
+}
+
+//
+void test_put_and_get() {
+  Ring ring{4};
+  TEST_ASSERT_TRUE(ring.put(10, 100));
+  TEST_ASSERT_TRUE(ring.put(12, 120));
+  TEST_ASSERT_EQUAL_INT16(100, ring.get(10).value());
+  TEST_ASSERT_EQUAL_INT16(120, ring.get(12).value());
+  // 書いていない分
+  TEST_ASSERT_FALSE(ring.get(11).has_value());
+  TEST_ASSERT_EQUAL_UINT32(12, ring.latest_minute());
+}
+
+// minute 0は空きスロットの印なので入れられない
+void test_minute_zero_is_rejected() {
+  Ring ring{4};
+  TEST_ASSERT_FALSE(ring.put(0, 1));
+}
+
+// 容量を超えたら同じスロットの古い値を捨てる
+void test_wraps_and_drops_oldest() {
+  Ring ring{4};
+  for (uint32_t minute = 1; minute <= 6; ++minute) {
+    TEST_ASSERT_TRUE(ring.put(minute, static_cast<int16_t>(minute * 10)));
+  }
+  TEST_ASSERT_EQUAL_UINT32(3, ring.oldest_minute());
+  TEST_ASSERT_FALSE(ring.get(1).has_value());
+  TEST_ASSERT_FALSE(ring.get(2).has_value());
+  TEST_ASSERT_EQUAL_INT16(30, ring.get(3).value());
+  TEST_ASSERT_EQUAL_INT16(60, ring.get(6).value());
+}
+
+//
+void test_value_older_than_retention_is_rejected() {
+  Ring ring{4};
+  ring.put(10, 100);
+  TEST_ASSERT_FALSE(ring.put(6, 60));
+  TEST_ASSERT_TRUE(ring.put(7, 70));
+  TEST_ASSERT_EQUAL_INT16(100, ring.get(10).value());
+}
+
+// 遅れて来た値は最新の分を戻さない
+void test_late_value_keeps_latest_minute() {
+  Ring ring{4};
+  ring.put(10, 100);
+  ring.put(9, 90);
+  TEST_ASSERT_EQUAL_UINT32(10, ring.latest_minute());
+  TEST_ASSERT_EQUAL_INT16(90, ring.get(9).value());
+}
+
+//
+void test_minute_conversion_round_trips() {
+  auto minute = RingBufferStore::to_minute(T0 + seconds{59});
+  TEST_ASSERT_EQUAL_UINT32(28000000, minute);
+  TEST_ASSERT_TRUE(RingBufferStore::from_minute(minute) == T0);
+}
+
+//
+void test_store_reads_by_time_in_order() {
+  RingBufferStore store{60};
+  using Table = RingBufferStore::Table;
+  store.insert(Table::Temperature, {SENSOR_A, T0, 20.5});
+  store.insert(Table::Temperature, {SENSOR_A, T0 + minutes{1}, 21.0});
+  store.insert(Table::Temperature, {SENSOR_B, T0 + minutes{1}, 19.25});
+  std::vector<double> values{};
+  auto counter = store.read(
+      Table::Temperature, {T0, Database::OrderByAtDesc},
+      RingBufferStore::ReadCallback<RingBufferStore::TimePointAndDouble>{
+          [&values](size_t, RingBufferStore::TimePointAndDouble item) {
+            values.push_back(std::get<2>(item));
+            return true;
+          }});
+  // counterは1から数える
+  TEST_ASSERT_EQUAL_size_t(4, counter.value());
+  TEST_ASSERT_EQUAL_size_t(3, values.size());
+  TEST_ASSERT_DOUBLE_WITHIN(1e-9, 20.5, values.back());
+}
+
+//
+void test_store_keeps_baseline_per_minute() {
+  RingBufferStore store{60};
+  using Table = RingBufferStore::Table;
+  using Row = RingBufferStore::TimePointAndIntAndOptInt;
+  store.insert(Table::CarbonDioxide, Row{SENSOR_A, T0, 400, 0x8a00});
+  store.insert(Table::CarbonDioxide,
+               Row{SENSOR_A, T0 + minutes{1}, 410, std::nullopt});
+  std::vector<Row> rows{};
+  store.read(Table::CarbonDioxide, {SENSOR_A, Database::OrderByAtAsc, 10},
+             RingBufferStore::ReadCallback<Row>{[&rows](size_t, Row row) {
+               rows.push_back(row);
+               return true;
+             }});
+  TEST_ASSERT_EQUAL_size_t(2, rows.size());
+  TEST_ASSERT_EQUAL_UINT16(400, std::get<2>(rows[0]));
+  TEST_ASSERT_EQUAL_UINT16(0x8a00, std::get<3>(rows[0]).value());
+  TEST_ASSERT_FALSE(std::get<3>(rows[1]).has_value());
+}
+
+//
+void test_store_hides_deleted_minutes() {
+  RingBufferStore store{60};
+  using Table = RingBufferStore::Table;
+  store.insert(Table::Pressure, {SENSOR_A, T0, 1013.0});
+  store.insert(Table::Pressure, {SENSOR_A, T0 + minutes{2}, 1012.5});
+  store.delete_older_than(T0 + minutes{1});
+  size_t rows{0};
+  store.read(Table::Pressure, {T0, Database::OrderByAtAsc},
+             RingBufferStore::ReadCallback<RingBufferStore::TimePointAndDouble>{
+                 [&rows](size_t, RingBufferStore::TimePointAndDouble) {
+                   ++rows;
+                   return true;
+                 }});
+  TEST_ASSERT_EQUAL_size_t(1, rows);
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_ring);
+  RUN_TEST(test_put_and_get);
+  RUN_TEST(test_minute_zero_is_rejected);
+  RUN_TEST(test_wraps_and_drops_oldest);
+  RUN_TEST(test_value_older_than_retention_is_rejected);
+  RUN_TEST(test_late_value_keeps_latest_minute);
+  RUN_TEST(test_minute_conversion_round_trips);
+  RUN_TEST(test_store_reads_by_time_in_order);
+  RUN_TEST(test_store_keeps_baseline_per_minute);
+  RUN_TEST(test_store_hides_deleted_minutes);
+  return UNITY_END();
+}
@@ -0,0 +1,139 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "Scheduler.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unity.h>
+
+using namespace std::chrono;
+using Duration = Scheduler::Duration;
+
+void setUp() {}
+void tearDown() {}
+
+// 仕事が無ければ最大時間眠る
+void test_no_job_sleeps_max() {
+  Scheduler scheduler{};
+  TEST_ASSERT_EQUAL_INT64(Scheduler::MAX_SLEEP.count(),
+                          scheduler.run_pending(steady_clock::now()).count());
+}
+
+// 期限はsteady_clockで決まるので, 実際に待ってから呼ぶ
+void test_job_runs_only_when_due() {
+  Scheduler scheduler{};
+  int runs{0};
+  scheduler.add(Duration{20}, [&runs]() -> Duration {
+    ++runs;
+    return Duration{1000};
+  });
+  auto sleep = scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(0, runs);
+  TEST_ASSERT_TRUE(sleep > Duration{0} && sleep <= Duration{20});
+  std::this_thread::sleep_for(sleep);
+  scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(1, runs);
+  // 次の期限は実行を終えた時から数える
+  sleep = scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(1, runs);
+  TEST_ASSERT_TRUE(sleep > Duration{900} && sleep <= Duration{1000});
+}
+
+// 期限の早い順に実行する
+void test_jobs_run_in_deadline_order() {
+  Scheduler scheduler{};
+  std::string order{};
+  scheduler.add(Duration{3}, [&order]() -> Duration {
+    order += 'c';
+    return Duration{1000};
+  });
+  scheduler.add(Duration{1}, [&order]() -> Duration {
+    order += 'a';
+    return Duration{1000};
+  });
+  scheduler.every(Duration{2}, [&order]() { order += 'b'; });
+  std::this_thread::sleep_for(Duration{5});
+  scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_STRING("abc", order.c_str());
+}
+
+// 戻り値の間隔で次回実行する
+void test_job_reschedules_with_returned_interval() {
+  Scheduler scheduler{};
+  int runs{0};
+  scheduler.add(Duration{0}, [&runs]() -> Duration {
+    ++runs;
+    return runs == 1 ? Duration{0} : Duration{500};
+  });
+  auto sleep = scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(1, runs);
+  TEST_ASSERT_EQUAL_INT64(0, sleep.count());
+  scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(2, runs);
+  sleep = scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(2, runs);
+  TEST_ASSERT_TRUE(sleep > Duration{400} && sleep <= Duration{500});
+}
+
+// 遠い期限でも最大時間で起きる
+void test_sleep_is_clamped_to_max() {
+  Scheduler scheduler{};
+  scheduler.add(seconds{60}, []() -> Duration { return Duration{0}; });
+  TEST_ASSERT_EQUAL_INT64(Scheduler::MAX_SLEEP.count(),
+                          scheduler.run_pending(steady_clock::now()).count());
+}
+
+// notifyされた仕事は期限を待たずに実行する
+void test_notified_job_runs_before_deadline() {
+  Scheduler scheduler{};
+  int runs{0};
+  auto id = scheduler.add(seconds{60}, [&runs]() -> Duration {
+    ++runs;
+    return Duration{1000};
+  });
+  scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(0, runs);
+  scheduler.notify(id);
+  scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(1, runs);
+  // 前倒しする前の期限では実行しない
+  auto sleep = scheduler.run_pending(steady_clock::now());
+  TEST_ASSERT_EQUAL_INT(1, runs);
+  TEST_ASSERT_TRUE(sleep > Duration{900} && sleep <= Duration{1000});
+}
+
+// run()で眠っているタスクは他のタスクのnotifyで起きる
+void test_notify_wakes_running_scheduler() {
+  // run()は戻らないのでプログラムの終わりまで残す
+  static Scheduler scheduler{};
+  static std::atomic<int> runs{0};
+  auto id = scheduler.add(seconds{60}, []() -> Duration {
+    ++runs;
+    return seconds{60};
+  });
+  std::thread{[] { scheduler.run(); }}.detach();
+  std::this_thread::sleep_for(Duration{50});
+  TEST_ASSERT_EQUAL_INT(0, runs.load());
+  scheduler.notify(id);
+  // MAX_SLEEPより十分早く起きる
+  for (int i = 0; i < 100 && runs.load() == 0; ++i) {
+    std::this_thread::sleep_for(Duration{1});
+  }
+  TEST_ASSERT_EQUAL_INT(1, runs.load());
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_no_job_sleeps_max);
+  RUN_TEST(test_job_runs_only_when_due);
+  RUN_TEST(test_jobs_run_in_deadline_order);
+  RUN_TEST(test_job_reschedules_with_returned_interval);
+  RUN_TEST(test_sleep_is_clamped_to_max);
+  RUN_TEST(test_notified_job_runs_before_deadline);
+  RUN_TEST(test_notify_wakes_running_scheduler);
+  return UNITY_END();
+}
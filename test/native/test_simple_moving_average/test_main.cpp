@@ -0,0 +1,128 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "SimpleMovingAverage.hpp"
+#include <cstdint>
+#include <functional>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+//
+void test_wedge_keeps_minimum_in_window() {
+  MonotonicWedge<4, int16_t, std::less<int16_t>> wedge{};
+  wedge.push_back(0, 5);
+  wedge.push_back(1, 3);
+  wedge.push_back(2, 7);
+  TEST_ASSERT_EQUAL_INT16(3, wedge.front());
+  // 3が窓から外れたら次に小さい7
+  wedge.expire(2);
+  TEST_ASSERT_EQUAL_INT16(7, wedge.front());
+  wedge.push_back(3, 1);
+  TEST_ASSERT_EQUAL_INT16(1, wedge.front());
+}
+
+//
+void test_wedge_keeps_maximum_in_window() {
+  MonotonicWedge<4, int16_t, std::greater<int16_t>> wedge{};
+  wedge.push_back(0, 5);
+  wedge.push_back(1, 9);
+  wedge.push_back(2, 2);
+  TEST_ASSERT_EQUAL_INT16(9, wedge.front());
+  wedge.expire(2);
+  TEST_ASSERT_EQUAL_INT16(2, wedge.front());
+  // 同じ値は新しい方を残す
+  wedge.push_back(3, 2);
+  wedge.expire(3);
+  TEST_ASSERT_EQUAL_INT16(2, wedge.front());
+}
+
+//
+void test_empty_average_is_zero() {
+  SimpleMovingAverage<4, int16_t, int32_t> sma{};
+  TEST_ASSERT_FALSE(sma.ready());
+  TEST_ASSERT_EQUAL_INT16(0, sma.calculate());
+  TEST_ASSERT_EQUAL_UINT8(0, sma.statistics().count);
+}
+
+//
+void test_average_drops_oldest_value() {
+  SimpleMovingAverage<4, int16_t, int32_t> sma{3};
+  sma.push_back(10);
+  sma.push_back(20);
+  TEST_ASSERT_TRUE(sma.ready());
+  TEST_ASSERT_FALSE(sma.full());
+  TEST_ASSERT_EQUAL_INT16(15, sma.calculate());
+  sma.push_back(30);
+  TEST_ASSERT_TRUE(sma.full());
+  TEST_ASSERT_EQUAL_INT16(20, sma.calculate());
+  sma.push_back(40);
+  TEST_ASSERT_EQUAL_INT16(30, sma.calculate());
+}
+
+//
+void test_statistics_of_window() {
+  SimpleMovingAverage<8, int16_t, int32_t> sma{4};
+  for (int16_t v : {100, -4, 2, 4, 6}) {
+    sma.push_back(v);
+  }
+  // 窓の中は -4, 2, 4, 6
+  auto stat = sma.statistics();
+  TEST_ASSERT_EQUAL_UINT8(4, stat.count);
+  TEST_ASSERT_EQUAL_INT16(2, stat.mean);
+  TEST_ASSERT_EQUAL_INT16(-4, stat.min);
+  TEST_ASSERT_EQUAL_INT16(6, stat.max);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, 14.0f, stat.variance);
+}
+
+//
+void test_window_is_clamped_to_capacity() {
+  SimpleMovingAverage<4, uint16_t, uint32_t> sma{0};
+  TEST_ASSERT_EQUAL_UINT8(1, sma.getWindow());
+  sma.setWindow(10);
+  TEST_ASSERT_EQUAL_UINT8(4, sma.getWindow());
+}
+
+//
+void test_set_window_discards_values() {
+  SimpleMovingAverage<4, uint16_t, uint32_t> sma{4};
+  sma.push_back(1);
+  sma.push_back(2);
+  sma.setWindow(2);
+  TEST_ASSERT_FALSE(sma.ready());
+}
+
+//
+void test_resize_keeps_newest_values() {
+  SimpleMovingAverage<8, uint16_t, uint32_t> sma{5};
+  for (uint16_t v = 1; v <= 7; ++v) {
+    sma.push_back(v); // 窓の中は 3, 4, 5, 6, 7
+  }
+  sma.resize(2);
+  auto shrunk = sma.statistics();
+  TEST_ASSERT_EQUAL_UINT8(2, shrunk.count);
+  TEST_ASSERT_EQUAL_UINT16(6, shrunk.min);
+  TEST_ASSERT_EQUAL_UINT16(7, shrunk.max);
+  sma.resize(6);
+  sma.push_back(8);
+  auto grown = sma.statistics();
+  TEST_ASSERT_EQUAL_UINT8(3, grown.count);
+  TEST_ASSERT_EQUAL_UINT16(7, grown.mean);
+  TEST_ASSERT_EQUAL_UINT16(6, grown.min);
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_wedge_keeps_minimum_in_window);
+  RUN_TEST(test_wedge_keeps_maximum_in_window);
+  RUN_TEST(test_empty_average_is_zero);
+  RUN_TEST(test_average_drops_oldest_value);
+  RUN_TEST(test_statistics_of_window);
+  RUN_TEST(test_window_is_clamped_to_capacity);
+  RUN_TEST(test_set_window_discards_values);
+  RUN_TEST(test_resize_keeps_newest_values);
+  return UNITY_END();
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "SpscQueue.hpp"
+#include <cstdint>
+#include <thread>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+//
+void test_empty_queue_pops_nothing() {
+  SpscQueue<int, 3> queue{};
+  TEST_ASSERT_TRUE(queue.empty());
+  TEST_ASSERT_FALSE(queue.pop().has_value());
+}
+
+//
+void test_pops_in_pushed_order() {
+  SpscQueue<int, 3> queue{};
+  TEST_ASSERT_TRUE(queue.push(1));
+  TEST_ASSERT_TRUE(queue.push(2));
+  TEST_ASSERT_FALSE(queue.empty());
+  TEST_ASSERT_EQUAL_INT(1, queue.pop().value());
+  TEST_ASSERT_EQUAL_INT(2, queue.pop().value());
+  TEST_ASSERT_TRUE(queue.empty());
+}
+
+//
+void test_full_queue_rejects_push() {
+  SpscQueue<int, 3> queue{};
+  TEST_ASSERT_EQUAL_size_t(3, queue.capacity());
+  for (int i = 0; i < 3; ++i) {
+    TEST_ASSERT_TRUE(queue.push(i));
+  }
+  TEST_ASSERT_FALSE(queue.push(3));
+  // 1つ空けば入る
+  TEST_ASSERT_EQUAL_INT(0, queue.pop().value());
+  TEST_ASSERT_TRUE(queue.push(3));
+}
+
+//
+void test_wraps_around_the_ring() {
+  SpscQueue<int, 2> queue{};
+  for (int i = 0; i < 10; ++i) {
+    TEST_ASSERT_TRUE(queue.push(i));
+    TEST_ASSERT_EQUAL_INT(i, queue.pop().value());
+  }
+  TEST_ASSERT_TRUE(queue.empty());
+}
+
+// 入れるスレッドと出すスレッドを分けても順番通りに全部出てくる
+void test_producer_and_consumer_threads() {
+  constexpr uint32_t COUNT{100000};
+  SpscQueue<uint32_t, 16> queue{};
+  std::thread producer{[&queue]() {
+    for (uint32_t i = 0; i < COUNT;) {
+      if (queue.push(i)) {
+        ++i;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }};
+  uint32_t expected{0};
+  bool in_order{true};
+  while (expected < COUNT) {
+    if (auto item = queue.pop(); item) {
+      in_order = in_order && *item == expected;
+      ++expected;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  TEST_ASSERT_TRUE(in_order);
+  TEST_ASSERT_TRUE(queue.empty());
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_queue_pops_nothing);
+  RUN_TEST(test_pops_in_pushed_order);
+  RUN_TEST(test_full_queue_rejects_push);
+  RUN_TEST(test_wraps_around_the_ring);
+  RUN_TEST(test_producer_and_consumer_threads);
+  return UNITY_END();
+}
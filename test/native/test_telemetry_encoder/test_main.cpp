@@ -0,0 +1,163 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "MessageWriter.hpp"
+#include "SensorTraits.hpp"
+#include "TelemetryEncoder.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <unity.h>
+
+using namespace std::chrono;
+
+namespace {
+// 2023-11-14T22:13:20Z
+const system_clock::time_point T0{seconds{1700000000}};
+//
+TelemetryEncoder::Payload bme280(int i) {
+  return Sensor::MeasurementBme280{
+      T0 + seconds{i},
+      Sensor::Bme280{Sensor::Traits<Sensor::Bme280>::descriptor,
+                     CentiDegC(2000 + i), CentiRH(5000), DeciPa(1013000)}};
+}
+//
+TelemetryEncoder::Payload sgp30() {
+  return Sensor::MeasurementSgp30{
+      T0, Sensor::Sgp30{Sensor::Traits<Sensor::Sgp30>::descriptor, Ppm(415),
+                        Ppb(12), BaselineECo2(0x8a00), std::nullopt}};
+}
+//
+TelemetryEncoder encoder(TelemetryEncoder::Encoding encoding) {
+  TelemetryEncoder e{};
+  e.setDeviceId("dev");
+  e.setEncoding(encoding);
+  return e;
+}
+} // namespace
+
+void setUp() {}
+void tearDown() {}
+
+//
+void test_json_single_message() {
+  auto e = encoder(TelemetryEncoder::Encoding::Json);
+  std::array<char, 256> buffer{};
+  auto length = e.write_single_message(bme280(0), buffer.data(), buffer.size());
+  const char *expected{R"({"sensorId":"dev-BME280",)"
+                       R"("measuredAt":"2023-11-14T22:13:20Z",)"
+                       R"("temperature":20.00,"humidity":50.00,)"
+                       R"("pressure":1013.00})"};
+  TEST_ASSERT_EQUAL_STRING(expected, buffer.data());
+  TEST_ASSERT_EQUAL_size_t(std::strlen(expected), length);
+}
+
+// ベースラインは測定値の後に書く, 無いベースラインは書かない
+void test_json_baseline_follows_values() {
+  auto e = encoder(TelemetryEncoder::Encoding::Json);
+  std::array<char, 256> buffer{};
+  e.write_single_message(sgp30(), buffer.data(), buffer.size());
+  TEST_ASSERT_EQUAL_STRING(R"({"sensorId":"dev-SGP30",)"
+                           R"("measuredAt":"2023-11-14T22:13:20Z",)"
+                           R"("tvoc":12,"eCo2":415,"eCo2_baseline":35328})",
+                           buffer.data());
+}
+
+// デバイスIDを変えたら覚えていたセンサーIDを作り直す
+void test_device_id_change_rebuilds_sensor_id() {
+  auto e = encoder(TelemetryEncoder::Encoding::Json);
+  std::array<char, 256> buffer{};
+  e.write_single_message(bme280(0), buffer.data(), buffer.size());
+  e.setDeviceId("other");
+  e.write_single_message(bme280(0), buffer.data(), buffer.size());
+  TEST_ASSERT_NOT_NULL(std::strstr(buffer.data(), R"("other-BME280")"));
+}
+
+//
+void test_json_overflow_returns_zero() {
+  auto e = encoder(TelemetryEncoder::Encoding::Json);
+  std::array<char, 32> buffer{};
+  TEST_ASSERT_EQUAL_size_t(
+      0, e.write_single_message(bme280(0), buffer.data(), buffer.size()));
+}
+
+//
+void test_cbor_single_message() {
+  auto e = encoder(TelemetryEncoder::Encoding::Cbor);
+  std::array<char, 128> buffer{};
+  auto length = e.write_single_message(bme280(0), buffer.data(), buffer.size());
+  const uint8_t expected[]{
+      0xa5,                                         // map(5)
+      0x61, 's',                                    //
+      0x66, 'B', 'M', 'E', '2', '8', '0',           //
+      0x61, 't',                                    //
+      0x1a, 0x65, 0x53, 0xf1, 0x00,                 // 1700000000
+      0x6b, 't', 'e', 'm', 'p', 'e', 'r', 'a', 't', //
+      'u', 'r', 'e', 0x19, 0x07, 0xd0,              // 2000
+      0x68, 'h', 'u', 'm', 'i', 'd', 'i', 't', 'y', //
+      0x19, 0x13, 0x88,                             // 5000
+      0x68, 'p', 'r', 'e', 's', 's', 'u', 'r', 'e', //
+      0x1a, 0x00, 0x0f, 0x75, 0x08,                 // 1013000
+  };
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), length);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer.data(), sizeof(expected));
+}
+
+//
+void test_json_batch_respects_max_items() {
+  auto e = encoder(TelemetryEncoder::Encoding::Json);
+  e.setBatchMode(2, 1024);
+  std::deque<TelemetryEncoder::Payload> fifo{bme280(0), bme280(1), bme280(2)};
+  std::array<char, 1024> buffer{};
+  auto [length, items] =
+      e.write_batch_message(fifo, buffer.data(), buffer.size());
+  TEST_ASSERT_EQUAL_size_t(2, items);
+  TEST_ASSERT_EQUAL_size_t(std::strlen(buffer.data()), length);
+  TEST_ASSERT_EQUAL('[', buffer[0]);
+  TEST_ASSERT_EQUAL(']', buffer[length - 1]);
+  TEST_ASSERT_NOT_NULL(std::strstr(buffer.data(), "},{"));
+}
+
+// 入りきらないアイテムは次のメッセージにする
+void test_json_batch_respects_max_bytes() {
+  auto e = encoder(TelemetryEncoder::Encoding::Json);
+  e.setBatchMode(8, 200);
+  std::deque<TelemetryEncoder::Payload> fifo{bme280(0), bme280(1), bme280(2)};
+  std::array<char, 1024> buffer{};
+  auto [length, items] =
+      e.write_batch_message(fifo, buffer.data(), buffer.size());
+  TEST_ASSERT_EQUAL_size_t(1, items);
+  TEST_ASSERT_LESS_OR_EQUAL(200, length + 1);
+}
+
+// 2つ目からは1つ前との時刻の差を書く
+void test_cbor_batch_writes_time_delta() {
+  auto e = encoder(TelemetryEncoder::Encoding::Cbor);
+  e.setBatchMode(8, 1024);
+  std::deque<TelemetryEncoder::Payload> fifo{bme280(0), bme280(60)};
+  std::array<char, 1024> buffer{};
+  auto [length, items] =
+      e.write_batch_message(fifo, buffer.data(), buffer.size());
+  TEST_ASSERT_EQUAL_size_t(2, items);
+  TEST_ASSERT_EQUAL_HEX8(CBOR_INDEFINITE_ARRAY, buffer[0]);
+  TEST_ASSERT_EQUAL_HEX8(CBOR_BREAK, buffer[length - 1]);
+  const uint8_t dt[]{0x62, 'd', 't', 0x18, 0x3c}; // "dt": 60
+  TEST_ASSERT_NOT_NULL(memmem(buffer.data(), length, dt, sizeof(dt)));
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_json_single_message);
+  RUN_TEST(test_json_baseline_follows_values);
+  RUN_TEST(test_device_id_change_rebuilds_sensor_id);
+  RUN_TEST(test_json_overflow_returns_zero);
+  RUN_TEST(test_cbor_single_message);
+  RUN_TEST(test_json_batch_respects_max_items);
+  RUN_TEST(test_json_batch_respects_max_bytes);
+  RUN_TEST(test_cbor_batch_writes_time_delta);
+  return UNITY_END();
+}
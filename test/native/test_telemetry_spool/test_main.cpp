@@ -0,0 +1,328 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "SensorTraits.hpp"
+#include "TelemetrySpool.hpp"
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <string>
+#include <unity.h>
+
+using namespace std::chrono;
+
+namespace {
+//
+const std::string path{
+    (std::filesystem::temp_directory_path() / "test_telemetry_spool.bin")
+        .string()};
+//
+const system_clock::time_point T0{seconds{1700000000}};
+//
+TelemetrySpool::Payload bme280(int i) {
+  return Sensor::MeasurementBme280{
+      T0 + seconds{i},
+      Sensor::Bme280{Sensor::Traits<Sensor::Bme280>::descriptor,
+                     CentiDegC(2000 + i), CentiRH(5000 - i),
+                     DeciPa(101300 + i)}};
+}
+//
+TelemetrySpool::Payload sgp30(int i) {
+  return Sensor::MeasurementSgp30{
+      T0 + seconds{i},
+      Sensor::Sgp30{Sensor::Traits<Sensor::Sgp30>::descriptor,
+                    Ppm(400 + i), Ppb(i), BaselineECo2(0x8a00),
+                    std::nullopt}};
+}
+// ファイルの末尾のバイトを書き換えて最後のレコードを壊す
+void break_last_record() {
+  std::FILE *fp = std::fopen(path.c_str(), "r+b");
+  std::fseek(fp, -1, SEEK_END);
+  int c = std::fgetc(fp);
+  std::fseek(fp, -1, SEEK_END);
+  std::fputc(c ^ 0xff, fp);
+  std::fclose(fp);
+}
+} // namespace
+
+void setUp() { std::remove(path.c_str()); }
+void tearDown() { std::remove(path.c_str()); }
+
+namespace {
+// 1レコードのファイル上の大きさ
+long record_size() {
+  TelemetrySpool spool{};
+  spool.begin(path);
+  spool.checkpoint();
+  auto header = std::filesystem::file_size(path);
+  spool.append(bme280(0));
+  spool.checkpoint();
+  auto size = std::filesystem::file_size(path) - header;
+  spool.terminate();
+  std::remove(path.c_str());
+  return static_cast<long>(size);
+}
+} // namespace
+
+//
+void test_records_round_trip() {
+  TelemetrySpool spool{};
+  TEST_ASSERT_TRUE(spool.begin(path));
+  TEST_ASSERT_TRUE(spool.append(bme280(1)));
+  TEST_ASSERT_TRUE(spool.append(sgp30(2)));
+  TEST_ASSERT_EQUAL_size_t(2, spool.pending());
+  std::deque<TelemetrySpool::Payload> out{};
+  auto range = spool.read(10, out);
+  TEST_ASSERT_EQUAL_UINT32(0, range.first);
+  TEST_ASSERT_EQUAL_UINT32(2, range.count);
+  TEST_ASSERT_EQUAL_size_t(2, out.size());
+  TEST_ASSERT_TRUE(out[0] == bme280(1));
+  TEST_ASSERT_TRUE(out[1] == sgp30(2));
+}
+
+// 送信済みの確認が来るまで消さない
+void test_acknowledge_commits_records() {
+  TelemetrySpool spool{};
+  spool.begin(path);
+  for (int i = 0; i < 3; ++i) {
+    spool.append(bme280(i));
+  }
+  std::deque<TelemetrySpool::Payload> out{};
+  auto first = spool.read(2, out);
+  auto second = spool.read(2, out);
+  TEST_ASSERT_EQUAL_UINT32(2, first.count);
+  TEST_ASSERT_EQUAL_UINT32(2, second.first);
+  TEST_ASSERT_EQUAL_UINT32(1, second.count);
+  // 後の範囲を先に確認しても繋がるまで進めない
+  spool.acknowledge(second);
+  TEST_ASSERT_EQUAL_size_t(3, spool.pending());
+  spool.acknowledge(first);
+  TEST_ASSERT_EQUAL_size_t(0, spool.pending());
+}
+
+//
+void test_rewind_reads_unacknowledged_again() {
+  TelemetrySpool spool{};
+  spool.begin(path);
+  spool.append(bme280(1));
+  spool.append(bme280(2));
+  std::deque<TelemetrySpool::Payload> out{};
+  spool.acknowledge(spool.read(1, out));
+  spool.read(1, out);
+  TEST_ASSERT_EQUAL_UINT32(0, spool.read(1, out).count);
+  spool.rewind();
+  out.clear();
+  auto range = spool.read(10, out);
+  TEST_ASSERT_EQUAL_UINT32(1, range.first);
+  TEST_ASSERT_EQUAL_UINT32(1, range.count);
+  TEST_ASSERT_TRUE(out.front() == bme280(2));
+}
+
+// 開き直したら送信済みの確認が来ていない所から読む
+void test_reopen_replays_pending_records() {
+  {
+    TelemetrySpool spool{};
+    spool.begin(path);
+    spool.append(bme280(1));
+    spool.append(sgp30(2));
+    std::deque<TelemetrySpool::Payload> out{};
+    spool.acknowledge(spool.read(1, out));
+    spool.terminate();
+  }
+  TelemetrySpool spool{};
+  TEST_ASSERT_TRUE(spool.begin(path));
+  TEST_ASSERT_EQUAL_size_t(1, spool.pending());
+  std::deque<TelemetrySpool::Payload> out{};
+  spool.read(10, out);
+  TEST_ASSERT_EQUAL_size_t(1, out.size());
+  TEST_ASSERT_TRUE(out.front() == sgp30(2));
+}
+
+// 作り直す前に読んだ範囲の確認は無視する
+void test_stale_acknowledge_is_ignored() {
+  TelemetrySpool spool{};
+  spool.begin(path);
+  spool.append(bme280(1));
+  std::deque<TelemetrySpool::Payload> out{};
+  auto stale = spool.read(1, out);
+  spool.acknowledge(stale);
+  // 全て送信済みになるとファイルを作り直す
+  TEST_ASSERT_TRUE(spool.checkpoint());
+  spool.append(bme280(2));
+  spool.acknowledge(stale);
+  TEST_ASSERT_EQUAL_size_t(1, spool.pending());
+}
+
+// 壊れたレコードは送信済みとして読み飛ばす
+void test_broken_record_is_skipped() {
+  {
+    TelemetrySpool spool{};
+    spool.begin(path);
+    for (int i = 0; i < 3; ++i) {
+      spool.append(bme280(i));
+    }
+    spool.terminate();
+  }
+  break_last_record();
+  TelemetrySpool spool{};
+  spool.begin(path);
+  std::deque<TelemetrySpool::Payload> out{};
+  auto range = spool.read(10, out);
+  TEST_ASSERT_EQUAL_UINT32(2, range.count);
+  spool.acknowledge(range);
+  TEST_ASSERT_EQUAL_UINT32(0, spool.read(10, out).count);
+  TEST_ASSERT_EQUAL_size_t(0, spool.pending());
+  TEST_ASSERT_EQUAL_size_t(2, out.size());
+}
+
+// 送信済みの確認ではファイルに書かない
+void test_acknowledge_is_written_at_checkpoint() {
+  TelemetrySpool spool{};
+  spool.begin(path);
+  spool.append(bme280(1));
+  spool.append(bme280(2));
+  std::deque<TelemetrySpool::Payload> out{};
+  spool.acknowledge(spool.read(1, out));
+  {
+    TelemetrySpool other{};
+    other.begin(path);
+    TEST_ASSERT_EQUAL_size_t(2, other.pending());
+  }
+  TEST_ASSERT_TRUE(spool.checkpoint());
+  TelemetrySpool other{};
+  other.begin(path);
+  TEST_ASSERT_EQUAL_size_t(1, other.pending());
+}
+
+// 作り直せなければ今のファイルを使い続ける
+void test_failed_recreate_keeps_file() {
+  namespace fs = std::filesystem;
+  const auto dir = fs::temp_directory_path() / "test_telemetry_spool.d";
+  const auto moved = fs::temp_directory_path() / "test_telemetry_spool.moved";
+  fs::remove_all(dir);
+  fs::remove_all(moved);
+  fs::create_directory(dir);
+  TelemetrySpool spool{};
+  spool.begin((dir / "spool.bin").string());
+  spool.append(bme280(1));
+  std::deque<TelemetrySpool::Payload> out{};
+  spool.acknowledge(spool.read(1, out));
+  // ディレクトリを動かしてファイルを作り直せなくする
+  fs::rename(dir, moved);
+  TEST_ASSERT_TRUE(spool.checkpoint());
+  TEST_ASSERT_TRUE(spool.isOpened());
+  TEST_ASSERT_TRUE(spool.append(bme280(2)));
+  out.clear();
+  auto range = spool.read(10, out);
+  spool.terminate();
+  fs::remove_all(moved);
+  TEST_ASSERT_EQUAL_UINT32(1, range.first);
+  TEST_ASSERT_EQUAL_UINT32(1, range.count);
+  TEST_ASSERT_TRUE(out.front() == bme280(2));
+}
+
+//
+void test_broken_header_recreates_file() {
+  std::FILE *fp = std::fopen(path.c_str(), "wb");
+  std::fputs("not a spool file", fp);
+  std::fclose(fp);
+  TelemetrySpool spool{};
+  TEST_ASSERT_TRUE(spool.begin(path));
+  TEST_ASSERT_EQUAL_size_t(0, spool.pending());
+  TEST_ASSERT_TRUE(spool.append(bme280(1)));
+}
+
+// 送信済みの部分が大きくなったら未送信のレコードだけを残す
+void test_checkpoint_compacts_acknowledged_records() {
+  const int count =
+      static_cast<int>(TelemetrySpool::COMPACTION_MIN_SIZE / record_size()) +
+      3;
+  TelemetrySpool spool{};
+  spool.begin(path);
+  for (int i = 0; i < count; ++i) {
+    spool.append(bme280(i));
+  }
+  std::deque<TelemetrySpool::Payload> out{};
+  spool.acknowledge(spool.read(count - 2, out));
+  // 送信中の範囲
+  out.clear();
+  auto in_flight = spool.read(1, out);
+  TEST_ASSERT_TRUE(spool.checkpoint());
+  TEST_ASSERT_TRUE(std::filesystem::file_size(path) <
+                   static_cast<uintmax_t>(TelemetrySpool::COMPACTION_MIN_SIZE));
+  TEST_ASSERT_EQUAL_size_t(2, spool.pending());
+  // 詰める前に読み出した範囲の確認も効く
+  spool.acknowledge(in_flight);
+  TEST_ASSERT_EQUAL_size_t(1, spool.pending());
+  out.clear();
+  TEST_ASSERT_EQUAL_UINT32(1, spool.read(10, out).count);
+  TEST_ASSERT_TRUE(out.front() == bme280(count - 1));
+  // 開き直しても残りから読む
+  spool.terminate();
+  TelemetrySpool other{};
+  other.begin(path);
+  TEST_ASSERT_EQUAL_size_t(1, other.pending());
+  out.clear();
+  other.read(10, out);
+  TEST_ASSERT_TRUE(out.front() == bme280(count - 1));
+}
+
+// 一杯になったら送信済みの部分を詰めて, 詰められなければ捨てた数を数える
+void test_full_spool_compacts_or_counts_dropped() {
+  const int capacity = static_cast<int>(
+      (TelemetrySpool::MAX_FILE_SIZE - record_size()) / record_size());
+  TelemetrySpool spool{};
+  spool.begin(path);
+  int appended{0};
+  while (spool.append(bme280(appended))) {
+    ++appended;
+  }
+  TEST_ASSERT_TRUE(appended >= capacity);
+  TEST_ASSERT_EQUAL_size_t(1, spool.dropped());
+  TEST_ASSERT_FALSE(spool.append(bme280(appended)));
+  TEST_ASSERT_EQUAL_size_t(2, spool.dropped());
+  //
+  std::deque<TelemetrySpool::Payload> out{};
+  spool.acknowledge(spool.read(10, out));
+  TEST_ASSERT_TRUE(spool.append(bme280(appended)));
+  TEST_ASSERT_EQUAL_size_t(2, spool.dropped());
+  TEST_ASSERT_EQUAL_size_t(appended - 10 + 1, spool.pending());
+  out.clear();
+  spool.read(1, out);
+  TEST_ASSERT_TRUE(out.front() == bme280(10));
+}
+
+// 置き換える途中で止まっていたら置き換えを終わらせる
+void test_unfinished_replacement_is_completed() {
+  {
+    TelemetrySpool spool{};
+    spool.begin(path);
+    spool.append(bme280(1));
+    spool.terminate();
+  }
+  std::filesystem::rename(path, path + ".tmp");
+  TelemetrySpool spool{};
+  TEST_ASSERT_TRUE(spool.begin(path));
+  TEST_ASSERT_EQUAL_size_t(1, spool.pending());
+  TEST_ASSERT_FALSE(std::filesystem::exists(path + ".tmp"));
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_records_round_trip);
+  RUN_TEST(test_acknowledge_commits_records);
+  RUN_TEST(test_rewind_reads_unacknowledged_again);
+  RUN_TEST(test_reopen_replays_pending_records);
+  RUN_TEST(test_stale_acknowledge_is_ignored);
+  RUN_TEST(test_broken_record_is_skipped);
+  RUN_TEST(test_acknowledge_is_written_at_checkpoint);
+  RUN_TEST(test_failed_recreate_keeps_file);
+  RUN_TEST(test_broken_header_recreates_file);
+  RUN_TEST(test_checkpoint_compacts_acknowledged_records);
+  RUN_TEST(test_full_spool_compacts_or_counts_dropped);
+  RUN_TEST(test_unfinished_replacement_is_completed);
+  return UNITY_END();
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "VersionedSnapshot.hpp"
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+// 書きかけを読んだらvalueとcheckが合わなくなる
+struct Sample {
+  uint32_t value;
+  uint32_t check;
+};
+
+//
+void test_initial_value_is_version_zero() {
+  VersionedSnapshot<Sample> snapshot{};
+  auto [version, sample] = snapshot.read();
+  TEST_ASSERT_EQUAL_UINT32(0, version);
+  TEST_ASSERT_EQUAL_UINT32(0, sample.value);
+  TEST_ASSERT_EQUAL_UINT32(0, snapshot.version());
+}
+
+//
+void test_read_returns_latest_publish() {
+  VersionedSnapshot<Sample> snapshot{};
+  snapshot.publish(Sample{1, ~uint32_t{1}});
+  snapshot.publish(Sample{2, ~uint32_t{2}});
+  auto [version, sample] = snapshot.read();
+  TEST_ASSERT_EQUAL_UINT32(2, version);
+  TEST_ASSERT_EQUAL_UINT32(2, sample.value);
+  TEST_ASSERT_EQUAL_UINT32(~uint32_t{2}, sample.check);
+}
+
+// 書くスレッドが書き続けていても読めた値は壊れていない
+void test_readers_never_see_torn_values() {
+  constexpr uint32_t COUNT{200000};
+  VersionedSnapshot<Sample> snapshot{};
+  std::atomic<bool> done{false};
+  std::atomic<uint32_t> torn{0};
+  auto reader = [&]() {
+    uint32_t last_version{0};
+    while (!done.load()) {
+      auto [version, sample] = snapshot.read();
+      if (sample.check != ~sample.value || version < last_version) {
+        torn.fetch_add(1);
+      }
+      last_version = version;
+    }
+  };
+  snapshot.publish(Sample{0, ~uint32_t{0}});
+  std::thread reader1{reader};
+  std::thread reader2{reader};
+  for (uint32_t i = 1; i <= COUNT; ++i) {
+    snapshot.publish(Sample{i, ~i});
+  }
+  done.store(true);
+  reader1.join();
+  reader2.join();
+  TEST_ASSERT_EQUAL_UINT32(0, torn.load());
+  TEST_ASSERT_EQUAL_UINT32(COUNT, snapshot.read().second.value);
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_initial_value_is_version_zero);
+  RUN_TEST(test_read_returns_latest_publish);
+  RUN_TEST(test_readers_never_see_torn_values);
+  return UNITY_END();
+}
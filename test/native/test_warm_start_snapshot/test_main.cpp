@@ -0,0 +1,238 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#include "SensorTraits.hpp"
+#include "WarmStartSnapshot.hpp"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unity.h>
+
+using namespace std::chrono;
+
+namespace {
+//
+const std::string path{
+    (std::filesystem::temp_directory_path() / "test_warm_start_snapshot.bin")
+        .string()};
+//
+const std::string database_path{
+    (std::filesystem::temp_directory_path() / "test_warm_start_snapshot.db")
+        .string()};
+//
+const system_clock::time_point T0{seconds{1700000000}};
+//
+Sensor::MeasuredValue bme280(int i) {
+  return Sensor::Bme280{Sensor::Traits<Sensor::Bme280>::descriptor,
+                        CentiDegC(2000 + i), CentiRH(5000 - i),
+                        DeciPa(101300 + i)};
+}
+//
+Sensor::MeasuredValue scd41(int i) {
+  return Sensor::Scd41{Sensor::Traits<Sensor::Scd41>::descriptor,
+                       Ppm(400 + i), CentiDegC(2100 + i), CentiRH(4000 + i)};
+}
+//
+using Restored =
+    std::vector<std::pair<system_clock::time_point,
+                          std::vector<Sensor::MeasuredValue>>>;
+//
+Restored restore(WarmStartSnapshot &snapshot,
+                 system_clock::time_point keep_from) {
+  Restored out{};
+  snapshot.restore(keep_from,
+                   [&out](system_clock::time_point at,
+                          const std::vector<Sensor::MeasuredValue> &values) {
+                     out.emplace_back(at, values);
+                     return true;
+                   });
+  return out;
+}
+// 1時間毎の温度の集計
+std::vector<Database::TimePointAndAggregate> read_hourly(Database &db) {
+  std::vector<Database::TimePointAndAggregate> rows{};
+  db.read_aggregates(Database::Resolution::Hourly, Database::Table::Temperature,
+                     Database::OrderByAtAsc, system_clock::time_point{},
+                     [&rows](size_t, Database::TimePointAndAggregate item) {
+                       rows.push_back(item);
+                       return true;
+                     });
+  return rows;
+}
+} // namespace
+
+void setUp() {
+  std::remove(path.c_str());
+  std::remove((path + ".tmp").c_str());
+  std::remove((path + ".rollup").c_str());
+  std::remove((path + ".rollup.tmp").c_str());
+  std::remove(database_path.c_str());
+}
+void tearDown() { setUp(); }
+
+// 同じ時間に測定した値はまとめて書き戻す
+void test_checkpoint_and_restore() {
+  WarmStartSnapshot snapshot{};
+  TEST_ASSERT_TRUE(snapshot.begin(path));
+  snapshot.stage(T0, {bme280(1), scd41(1)});
+  snapshot.stage(T0 + seconds{60}, {bme280(2)});
+  TEST_ASSERT_TRUE(snapshot.dirty());
+  TEST_ASSERT_TRUE(snapshot.checkpoint(T0));
+  TEST_ASSERT_FALSE(snapshot.dirty());
+  auto restored = restore(snapshot, T0);
+  TEST_ASSERT_EQUAL_size_t(2, restored.size());
+  TEST_ASSERT_TRUE(restored[0].first == T0);
+  TEST_ASSERT_EQUAL_size_t(2, restored[0].second.size());
+  TEST_ASSERT_TRUE(restored[0].second[0] == bme280(1));
+  TEST_ASSERT_TRUE(restored[0].second[1] == scd41(1));
+  TEST_ASSERT_TRUE(restored[1].second[0] == bme280(2));
+}
+
+// 値の無い測定値は書かない
+void test_monostate_is_not_staged() {
+  WarmStartSnapshot snapshot{};
+  snapshot.begin(path);
+  snapshot.stage(T0, {std::monostate{}});
+  TEST_ASSERT_FALSE(snapshot.dirty());
+}
+
+// 残す期間より古いレコードは書き戻さない
+void test_restore_skips_older_records() {
+  WarmStartSnapshot snapshot{};
+  snapshot.begin(path);
+  snapshot.stage(T0, {bme280(1)});
+  snapshot.stage(T0 + seconds{60}, {bme280(2)});
+  snapshot.checkpoint(T0);
+  auto restored = restore(snapshot, T0 + seconds{1});
+  TEST_ASSERT_EQUAL_size_t(1, restored.size());
+  TEST_ASSERT_TRUE(restored[0].second[0] == bme280(2));
+}
+
+//
+void test_reopen_keeps_records() {
+  {
+    WarmStartSnapshot snapshot{};
+    snapshot.begin(path);
+    snapshot.stage(T0, {scd41(3)});
+    snapshot.checkpoint(T0);
+    snapshot.terminate();
+  }
+  WarmStartSnapshot snapshot{};
+  TEST_ASSERT_TRUE(snapshot.begin(path));
+  auto restored = restore(snapshot, T0);
+  TEST_ASSERT_EQUAL_size_t(1, restored.size());
+  TEST_ASSERT_TRUE(restored[0].second[0] == scd41(3));
+}
+
+// 壊れたレコードは読み飛ばす
+void test_broken_record_is_skipped() {
+  {
+    WarmStartSnapshot snapshot{};
+    snapshot.begin(path);
+    snapshot.stage(T0, {bme280(1)});
+    snapshot.stage(T0 + seconds{60}, {bme280(2)});
+    snapshot.checkpoint(T0);
+    snapshot.terminate();
+  }
+  std::FILE *fp = std::fopen(path.c_str(), "r+b");
+  std::fseek(fp, -1, SEEK_END);
+  int c = std::fgetc(fp);
+  std::fseek(fp, -1, SEEK_END);
+  std::fputc(c ^ 0xff, fp);
+  std::fclose(fp);
+  WarmStartSnapshot snapshot{};
+  snapshot.begin(path);
+  auto restored = restore(snapshot, T0);
+  TEST_ASSERT_EQUAL_size_t(1, restored.size());
+  TEST_ASSERT_TRUE(restored[0].second[0] == bme280(1));
+}
+
+// 古いレコードが溜まったら詰め直す
+void test_checkpoint_compacts_old_records() {
+  WarmStartSnapshot snapshot{};
+  snapshot.begin(path);
+  snapshot.stage(T0, {bme280(1)});
+  snapshot.checkpoint(T0);
+  // ヘッダーと1つのレコード
+  auto one_record_size = std::filesystem::file_size(path);
+  auto later = T0 + WarmStartSnapshot::COMPACTION_SLACK + hours{1};
+  snapshot.stage(later, {bme280(2)});
+  TEST_ASSERT_TRUE(snapshot.checkpoint(later));
+  TEST_ASSERT_EQUAL_UINT32(one_record_size, std::filesystem::file_size(path));
+  auto restored = restore(snapshot, T0);
+  TEST_ASSERT_EQUAL_size_t(1, restored.size());
+  TEST_ASSERT_TRUE(restored[0].first == later);
+}
+
+// 途中で止めたら残りは読まない
+void test_restore_stops_when_callback_declines() {
+  WarmStartSnapshot snapshot{};
+  snapshot.begin(path);
+  snapshot.stage(T0, {bme280(1)});
+  snapshot.stage(T0 + seconds{60}, {bme280(2)});
+  snapshot.checkpoint(T0);
+  size_t calls{0};
+  snapshot.restore(T0, [&calls](system_clock::time_point,
+                                const std::vector<Sensor::MeasuredValue> &) {
+    ++calls;
+    return false;
+  });
+  TEST_ASSERT_EQUAL_size_t(1, calls);
+}
+
+// 再起動しても集計が残り, 書き戻した測定値を二度畳み込まない
+void test_rollups_survive_restart() {
+  const auto hour = floor<hours>(T0);
+  {
+    Database db{};
+    TEST_ASSERT_TRUE(db.begin(database_path));
+    for (int i = 0; i < 120; ++i) {
+      TEST_ASSERT_TRUE(db.insert(hour + minutes{i}, {bme280(i)}));
+    }
+    TEST_ASSERT_TRUE(db.rollup_measurements(hour + minutes{150}));
+    WarmStartSnapshot snapshot{};
+    TEST_ASSERT_TRUE(snapshot.begin(path));
+    TEST_ASSERT_TRUE(snapshot.checkpointRollups(db));
+  }
+  std::remove(database_path.c_str());
+  //
+  Database db{};
+  TEST_ASSERT_TRUE(db.begin(database_path));
+  WarmStartSnapshot snapshot{};
+  TEST_ASSERT_TRUE(snapshot.begin(path));
+  // 温度, 湿度, 気圧の2時間分と1日分
+  TEST_ASSERT_EQUAL_size_t(9, snapshot.restoreRollups(db));
+  auto rows = read_hourly(db);
+  TEST_ASSERT_EQUAL_size_t(2, rows.size());
+  TEST_ASSERT_EQUAL_UINT32(60, std::get<2>(rows[1]).samples);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 20.895, std::get<2>(rows[1]).mean);
+  // 集計に入っている測定値を書き戻しても畳み込まない
+  for (int i = 60; i < 180; ++i) {
+    TEST_ASSERT_TRUE(db.insert(hour + minutes{i}, {bme280(i)}));
+  }
+  TEST_ASSERT_TRUE(db.rollup_measurements(hour + minutes{190}));
+  rows = read_hourly(db);
+  TEST_ASSERT_EQUAL_size_t(3, rows.size());
+  TEST_ASSERT_EQUAL_UINT32(60, std::get<2>(rows[1]).samples);
+  TEST_ASSERT_EQUAL_UINT32(60, std::get<2>(rows[2]).samples);
+  // データーベースの方が新しければ書き戻さない
+  TEST_ASSERT_EQUAL_size_t(0, snapshot.restoreRollups(db));
+}
+
+//
+int main(int, char **) {
+  UNITY_BEGIN();
+  RUN_TEST(test_checkpoint_and_restore);
+  RUN_TEST(test_monostate_is_not_staged);
+  RUN_TEST(test_restore_skips_older_records);
+  RUN_TEST(test_reopen_keeps_records);
+  RUN_TEST(test_broken_record_is_skipped);
+  RUN_TEST(test_checkpoint_compacts_old_records);
+  RUN_TEST(test_restore_stops_when_callback_declines);
+  RUN_TEST(test_rollups_survive_restart);
+  return UNITY_END();
+}
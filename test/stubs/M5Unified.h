@@ -0,0 +1,32 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <cstdio>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+//
+// env:nativeのテストでM5_LOGxを標準エラー出力に書く
+//
+#define M5_NATIVE_LOG(level, format, ...)                                      \
+  std::fprintf(stderr, "[%s][%s:%d] " format "\n", level, __FILE__, __LINE__,  \
+               ##__VA_ARGS__)
+#define M5_LOGE(format, ...) M5_NATIVE_LOG("E", format, ##__VA_ARGS__)
+#define M5_LOGW(format, ...) M5_NATIVE_LOG("W", format, ##__VA_ARGS__)
+#define M5_LOGI(format, ...) M5_NATIVE_LOG("I", format, ##__VA_ARGS__)
+// CORE_DEBUG_LEVELより詳しいログは消す
+#if CORE_DEBUG_LEVEL >= 4
+#define M5_LOGD(format, ...) M5_NATIVE_LOG("D", format, ##__VA_ARGS__)
+#else
+#define M5_LOGD(format, ...)
+#endif
+#if CORE_DEBUG_LEVEL >= 5
+#define M5_LOGV(format, ...) M5_NATIVE_LOG("V", format, ##__VA_ARGS__)
+#else
+#define M5_LOGV(format, ...)
+#endif
+
+// SPIRAMは無いことにする(SQLiteは既定のmallocを使う)
+inline bool psramFound() { return false; }
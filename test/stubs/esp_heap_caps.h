@@ -0,0 +1,34 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <malloc.h>
+
+//
+// env:nativeのテストではESP-IDFのヒープの代わりにmallocを使う
+// (freeで返せる様に割り当てる)
+//
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+inline void *heap_caps_malloc(size_t size, uint32_t) {
+  return std::malloc(size);
+}
+inline void *heap_caps_aligned_alloc(size_t alignment, size_t size,
+                                     uint32_t) {
+  void *ptr{nullptr};
+  return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+inline void *heap_caps_realloc(void *ptr, size_t size, uint32_t) {
+  return std::realloc(ptr, size);
+}
+inline size_t heap_caps_get_allocated_size(void *ptr) {
+  return malloc_usable_size(ptr);
+}
+inline void heap_caps_free(void *ptr) { std::free(ptr); }
@@ -0,0 +1,16 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+//
+// env:nativeのテストでesp_timer_get_timeをsteady_clockで代わりにする
+//
+inline int64_t esp_timer_get_time() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch())
+      .count();
+}
@@ -0,0 +1,15 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include <cstdint>
+
+//
+// env:nativeのテストで1tick = 1msとする
+//
+using TickType_t = uint32_t;
+using BaseType_t = int;
+#define pdMS_TO_TICKS(ms) (static_cast<TickType_t>(ms))
+#define pdFALSE (static_cast<BaseType_t>(0))
+#define pdTRUE (static_cast<BaseType_t>(1))
@@ -0,0 +1,54 @@
+// Copyright (c) 2024 Akihiro Yamamoto.
+// Licensed under the MIT License <https://spdx.org/licenses/MIT.html>
+// See LICENSE file in the project root for full license information.
+//
+#pragma once
+#include "FreeRTOS.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+//
+inline void vTaskDelay(TickType_t ticks) {
+  std::this_thread::sleep_for(std::chrono::milliseconds{ticks});
+}
+
+//
+// タスク通知はスレッド毎のカウンタで代用する
+//
+struct tskTaskControlBlock {
+  std::mutex mutex{};
+  std::condition_variable cv{};
+  uint32_t count{0};
+};
+using TaskHandle_t = tskTaskControlBlock *;
+
+//
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+  thread_local tskTaskControlBlock tcb{};
+  return &tcb;
+}
+
+//
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  {
+    std::lock_guard<std::mutex> lock{task->mutex};
+    task->count++;
+  }
+  task->cv.notify_one();
+  return pdTRUE;
+}
+
+//
+inline uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks) {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> lock{task->mutex};
+  task->cv.wait_for(lock, std::chrono::milliseconds{ticks},
+                    [task] { return task->count > 0; });
+  uint32_t count = task->count;
+  if (count > 0) {
+    task->count = clear_on_exit ? 0 : count - 1;
+  }
+  return count;
+}